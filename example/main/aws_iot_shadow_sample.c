@@ -1,5 +1,7 @@
 #include "aws_iot_shadow.h"
+#include "aws_iot_shadow_json.h"
 #include "aws_iot_shadow_mqtt_error.h"
+#include "aws_iot_shadow_persistence.h"
 #include <cJSON.h>
 #include <esp_err.h>
 #include <esp_log.h>
@@ -74,49 +76,41 @@ static void shadow_event_handler_state_accepted(__unused void *handler_args, __u
 {
     const struct aws_iot_shadow_event_data *event = (const struct aws_iot_shadow_event_data *)event_data;
 
-    char *to_update_str = NULL;
-    cJSON *to_update = NULL;
-
-    // Parse
-    // TODO use with length in newer cjson version
-    cJSON *root = cJSON_ParseWithOpts(event->data, NULL, false);
-    cJSON *desired = cJSON_GetObjectItemCaseSensitive(root, AWS_IOT_SHADOW_JSON_DESIRED);
+    // Parse, values reference event data directly
+    struct aws_iot_shadow_json_document doc;
+    if (aws_iot_shadow_json_parse_event(event, &doc) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "invalid shadow document");
+        return;
+    }
 
     // Ignore if desired is missing
-    if (!desired)
+    if (doc.desired.type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
     {
-        goto cleanup;
+        return;
     }
 
-    to_update = cJSON_CreateObject();
-    cJSON *to_state = cJSON_AddObjectToObject(to_update, AWS_IOT_SHADOW_JSON_STATE);
-    cJSON *to_report = cJSON_AddObjectToObject(to_state, AWS_IOT_SHADOW_JSON_REPORTED);
-
     // Handle change
-    const cJSON *my_value_obj = cJSON_GetObjectItemCaseSensitive(desired, SHADOW_KEY_MY_VALUE);
-    if (cJSON_IsNumber(my_value_obj))
+    struct aws_iot_shadow_json_value my_value_obj;
+    int64_t value;
+    if (aws_iot_shadow_json_object_get(&doc.desired, SHADOW_KEY_MY_VALUE, &my_value_obj) == ESP_OK
+        && aws_iot_shadow_json_get_int64(&my_value_obj, &value) == ESP_OK)
     {
-        my_value = my_value_obj->valueint;
+        my_value = (int)value;
         ESP_LOGI(TAG, "%s changed to %d", SHADOW_KEY_MY_VALUE, my_value);
     }
 
     // Report
-    cJSON_AddNumberToObject(to_report, SHADOW_KEY_MY_VALUE, my_value);
+    char to_update_str[64];
+    int len = snprintf(to_update_str, sizeof(to_update_str), "{\"" AWS_IOT_SHADOW_JSON_STATE "\":{\"" AWS_IOT_SHADOW_JSON_REPORTED "\":{\"%s\":%d}}}",
+                       SHADOW_KEY_MY_VALUE, my_value);
 
     // Publish event
-    to_update_str = cJSON_PrintUnformatted(to_update);
-    esp_err_t err = aws_iot_shadow_request_update(event->handle, to_update_str, strlen(to_update_str));
+    esp_err_t err = aws_iot_shadow_request_update(event->handle, to_update_str, len);
     if (err != ESP_OK)
     {
         ESP_LOGW(TAG, "failed to publish update: %d (%s)", err, esp_err_to_name(err));
-        goto cleanup;
     }
-
-cleanup:
-    // Cleanup
-    cJSON_Delete(root);
-    cJSON_Delete(to_update);
-    free(to_update_str);
 }
 
 static void shadow_event_handler_error(__unused void *handler_args, __unused esp_event_base_t event_base,
@@ -125,15 +119,34 @@ static void shadow_event_handler_error(__unused void *handler_args, __unused esp
     const struct aws_iot_shadow_event_data *event = (const struct aws_iot_shadow_event_data *)event_data;
 
     // Parse
-    // TODO use with length in newer cjson version
-    cJSON *root = cJSON_ParseWithOpts(event->data, NULL, false);
-    cJSON *code = cJSON_GetObjectItemCaseSensitive(root, AWS_IOT_SHADOW_JSON_CODE);
-    cJSON *message = cJSON_GetObjectItemCaseSensitive(root, AWS_IOT_SHADOW_JSON_MESSAGE);
+    struct aws_iot_shadow_json_value root, code_obj, message_obj;
+    int64_t code = -1;
+    char message[128] = "";
+    if (aws_iot_shadow_json_parse(event->data, event->data_len, &root) == ESP_OK)
+    {
+        if (aws_iot_shadow_json_object_get(&root, AWS_IOT_SHADOW_JSON_CODE, &code_obj) == ESP_OK)
+        {
+            aws_iot_shadow_json_get_int64(&code_obj, &code);
+        }
+        if (aws_iot_shadow_json_object_get(&root, AWS_IOT_SHADOW_JSON_MESSAGE, &message_obj) == ESP_OK)
+        {
+            aws_iot_shadow_json_string_copy(&message_obj, message, sizeof(message));
+        }
+    }
 
     // Log
-    ESP_LOGW(TAG, "shadow error %d: %d %s", event->event_id, code ? code->valueint : -1, message ? message->valuestring : "");
+    ESP_LOGW(TAG, "shadow error %d: %d %s", event->event_id, (int)code, message);
 }
 
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+static void shadow_update_done(__unused aws_iot_shadow_handle_ptr handle,
+                               const struct aws_iot_shadow_request_completion *completion, __unused void *arg)
+{
+    ESP_LOGI(TAG, "update %s completed: %d in %lld ms", completion->client_token, completion->result,
+             (long long)(completion->rtt_us / 1000));
+}
+#endif
+
 static void setup()
 {
     esp_log_level_set("*", ESP_LOG_INFO);
@@ -211,6 +224,13 @@ static void setup()
     ESP_ERROR_CHECK(aws_iot_shadow_handler_register(shadow_client, AWS_IOT_SHADOW_EVENT_GET_REJECTED, shadow_event_handler_error, NULL));
     ESP_ERROR_CHECK(aws_iot_shadow_handler_register(shadow_client, AWS_IOT_SHADOW_EVENT_UPDATE_REJECTED, shadow_event_handler_error, NULL));
 
+#if AWS_IOT_SHADOW_PERSISTENCE
+    // Last known state is dispatched right away, before connecting
+    struct aws_iot_shadow_persistence persistence;
+    ESP_ERROR_CHECK(aws_iot_shadow_persistence_nvs_init("aws_iot_shadow", &persistence));
+    aws_iot_shadow_restore(shadow_client, &persistence);
+#endif
+
     // Connect
     ESP_ERROR_CHECK(esp_wifi_connect());
 
@@ -236,10 +256,25 @@ static _Noreturn void run()
         time(&now);
 
         cJSON_SetIntValue(now_obj, now);
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+        // Only members which differ from last accepted state are sent
+        if (cJSON_PrintPreallocated(to_report, buf, sizeof(buf), false))
+        {
+            aws_iot_shadow_request_update_reported(shadow_client, buf, strlen(buf));
+        }
+#elif AWS_IOT_SHADOW_REQUEST_TRACKING
+        // Outcome and round trip time of this very update, clientToken is generated
+        if (cJSON_PrintPreallocated(to_update, buf, sizeof(buf), false))
+        {
+            struct aws_iot_shadow_request_config config = {.callback = shadow_update_done};
+            aws_iot_shadow_request_update_tracked(shadow_client, buf, strlen(buf), &config);
+        }
+#else
         if (cJSON_PrintPreallocated(to_update, buf, sizeof(buf), false))
         {
             aws_iot_shadow_request_update(shadow_client, buf, strlen(buf));
         }
+#endif
         else
         {
             ESP_LOGW(TAG, "failed to print json");
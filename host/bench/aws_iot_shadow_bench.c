@@ -0,0 +1,154 @@
+#include "bench.h"
+#include <esp_log.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct bench_suite
+{
+    const char *name;
+    bench_suite_fn fn;
+};
+
+static const struct bench_suite SUITES[] = {
+    {"shadow", bench_shadow},
+    {"json", bench_json},
+};
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void bench_report(const char *name, const char *params, unsigned int iterations, uint64_t elapsed_ns)
+{
+    double ns_per_op = iterations ? (double)elapsed_ns / iterations : 0;
+    printf("%-32s %-32s iterations=%-8u ns_per_op=%-10.1f ops_per_sec=%.0f\n", name, params ? params : "", iterations,
+           ns_per_op, ns_per_op > 0 ? 1e9 / ns_per_op : 0);
+}
+
+static const char DOCUMENT_HEAD[] = "{\"state\":{\"reported\":{\"pad\":\"";
+static const char DOCUMENT_TAIL[] = "\"}}}";
+
+// Padding of at least one byte
+#define DOCUMENT_MIN_SIZE (sizeof(DOCUMENT_HEAD) - 1 + sizeof(DOCUMENT_TAIL) - 1 + 1)
+
+void bench_report_memory(const char *name, const char *params, size_t bytes)
+{
+    printf("%-32s %-32s bytes=%zu\n", name, params ? params : "", bytes);
+}
+
+size_t bench_heap_used(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks;
+}
+
+void bench_fill_document(char *buf, size_t len)
+{
+    size_t head_len = sizeof(DOCUMENT_HEAD) - 1;
+    size_t tail_len = sizeof(DOCUMENT_TAIL) - 1;
+
+    memcpy(buf, DOCUMENT_HEAD, head_len);
+    memset(buf + head_len, 'x', len - head_len - tail_len);
+    memcpy(buf + len - tail_len, DOCUMENT_TAIL, tail_len);
+}
+
+static int discard_vprintf(const char *format, va_list args)
+{
+    // Emulates formatting cost of UART logging, without the output
+    char line[256];
+    return vsnprintf(line, sizeof(line), format, args);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-n iterations] [-r rounds] [-s shadows] [-p payload_size] [-l] [-t trace_file] [suite...]\n", argv0);
+    fprintf(stderr, "  -n  iterations per round\n");
+    fprintf(stderr, "  -r  number of rounds, fastest one is reported\n");
+    fprintf(stderr, "  -l  keep INFO logging enabled (formatted, but discarded)\n");
+    fprintf(stderr, "  -t  write trace ring of the shadow suite, built with AWS_IOT_SHADOW_TRACE\n");
+    fprintf(stderr, "suites:");
+    for (size_t i = 0; i < sizeof(SUITES) / sizeof(SUITES[0]); i++)
+    {
+        fprintf(stderr, " %s", SUITES[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_options options = {
+        .iterations = 100000,
+        .rounds = 5,
+        .shadows = 1,
+        .payload_size = 256,
+        .log = false,
+        .trace_path = NULL,
+    };
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (strcmp(argv[i], "-l") == 0)
+        {
+            options.log = true;
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+        {
+            options.iterations = (unsigned int)strtoul(argv[++i], NULL, 10);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-r") == 0)
+        {
+            options.rounds = (unsigned int)strtoul(argv[++i], NULL, 10);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-s") == 0)
+        {
+            options.shadows = (unsigned int)strtoul(argv[++i], NULL, 10);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-p") == 0)
+        {
+            options.payload_size = strtoul(argv[++i], NULL, 10);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-t") == 0)
+        {
+            options.trace_path = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (options.iterations == 0 || options.rounds == 0 || options.shadows == 0 || options.payload_size < DOCUMENT_MIN_SIZE)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    esp_log_set_vprintf(discard_vprintf);
+    esp_log_level_set("*", options.log ? ESP_LOG_INFO : ESP_LOG_NONE);
+
+    int result = 0;
+    for (size_t s = 0; s < sizeof(SUITES) / sizeof(SUITES[0]); s++)
+    {
+        bool selected = i == argc;
+        for (int a = i; a < argc; a++)
+        {
+            selected |= strcmp(argv[a], SUITES[s].name) == 0;
+        }
+
+        if (selected && SUITES[s].fn(&options) != 0)
+        {
+            fprintf(stderr, "suite %s failed\n", SUITES[s].name);
+            result = 1;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,58 @@
+#ifndef AWS_IOT_SHADOW_BENCH_H
+#define AWS_IOT_SHADOW_BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bench_options
+{
+    unsigned int iterations; // per round
+    unsigned int rounds;     // best round is reported
+    unsigned int shadows;
+    size_t payload_size;
+    bool log;
+    const char *trace_path; // dump of the trace ring is written there, with AWS_IOT_SHADOW_TRACE
+};
+
+/**
+ * @brief Benchmark suite entry point, returns 0 on success.
+ */
+typedef int (*bench_suite_fn)(const struct bench_options *options);
+
+uint64_t bench_now_ns(void);
+
+static inline uint64_t bench_min(uint64_t a, uint64_t b) { return a < b ? a : b; }
+
+/**
+ * @brief Prints one result line, `name key=value... ns_per_op=N ops_per_sec=N`.
+ */
+void bench_report(const char *name, const char *params, unsigned int iterations, uint64_t elapsed_ns);
+
+/**
+ * @brief Prints one memory result line, `name key=value... bytes=N`.
+ */
+void bench_report_memory(const char *name, const char *params, size_t bytes);
+
+/**
+ * @brief Heap bytes currently allocated by the process.
+ */
+size_t bench_heap_used(void);
+
+/**
+ * @brief Fills buffer with a valid shadow document of exactly len bytes (len >= 32).
+ */
+void bench_fill_document(char *buf, size_t len);
+
+int bench_shadow(const struct bench_options *options);
+int bench_json(const struct bench_options *options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,684 @@
+#include "aws_iot_shadow_json.h"
+#include "bench.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if BENCH_HAVE_CJSON
+#include <cJSON.h>
+#endif
+
+#define BENCH_JSON_KEY "my_value"
+
+static const size_t BENCH_JSON_SIZES[] = {100, 512, 1024, 4096, 8192};
+
+/**
+ * @brief Builds a realistic get/accepted document, roughly len bytes long.
+ *
+ * Looked up value is the last member of state.desired, after all the padding fields.
+ */
+static size_t bench_json_document(char *buf, size_t len)
+{
+    static const char HEAD[] = "{\"state\":{\"reported\":{";
+    static const char MIDDLE[] = "},\"desired\":{";
+    static const char TAIL[] = "\"" BENCH_JSON_KEY "\":42}},\"metadata\":{},\"version\":1234,\"timestamp\":1700000000,"
+                               "\"clientToken\":\"bench\"}";
+    size_t pos = 0;
+
+    memcpy(buf + pos, HEAD, sizeof(HEAD) - 1);
+    pos += sizeof(HEAD) - 1;
+
+    // Padding fields, 3/4 of the budget in reported, rest in desired
+    size_t budget = len > sizeof(HEAD) + sizeof(MIDDLE) + sizeof(TAIL) ? len - sizeof(HEAD) - sizeof(MIDDLE) - sizeof(TAIL) : 0;
+    size_t used = 0;
+    for (unsigned int i = 0; used + 48 < budget * 3 / 4; i++)
+    {
+        int n = sprintf(buf + pos, "%s\"field_%u\":{\"v\":%u,\"s\":\"a\\\"b\"}", i ? "," : "", i, i * 7);
+        pos += n;
+        used += n;
+    }
+
+    memcpy(buf + pos, MIDDLE, sizeof(MIDDLE) - 1);
+    pos += sizeof(MIDDLE) - 1;
+    for (unsigned int i = 0; used + 24 < budget; i++)
+    {
+        int n = sprintf(buf + pos, "\"flag_%u\":true,", i);
+        pos += n;
+        used += n;
+    }
+    memcpy(buf + pos, TAIL, sizeof(TAIL) - 1);
+    pos += sizeof(TAIL) - 1;
+    buf[pos] = '\0';
+    return pos;
+}
+
+static int bench_json_tokenizer(const char *doc, size_t len, const struct bench_options *options, char *params)
+{
+    volatile int64_t sink = 0;
+    uint64_t elapsed = UINT64_MAX;
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            struct aws_iot_shadow_json_document parsed;
+            struct aws_iot_shadow_json_value value;
+            int64_t result;
+
+            if (aws_iot_shadow_json_parse_document(doc, len, &parsed) != ESP_OK
+                || aws_iot_shadow_json_object_get(&parsed.desired, BENCH_JSON_KEY, &value) != ESP_OK
+                || aws_iot_shadow_json_get_int64(&value, &result) != ESP_OK)
+            {
+                fprintf(stderr, "tokenizer failed to parse document of %zu bytes\n", len);
+                return -1;
+            }
+            sink += result + parsed.version;
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    bench_report("json/tokenizer", params, options->iterations, elapsed);
+    return 0;
+}
+
+static int bench_json_version(const char *doc, size_t len, const struct bench_options *options, char *params)
+{
+    volatile int64_t sink = 0;
+    uint64_t peek_elapsed = UINT64_MAX;
+    uint64_t parse_elapsed = UINT64_MAX;
+
+    // Only version is needed, to drop redelivered messages
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            int64_t version = 0;
+            if (aws_iot_shadow_json_peek_version(doc, len, &version) != ESP_OK)
+            {
+                fprintf(stderr, "failed to peek version of document of %zu bytes\n", len);
+                return -1;
+            }
+            sink += version;
+        }
+        peek_elapsed = bench_min(peek_elapsed, bench_now_ns() - start);
+
+        start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            struct aws_iot_shadow_json_document parsed;
+            if (aws_iot_shadow_json_parse_document(doc, len, &parsed) != ESP_OK || !parsed.has_version)
+            {
+                fprintf(stderr, "tokenizer failed to parse document of %zu bytes\n", len);
+                return -1;
+            }
+            sink += parsed.version;
+        }
+        parse_elapsed = bench_min(parse_elapsed, bench_now_ns() - start);
+    }
+
+    bench_report("json/version_peek", params, options->iterations, peek_elapsed);
+    bench_report("json/version_parse", params, options->iterations, parse_elapsed);
+    return 0;
+}
+
+/**
+ * @brief Builds an /update/documents message from doc, with BENCH_JSON_KEY changed in current.
+ */
+static size_t bench_json_documents(char *buf, const char *doc, size_t len)
+{
+    static const char KEY[] = "\"" BENCH_JSON_KEY "\":42";
+    const char *key = strstr(doc, KEY);
+    if (key == NULL)
+    {
+        return 0;
+    }
+    size_t key_pos = (size_t)(key - doc) + sizeof(KEY) - 2; // last digit
+    int n = sprintf(buf, "{\"previous\":%.*s,\"current\":%.*s3%.*s,\"timestamp\":1700000001}", (int)len, doc,
+                    (int)key_pos, doc, (int)(len - key_pos - 1), doc + key_pos + 1);
+    return (size_t)n;
+}
+
+static int bench_json_changes(const char *msg, size_t len, const struct bench_options *options, char *params)
+{
+    volatile int64_t sink = 0;
+    uint64_t elapsed = UINT64_MAX;
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            struct aws_iot_shadow_json_documents docs;
+            if (aws_iot_shadow_json_parse_documents(msg, len, &docs) != ESP_OK || docs.desired.count != 1
+                || !aws_iot_shadow_json_string_equals(&docs.desired.keys[0], BENCH_JSON_KEY) || docs.reported.count != 0)
+            {
+                fprintf(stderr, "tokenizer failed to compare documents of %zu bytes\n", len);
+                return -1;
+            }
+            sink += docs.current.version + docs.desired.count;
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    bench_report("json/documents_changes", params, options->iterations, elapsed);
+    return 0;
+}
+
+/**
+ * @brief Reported state of a typical device, 16 members.
+ */
+struct bench_json_state
+{
+    bool power;
+    bool charging;
+    int32_t rssi;
+    uint32_t uptime;
+    int64_t timestamp;
+    float temperature;
+    float humidity;
+    double latitude;
+    double longitude;
+    char firmware[16];
+    char mode[12];
+    int32_t led_red;
+    int32_t led_green;
+    int32_t led_blue;
+    uint32_t errors;
+    char status[32];
+};
+
+static const struct aws_iot_shadow_json_field BENCH_JSON_SCHEMA[] = {
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, power, BOOL, "power"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, charging, BOOL, "charging"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, rssi, INT32, "rssi"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, uptime, UINT32, "uptime"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, timestamp, INT64, "timestamp"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, temperature, FLOAT, "env.temperature"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, humidity, FLOAT, "env.humidity"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, latitude, DOUBLE, "location.lat"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, longitude, DOUBLE, "location.lon"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, firmware, STRING, "firmware"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, mode, STRING, "mode"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, led_red, INT32, "led.r"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, led_green, INT32, "led.g"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, led_blue, INT32, "led.b"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, errors, UINT32, "errors"),
+    AWS_IOT_SHADOW_JSON_FIELD(struct bench_json_state, status, STRING, "status"),
+};
+
+#define BENCH_JSON_FIELDS (sizeof(BENCH_JSON_SCHEMA) / sizeof(BENCH_JSON_SCHEMA[0]))
+
+static const struct bench_json_state BENCH_JSON_STATE = {
+    .power = true,
+    .rssi = -67,
+    .uptime = 86400,
+    .timestamp = 1700000000123LL,
+    .temperature = 21.5f,
+    .humidity = 40.25f,
+    .latitude = 48.858222,
+    .longitude = 2.2945,
+    .firmware = "1.4.2",
+    .mode = "auto",
+    .led_red = 255,
+    .led_green = 128,
+    .errors = 3,
+    .status = "all \"systems\" nominal",
+};
+
+/**
+ * @brief Update of reported state from a struct, all members, and only the one that has changed since last time.
+ */
+static int bench_json_schema(const struct bench_options *options)
+{
+    struct bench_json_state state = BENCH_JSON_STATE;
+    struct bench_json_state prev = BENCH_JSON_STATE;
+    char buf[1024];
+    size_t all_len = 0, changed_len = 0;
+    volatile size_t sink = 0;
+    uint64_t all_elapsed = UINT64_MAX;
+    uint64_t changed_elapsed = UINT64_MAX;
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            state.uptime++;
+            if (aws_iot_shadow_json_write_reported(BENCH_JSON_SCHEMA, BENCH_JSON_FIELDS, &state, NULL, buf, sizeof(buf), &all_len) != ESP_OK)
+            {
+                fprintf(stderr, "failed to write reported state\n");
+                return -1;
+            }
+            sink += all_len;
+        }
+        all_elapsed = bench_min(all_elapsed, bench_now_ns() - start);
+
+        start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            state.uptime++;
+            if (aws_iot_shadow_json_write_reported(BENCH_JSON_SCHEMA, BENCH_JSON_FIELDS, &state, &prev, buf, sizeof(buf), &changed_len) != ESP_OK)
+            {
+                fprintf(stderr, "failed to write changes of reported state\n");
+                return -1;
+            }
+            prev.uptime = state.uptime;
+            sink += changed_len;
+        }
+        changed_elapsed = bench_min(changed_elapsed, bench_now_ns() - start);
+    }
+
+    char params[32];
+    snprintf(params, sizeof(params), "fields=%zu bytes=%zu", BENCH_JSON_FIELDS, all_len);
+    bench_report("json/schema_reported", params, options->iterations, all_elapsed);
+    snprintf(params, sizeof(params), "fields=1 bytes=%zu", changed_len);
+    bench_report("json/schema_changed", params, options->iterations, changed_elapsed);
+    return 0;
+}
+
+static void bench_json_field_changed(void *arg, const struct aws_iot_shadow_json_field *field)
+{
+    (*(unsigned int *)arg)++;
+}
+
+/**
+ * @brief Delta of all members of the struct stored with a single walk, and the acknowledgement written.
+ */
+static int bench_json_schema_apply(const struct bench_options *options)
+{
+    struct aws_iot_shadow_json_schema schema;
+    char delta[1024], ack[1024];
+    size_t delta_len = 0, ack_len = 0;
+    if (aws_iot_shadow_json_schema_init(&schema, BENCH_JSON_SCHEMA, BENCH_JSON_FIELDS) != ESP_OK
+        || aws_iot_shadow_json_write_reported(BENCH_JSON_SCHEMA, BENCH_JSON_FIELDS, &BENCH_JSON_STATE, NULL, delta, sizeof(delta), &delta_len) != ESP_OK)
+    {
+        fprintf(stderr, "failed to init schema\n");
+        return -1;
+    }
+    struct aws_iot_shadow_json_value root, value;
+    if (aws_iot_shadow_json_parse(delta, delta_len, &root) != ESP_OK
+        || aws_iot_shadow_json_find(&root, AWS_IOT_SHADOW_JSON_STATE "." AWS_IOT_SHADOW_JSON_REPORTED, &value) != ESP_OK)
+    {
+        return -1;
+    }
+
+    unsigned int changed = 0;
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            // Fresh state, so every member changes
+            struct bench_json_state state = {0};
+            if (aws_iot_shadow_json_apply(&schema, &value, &state, bench_json_field_changed, &changed, ack, sizeof(ack), &ack_len) != ESP_OK)
+            {
+                fprintf(stderr, "failed to apply delta\n");
+                return -1;
+            }
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+    // Members left at zero do not change
+    if (changed == 0 || ack_len != delta_len)
+    {
+        fprintf(stderr, "delta applied partially, %u changes, ack of %zu bytes\n", changed, ack_len);
+        return -1;
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "fields=%zu changed=%u payload=%zu slots=%u", BENCH_JSON_FIELDS,
+             changed / (options->iterations * options->rounds), value.len, schema.mask + 1U);
+    bench_report("json/schema_apply", params, options->iterations, elapsed);
+    return 0;
+}
+
+#define BENCH_JSON_TEMPLATE "{\"state\":{\"reported\":{\"now\":%12,\"uptime\":%10,\"temperature\":%8,\"firmware\":\"1.4.2\"}}}"
+
+/**
+ * @brief Periodic report of a fixed shape, only its numbers patched each tick.
+ */
+static int bench_json_template(const struct bench_options *options)
+{
+    struct aws_iot_shadow_json_template tpl;
+    char buf[128];
+    if (aws_iot_shadow_json_template_init(&tpl, BENCH_JSON_TEMPLATE, buf, sizeof(buf)) != ESP_OK)
+    {
+        fprintf(stderr, "failed to compile template\n");
+        return -1;
+    }
+
+    volatile size_t sink = 0;
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            if (aws_iot_shadow_json_template_set_int(&tpl, 0, 1700000000 + i) != ESP_OK
+                || aws_iot_shadow_json_template_set_int(&tpl, 1, i) != ESP_OK
+                || aws_iot_shadow_json_template_set_double(&tpl, 2, 21.5 + (i % 100) * 0.01, 2) != ESP_OK)
+            {
+                fprintf(stderr, "failed to patch template\n");
+                return -1;
+            }
+            sink += tpl.len; // publish tpl.buf, tpl.len
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    char params[32];
+    snprintf(params, sizeof(params), "slots=%u bytes=%zu", tpl.slot_count, tpl.len);
+    bench_report("json/template_update", params, options->iterations, elapsed);
+    return 0;
+}
+
+#if BENCH_HAVE_CJSON
+/**
+ * @brief Number of top level members which differ between prev and next.
+ */
+static int bench_json_cjson_count_changes(const cJSON *prev, const cJSON *next)
+{
+    int changes = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, next)
+    {
+        if (!cJSON_Compare(item, cJSON_GetObjectItemCaseSensitive(prev, item->string), true))
+        {
+            changes++;
+        }
+    }
+    cJSON_ArrayForEach(item, prev)
+    {
+        if (!cJSON_HasObjectItem(next, item->string))
+        {
+            changes++;
+        }
+    }
+    return changes;
+}
+
+static int bench_json_cjson_changes(const char *msg, size_t len, const struct bench_options *options, char *params)
+{
+    volatile int64_t sink = 0;
+    uint64_t elapsed = UINT64_MAX;
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            cJSON *root = cJSON_ParseWithLength(msg, len);
+            cJSON *prev = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(root, AWS_IOT_SHADOW_JSON_PREVIOUS), AWS_IOT_SHADOW_JSON_STATE);
+            cJSON *next = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(root, AWS_IOT_SHADOW_JSON_CURRENT), AWS_IOT_SHADOW_JSON_STATE);
+            int desired = bench_json_cjson_count_changes(cJSON_GetObjectItemCaseSensitive(prev, AWS_IOT_SHADOW_JSON_DESIRED),
+                                                         cJSON_GetObjectItemCaseSensitive(next, AWS_IOT_SHADOW_JSON_DESIRED));
+            int reported = bench_json_cjson_count_changes(cJSON_GetObjectItemCaseSensitive(prev, AWS_IOT_SHADOW_JSON_REPORTED),
+                                                          cJSON_GetObjectItemCaseSensitive(next, AWS_IOT_SHADOW_JSON_REPORTED));
+            cJSON_Delete(root);
+            if (desired != 1 || reported != 0)
+            {
+                fprintf(stderr, "cJSON failed to compare documents of %zu bytes\n", len);
+                return -1;
+            }
+            sink += desired;
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    bench_report("json/cjson_changes", params, options->iterations, elapsed);
+    return 0;
+}
+
+/**
+ * @brief Same update as bench_json_schema(), built as the example did, a tree per publish and a printed copy.
+ */
+static int bench_json_cjson_reported(const struct bench_options *options)
+{
+    struct bench_json_state state = BENCH_JSON_STATE;
+    size_t len = 0;
+    volatile size_t sink = 0;
+    uint64_t elapsed = UINT64_MAX;
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            state.uptime++;
+            cJSON *root = cJSON_CreateObject();
+            cJSON *reported = cJSON_AddObjectToObject(cJSON_AddObjectToObject(root, AWS_IOT_SHADOW_JSON_STATE), AWS_IOT_SHADOW_JSON_REPORTED);
+            cJSON_AddBoolToObject(reported, "power", state.power);
+            cJSON_AddBoolToObject(reported, "charging", state.charging);
+            cJSON_AddNumberToObject(reported, "rssi", state.rssi);
+            cJSON_AddNumberToObject(reported, "uptime", state.uptime);
+            cJSON_AddNumberToObject(reported, "timestamp", (double)state.timestamp);
+            cJSON *env = cJSON_AddObjectToObject(reported, "env");
+            cJSON_AddNumberToObject(env, "temperature", state.temperature);
+            cJSON_AddNumberToObject(env, "humidity", state.humidity);
+            cJSON *location = cJSON_AddObjectToObject(reported, "location");
+            cJSON_AddNumberToObject(location, "lat", state.latitude);
+            cJSON_AddNumberToObject(location, "lon", state.longitude);
+            cJSON_AddStringToObject(reported, "firmware", state.firmware);
+            cJSON_AddStringToObject(reported, "mode", state.mode);
+            cJSON *led = cJSON_AddObjectToObject(reported, "led");
+            cJSON_AddNumberToObject(led, "r", state.led_red);
+            cJSON_AddNumberToObject(led, "g", state.led_green);
+            cJSON_AddNumberToObject(led, "b", state.led_blue);
+            cJSON_AddNumberToObject(reported, "errors", state.errors);
+            cJSON_AddStringToObject(reported, "status", state.status);
+
+            char *printed = cJSON_PrintUnformatted(root);
+            cJSON_Delete(root);
+            if (printed == NULL)
+            {
+                fprintf(stderr, "cJSON failed to print reported state\n");
+                return -1;
+            }
+            len = strlen(printed);
+            sink += len;
+            cJSON_free(printed);
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    char params[32];
+    snprintf(params, sizeof(params), "fields=%zu bytes=%zu", BENCH_JSON_FIELDS, len);
+    bench_report("json/cjson_reported", params, options->iterations, elapsed);
+    return 0;
+}
+
+static void bench_json_cjson_string(const cJSON *object, const char *key, char *buf, size_t buf_len)
+{
+    const cJSON *item = cJSON_GetObjectItemCaseSensitive(object, key);
+    if (cJSON_IsString(item) && strlen(item->valuestring) < buf_len)
+    {
+        strcpy(buf, item->valuestring);
+    }
+}
+
+/**
+ * @brief Same delta as bench_json_schema_apply(), looked up member by member in a parsed tree, without acknowledgement.
+ */
+static int bench_json_cjson_apply(const struct bench_options *options)
+{
+    char delta[1024];
+    size_t delta_len = 0;
+    if (aws_iot_shadow_json_write_reported(BENCH_JSON_SCHEMA, BENCH_JSON_FIELDS, &BENCH_JSON_STATE, NULL, delta, sizeof(delta), &delta_len) != ESP_OK)
+    {
+        return -1;
+    }
+
+    volatile int64_t sink = 0;
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            struct bench_json_state state = {0};
+            cJSON *root = cJSON_ParseWithLength(delta, delta_len);
+            cJSON *reported = cJSON_GetObjectItemCaseSensitive(cJSON_GetObjectItemCaseSensitive(root, AWS_IOT_SHADOW_JSON_STATE), AWS_IOT_SHADOW_JSON_REPORTED);
+            if (reported == NULL)
+            {
+                fprintf(stderr, "cJSON failed to parse delta\n");
+                cJSON_Delete(root);
+                return -1;
+            }
+            const cJSON *env = cJSON_GetObjectItemCaseSensitive(reported, "env");
+            const cJSON *location = cJSON_GetObjectItemCaseSensitive(reported, "location");
+            const cJSON *led = cJSON_GetObjectItemCaseSensitive(reported, "led");
+            state.power = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(reported, "power"));
+            state.charging = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(reported, "charging"));
+            state.rssi = (int32_t)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(reported, "rssi"));
+            state.uptime = (uint32_t)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(reported, "uptime"));
+            state.timestamp = (int64_t)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(reported, "timestamp"));
+            state.temperature = (float)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(env, "temperature"));
+            state.humidity = (float)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(env, "humidity"));
+            state.latitude = cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(location, "lat"));
+            state.longitude = cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(location, "lon"));
+            bench_json_cjson_string(reported, "firmware", state.firmware, sizeof(state.firmware));
+            bench_json_cjson_string(reported, "mode", state.mode, sizeof(state.mode));
+            state.led_red = (int32_t)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(led, "r"));
+            state.led_green = (int32_t)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(led, "g"));
+            state.led_blue = (int32_t)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(led, "b"));
+            state.errors = (uint32_t)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(reported, "errors"));
+            bench_json_cjson_string(reported, "status", state.status, sizeof(state.status));
+            cJSON_Delete(root);
+            sink += state.uptime + state.led_red;
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    char params[48];
+    snprintf(params, sizeof(params), "fields=%zu payload=%zu", BENCH_JSON_FIELDS, delta_len);
+    bench_report("json/cjson_apply", params, options->iterations, elapsed);
+    return 0;
+}
+
+/**
+ * @brief Same report as bench_json_template(), as the example did, a tree kept between ticks and printed each one.
+ */
+static int bench_json_cjson_template(const struct bench_options *options)
+{
+    cJSON *root = cJSON_CreateObject();
+    cJSON *reported = cJSON_AddObjectToObject(cJSON_AddObjectToObject(root, AWS_IOT_SHADOW_JSON_STATE), AWS_IOT_SHADOW_JSON_REPORTED);
+    cJSON *now = cJSON_AddNumberToObject(reported, "now", 0);
+    cJSON *uptime = cJSON_AddNumberToObject(reported, "uptime", 0);
+    cJSON *temperature = cJSON_AddNumberToObject(reported, "temperature", 0);
+    cJSON_AddStringToObject(reported, "firmware", "1.4.2");
+
+    char buf[128];
+    size_t len = 0;
+    volatile size_t sink = 0;
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            cJSON_SetIntValue(now, 1700000000 + i);
+            cJSON_SetIntValue(uptime, i);
+            cJSON_SetNumberValue(temperature, 21.5 + (i % 100) * 0.01);
+            if (!cJSON_PrintPreallocated(root, buf, sizeof(buf), false))
+            {
+                fprintf(stderr, "cJSON failed to print report\n");
+                cJSON_Delete(root);
+                return -1;
+            }
+            len = strlen(buf);
+            sink += len;
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+    cJSON_Delete(root);
+
+    char params[32];
+    snprintf(params, sizeof(params), "bytes=%zu", len);
+    bench_report("json/cjson_template", params, options->iterations, elapsed);
+    return 0;
+}
+
+static int bench_json_cjson(const char *doc, size_t len, const struct bench_options *options, char *params)
+{
+    volatile int64_t sink = 0;
+    uint64_t elapsed = UINT64_MAX;
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            cJSON *root = cJSON_ParseWithLength(doc, len);
+            cJSON *state = cJSON_GetObjectItemCaseSensitive(root, AWS_IOT_SHADOW_JSON_STATE);
+            cJSON *desired = cJSON_GetObjectItemCaseSensitive(state, AWS_IOT_SHADOW_JSON_DESIRED);
+            cJSON *value = cJSON_GetObjectItemCaseSensitive(desired, BENCH_JSON_KEY);
+            cJSON *version = cJSON_GetObjectItemCaseSensitive(root, AWS_IOT_SHADOW_JSON_VERSION);
+            if (!cJSON_IsNumber(value) || !cJSON_IsNumber(version))
+            {
+                fprintf(stderr, "cJSON failed to parse document of %zu bytes\n", len);
+                cJSON_Delete(root);
+                return -1;
+            }
+            sink += value->valueint + version->valueint;
+            cJSON_Delete(root);
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    bench_report("json/cjson", params, options->iterations, elapsed);
+    return 0;
+}
+#endif
+
+int bench_json(const struct bench_options *options)
+{
+    size_t max_len = BENCH_JSON_SIZES[sizeof(BENCH_JSON_SIZES) / sizeof(BENCH_JSON_SIZES[0]) - 1];
+    char *doc = (char *)malloc(max_len + 1);
+    char *msg = (char *)malloc(2 * max_len + 64);
+    if (doc == NULL || msg == NULL)
+    {
+        free(doc);
+        return -1;
+    }
+
+    int result = 0;
+    for (size_t s = 0; result == 0 && s < sizeof(BENCH_JSON_SIZES) / sizeof(BENCH_JSON_SIZES[0]); s++)
+    {
+        size_t len = bench_json_document(doc, BENCH_JSON_SIZES[s]);
+
+        char params[32];
+        snprintf(params, sizeof(params), "payload=%zu", len);
+
+        result = bench_json_tokenizer(doc, len, options, params);
+        if (result == 0) result = bench_json_version(doc, len, options, params);
+#if BENCH_HAVE_CJSON
+        if (result == 0) result = bench_json_cjson(doc, len, options, params);
+#endif
+
+        // Both versions of the document
+        size_t msg_len = bench_json_documents(msg, doc, len);
+        snprintf(params, sizeof(params), "payload=%zu", msg_len);
+        if (result == 0) result = bench_json_changes(msg, msg_len, options, params);
+#if BENCH_HAVE_CJSON
+        if (result == 0) result = bench_json_cjson_changes(msg, msg_len, options, params);
+#endif
+    }
+
+    // Updates written from a struct
+    if (result == 0) result = bench_json_schema(options);
+    if (result == 0) result = bench_json_schema_apply(options);
+    if (result == 0) result = bench_json_template(options);
+#if BENCH_HAVE_CJSON
+    if (result == 0) result = bench_json_cjson_reported(options);
+    if (result == 0) result = bench_json_cjson_apply(options);
+    if (result == 0) result = bench_json_cjson_template(options);
+#endif
+
+    free(msg);
+    free(doc);
+    return result;
+}
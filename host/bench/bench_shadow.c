@@ -0,0 +1,1929 @@
+#include "aws_iot_shadow.h"
+#include "aws_iot_shadow_handle.h"
+#include "aws_iot_shadow_json.h"
+#include "aws_iot_shadow_persistence.h"
+#include "bench.h"
+#include <inttypes.h>
+#include <mqtt_client_mock.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_THING_NAME "bench-thing"
+#define BENCH_FRAGMENT_SIZE (128)
+#define BENCH_SLOW_HANDLER_NS (20000)
+#define BENCH_WAIT_TIMEOUT_NS (5000000000ULL)
+
+#define BENCH_WAIT_SLEEP_NS (10000)
+#define BENCH_BROKER_LATENCY_NS (200000)
+#define BENCH_BROKER_QUEUE_LENGTH (64)
+#define BENCH_COALESCE_SOURCES (4)
+#define BENCH_THROTTLE_THING_NAME "bench-throttle"
+#define BENCH_OFFLINE_UPDATES (32)
+#define BENCH_LAZY_THING_NAME "bench-lazy"
+#define BENCH_GATEWAY_THINGS (1000U)
+#define BENCH_KEY_MODULES (6U)
+
+// Events may be dropped, when they are queued faster than handled
+#define BENCH_EVENTS_EXACT (!AWS_IOT_SHADOW_ASYNC_DISPATCH || AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK)
+
+struct bench_shadow_ctx
+{
+    esp_mqtt_client_handle_t client;
+    aws_iot_shadow_handle_ptr *handles;
+    unsigned int count;
+    atomic_ulong events; // handlers might run on a worker task
+    size_t heap_per_shadow;
+};
+
+static void bench_shadow_handler(void *handler_args, __unused esp_event_base_t event_base,
+                                 __unused int32_t event_id, __unused void *event_data)
+{
+    struct bench_shadow_ctx *ctx = (struct bench_shadow_ctx *)handler_args;
+    atomic_fetch_add_explicit(&ctx->events, 1, memory_order_relaxed);
+}
+
+static void bench_shadow_slow_handler(__unused void *handler_args, __unused esp_event_base_t event_base,
+                                      __unused int32_t event_id, __unused void *event_data)
+{
+    // Parsing, flash writes, ...
+    uint64_t until = bench_now_ns() + BENCH_SLOW_HANDLER_NS;
+    while (bench_now_ns() < until)
+    {
+    }
+}
+
+static void bench_shadow_sleep(uint64_t ns)
+{
+    // Sleep, not yield, so a worker task gets the CPU
+    struct timespec ts = {.tv_sec = (time_t)(ns / 1000000000), .tv_nsec = (long)(ns % 1000000000)};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Waits until handlers have seen given number of events, returns number of events seen.
+ */
+static unsigned long bench_shadow_wait_events(struct bench_shadow_ctx *ctx, unsigned long expected)
+{
+    uint64_t deadline = bench_now_ns() + BENCH_WAIT_TIMEOUT_NS;
+    unsigned long events;
+    while ((events = atomic_load(&ctx->events)) < expected && bench_now_ns() < deadline)
+    {
+        bench_shadow_sleep(BENCH_WAIT_SLEEP_NS);
+    }
+    return events;
+}
+
+/**
+ * @brief Waits until handlers are idle, returns number of events seen.
+ */
+static unsigned long bench_shadow_wait_idle(struct bench_shadow_ctx *ctx)
+{
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+    // Worker drains its queue in a few ms at worst
+    unsigned long events;
+    do
+    {
+        events = atomic_load(&ctx->events);
+        bench_shadow_sleep(10000000);
+    } while (events != atomic_load(&ctx->events));
+    return events;
+#else
+    return atomic_load(&ctx->events);
+#endif
+}
+
+static int bench_shadow_setup(struct bench_shadow_ctx *ctx, unsigned int count)
+{
+    memset(ctx, 0, sizeof(*ctx));
+
+    esp_mqtt_client_config_t cfg = {
+        .client_id = "arn:aws:iot:eu-west-1:123456789012:thing/" BENCH_THING_NAME,
+    };
+    ctx->client = esp_mqtt_client_init(&cfg);
+    ctx->handles = (aws_iot_shadow_handle_ptr *)calloc(count, sizeof(*ctx->handles));
+    if (ctx->client == NULL || ctx->handles == NULL)
+    {
+        return -1;
+    }
+
+    size_t heap_before = bench_heap_used();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        // Single shadow is the classic one, otherwise named shadows only
+        char shadow_name[32];
+        snprintf(shadow_name, sizeof(shadow_name), "shadow-%u", i);
+
+        if (aws_iot_shadow_init(ctx->client, aws_iot_shadow_thing_name(cfg.client_id), count > 1 ? shadow_name : NULL, &ctx->handles[i]) != ESP_OK
+            || aws_iot_shadow_handler_register(ctx->handles[i], AWS_IOT_SHADOW_EVENT_ANY, bench_shadow_handler, ctx) != ESP_OK)
+        {
+            fprintf(stderr, "failed to init shadow %u\n", i);
+            return -1;
+        }
+        ctx->count++;
+    }
+    ctx->heap_per_shadow = (bench_heap_used() - heap_before) / count;
+
+    mock_mqtt_connect(ctx->client, false);
+    mock_mqtt_ack_subscriptions(ctx->client);
+    mock_mqtt_ack_publishes(ctx->client);
+    bench_shadow_wait_idle(ctx);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (!aws_iot_shadow_is_ready(ctx->handles[i]))
+        {
+            fprintf(stderr, "shadow %u is not ready\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void bench_shadow_teardown(struct bench_shadow_ctx *ctx)
+{
+    for (unsigned int i = 0; i < ctx->count; i++)
+    {
+        aws_iot_shadow_delete(ctx->handles[i]);
+    }
+    free(ctx->handles);
+    // Shadows never unregister their mqtt handlers, so the client is intentionally leaked
+}
+
+static int bench_shadow_dispatch(struct bench_shadow_ctx *ctx, const struct bench_options *options, const char *suffix,
+                                 int buffer_size)
+{
+    char *doc = (char *)malloc(options->payload_size);
+    if (doc == NULL)
+    {
+        return -1;
+    }
+    bench_fill_document(doc, options->payload_size);
+
+    // Last registered shadow is the worst case for any linear lookup
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(topic, sizeof(topic), "%s%s", ctx->handles[ctx->count - 1]->topic_prefix, suffix);
+
+    mock_mqtt_set_buffer_size(ctx->client, buffer_size);
+
+    unsigned long events_before = bench_shadow_wait_idle(ctx);
+    unsigned long expected = events_before + (unsigned long)options->iterations * options->rounds;
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        // With async dispatch, this includes waiting for the worker once the queue is full
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            mock_mqtt_deliver(ctx->client, topic, doc, (int)options->payload_size);
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+    free(doc);
+    mock_mqtt_set_buffer_size(ctx->client, 0);
+
+    unsigned long events = BENCH_EVENTS_EXACT ? bench_shadow_wait_events(ctx, expected) : bench_shadow_wait_idle(ctx);
+    if (BENCH_EVENTS_EXACT && events != expected)
+    {
+        fprintf(stderr, "expected %lu events, got %lu\n", expected - events_before, events - events_before);
+        return -1;
+    }
+
+    char name[64], params[96];
+    snprintf(name, sizeof(name), "dispatch%s", suffix);
+    snprintf(params, sizeof(params), "shadows=%u payload=%zu buffer=%d handled=%lu%%", ctx->count, options->payload_size,
+             buffer_size, (events - events_before) * 100 / (expected - events_before));
+    bench_report(name, params, options->iterations, elapsed);
+    return 0;
+}
+
+#if AWS_IOT_SHADOW_VERSION_FILTER && AWS_IOT_SHADOW_SUPPORT_DELTA
+static int bench_shadow_redelivered(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    aws_iot_shadow_handle_ptr handle = ctx->handles[ctx->count - 1];
+    size_t len = options->payload_size > 128 ? options->payload_size : 128;
+    char *doc = (char *)malloc(len + 1);
+    char *state = (char *)malloc(len);
+    if (doc == NULL || state == NULL)
+    {
+        free(doc);
+        free(state);
+        return -1;
+    }
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(topic, sizeof(topic), "%s" AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA, handle->topic_prefix);
+
+    struct aws_iot_shadow_discard_stats stats_before, stats;
+    aws_iot_shadow_discard_stats(handle, &stats_before);
+
+    // Same delta again and again, e.g. QoS 1 redelivery after a flaky link, only the first one is dispatched
+    uint64_t elapsed = UINT64_MAX;
+    int doc_len = 0;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        // Layout of AWS IoT deltas, version is after state and metadata
+        bench_fill_document(state, len - 96);
+        doc_len = snprintf(doc, len + 1, "{\"state\":%.*s,\"metadata\":{},\"version\":%u,\"timestamp\":1700000000}",
+                           (int)(len - 96 - 11), state + 9, 1000000 + r);
+
+        unsigned long events_before = bench_shadow_wait_idle(ctx);
+        mock_mqtt_deliver(ctx->client, topic, doc, doc_len);
+
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            mock_mqtt_deliver(ctx->client, topic, doc, doc_len);
+        }
+        uint64_t round_elapsed = bench_now_ns() - start;
+
+        unsigned long events = BENCH_EVENTS_EXACT ? bench_shadow_wait_events(ctx, events_before + 1) : bench_shadow_wait_idle(ctx);
+        if (events != events_before + 1)
+        {
+            fprintf(stderr, "expected a single delta to be dispatched, got %lu\n", events - events_before);
+            free(doc);
+            free(state);
+            return -1;
+        }
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+    free(doc);
+    free(state);
+
+    aws_iot_shadow_discard_stats(handle, &stats);
+    char params[96];
+    snprintf(params, sizeof(params), "shadows=%u payload=%d duplicate=%lu", ctx->count, doc_len,
+             (unsigned long)(stats.duplicate - stats_before.duplicate));
+    bench_report("dispatch/update/delta_duplicate", params, options->iterations, elapsed);
+    return 0;
+}
+
+static int bench_shadow_recreated(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    aws_iot_shadow_handle_ptr handle = ctx->handles[ctx->count - 1];
+    char delta_topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH], accepted_topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(delta_topic, sizeof(delta_topic), "%s" AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA,
+             handle->topic_prefix);
+    snprintf(accepted_topic, sizeof(accepted_topic), "%s" AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_ACCEPTED,
+             handle->topic_prefix);
+
+    // Shadow deleted by another client, /delete/accepted not seen, versions start at 1 again
+    uint64_t elapsed = UINT64_MAX;
+    char doc[96];
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        unsigned long events_before = bench_shadow_wait_idle(ctx);
+        int doc_len = snprintf(doc, sizeof(doc), "{\"state\":{\"v\":1},\"metadata\":{},\"version\":%u}", 2000000 + r);
+        mock_mqtt_deliver(ctx->client, delta_topic, doc, doc_len);
+        mock_mqtt_deliver(ctx->client, accepted_topic, doc, doc_len);
+
+        uint64_t start = bench_now_ns();
+        for (unsigned int version = 1; version <= 2; version++)
+        {
+            doc_len = snprintf(doc, sizeof(doc), "{\"state\":{\"v\":1},\"metadata\":{},\"version\":%u}", version);
+            mock_mqtt_deliver(ctx->client, delta_topic, doc, doc_len);
+            mock_mqtt_deliver(ctx->client, accepted_topic, doc, doc_len);
+        }
+        uint64_t round_elapsed = bench_now_ns() - start;
+
+        unsigned long events = BENCH_EVENTS_EXACT ? bench_shadow_wait_events(ctx, events_before + 6) : bench_shadow_wait_idle(ctx);
+        if (events != events_before + 6)
+        {
+            fprintf(stderr, "expected updates of recreated shadow to be dispatched, got %lu of 6\n", events - events_before);
+            return -1;
+        }
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+
+    char params[32];
+    snprintf(params, sizeof(params), "shadows=%u", ctx->count);
+    bench_report("dispatch/update/recreated", params, 4, elapsed);
+    return 0;
+}
+#endif
+
+static int bench_shadow_slow_handler_burst(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    // Burst fits the queue of async dispatch, so it measures time spent on the MQTT task only
+    const unsigned int burst = 8;
+    unsigned int bursts = options->iterations / 1000 > 0 ? options->iterations / 1000 : 1;
+
+    aws_iot_shadow_handle_ptr handle = ctx->handles[ctx->count - 1];
+    esp_event_handler_instance_t instance = NULL;
+    if (aws_iot_shadow_handler_instance_register(handle, AWS_IOT_SHADOW_EVENT_GET_REJECTED, bench_shadow_slow_handler, NULL, &instance) != ESP_OK)
+    {
+        fprintf(stderr, "failed to register slow handler\n");
+        return -1;
+    }
+
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(topic, sizeof(topic), "%s" AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_REJECTED, handle->topic_prefix);
+    static const char ERROR_DOC[] = "{\"code\":404,\"message\":\"No shadow exists with name\"}";
+
+    bench_shadow_wait_idle(ctx);
+
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t round_elapsed = 0;
+        for (unsigned int b = 0; b < bursts; b++)
+        {
+            unsigned long expected = atomic_load(&ctx->events) + burst;
+
+            uint64_t start = bench_now_ns();
+            for (unsigned int i = 0; i < burst; i++)
+            {
+                mock_mqtt_deliver(ctx->client, topic, ERROR_DOC, sizeof(ERROR_DOC) - 1);
+            }
+            round_elapsed += bench_now_ns() - start;
+
+            if (bench_shadow_wait_events(ctx, expected) != expected)
+            {
+                fprintf(stderr, "slow handler events were lost\n");
+                aws_iot_shadow_handler_instance_unregister(handle, AWS_IOT_SHADOW_EVENT_GET_REJECTED, instance);
+                return -1;
+            }
+        }
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+    aws_iot_shadow_handler_instance_unregister(handle, AWS_IOT_SHADOW_EVENT_GET_REJECTED, instance);
+
+    char params[64];
+    snprintf(params, sizeof(params), "shadows=%u handler_ns=%u burst=%u", ctx->count, BENCH_SLOW_HANDLER_NS, burst);
+    bench_report("dispatch/slow_handler", params, bursts * burst, elapsed);
+    return 0;
+}
+
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH && AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_COALESCE_DELTA \
+    && AWS_IOT_SHADOW_SUPPORT_DELTA
+struct bench_shadow_stall
+{
+    sem_t release;
+    atomic_bool stalled;
+};
+
+static void bench_shadow_stall_handler(void *handler_args, __unused esp_event_base_t event_base,
+                                       __unused int32_t event_id, __unused void *event_data)
+{
+    struct bench_shadow_stall *stall = (struct bench_shadow_stall *)handler_args;
+    atomic_store(&stall->stalled, true);
+    sem_wait(&stall->release);
+}
+
+static void bench_shadow_count_handler(void *handler_args, __unused esp_event_base_t event_base,
+                                       __unused int32_t event_id, __unused void *event_data)
+{
+    atomic_fetch_add_explicit((atomic_ulong *)handler_args, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Overflows the queue of a stalled worker with deltas, responses queued before them must not be dropped.
+ */
+static int bench_shadow_overflow_coalesced(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    static const enum aws_iot_shadow_event EVENTS[] = {
+        AWS_IOT_SHADOW_EVENT_GET_REJECTED, // stalls the worker
+        AWS_IOT_SHADOW_EVENT_GET_ACCEPTED,
+        AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED,
+        AWS_IOT_SHADOW_EVENT_UPDATE_DELTA,
+    };
+    _Static_assert(AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH > 2, "queue holds both responses and a delta");
+    const unsigned int deltas = 3 * AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH;
+
+    aws_iot_shadow_handle_ptr handle = ctx->handles[ctx->count - 1];
+    struct bench_shadow_stall stall = {};
+    sem_init(&stall.release, 0, 0);
+    atomic_ulong counts[4] = {};
+    esp_event_handler_instance_t instances[4] = {};
+    int result = 0;
+    for (unsigned int i = 0; i < 4 && result == 0; i++)
+    {
+        if (aws_iot_shadow_handler_instance_register(handle, EVENTS[i], i == 0 ? bench_shadow_stall_handler : bench_shadow_count_handler,
+                                                     i == 0 ? (void *)&stall : (void *)&counts[i], &instances[i]) != ESP_OK)
+        {
+            fprintf(stderr, "failed to register handler of event %d\n", EVENTS[i]);
+            result = -1;
+        }
+    }
+
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH], doc[96];
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds && result == 0; r++)
+    {
+        bench_shadow_wait_idle(ctx);
+        unsigned long before[4];
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            before[i] = atomic_load(&counts[i]);
+        }
+
+        static const char ERROR_DOC[] = "{\"code\":404,\"message\":\"No shadow exists with name\"}";
+        snprintf(topic, sizeof(topic), "%s" AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_REJECTED, handle->topic_prefix);
+        atomic_store(&stall.stalled, false);
+        mock_mqtt_deliver(ctx->client, topic, ERROR_DOC, sizeof(ERROR_DOC) - 1);
+        while (!atomic_load(&stall.stalled))
+        {
+            bench_shadow_sleep(BENCH_WAIT_SLEEP_NS);
+        }
+
+        uint64_t start = bench_now_ns();
+        unsigned int version = 3000000 + r * (deltas + 2);
+        int doc_len = snprintf(doc, sizeof(doc), "{\"state\":{\"desired\":{\"v\":0}},\"version\":%u}", version);
+        snprintf(topic, sizeof(topic), "%s" AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_ACCEPTED, handle->topic_prefix);
+        mock_mqtt_deliver(ctx->client, topic, doc, doc_len);
+        doc_len = snprintf(doc, sizeof(doc), "{\"state\":{\"reported\":{\"v\":0}},\"version\":%u}", ++version);
+        snprintf(topic, sizeof(topic), "%s" AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_ACCEPTED, handle->topic_prefix);
+        mock_mqtt_deliver(ctx->client, topic, doc, doc_len);
+        snprintf(topic, sizeof(topic), "%s" AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA, handle->topic_prefix);
+        for (unsigned int i = 0; i < deltas; i++)
+        {
+            doc_len = snprintf(doc, sizeof(doc), "{\"state\":{\"k%u\":%u},\"metadata\":{},\"version\":%u}", i % 4, i,
+                               ++version);
+            mock_mqtt_deliver(ctx->client, topic, doc, doc_len);
+        }
+        uint64_t round_elapsed = bench_now_ns() - start;
+
+        sem_post(&stall.release);
+        bench_shadow_wait_idle(ctx);
+        if (atomic_load(&counts[1]) != before[1] + 1 || atomic_load(&counts[2]) != before[2] + 1
+            || atomic_load(&counts[3]) != before[3] + AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH - 2)
+        {
+            // Deltas fill the rest of the queue, later ones are merged into the last one
+            fprintf(stderr, "expected get/accepted, update/accepted and %u deltas, got %lu, %lu and %lu\n",
+                    AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH - 2,
+                    atomic_load(&counts[1]) - before[1], atomic_load(&counts[2]) - before[2], atomic_load(&counts[3]) - before[3]);
+            result = -1;
+        }
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        if (instances[i] != NULL)
+        {
+            aws_iot_shadow_handler_instance_unregister(handle, EVENTS[i], instances[i]);
+        }
+    }
+    sem_destroy(&stall.release);
+    if (result == 0)
+    {
+        char params[64];
+        snprintf(params, sizeof(params), "shadows=%u queue=%u deltas=%u", ctx->count, AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH, deltas);
+        bench_report("dispatch/overflow_coalesced", params, deltas + 2, elapsed);
+    }
+    return result;
+}
+#endif
+
+static int bench_shadow_publish(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    char *doc = (char *)malloc(options->payload_size);
+    if (doc == NULL)
+    {
+        return -1;
+    }
+    bench_fill_document(doc, options->payload_size);
+
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t round_elapsed = 0;
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            uint64_t start = bench_now_ns();
+            esp_err_t err = aws_iot_shadow_request_update(ctx->handles[0], doc, options->payload_size);
+            round_elapsed += bench_now_ns() - start;
+
+            if (err != ESP_OK)
+            {
+                fprintf(stderr, "aws_iot_shadow_request_update failed: %d\n", err);
+                free(doc);
+                return -1;
+            }
+
+            // Keep mock outbox small, outside of the measured section
+            if (i % 1024 == 1023)
+            {
+                mock_mqtt_ack_publishes(ctx->client);
+            }
+        }
+        mock_mqtt_ack_publishes(ctx->client);
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+    free(doc);
+
+    char params[64];
+    snprintf(params, sizeof(params), "shadows=%u payload=%zu", ctx->count, options->payload_size);
+    bench_report("request_update", params, options->iterations, elapsed);
+    return 0;
+}
+
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+/**
+ * @brief Writes reported state `{"k000":0,...}` of at most len bytes, returns its length.
+ */
+static size_t bench_shadow_fill_reported(char *buf, size_t len)
+{
+    size_t pos = 0;
+    buf[pos++] = '{';
+    for (unsigned int i = 0; i < 1000 && pos + 11 < len; i++)
+    {
+        pos += (size_t)snprintf(buf + pos, len - pos, "%s\"k%03u\":0", i > 0 ? "," : "", i);
+    }
+    buf[pos++] = '}';
+    buf[pos] = '\0';
+    return pos;
+}
+
+static int bench_shadow_update_reported(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    aws_iot_shadow_handle_ptr handle = ctx->handles[0];
+    size_t len = options->payload_size > 32 ? options->payload_size : 32;
+    char *reported = (char *)malloc(len);
+    char *doc = (char *)malloc(len + 64);
+    if (reported == NULL || doc == NULL)
+    {
+        free(reported);
+        free(doc);
+        return -1;
+    }
+    size_t reported_len = bench_shadow_fill_reported(reported, len);
+
+    // Known state, as received on connect
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(topic, sizeof(topic), "%s" AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_ACCEPTED, handle->topic_prefix);
+    int doc_len = snprintf(doc, len + 64, "{\"state\":{\"reported\":%s},\"version\":1}", reported);
+    mock_mqtt_deliver(ctx->client, topic, doc, doc_len);
+    bench_shadow_wait_idle(ctx);
+
+    if (aws_iot_shadow_cached_reported(handle, doc, len + 64, NULL) != ESP_OK)
+    {
+        fprintf(stderr, "reported state was not cached\n");
+        free(reported);
+        free(doc);
+        return -1;
+    }
+
+    struct aws_iot_shadow_cache_stats stats_before, stats;
+    aws_iot_shadow_cache_stats(handle, &stats_before);
+    mock_mqtt_reset_stats(ctx->client);
+
+    // Typical telemetry tick, a single member changes
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t round_elapsed = 0;
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            reported[8] = (char)('0' + i % 10); // {"k000":N, unchanged every 10th time
+            uint64_t start = bench_now_ns();
+            esp_err_t err = aws_iot_shadow_request_update_reported(handle, reported, reported_len);
+            round_elapsed += bench_now_ns() - start;
+
+            if (err != ESP_OK)
+            {
+                fprintf(stderr, "aws_iot_shadow_request_update_reported failed: %d\n", err);
+                free(reported);
+                free(doc);
+                return -1;
+            }
+            if (i % 1024 == 1023)
+            {
+                mock_mqtt_ack_publishes(ctx->client);
+            }
+        }
+        mock_mqtt_ack_publishes(ctx->client);
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+    free(reported);
+    free(doc);
+
+    struct mock_mqtt_stats mqtt_stats;
+    mock_mqtt_get_stats(ctx->client, &mqtt_stats);
+    aws_iot_shadow_cache_stats(handle, &stats);
+    uint64_t saved = stats.bytes_saved - stats_before.bytes_saved;
+    unsigned int updates = (stats.updates_sent - stats_before.updates_sent) + (stats.updates_skipped - stats_before.updates_skipped);
+
+    char params[128];
+    snprintf(params, sizeof(params), "shadows=%u reported=%zu sent_bytes=%zu saved=%llu%%", ctx->count, reported_len,
+             updates > 0 ? mqtt_stats.publish_bytes / updates : 0,
+             (unsigned long long)(saved * 100 / (saved + mqtt_stats.publish_bytes + 1)));
+    bench_report("request_update_reported", params, options->iterations, elapsed);
+    return 0;
+}
+#endif
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+static int bench_shadow_restore(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    // Handle keeps using the store, after this suite
+    static char dir[] = "/tmp/aws_iot_shadow_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        return -1;
+    }
+    struct aws_iot_shadow_persistence persistence;
+    aws_iot_shadow_persistence_file_init(dir, &persistence);
+
+    // Snapshot of a state received from the server
+    aws_iot_shadow_handle_ptr handle = ctx->handles[0];
+    size_t len = options->payload_size > 64 ? options->payload_size : 64;
+    char *state = (char *)malloc(len / 2);
+    char *doc = (char *)malloc(len + 64);
+    if (state == NULL || doc == NULL)
+    {
+        free(state);
+        free(doc);
+        return -1;
+    }
+    bench_shadow_fill_reported(state, len / 2);
+    int doc_len = snprintf(doc, len + 64, "{\"state\":{\"desired\":%s,\"reported\":%s},\"version\":7}", state, state);
+    aws_iot_shadow_restore(handle, &persistence);
+
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(topic, sizeof(topic), "%s" AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_ACCEPTED, handle->topic_prefix);
+    mock_mqtt_deliver(ctx->client, topic, doc, doc_len);
+    free(state);
+    free(doc);
+    bench_shadow_wait_idle(ctx);
+
+    // Reboot is a new handle, state is dispatched by aws_iot_shadow_restore() instead of /get round trip
+    unsigned int iterations = options->iterations / 100 > 0 ? options->iterations / 100 : 1;
+    uint64_t elapsed = UINT64_MAX;
+    int result = 0;
+    for (unsigned int r = 0; r < options->rounds && result == 0; r++)
+    {
+        uint64_t round_elapsed = 0;
+        for (unsigned int i = 0; i < iterations && result == 0; i++)
+        {
+            char thing_name[AWS_IOT_SHADOW_THINGNAME_LENGTH_MAX];
+            char shadow_name[AWS_IOT_SHADOW_NAME_LENGTH_MAX];
+            strcpy(thing_name, handle->thing_name);
+            strcpy(shadow_name, handle->shadow_name);
+
+            aws_iot_shadow_delete(handle);
+            if (aws_iot_shadow_init(ctx->client, thing_name, shadow_name[0] ? shadow_name : NULL, &handle) != ESP_OK
+                || aws_iot_shadow_handler_register(handle, AWS_IOT_SHADOW_EVENT_ANY, bench_shadow_handler, ctx) != ESP_OK)
+            {
+                fprintf(stderr, "failed to init shadow\n");
+                result = -1;
+                break;
+            }
+            ctx->handles[0] = handle;
+
+            unsigned long expected = bench_shadow_wait_idle(ctx) + 1;
+            uint64_t start = bench_now_ns();
+            esp_err_t err = aws_iot_shadow_restore(handle, &persistence);
+            bool restored = err == ESP_OK && bench_shadow_wait_events(ctx, expected) == expected;
+            round_elapsed += bench_now_ns() - start;
+
+            if (!restored)
+            {
+                fprintf(stderr, "aws_iot_shadow_restore failed: %d\n", err);
+                result = -1;
+            }
+
+            // Subscriptions of the new handle
+            mock_mqtt_ack_subscriptions(ctx->client);
+            mock_mqtt_ack_publishes(ctx->client);
+        }
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, handle->snapshot_key);
+    struct stat st = {0};
+    stat(path, &st);
+    unlink(path);
+    rmdir(dir);
+
+    if (result == 0)
+    {
+        char params[96];
+        snprintf(params, sizeof(params), "shadows=%u payload=%d snapshot=%lld round_trips=0", ctx->count,
+                 doc_len, (long long)st.st_size);
+        bench_report("restore", params, iterations, elapsed);
+    }
+    return result;
+}
+#endif
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+struct bench_broker_response
+{
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    char doc[160];
+    int doc_len;
+    uint64_t due;
+};
+
+/**
+ * @brief Broker answering every update after BENCH_BROKER_LATENCY_NS. Only touched by the bench task.
+ */
+struct bench_broker
+{
+    struct bench_broker_response responses[BENCH_BROKER_QUEUE_LENGTH];
+    unsigned int head;
+    unsigned int tail;
+    atomic_ulong completed;
+    atomic_ullong rtt_us;
+    atomic_ulong failed;
+};
+
+static void bench_broker_publish_hook(__unused esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                                      int len, void *arg)
+{
+    struct bench_broker *broker = (struct bench_broker *)arg;
+    struct aws_iot_shadow_json_document doc;
+    char client_token[AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX];
+    if (broker->tail - broker->head >= BENCH_BROKER_QUEUE_LENGTH
+        || aws_iot_shadow_json_parse_document(data, (size_t)len, &doc) != ESP_OK
+        || aws_iot_shadow_json_string_copy(&doc.client_token, client_token, sizeof(client_token)) != ESP_OK)
+    {
+        return;
+    }
+
+    struct bench_broker_response *response = &broker->responses[broker->tail++ % BENCH_BROKER_QUEUE_LENGTH];
+    snprintf(response->topic, sizeof(response->topic), "%s" AWS_IOT_SHADOW_SUFFIX_ACCEPTED, topic);
+    response->doc_len = snprintf(response->doc, sizeof(response->doc),
+                                 "{\"state\":{\"reported\":{\"v\":1}},\"clientToken\":\"%s\",\"version\":%u}",
+                                 client_token, broker->tail);
+    response->due = bench_now_ns() + BENCH_BROKER_LATENCY_NS;
+}
+
+/**
+ * @brief Waits for the oldest response and delivers it, returns false if there is none.
+ */
+static bool bench_broker_deliver(struct bench_broker *broker, esp_mqtt_client_handle_t client)
+{
+    if (broker->head == broker->tail)
+    {
+        return false;
+    }
+    struct bench_broker_response *response = &broker->responses[broker->head++ % BENCH_BROKER_QUEUE_LENGTH];
+    uint64_t now = bench_now_ns();
+    if (now < response->due)
+    {
+        bench_shadow_sleep(response->due - now);
+    }
+    mock_mqtt_deliver(client, response->topic, response->doc, response->doc_len);
+    return true;
+}
+
+static void bench_shadow_tracked_done(__unused aws_iot_shadow_handle_ptr handle,
+                                      const struct aws_iot_shadow_request_completion *completion, void *arg)
+{
+    struct bench_broker *broker = (struct bench_broker *)arg;
+    if (completion->result != AWS_IOT_SHADOW_REQUEST_ACCEPTED)
+    {
+        atomic_fetch_add(&broker->failed, 1);
+    }
+    atomic_fetch_add(&broker->rtt_us, (unsigned long long)completion->rtt_us);
+    atomic_fetch_add(&broker->completed, 1);
+}
+
+static int bench_shadow_tracked_window(struct bench_shadow_ctx *ctx, const struct bench_options *options, unsigned int window)
+{
+    static const char update[] = "{\"state\":{\"reported\":{\"v\":1}}}";
+
+    // Each request waits for the broker, like reconnects
+    unsigned int iterations = options->iterations / 100 > 0 ? options->iterations / 100 : 1;
+    struct bench_broker *broker = (struct bench_broker *)calloc(1, sizeof(*broker));
+    if (broker == NULL)
+    {
+        return -1;
+    }
+    mock_mqtt_set_publish_hook(ctx->client, bench_broker_publish_hook, broker);
+
+    struct aws_iot_shadow_request_config config = {
+        .callback = bench_shadow_tracked_done,
+        .arg = broker,
+    };
+
+    uint64_t elapsed = UINT64_MAX;
+    unsigned long long rtt_us = 0;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        atomic_store(&broker->completed, 0);
+        atomic_store(&broker->rtt_us, 0);
+
+        uint64_t start = bench_now_ns();
+        unsigned int sent = 0;
+        while (atomic_load(&broker->completed) < iterations)
+        {
+            if (sent < iterations && sent - atomic_load(&broker->completed) < window)
+            {
+                esp_err_t err = aws_iot_shadow_request_update_tracked(ctx->handles[0], update, sizeof(update) - 1, &config);
+                if (err == ESP_OK)
+                {
+                    sent++;
+                    continue;
+                }
+                if (err != ESP_ERR_NO_MEM)
+                {
+                    fprintf(stderr, "aws_iot_shadow_request_update_tracked failed: %d\n", err);
+                    mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+                    free(broker);
+                    return -1;
+                }
+            }
+            if (!bench_broker_deliver(broker, ctx->client))
+            {
+                // Worker has not completed delivered responses yet
+                bench_shadow_sleep(BENCH_WAIT_SLEEP_NS);
+            }
+            mock_mqtt_ack_publishes(ctx->client);
+        }
+        uint64_t round_elapsed = bench_now_ns() - start;
+
+        if (round_elapsed < elapsed)
+        {
+            elapsed = round_elapsed;
+            rtt_us = atomic_load(&broker->rtt_us) / iterations;
+        }
+    }
+    mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+    unsigned long failed = atomic_load(&broker->failed);
+    free(broker);
+
+    if (failed > 0)
+    {
+        fprintf(stderr, "%lu tracked requests failed\n", failed);
+        return -1;
+    }
+
+    char params[96];
+    snprintf(params, sizeof(params), "shadows=%u window=%u latency_us=%u rtt_us=%llu", ctx->count, window,
+             BENCH_BROKER_LATENCY_NS / 1000, rtt_us);
+    bench_report("request_update_tracked", params, iterations, elapsed);
+    return 0;
+}
+
+#define BENCH_SYNC_STATE_SIZE (512U)
+
+/**
+ * @brief Broker answering a get right away, from within the publish, with BENCH_SYNC_STATE_SIZE bytes of desired state.
+ */
+struct bench_sync_broker
+{
+    char doc[BENCH_SYNC_STATE_SIZE + 160];
+    char state[BENCH_SYNC_STATE_SIZE + 1];
+    unsigned int version;
+};
+
+static void bench_sync_publish_hook(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, void *arg)
+{
+    struct bench_sync_broker *broker = (struct bench_sync_broker *)arg;
+    struct aws_iot_shadow_json_document doc;
+    char client_token[AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX] = "";
+    if (len > 0 && aws_iot_shadow_json_parse_document(data, (size_t)len, &doc) == ESP_OK)
+    {
+        aws_iot_shadow_json_string_copy(&doc.client_token, client_token, sizeof(client_token));
+    }
+
+    char response_topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(response_topic, sizeof(response_topic), "%s" AWS_IOT_SHADOW_SUFFIX_ACCEPTED, topic);
+    int doc_len = snprintf(broker->doc, sizeof(broker->doc),
+                           "{\"state\":{\"desired\":{\"pad\":\"%s\"}},\"clientToken\":\"%s\",\"version\":%u}",
+                           broker->state, client_token, ++broker->version);
+    mock_mqtt_deliver(client, response_topic, broker->doc, doc_len);
+}
+
+struct bench_sync_waiter
+{
+    sem_t done;
+    char *copy; // what the application keeps, allocated by the handler
+    size_t copy_len;
+};
+
+static void bench_sync_get_handler(void *handler_args, __unused esp_event_base_t event_base,
+                                   __unused int32_t event_id, void *event_data)
+{
+    // Without a synchronous get, the application copies the document out of the MQTT buffer and signals itself
+    struct bench_sync_waiter *waiter = (struct bench_sync_waiter *)handler_args;
+    const struct aws_iot_shadow_event_data *event = (const struct aws_iot_shadow_event_data *)event_data;
+    waiter->copy = (char *)malloc(event->data_len + 1);
+    if (waiter->copy != NULL)
+    {
+        memcpy(waiter->copy, event->data, event->data_len);
+        waiter->copy[event->data_len] = '\0';
+        waiter->copy_len = event->data_len;
+    }
+    sem_post(&waiter->done);
+}
+
+/**
+ * @brief Get at boot, with a handler signalling a semaphore, or with aws_iot_shadow_request_get_sync().
+ */
+static int bench_shadow_get_sync_mode(struct bench_shadow_ctx *ctx, const struct bench_options *options, bool sync)
+{
+    struct bench_sync_broker *broker = (struct bench_sync_broker *)calloc(1, sizeof(*broker));
+    char *buf = (char *)malloc(sizeof(broker->doc));
+    struct bench_sync_waiter waiter = {0};
+    esp_event_handler_instance_t instance = NULL;
+    if (broker == NULL || buf == NULL || sem_init(&waiter.done, 0, 0) != 0)
+    {
+        free(broker);
+        free(buf);
+        return -1;
+    }
+    memset(broker->state, 'x', BENCH_SYNC_STATE_SIZE);
+
+    aws_iot_shadow_handle_ptr handle = ctx->handles[0];
+    int result = 0;
+    if (!sync && aws_iot_shadow_handler_instance_register(handle, AWS_IOT_SHADOW_EVENT_GET_ACCEPTED, bench_sync_get_handler,
+                                                          &waiter, &instance) != ESP_OK)
+    {
+        result = -1;
+    }
+    mock_mqtt_set_publish_hook(ctx->client, bench_sync_publish_hook, broker);
+
+    uint64_t elapsed = UINT64_MAX;
+    size_t response_len = 0;
+    int64_t rtt_us = 0;
+    for (unsigned int r = 0; result == 0 && r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; result == 0 && i < options->iterations; i++)
+        {
+            if (sync)
+            {
+                struct aws_iot_shadow_sync_response response;
+                esp_err_t err = aws_iot_shadow_request_get_sync(handle, buf, sizeof(broker->doc), portMAX_DELAY, &response);
+                if (err != ESP_OK)
+                {
+                    fprintf(stderr, "aws_iot_shadow_request_get_sync failed: %d\n", err);
+                    result = -1;
+                }
+                response_len = response.len;
+                rtt_us = response.rtt_us;
+            }
+            else if (aws_iot_shadow_request_get(handle) == ESP_OK)
+            {
+                sem_wait(&waiter.done);
+                response_len = waiter.copy_len;
+                free(waiter.copy);
+                waiter.copy = NULL;
+            }
+            else
+            {
+                fprintf(stderr, "aws_iot_shadow_request_get failed\n");
+                result = -1;
+            }
+            mock_mqtt_ack_publishes(ctx->client);
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+    if (instance != NULL)
+    {
+        aws_iot_shadow_handler_instance_unregister(handle, AWS_IOT_SHADOW_EVENT_GET_ACCEPTED, instance);
+    }
+    sem_destroy(&waiter.done);
+    free(buf);
+    free(broker);
+
+    if (result == 0)
+    {
+        // Handler mode has no round trip time of its own
+        char params[96];
+        int len = snprintf(params, sizeof(params), "shadows=%u mode=%s response=%zu", ctx->count,
+                           sync ? "sync" : "handler", response_len);
+        if (sync)
+        {
+            snprintf(params + len, sizeof(params) - (size_t)len, " rtt_us=%lld", (long long)rtt_us);
+        }
+        bench_report("request_get_sync", params, options->iterations, elapsed);
+    }
+    return result;
+}
+
+static int bench_shadow_tracked(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    // Waiting for each response, and pipelined up to the pending table size
+    int result = bench_shadow_tracked_window(ctx, options, 1);
+    if (result == 0) result = bench_shadow_tracked_window(ctx, options, AWS_IOT_SHADOW_REQUEST_MAX_PENDING);
+    if (result == 0) result = bench_shadow_get_sync_mode(ctx, options, false);
+    if (result == 0) result = bench_shadow_get_sync_mode(ctx, options, true);
+    return result;
+}
+#endif
+
+#if AWS_IOT_SHADOW_UPDATE_COALESCING || AWS_IOT_SHADOW_PUBLISH_THROTTLE
+static bool bench_shadow_wait_published(sem_t *published)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += BENCH_WAIT_TIMEOUT_NS / 1000000000ULL;
+    return sem_timedwait(published, &deadline) == 0;
+}
+
+#endif
+
+#if AWS_IOT_SHADOW_UPDATE_COALESCING
+/**
+ * @brief CPU time of all threads, merged updates are published from the esp_timer task.
+ */
+static uint64_t bench_shadow_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Broker echoing every update as /update/accepted, as AWS IoT does, and posting published semaphore.
+ */
+static void bench_echo_publish_hook(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len,
+                                    void *arg)
+{
+    char accepted[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(accepted, sizeof(accepted), "%s" AWS_IOT_SHADOW_SUFFIX_ACCEPTED, topic);
+    mock_mqtt_deliver(client, accepted, data, len);
+    sem_post((sem_t *)arg);
+}
+
+/**
+ * @brief Every source reports its own fragment each tick, published separately or coalesced into one update.
+ */
+static int bench_shadow_coalesced_mode(struct bench_shadow_ctx *ctx, const struct bench_options *options, bool coalesce)
+{
+    unsigned int iterations = options->iterations / 100 > 0 ? options->iterations / 100 : 1;
+    uint64_t elapsed = UINT64_MAX;
+    struct mock_mqtt_stats stats = {0};
+    sem_t published;
+    sem_init(&published, 0, 0);
+    mock_mqtt_set_publish_hook(ctx->client, bench_echo_publish_hook, &published);
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        mock_mqtt_ack_publishes(ctx->client);
+        mock_mqtt_reset_stats(ctx->client);
+
+        uint64_t start = bench_shadow_cpu_ns();
+        for (unsigned int i = 0; i < iterations; i++)
+        {
+            for (unsigned int s = 0; s < BENCH_COALESCE_SOURCES; s++)
+            {
+                char fragment[96];
+                esp_err_t err;
+                if (coalesce)
+                {
+                    int len = snprintf(fragment, sizeof(fragment), "{\"s%u\":{\"v\":%u,\"round\":%u}}", s, i, r);
+                    err = aws_iot_shadow_request_update_coalesced(ctx->handles[0], fragment, (size_t)len);
+                }
+                else
+                {
+                    int len = snprintf(fragment, sizeof(fragment), "{\"state\":{\"reported\":{\"s%u\":{\"v\":%u,\"round\":%u}}}}",
+                                       s, i, r);
+                    err = aws_iot_shadow_request_update(ctx->handles[0], fragment, (size_t)len);
+                }
+                if (err != ESP_OK)
+                {
+                    fprintf(stderr, "update of source %u failed: %d\n", s, err);
+                    mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+                    sem_destroy(&published);
+                    return -1;
+                }
+            }
+
+            // Window ends once every source has reported
+            if (coalesce && (aws_iot_shadow_request_update_flush(ctx->handles[0]) != ESP_OK
+                             || !bench_shadow_wait_published(&published)))
+            {
+                fprintf(stderr, "coalesced update %u was not published\n", i);
+                mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+                sem_destroy(&published);
+                return -1;
+            }
+        }
+        elapsed = bench_min(elapsed, bench_shadow_cpu_ns() - start);
+        mock_mqtt_get_stats(ctx->client, &stats);
+
+        // Separate updates posted it too
+        while (sem_trywait(&published) == 0)
+        {
+        }
+    }
+    mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+    sem_destroy(&published);
+    mock_mqtt_ack_publishes(ctx->client);
+
+    // Per tick of all sources, CPU time including /update/accepted echoes
+    char params[96];
+    snprintf(params, sizeof(params), "shadows=%u sources=%u publishes=%.2f bytes=%zu", ctx->count, BENCH_COALESCE_SOURCES,
+             (double)stats.publish_count / iterations, stats.publish_bytes / iterations);
+    bench_report(coalesce ? "request_update_coalesced" : "request_update_fragments", params, iterations, elapsed);
+    return 0;
+}
+
+static int bench_shadow_coalesced(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    int result = bench_shadow_coalesced_mode(ctx, options, false);
+    if (result == 0) result = bench_shadow_coalesced_mode(ctx, options, true);
+    return result;
+}
+#endif
+
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+/**
+ * @brief Updates of 4 sensors while disconnected, then time from reconnect until the journal is published.
+ */
+static int bench_shadow_offline(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    // Reconnect cycles are much more expensive than messages
+    unsigned int iterations = options->iterations / 100 > 0 ? options->iterations / 100 : 1;
+    uint64_t elapsed = UINT64_MAX;
+    size_t offline_bytes = 0;
+    struct mock_mqtt_stats stats = {0};
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t round_elapsed = 0;
+        struct mock_mqtt_stats round_stats = {0};
+        offline_bytes = 0;
+
+        for (unsigned int i = 0; i < iterations; i++)
+        {
+            mock_mqtt_disconnect(ctx->client);
+            for (unsigned int u = 0; u < BENCH_OFFLINE_UPDATES; u++)
+            {
+                char doc[96];
+                int len = snprintf(doc, sizeof(doc), "{\"state\":{\"reported\":{\"s%u\":{\"v\":%u,\"round\":%u}}}}", u % 4, u, i);
+                offline_bytes += (size_t)len;
+                esp_err_t err = aws_iot_shadow_request_update(ctx->handles[0], doc, (size_t)len);
+                if (err != ESP_OK)
+                {
+                    fprintf(stderr, "offline update %u failed: %d\n", u, err);
+                    return -1;
+                }
+            }
+
+            mock_mqtt_reset_stats(ctx->client);
+            uint64_t start = bench_now_ns();
+            mock_mqtt_connect(ctx->client, false);
+            while (mock_mqtt_ack_subscriptions(ctx->client) > 0)
+            {
+            }
+            round_elapsed += bench_now_ns() - start;
+
+            // Less the get of each shadow
+            struct mock_mqtt_stats cycle;
+            mock_mqtt_get_stats(ctx->client, &cycle);
+            round_stats.publish_count += cycle.publish_count - ctx->count;
+            round_stats.publish_bytes += cycle.publish_bytes;
+            mock_mqtt_ack_publishes(ctx->client);
+        }
+        if (round_elapsed < elapsed)
+        {
+            elapsed = round_elapsed;
+            stats = round_stats;
+        }
+    }
+
+    char params[160];
+    snprintf(params, sizeof(params), "shadows=%u policy=%s updates=%u offline_bytes=%zu publishes=%.2f bytes=%zu",
+             ctx->count, AWS_IOT_SHADOW_OFFLINE_JOURNAL_POLICY == AWS_IOT_SHADOW_OFFLINE_JOURNAL_ALL ? "all" : "latest",
+             BENCH_OFFLINE_UPDATES, offline_bytes / iterations, (double)stats.publish_count / iterations,
+             stats.publish_bytes / iterations);
+    bench_report("reconnect_journal", params, iterations, elapsed);
+    return 0;
+}
+#endif
+
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+struct bench_throttle_broker
+{
+    char get_topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    atomic_ullong get_published_ns;
+    sem_t get_published;
+};
+
+/**
+ * @brief Acknowledges every publish right away, and notes when a get request goes out.
+ */
+static void bench_throttle_publish_hook(esp_mqtt_client_handle_t client, const char *topic, __unused const char *data,
+                                        __unused int len, void *arg)
+{
+    struct bench_throttle_broker *broker = (struct bench_throttle_broker *)arg;
+    mock_mqtt_ack_publishes(client);
+    if (strcmp(topic, broker->get_topic) == 0)
+    {
+        atomic_store(&broker->get_published_ns, bench_now_ns());
+        sem_post(&broker->get_published);
+    }
+}
+
+/**
+ * @brief Burst of low priority telemetry fills the queue of a thing, then a get has to go out before it.
+ */
+static int bench_shadow_throttle(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    static const char telemetry[] = "{\"state\":{\"reported\":{\"t\":1}}}";
+    const uint64_t interval_ns = 1000000000ULL / AWS_IOT_SHADOW_THROTTLE_RATE;
+
+    struct bench_throttle_broker broker = {0};
+    sem_init(&broker.get_published, 0, 0);
+    mock_mqtt_set_publish_hook(ctx->client, bench_throttle_publish_hook, &broker);
+
+    // Own thing, its queue is dropped by delete
+    aws_iot_shadow_handle_ptr handle = NULL;
+    if (aws_iot_shadow_init(ctx->client, BENCH_THROTTLE_THING_NAME, NULL, &handle) != ESP_OK)
+    {
+        fprintf(stderr, "failed to init shadow\n");
+        mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+        return -1;
+    }
+    snprintf(broker.get_topic, sizeof(broker.get_topic), "%s" AWS_IOT_SHADOW_OP_GET, handle->topic_prefix);
+
+    // Ready publishes a get, then the bucket refills
+    mock_mqtt_ack_subscriptions(ctx->client);
+    int result = bench_shadow_wait_published(&broker.get_published) ? 0 : -1;
+    bench_shadow_sleep(2 * interval_ns);
+
+    unsigned int refused = 0;
+    for (unsigned int i = 0; result == 0 && i < AWS_IOT_SHADOW_THROTTLE_BURST + AWS_IOT_SHADOW_THROTTLE_QUEUE_LENGTH; i++)
+    {
+        esp_err_t err = aws_iot_shadow_request_update_priority(handle, telemetry, sizeof(telemetry) - 1, AWS_IOT_SHADOW_PRIORITY_LOW);
+        if (err == ESP_ERR_NO_MEM)
+        {
+            refused++;
+        }
+        else if (err != ESP_OK)
+        {
+            fprintf(stderr, "aws_iot_shadow_request_update_priority failed: %d\n", err);
+            result = -1;
+        }
+    }
+
+    struct aws_iot_shadow_throttle_stats stats = {0};
+    aws_iot_shadow_throttle_stats(handle, &stats);
+
+    uint64_t get_start = bench_now_ns();
+    if (result == 0 && (aws_iot_shadow_request_get(handle) != ESP_OK || !bench_shadow_wait_published(&broker.get_published)))
+    {
+        fprintf(stderr, "throttled get was not published\n");
+        result = -1;
+    }
+    uint64_t get_latency = atomic_load(&broker.get_published_ns) - get_start;
+
+    // While the queue drains
+    unsigned long throttled = 0;
+    uint64_t start = bench_now_ns();
+    for (unsigned int i = 0; result == 0 && i < options->iterations; i++)
+    {
+        throttled += aws_iot_shadow_would_throttle(handle, AWS_IOT_SHADOW_PRIORITY_LOW) ? 1 : 0;
+    }
+    uint64_t would_throttle_elapsed = bench_now_ns() - start;
+
+    mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+    aws_iot_shadow_delete(handle);
+    sem_destroy(&broker.get_published);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // In FIFO order, the get would wait for the whole queue
+    char params[128];
+    snprintf(params, sizeof(params), "rate=%u burst=%u queued=%u refused=%u fifo_us=%llu", AWS_IOT_SHADOW_THROTTLE_RATE,
+             AWS_IOT_SHADOW_THROTTLE_BURST, stats.queued, refused,
+             (unsigned long long)((stats.queued + 1) * interval_ns / 1000));
+    bench_report("request_get_throttled", params, 1, get_latency);
+
+    snprintf(params, sizeof(params), "throttled=%lu%%", throttled * 100 / options->iterations);
+    bench_report("would_throttle", params, options->iterations, would_throttle_elapsed);
+    return 0;
+}
+#endif
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+static void bench_shadow_noop_handler(__unused void *arg, __unused esp_event_base_t base, __unused int32_t event_id,
+                                      __unused void *event_data)
+{
+}
+
+/**
+ * @brief Time to ready of read-mostly shadows, listening to /get/accepted and /update/delta only,
+ * then the cost of dropping a handler.
+ */
+static int bench_shadow_lazy(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    // Own client, so only these shadows (re)connect
+    esp_mqtt_client_config_t cfg = {
+        .client_id = "arn:aws:iot:eu-west-1:123456789012:thing/" BENCH_LAZY_THING_NAME,
+    };
+    esp_mqtt_client_handle_t client = esp_mqtt_client_init(&cfg);
+    aws_iot_shadow_handle_ptr *handles = (aws_iot_shadow_handle_ptr *)calloc(ctx->count, sizeof(*handles));
+    esp_event_handler_instance_t delta_instance = NULL;
+    int result = client != NULL && handles != NULL ? 0 : -1;
+
+    for (unsigned int i = 0; result == 0 && i < ctx->count; i++)
+    {
+        char shadow_name[32];
+        snprintf(shadow_name, sizeof(shadow_name), "shadow-%u", i);
+        if (aws_iot_shadow_init(client, BENCH_LAZY_THING_NAME, shadow_name, &handles[i]) != ESP_OK
+            || aws_iot_shadow_handler_register(handles[i], AWS_IOT_SHADOW_EVENT_GET_ACCEPTED, bench_shadow_noop_handler, NULL) != ESP_OK
+#if AWS_IOT_SHADOW_SUPPORT_DELTA
+            || aws_iot_shadow_handler_instance_register(handles[i], AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, bench_shadow_noop_handler, NULL,
+                                                        i == 0 ? &delta_instance : NULL) != ESP_OK
+#endif
+        )
+        {
+            fprintf(stderr, "failed to init shadow %u\n", i);
+            result = -1;
+        }
+    }
+
+    unsigned int iterations = options->iterations / 100 > 0 ? options->iterations / 100 : 1;
+    uint64_t elapsed = UINT64_MAX;
+    unsigned long subscribes = 0;
+    unsigned long round_trips = 0;
+
+    for (unsigned int r = 0; result == 0 && r < options->rounds; r++)
+    {
+        uint64_t round_elapsed = 0;
+        subscribes = 0;
+        round_trips = 0;
+
+        for (unsigned int i = 0; result == 0 && i < iterations; i++)
+        {
+            mock_mqtt_disconnect(client);
+            mock_mqtt_reset_stats(client);
+
+            uint64_t start = bench_now_ns();
+            mock_mqtt_connect(client, false);
+            while (mock_mqtt_ack_subscriptions(client) > 0)
+            {
+                round_trips++;
+            }
+            round_elapsed += bench_now_ns() - start;
+
+            struct mock_mqtt_stats stats;
+            mock_mqtt_get_stats(client, &stats);
+            subscribes += stats.subscribe_count;
+
+            for (unsigned int h = 0; h < ctx->count; h++)
+            {
+                if (!aws_iot_shadow_is_ready(handles[h]))
+                {
+                    fprintf(stderr, "shadow %u is not ready after reconnect\n", h);
+                    result = -1;
+                }
+            }
+            mock_mqtt_ack_publishes(client);
+        }
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+
+    // Last handler of an event gone, its topic is unsubscribed on the esp_timer task
+    struct mock_mqtt_stats stats = {0};
+#if AWS_IOT_SHADOW_SUPPORT_DELTA
+    if (result == 0)
+    {
+        mock_mqtt_reset_stats(client);
+        aws_iot_shadow_handler_instance_unregister(handles[0], AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, delta_instance);
+        uint64_t deadline = bench_now_ns() + BENCH_WAIT_TIMEOUT_NS;
+        do
+        {
+            bench_shadow_sleep(BENCH_WAIT_SLEEP_NS);
+            mock_mqtt_get_stats(client, &stats);
+        } while (stats.unsubscribe_count == 0 && bench_now_ns() < deadline);
+        if (stats.unsubscribe_count != 1)
+        {
+            fprintf(stderr, "/update/delta has not been unsubscribed\n");
+            result = -1;
+        }
+    }
+#endif
+
+    if (result == 0)
+    {
+        char params[96];
+        snprintf(params, sizeof(params), "shadows=%u subscribes=%lu round_trips=%lu unsubscribes=%u", ctx->count,
+                 subscribes / iterations, round_trips / iterations, stats.unsubscribe_count);
+        bench_report("time_to_ready/lazy", params, iterations, elapsed);
+    }
+
+    for (unsigned int i = 0; handles != NULL && i < ctx->count; i++)
+    {
+        aws_iot_shadow_delete(handles[i]);
+    }
+    free(handles);
+    if (client != NULL)
+    {
+        esp_mqtt_client_destroy(client);
+    }
+    return result;
+}
+#endif
+
+/**
+ * @brief Time from CONNECTED until all shadows are ready, with a clean or a resumed broker session.
+ */
+static int bench_shadow_ready(struct bench_shadow_ctx *ctx, const struct bench_options *options, bool session_present)
+{
+    // Reconnect cycles are much more expensive than messages
+    unsigned int iterations = options->iterations / 100 > 0 ? options->iterations / 100 : 1;
+    uint64_t elapsed = UINT64_MAX;
+    unsigned long subscribes = 0;
+    unsigned long round_trips = 0;
+
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t round_elapsed = 0;
+        subscribes = 0;
+        round_trips = 0;
+
+        for (unsigned int i = 0; i < iterations; i++)
+        {
+            mock_mqtt_disconnect(ctx->client);
+            mock_mqtt_reset_stats(ctx->client);
+
+            uint64_t start = bench_now_ns();
+            mock_mqtt_connect(ctx->client, session_present);
+
+            // Each batch of SUBACKs is one network round trip
+            while (mock_mqtt_ack_subscriptions(ctx->client) > 0)
+            {
+                round_trips++;
+            }
+            round_elapsed += bench_now_ns() - start;
+
+            struct mock_mqtt_stats stats;
+            mock_mqtt_get_stats(ctx->client, &stats);
+            subscribes += stats.subscribe_count;
+
+            for (unsigned int h = 0; h < ctx->count; h++)
+            {
+                if (!aws_iot_shadow_is_ready(ctx->handles[h]))
+                {
+                    fprintf(stderr, "shadow %u is not ready after reconnect\n", h);
+                    return -1;
+                }
+            }
+            mock_mqtt_ack_publishes(ctx->client);
+        }
+        elapsed = bench_min(elapsed, round_elapsed);
+    }
+
+    char params[96];
+    snprintf(params, sizeof(params), "shadows=%u subscribes=%lu round_trips=%lu", ctx->count, subscribes / iterations,
+             round_trips / iterations);
+    bench_report(session_present ? "time_to_ready/session_present" : "time_to_ready", params, iterations, elapsed);
+    return 0;
+}
+
+#if AWS_IOT_SHADOW_KEY_HANDLERS && AWS_IOT_SHADOW_SUPPORT_DELTA
+static const char *const BENCH_KEY_PATHS[BENCH_KEY_MODULES] = {
+    "led.brightness", "fan.speed", "heater.target", "valve.open", "alarm.armed", "display.mode",
+};
+
+// Delta touching a key of a single module, no version so the filter keeps it
+static const char BENCH_KEY_DELTA[] =
+    "{\"state\":{\"valve\":{\"open\":true}},\"metadata\":{\"valve\":{\"open\":{\"timestamp\":1700000000}}},"
+    "\"timestamp\":1700000000}";
+
+struct bench_key_module
+{
+    const char *path;
+    atomic_ulong calls; // handler invocations
+    atomic_ulong hits;  // with a value at path
+};
+
+static void bench_key_event_handler(void *handler_args, __unused esp_event_base_t event_base,
+                                    __unused int32_t event_id, void *event_data)
+{
+    // Without key handlers, every module parses every delta to find out whether it owns a part of it
+    struct bench_key_module *module = (struct bench_key_module *)handler_args;
+    struct aws_iot_shadow_json_document doc;
+    struct aws_iot_shadow_json_value value;
+
+    atomic_fetch_add_explicit(&module->calls, 1, memory_order_relaxed);
+    if (aws_iot_shadow_json_parse_event((const struct aws_iot_shadow_event_data *)event_data, &doc) == ESP_OK
+        && aws_iot_shadow_json_find(&doc.delta, module->path, &value) == ESP_OK)
+    {
+        atomic_fetch_add_explicit(&module->hits, 1, memory_order_relaxed);
+    }
+}
+
+static void bench_key_path_handler(void *arg, __unused const struct aws_iot_shadow_event_data *event,
+                                   __unused const struct aws_iot_shadow_json_value *value)
+{
+    struct bench_key_module *module = (struct bench_key_module *)arg;
+    atomic_fetch_add_explicit(&module->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&module->hits, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Delta touching one of BENCH_KEY_MODULES modules, each with an event handler, or a key path handler.
+ */
+static int bench_shadow_key_handlers_mode(struct bench_shadow_ctx *ctx, const struct bench_options *options, bool by_key)
+{
+    aws_iot_shadow_handle_ptr handle = ctx->handles[ctx->count - 1];
+    struct bench_key_module modules[BENCH_KEY_MODULES];
+    esp_event_handler_instance_t instances[BENCH_KEY_MODULES] = {0};
+    int result = 0;
+
+    for (unsigned int m = 0; m < BENCH_KEY_MODULES; m++)
+    {
+        modules[m].path = BENCH_KEY_PATHS[m];
+        atomic_init(&modules[m].calls, 0);
+        atomic_init(&modules[m].hits, 0);
+
+        esp_err_t err = by_key
+            ? aws_iot_shadow_key_handler_register(handle, AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, modules[m].path,
+                                                  bench_key_path_handler, &modules[m])
+            : aws_iot_shadow_handler_instance_register(handle, AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, bench_key_event_handler,
+                                                       &modules[m], &instances[m]);
+        if (err != ESP_OK)
+        {
+            fprintf(stderr, "failed to register handler %u: %d\n", m, err);
+            return -1;
+        }
+    }
+
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(topic, sizeof(topic), "%s%s", handle->topic_prefix, AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA);
+
+    unsigned long events_before = bench_shadow_wait_idle(ctx);
+    unsigned long expected = events_before + (unsigned long)options->iterations * options->rounds;
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            mock_mqtt_deliver(ctx->client, topic, BENCH_KEY_DELTA, (int)sizeof(BENCH_KEY_DELTA) - 1);
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    unsigned long events = BENCH_EVENTS_EXACT ? bench_shadow_wait_events(ctx, expected) : bench_shadow_wait_idle(ctx);
+    unsigned long handled = events - events_before;
+    unsigned long calls = 0, hits = 0;
+    for (unsigned int m = 0; m < BENCH_KEY_MODULES; m++)
+    {
+        calls += atomic_load(&modules[m].calls);
+        hits += atomic_load(&modules[m].hits);
+        if (by_key)
+        {
+            aws_iot_shadow_key_handler_unregister(handle, AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, modules[m].path,
+                                                  bench_key_path_handler, &modules[m]);
+        }
+        else
+        {
+            aws_iot_shadow_handler_instance_unregister(handle, AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, instances[m]);
+        }
+    }
+
+    if ((BENCH_EVENTS_EXACT && events != expected) || handled == 0 || hits != handled)
+    {
+        fprintf(stderr, "expected %lu deltas with a single owner, got %lu events and %lu hits\n",
+                expected - events_before, handled, hits);
+        result = -1;
+    }
+
+    if (result == 0)
+    {
+        char params[96];
+        snprintf(params, sizeof(params), "modules=%u mode=%s calls_per_delta=%lu", BENCH_KEY_MODULES,
+                 by_key ? "key_path" : "event", calls / handled);
+        bench_report("dispatch/key_handlers", params, options->iterations, elapsed);
+    }
+    return result;
+}
+
+static int bench_shadow_key_handlers(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    int result = bench_shadow_key_handlers_mode(ctx, options, false);
+    if (result == 0) result = bench_shadow_key_handlers_mode(ctx, options, true);
+    return result;
+}
+#endif
+
+#if AWS_IOT_SHADOW_GATEWAY
+/**
+ * @brief Broker answering gets of child things, responses are delivered by the bench task, not under router lock.
+ */
+struct bench_gateway_broker
+{
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    bool pending;
+};
+
+static void bench_gateway_publish_hook(__unused esp_mqtt_client_handle_t client, const char *topic, __unused const char *data,
+                                       __unused int len, void *arg)
+{
+    struct bench_gateway_broker *broker = (struct bench_gateway_broker *)arg;
+    snprintf(broker->topic, sizeof(broker->topic), "%s" AWS_IOT_SHADOW_SUFFIX_ACCEPTED, topic);
+    broker->pending = true;
+}
+
+static void bench_gateway_handler(void *arg, __unused const struct aws_iot_shadow_event_data *event)
+{
+    struct bench_shadow_ctx *ctx = (struct bench_shadow_ctx *)arg;
+    atomic_fetch_add_explicit(&ctx->events, 1, memory_order_relaxed);
+}
+
+static int bench_gateway_get(struct bench_shadow_ctx *ctx, aws_iot_shadow_gateway_ptr gateway,
+                             struct bench_gateway_broker *broker, const char *thing_name, const char *doc, int doc_len)
+{
+    broker->pending = false;
+    if (aws_iot_shadow_gateway_request_get(gateway, thing_name) != ESP_OK)
+    {
+        return -1;
+    }
+    // Cold thing is subscribed first, get is published on SUBACK
+    mock_mqtt_ack_subscriptions(ctx->client);
+    mock_mqtt_ack_publishes(ctx->client);
+    if (!broker->pending)
+    {
+        return -1;
+    }
+    mock_mqtt_deliver(ctx->client, broker->topic, doc, doc_len);
+    return 0;
+}
+
+/**
+ * @brief Child things of a gateway on the client of the shadows, cycling through more things than subscriptions.
+ */
+static int bench_shadow_gateway(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    unsigned int things = BENCH_GATEWAY_THINGS < AWS_IOT_SHADOW_GATEWAY_MAX_THINGS ? BENCH_GATEWAY_THINGS : AWS_IOT_SHADOW_GATEWAY_MAX_THINGS;
+    aws_iot_shadow_gateway_ptr gateway = NULL;
+    struct bench_gateway_broker broker = {0};
+    char thing_name[32];
+    int result = 0;
+
+    size_t heap_before = bench_heap_used();
+    if (aws_iot_shadow_gateway_create(ctx->client, bench_gateway_handler, ctx, &gateway) != ESP_OK)
+    {
+        fprintf(stderr, "failed to create gateway\n");
+        return -1;
+    }
+    for (unsigned int i = 0; i < things && result == 0; i++)
+    {
+        snprintf(thing_name, sizeof(thing_name), "bench-child-%u", i);
+        if (aws_iot_shadow_gateway_add(gateway, thing_name) != ESP_OK)
+        {
+            fprintf(stderr, "failed to add %s\n", thing_name);
+            result = -1;
+        }
+    }
+    // Fixed budget of the gateway, divided by the things used
+    size_t heap_per_thing = (bench_heap_used() - heap_before) / things;
+
+    char *doc = (char *)malloc(options->payload_size);
+    if (doc == NULL)
+    {
+        result = -1;
+    }
+    else
+    {
+        bench_fill_document(doc, options->payload_size);
+    }
+    mock_mqtt_set_publish_hook(ctx->client, bench_gateway_publish_hook, &broker);
+
+    // Hot child, messages routed past the shadows to the gateway
+    if (result == 0 && bench_gateway_get(ctx, gateway, &broker, "bench-child-0", doc, (int)options->payload_size) != 0)
+    {
+        fprintf(stderr, "get of bench-child-0 failed\n");
+        result = -1;
+    }
+    uint64_t elapsed = UINT64_MAX;
+    // Gateway handler runs on the MQTT task, shadow handlers might still be running on the worker
+    unsigned long events_before = bench_shadow_wait_idle(ctx);
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    snprintf(topic, sizeof(topic), AWS_IOT_SHADOW_PREFIX_CLASSIC_FORMAT AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_ACCEPTED,
+             "bench-child-0");
+    for (unsigned int r = 0; r < options->rounds && result == 0; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            mock_mqtt_deliver(ctx->client, topic, doc, (int)options->payload_size);
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+    unsigned long expected = (unsigned long)options->iterations * options->rounds;
+    if (result == 0 && atomic_load(&ctx->events) - events_before != expected)
+    {
+        fprintf(stderr, "expected %lu gateway events, got %lu\n", expected, atomic_load(&ctx->events) - events_before);
+        result = -1;
+    }
+
+    char params[96];
+    if (result == 0)
+    {
+        snprintf(params, sizeof(params), "things=%u subscribed=%u", things, AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED);
+        bench_report_memory("memory/gateway_thing", params, heap_per_thing);
+        snprintf(params, sizeof(params), "things=%u payload=%zu", things, options->payload_size);
+        bench_report("gateway/dispatch", params, options->iterations, elapsed);
+    }
+
+    // Cold gets round robin, each one evicts the least recently used child, once all subscriptions are taken
+    unsigned int iterations = options->iterations / 10 > 0 ? options->iterations / 10 : 1;
+    struct aws_iot_shadow_gateway_stats stats_before, stats;
+    aws_iot_shadow_gateway_stats(gateway, &stats_before);
+    elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds && result == 0; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < iterations && result == 0; i++)
+        {
+            snprintf(thing_name, sizeof(thing_name), "bench-child-%u", (r * iterations + i) % things);
+            if (bench_gateway_get(ctx, gateway, &broker, thing_name, doc, (int)options->payload_size) != 0)
+            {
+                fprintf(stderr, "get of %s failed\n", thing_name);
+                result = -1;
+            }
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+    aws_iot_shadow_gateway_stats(gateway, &stats);
+    if (result == 0)
+    {
+        snprintf(params, sizeof(params), "things=%u subscribed=%u evictions=%" PRIu32 " dropped=%" PRIu32, things,
+                 stats.subscribed, stats.evictions - stats_before.evictions, stats.dropped);
+        bench_report("gateway/cold_get", params, iterations, elapsed);
+    }
+
+    mock_mqtt_set_publish_hook(ctx->client, NULL, NULL);
+    free(doc);
+    aws_iot_shadow_gateway_delete(gateway);
+    return result;
+}
+#endif
+
+#if AWS_IOT_SHADOW_STATS
+/**
+ * @brief Snapshot and JSON of stats collected by the suites before, e.g. to be reported periodically.
+ */
+static int bench_shadow_stats(struct bench_shadow_ctx *ctx, const struct bench_options *options)
+{
+    aws_iot_shadow_handle_ptr handle = ctx->handles[ctx->count - 1];
+    char buf[2048];
+    size_t len = 0;
+    struct aws_iot_shadow_stats stats;
+
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < options->iterations; i++)
+        {
+            if (aws_iot_shadow_stats(handle, &stats) != ESP_OK
+                || aws_iot_shadow_stats_json(&stats, buf, sizeof(buf), &len) != ESP_OK)
+            {
+                fprintf(stderr, "failed to format stats\n");
+                return -1;
+            }
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    if (stats.ready.count == 0 || stats.handler.count == 0)
+    {
+        fprintf(stderr, "stats missed events: %s\n", buf);
+        return -1;
+    }
+    char params[96];
+    snprintf(params, sizeof(params), "bytes=%zu handler_p50_us=%" PRIu32 " ready_p50_us=%" PRIu32, len,
+             aws_iot_shadow_histogram_percentile(&stats.handler, 500), aws_iot_shadow_histogram_percentile(&stats.ready, 500));
+    bench_report("stats_json", params, options->iterations, elapsed);
+    return 0;
+}
+#endif
+
+#if AWS_IOT_SHADOW_TRACE
+/**
+ * @brief Dump of the whole ring, holding the last records of the suites before, written to -t file.
+ */
+static int bench_shadow_trace(const struct bench_options *options)
+{
+    static char buf[sizeof(struct aws_iot_shadow_trace_header) + AWS_IOT_SHADOW_TRACE_RECORDS * sizeof(struct aws_iot_shadow_trace_record)];
+    size_t len = 0;
+
+    unsigned int iterations = options->iterations / 100 > 0 ? options->iterations / 100 : 1;
+    uint64_t elapsed = UINT64_MAX;
+    for (unsigned int r = 0; r < options->rounds; r++)
+    {
+        uint64_t start = bench_now_ns();
+        for (unsigned int i = 0; i < iterations; i++)
+        {
+            if (aws_iot_shadow_trace_dump(buf, sizeof(buf), &len) != ESP_OK)
+            {
+                fprintf(stderr, "failed to dump trace\n");
+                return -1;
+            }
+        }
+        elapsed = bench_min(elapsed, bench_now_ns() - start);
+    }
+
+    if (options->trace_path != NULL)
+    {
+        FILE *f = fopen(options->trace_path, "wb");
+        if (f == NULL || fwrite(buf, 1, len, f) != len)
+        {
+            perror(options->trace_path);
+            if (f != NULL)
+            {
+                fclose(f);
+            }
+            return -1;
+        }
+        fclose(f);
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "records=%u bytes=%zu", AWS_IOT_SHADOW_TRACE_RECORDS, len);
+    bench_report("trace_dump", params, iterations, elapsed);
+    return 0;
+}
+#endif
+
+int bench_shadow(const struct bench_options *options)
+{
+    struct bench_shadow_ctx ctx;
+    int result = bench_shadow_setup(&ctx, options->shadows);
+
+    if (result == 0)
+    {
+        // Includes shared dispatcher, when there is a single shadow
+        char params[32];
+        snprintf(params, sizeof(params), "shadows=%u", ctx.count);
+        bench_report_memory("memory/shadow", params, ctx.heap_per_shadow);
+    }
+
+    if (result == 0) result = bench_shadow_dispatch(&ctx, options, AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_ACCEPTED, 0);
+#if AWS_IOT_SHADOW_SUPPORT_DELTA
+    if (result == 0) result = bench_shadow_dispatch(&ctx, options, AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA, 0);
+#endif
+#if AWS_IOT_SHADOW_VERSION_FILTER && AWS_IOT_SHADOW_SUPPORT_DELTA
+    if (result == 0) result = bench_shadow_redelivered(&ctx, options);
+    if (result == 0) result = bench_shadow_recreated(&ctx, options);
+#endif
+    // Reassembly of messages larger than MQTT buffer
+    if (result == 0 && options->payload_size > BENCH_FRAGMENT_SIZE)
+    {
+        result = bench_shadow_dispatch(&ctx, options, AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_ACCEPTED, BENCH_FRAGMENT_SIZE);
+    }
+    if (result == 0) result = bench_shadow_slow_handler_burst(&ctx, options);
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH && AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_COALESCE_DELTA \
+    && AWS_IOT_SHADOW_SUPPORT_DELTA
+    if (result == 0) result = bench_shadow_overflow_coalesced(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    // Requests are paced to the limits of the thing, publishing suites would measure the limits only
+    if (result == 0) result = bench_shadow_throttle(&ctx, options);
+#else
+    if (result == 0) result = bench_shadow_publish(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE && !AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    if (result == 0) result = bench_shadow_update_reported(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_PERSISTENCE
+    if (result == 0) result = bench_shadow_restore(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_REQUEST_TRACKING && !AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    if (result == 0) result = bench_shadow_tracked(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_UPDATE_COALESCING && !AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    if (result == 0) result = bench_shadow_coalesced(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL && !AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    if (result == 0) result = bench_shadow_offline(&ctx, options);
+#endif
+    if (result == 0) result = bench_shadow_ready(&ctx, options, false);
+    if (result == 0) result = bench_shadow_ready(&ctx, options, true);
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    if (result == 0) result = bench_shadow_lazy(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_KEY_HANDLERS && AWS_IOT_SHADOW_SUPPORT_DELTA
+    if (result == 0) result = bench_shadow_key_handlers(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_GATEWAY
+    if (result == 0) result = bench_shadow_gateway(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_STATS
+    if (result == 0) result = bench_shadow_stats(&ctx, options);
+#endif
+#if AWS_IOT_SHADOW_TRACE
+    if (result == 0) result = bench_shadow_trace(options);
+#else
+    if (result == 0 && options->trace_path != NULL)
+    {
+        fprintf(stderr, "-t needs a build with -D AWS_IOT_SHADOW_TRACE=1\n");
+        result = -1;
+    }
+#endif
+
+    bench_shadow_teardown(&ctx);
+    return result;
+}
@@ -0,0 +1,30 @@
+#ifndef EVENT_GROUPS_H
+#define EVENT_GROUPS_H
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct EventGroupDef_t *EventGroupHandle_t;
+typedef TickType_t EventBits_t;
+
+EventGroupHandle_t xEventGroupCreate(void);
+
+void vEventGroupDelete(EventGroupHandle_t xEventGroup);
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, EventBits_t uxBitsToSet);
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, EventBits_t uxBitsToClear);
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t xEventGroup);
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, EventBits_t uxBitsToWaitFor, BaseType_t xClearOnExit,
+                                BaseType_t xWaitForAllBits, TickType_t xTicksToWait);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
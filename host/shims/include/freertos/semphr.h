@@ -0,0 +1,38 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct QueueDefinition *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount);
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore);
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime);
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore);
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t xMutex, TickType_t xBlockTime);
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t xMutex);
+
+// Recursive mutexes only
+TaskHandle_t xSemaphoreGetMutexHolder(SemaphoreHandle_t xMutex);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef INC_TASK_H
+#define INC_TASK_H
+
+#include "freertos/FreeRTOS.h"
+#include <sched.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tasks are plain detached threads, stack size and priority are ignored. They are scheduled as SCHED_IDLE,
+// so on a single CPU host they do not preempt the main thread (which plays the MQTT task), like on another core.
+typedef struct tskTaskControlBlock *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define taskYIELD() sched_yield()
+
+BaseType_t xTaskCreate(TaskFunction_t pxTaskCode, const char *pcName, uint32_t usStackDepth, void *pvParameters,
+                       UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask);
+
+void vTaskDelete(TaskHandle_t xTaskToDelete);
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+TickType_t xTaskGetTickCount(void);
+
+void vTaskDelay(TickType_t xTicksToDelay);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
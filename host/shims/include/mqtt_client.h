@@ -0,0 +1,124 @@
+#ifndef _MQTT_CLIENT_H_
+#define _MQTT_CLIENT_H_
+
+#include "esp_err.h"
+#include "esp_event.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+
+typedef enum
+{
+    MQTT_EVENT_ANY = -1,
+    MQTT_EVENT_ERROR = 0,
+    MQTT_EVENT_CONNECTED,
+    MQTT_EVENT_DISCONNECTED,
+    MQTT_EVENT_SUBSCRIBED,
+    MQTT_EVENT_UNSUBSCRIBED,
+    MQTT_EVENT_PUBLISHED,
+    MQTT_EVENT_DATA,
+    MQTT_EVENT_BEFORE_CONNECT,
+    MQTT_EVENT_DELETED,
+    MQTT_USER_EVENT,
+} esp_mqtt_event_id_t;
+
+typedef enum
+{
+    MQTT_ERROR_TYPE_NONE = 0,
+    MQTT_ERROR_TYPE_TCP_TRANSPORT,
+    MQTT_ERROR_TYPE_CONNECTION_REFUSED,
+} esp_mqtt_error_type_t;
+
+typedef enum
+{
+    MQTT_TRANSPORT_UNKNOWN = 0x0,
+    MQTT_TRANSPORT_OVER_TCP,
+    MQTT_TRANSPORT_OVER_SSL,
+    MQTT_TRANSPORT_OVER_WS,
+    MQTT_TRANSPORT_OVER_WSS
+} esp_mqtt_transport_t;
+
+typedef struct esp_mqtt_error_codes
+{
+    esp_err_t esp_tls_last_esp_err;
+    int esp_tls_stack_err;
+    int esp_tls_cert_verify_flags;
+    esp_mqtt_error_type_t error_type;
+    int connect_return_code;
+    int esp_transport_sock_errno;
+} esp_mqtt_error_codes_t;
+
+typedef struct esp_mqtt_event_t
+{
+    esp_mqtt_event_id_t event_id;
+    esp_mqtt_client_handle_t client;
+    void *user_context;
+    char *data;
+    int data_len;
+    int total_data_len;
+    int current_data_offset;
+    char *topic;
+    int topic_len;
+    int msg_id;
+    int session_present;
+    esp_mqtt_error_codes_t *error_handle;
+    bool retain;
+    int qos;
+    bool dup;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+typedef struct
+{
+    const char *host;
+    uint32_t port;
+    const char *client_id;
+    bool disable_clean_session;
+    int buffer_size;
+    esp_mqtt_transport_t transport;
+    const char *cert_pem;
+    size_t cert_len;
+    const char *client_cert_pem;
+    size_t client_cert_len;
+    const char *client_key_pem;
+    size_t client_key_len;
+} esp_mqtt_client_config_t;
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config);
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client);
+
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client);
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client);
+
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client);
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos);
+
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *topic);
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos,
+                            int retain);
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event,
+                                         esp_event_handler_t event_handler, void *event_handler_arg);
+
+/**
+ * @brief Delivers MQTT_USER_EVENT to the handlers. esp-mqtt queues it for its task, the mock dispatches it
+ * on the calling thread.
+ */
+esp_err_t esp_mqtt_dispatch_custom_event(esp_mqtt_client_handle_t client, esp_mqtt_event_t *event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef MQTT_CLIENT_MOCK_H
+#define MQTT_CLIENT_MOCK_H
+
+#include "mqtt_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Called for every esp_mqtt_client_publish(), after it has been recorded.
+ *
+ * Runs on the publishing task, may call mock_mqtt_deliver() to emulate a broker response.
+ */
+typedef void (*mock_mqtt_publish_hook_t)(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len,
+                                         void *arg);
+
+struct mock_mqtt_stats
+{
+    unsigned int subscribe_count;
+    unsigned int unsubscribe_count;
+    unsigned int publish_count;
+    unsigned int pending_subscriptions;
+    unsigned int pending_publishes;
+    size_t publish_bytes;
+};
+
+/**
+ * @brief Emulates MQTT_EVENT_CONNECTED.
+ *
+ * Pending subscriptions and publishes of the previous session are discarded.
+ */
+void mock_mqtt_connect(esp_mqtt_client_handle_t client, bool session_present);
+
+/**
+ * @brief Emulates MQTT_EVENT_DISCONNECTED.
+ */
+void mock_mqtt_disconnect(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Emits MQTT_EVENT_SUBSCRIBED for every subscription sent so far.
+ *
+ * @return Number of dispatched events.
+ */
+unsigned int mock_mqtt_ack_subscriptions(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Emits MQTT_EVENT_PUBLISHED for every QoS 1 publish sent so far.
+ *
+ * @return Number of dispatched events.
+ */
+unsigned int mock_mqtt_ack_publishes(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Emits MQTT_EVENT_DATA, the same way esp-mqtt does.
+ *
+ * Payloads larger than esp_mqtt_client_config_t.buffer_size (when set) are delivered in chunks,
+ * only the first one having topic set.
+ */
+void mock_mqtt_deliver(esp_mqtt_client_handle_t client, const char *topic, const char *data, int data_len);
+
+/**
+ * @brief Changes esp_mqtt_client_config_t.buffer_size, 0 for unlimited.
+ */
+void mock_mqtt_set_buffer_size(esp_mqtt_client_handle_t client, int buffer_size);
+
+void mock_mqtt_set_publish_hook(esp_mqtt_client_handle_t client, mock_mqtt_publish_hook_t hook, void *arg);
+
+void mock_mqtt_get_stats(esp_mqtt_client_handle_t client, struct mock_mqtt_stats *stats);
+
+void mock_mqtt_reset_stats(esp_mqtt_client_handle_t client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+// Host build configuration, mirrors defaults from Kconfig.
+// Individual options can be overridden by the compiler command line (see host/CMakeLists.txt).
+
+#ifndef CONFIG_AWS_IOT_SHADOW_SUPPORT_DELTA
+#define CONFIG_AWS_IOT_SHADOW_SUPPORT_DELTA 1
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_SUPPORT_DELETE
+#define CONFIG_AWS_IOT_SHADOW_SUPPORT_DELETE 1
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_REASSEMBLY_MAX_SIZE
+#define CONFIG_AWS_IOT_SHADOW_REASSEMBLY_MAX_SIZE 8192
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_DIRECT_DISPATCH_MAX_HANDLERS
+#define CONFIG_AWS_IOT_SHADOW_DIRECT_DISPATCH_MAX_HANDLERS 8
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_KEY_HANDLERS_MAX
+#define CONFIG_AWS_IOT_SHADOW_KEY_HANDLERS_MAX 8
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH
+#define CONFIG_AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH 8
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE
+#define CONFIG_AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE 1024
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_ASYNC_BLOCK_TIMEOUT_MS
+#define CONFIG_AWS_IOT_SHADOW_ASYNC_BLOCK_TIMEOUT_MS 1000
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_ASYNC_TASK_STACK_SIZE
+#define CONFIG_AWS_IOT_SHADOW_ASYNC_TASK_STACK_SIZE 4096
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_ASYNC_TASK_PRIORITY
+#define CONFIG_AWS_IOT_SHADOW_ASYNC_TASK_PRIORITY 5
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE
+#define CONFIG_AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE 4096
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_REQUEST_MAX_PENDING
+#define CONFIG_AWS_IOT_SHADOW_REQUEST_MAX_PENDING 8
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS
+#define CONFIG_AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS 10000
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_COALESCE_WINDOW_MS
+#define CONFIG_AWS_IOT_SHADOW_COALESCE_WINDOW_MS 20
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_COALESCE_MAX_SIZE
+#define CONFIG_AWS_IOT_SHADOW_COALESCE_MAX_SIZE 1024
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_COALESCE_MAX_WAITERS
+#define CONFIG_AWS_IOT_SHADOW_COALESCE_MAX_WAITERS 8
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_THROTTLE_RATE
+#define CONFIG_AWS_IOT_SHADOW_THROTTLE_RATE 10
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_THROTTLE_BURST
+#define CONFIG_AWS_IOT_SHADOW_THROTTLE_BURST 5
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT
+#define CONFIG_AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT 8
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_THROTTLE_QUEUE_LENGTH
+#define CONFIG_AWS_IOT_SHADOW_THROTTLE_QUEUE_LENGTH 16
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE
+#define CONFIG_AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE 2048
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_TRACE_RECORDS
+#define CONFIG_AWS_IOT_SHADOW_TRACE_RECORDS 256
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_GATEWAY_MAX_THINGS
+#define CONFIG_AWS_IOT_SHADOW_GATEWAY_MAX_THINGS 1024
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_GATEWAY_NAMES_SIZE
+#define CONFIG_AWS_IOT_SHADOW_GATEWAY_NAMES_SIZE 16384
+#endif
+
+#ifndef CONFIG_AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED
+#define CONFIG_AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED 16
+#endif
+
+#ifndef CONFIG_LOG_DEFAULT_LEVEL
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#endif
+
+#endif
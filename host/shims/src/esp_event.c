@@ -0,0 +1,236 @@
+#include "esp_event.h"
+#include <pthread.h>
+#include <string.h>
+
+// Minimal synchronous emulation of esp_event user loops (loops without a dedicated task).
+// Same cost structure as the real thing: posted data is copied into a bounded queue,
+// esp_event_loop_run() drains it under the loop mutex and walks the handler list.
+
+struct event_handler_node
+{
+    esp_event_base_t event_base;
+    int32_t event_id;
+    esp_event_handler_t handler;
+    void *handler_arg;
+    struct event_handler_node *next;
+};
+
+struct event_post
+{
+    esp_event_base_t event_base;
+    int32_t event_id;
+    void *data;
+    size_t data_size;
+};
+
+struct event_loop
+{
+    pthread_mutex_t mutex;
+    struct event_handler_node *handlers;
+    struct event_post *queue;
+    int32_t queue_size;
+    int32_t queue_head;
+    int32_t queue_count;
+};
+
+esp_err_t esp_event_loop_create(const esp_event_loop_args_t *event_loop_args, esp_event_loop_handle_t *event_loop)
+{
+    if (event_loop_args == NULL || event_loop == NULL || event_loop_args->queue_size <= 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (event_loop_args->task_name != NULL)
+    {
+        return ESP_ERR_NOT_SUPPORTED; // host shim supports user loops only
+    }
+
+    struct event_loop *loop = (struct event_loop *)calloc(1, sizeof(*loop));
+    if (loop == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    loop->queue = (struct event_post *)calloc(event_loop_args->queue_size, sizeof(*loop->queue));
+    if (loop->queue == NULL)
+    {
+        free(loop);
+        return ESP_ERR_NO_MEM;
+    }
+    loop->queue_size = event_loop_args->queue_size;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&loop->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    *event_loop = loop;
+    return ESP_OK;
+}
+
+esp_err_t esp_event_loop_delete(esp_event_loop_handle_t event_loop)
+{
+    struct event_loop *loop = (struct event_loop *)event_loop;
+    if (loop == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while (loop->handlers)
+    {
+        struct event_handler_node *node = loop->handlers;
+        loop->handlers = node->next;
+        free(node);
+    }
+    for (int32_t i = 0; i < loop->queue_count; i++)
+    {
+        free(loop->queue[(loop->queue_head + i) % loop->queue_size].data);
+    }
+
+    pthread_mutex_destroy(&loop->mutex);
+    free(loop->queue);
+    free(loop);
+    return ESP_OK;
+}
+
+esp_err_t esp_event_post_to(esp_event_loop_handle_t event_loop, esp_event_base_t event_base, int32_t event_id,
+                            const void *event_data, size_t event_data_size, __attribute__((unused)) TickType_t ticks_to_wait)
+{
+    struct event_loop *loop = (struct event_loop *)event_loop;
+    if (loop == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Real implementation copies data into a heap block as well
+    void *data_copy = NULL;
+    if (event_data != NULL && event_data_size > 0)
+    {
+        data_copy = malloc(event_data_size);
+        if (data_copy == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        memcpy(data_copy, event_data, event_data_size);
+    }
+
+    pthread_mutex_lock(&loop->mutex);
+    if (loop->queue_count >= loop->queue_size)
+    {
+        // Nobody else can drain the queue in the host shim, waiting would block forever
+        pthread_mutex_unlock(&loop->mutex);
+        free(data_copy);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    struct event_post *post = &loop->queue[(loop->queue_head + loop->queue_count) % loop->queue_size];
+    post->event_base = event_base;
+    post->event_id = event_id;
+    post->data = data_copy;
+    post->data_size = event_data_size;
+    loop->queue_count++;
+    pthread_mutex_unlock(&loop->mutex);
+    return ESP_OK;
+}
+
+static void event_loop_run_handlers(struct event_loop *loop, const struct event_post *post, bool any_id)
+{
+    struct event_handler_node *node = loop->handlers;
+    while (node)
+    {
+        struct event_handler_node *next = node->next; // handler might unregister itself
+        bool base_match = node->event_base == ESP_EVENT_ANY_BASE || node->event_base == post->event_base;
+        bool id_match = any_id ? node->event_id == ESP_EVENT_ANY_ID : node->event_id == post->event_id;
+        if (base_match && id_match)
+        {
+            node->handler(node->handler_arg, post->event_base, post->event_id, post->data);
+        }
+        node = next;
+    }
+}
+
+esp_err_t esp_event_loop_run(esp_event_loop_handle_t event_loop, __attribute__((unused)) TickType_t ticks_to_run)
+{
+    struct event_loop *loop = (struct event_loop *)event_loop;
+    if (loop == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&loop->mutex);
+    while (loop->queue_count > 0)
+    {
+        struct event_post post = loop->queue[loop->queue_head];
+        loop->queue_head = (loop->queue_head + 1) % loop->queue_size;
+        loop->queue_count--;
+
+        // esp_event executes ANY_ID handlers of a base before id specific ones
+        event_loop_run_handlers(loop, &post, true);
+        event_loop_run_handlers(loop, &post, false);
+        free(post.data);
+    }
+    pthread_mutex_unlock(&loop->mutex);
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register_with(esp_event_loop_handle_t event_loop, esp_event_base_t event_base,
+                                                   int32_t event_id, esp_event_handler_t event_handler,
+                                                   void *event_handler_arg, esp_event_handler_instance_t *instance)
+{
+    struct event_loop *loop = (struct event_loop *)event_loop;
+    if (loop == NULL || event_handler == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct event_handler_node *node = (struct event_handler_node *)calloc(1, sizeof(*node));
+    if (node == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    node->event_base = event_base;
+    node->event_id = event_id;
+    node->handler = event_handler;
+    node->handler_arg = event_handler_arg;
+
+    pthread_mutex_lock(&loop->mutex);
+    struct event_handler_node **tail = &loop->handlers;
+    while (*tail)
+    {
+        tail = &(*tail)->next;
+    }
+    *tail = node;
+    pthread_mutex_unlock(&loop->mutex);
+
+    if (instance)
+    {
+        *instance = node;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_unregister_with(esp_event_loop_handle_t event_loop, esp_event_base_t event_base,
+                                                     int32_t event_id, esp_event_handler_instance_t instance)
+{
+    struct event_loop *loop = (struct event_loop *)event_loop;
+    if (loop == NULL || instance == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    pthread_mutex_lock(&loop->mutex);
+    for (struct event_handler_node **it = &loop->handlers; *it; it = &(*it)->next)
+    {
+        struct event_handler_node *node = *it;
+        if (node == instance && node->event_base == event_base && node->event_id == event_id)
+        {
+            *it = node->next;
+            free(node);
+            err = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loop->mutex);
+    return err;
+}
@@ -0,0 +1,54 @@
+#include "esp_log.h"
+#include <stdio.h>
+#include <time.h>
+
+static esp_log_level_t log_level = (esp_log_level_t)CONFIG_LOG_DEFAULT_LEVEL;
+static vprintf_like_t log_vprintf = vprintf;
+
+static const char LOG_LEVEL_CHARS[] = {'N', 'E', 'W', 'I', 'D', 'V'};
+
+void esp_log_level_set(__attribute__((unused)) const char *tag, esp_log_level_t level)
+{
+    // Host shim does not track levels per tag
+    log_level = level;
+}
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func)
+{
+    vprintf_like_t orig = log_vprintf;
+    log_vprintf = func;
+    return orig;
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static int esp_log_printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int ret = log_vprintf(format, args);
+    va_end(args);
+    return ret;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    if (level > log_level)
+    {
+        return;
+    }
+
+    esp_log_printf("%c (%u) %s: ", LOG_LEVEL_CHARS[level], esp_log_timestamp(), tag);
+
+    va_list args;
+    va_start(args, format);
+    log_vprintf(format, args);
+    va_end(args);
+
+    esp_log_printf("\n");
+}
@@ -0,0 +1,190 @@
+#include "esp_timer.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t alarm; // 0 when not armed
+    struct esp_timer *next; // armed timers, ordered by alarm
+};
+
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static struct esp_timer *timer_armed;
+static struct esp_timer *timer_running;
+static pthread_t timer_thread;
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void timer_unlink(struct esp_timer *timer)
+{
+    for (struct esp_timer **p = &timer_armed; *p; p = &(*p)->next)
+    {
+        if (*p == timer)
+        {
+            *p = timer->next;
+            break;
+        }
+    }
+    timer->next = NULL;
+    timer->alarm = 0;
+}
+
+static void *timer_main(void *arg)
+{
+    pthread_mutex_lock(&timer_mutex);
+    for (;;)
+    {
+        if (timer_armed == NULL)
+        {
+            pthread_cond_wait(&timer_cond, &timer_mutex);
+            continue;
+        }
+
+        int64_t now = esp_timer_get_time();
+        struct esp_timer *timer = timer_armed;
+        if (timer->alarm > now)
+        {
+            struct timespec deadline = {
+                .tv_sec = timer->alarm / 1000000,
+                .tv_nsec = (long)(timer->alarm % 1000000) * 1000,
+            };
+            pthread_cond_timedwait(&timer_cond, &timer_mutex, &deadline);
+            continue;
+        }
+
+        // Fire, callback may restart or stop the timer
+        timer_unlink(timer);
+        timer_running = timer;
+        pthread_mutex_unlock(&timer_mutex);
+        timer->callback(timer->arg);
+        pthread_mutex_lock(&timer_mutex);
+        timer_running = NULL;
+        pthread_cond_broadcast(&timer_cond);
+    }
+    return NULL;
+}
+
+static void timer_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_create(&timer_thread, NULL, timer_main, NULL);
+    pthread_detach(timer_thread);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    if (create_args == NULL || create_args->callback == NULL || out_handle == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_once(&timer_once, timer_init);
+
+    esp_timer_handle_t timer = (esp_timer_handle_t)calloc(1, sizeof(*timer));
+    if (timer == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&timer_mutex);
+    if (timer->alarm != 0)
+    {
+        pthread_mutex_unlock(&timer_mutex);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    timer->alarm = esp_timer_get_time() + (int64_t)timeout_us;
+    if (timer->alarm == 0)
+    {
+        timer->alarm = 1;
+    }
+
+    struct esp_timer **p = &timer_armed;
+    while (*p && (*p)->alarm <= timer->alarm)
+    {
+        p = &(*p)->next;
+    }
+    timer->next = *p;
+    *p = timer;
+
+    pthread_cond_broadcast(&timer_cond);
+    pthread_mutex_unlock(&timer_mutex);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (timer == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&timer_mutex);
+    esp_err_t err = timer->alarm != 0 ? ESP_OK : ESP_ERR_INVALID_STATE;
+    if (err == ESP_OK)
+    {
+        timer_unlink(timer);
+        pthread_cond_broadcast(&timer_cond);
+    }
+    pthread_mutex_unlock(&timer_mutex);
+    return err;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    if (timer == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&timer_mutex);
+    if (timer->alarm != 0)
+    {
+        pthread_mutex_unlock(&timer_mutex);
+        return ESP_ERR_INVALID_STATE;
+    }
+    while (timer_running == timer && !pthread_equal(pthread_self(), timer_thread))
+    {
+        pthread_cond_wait(&timer_cond, &timer_mutex);
+    }
+    pthread_mutex_unlock(&timer_mutex);
+
+    free(timer);
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&timer_mutex);
+    bool active = timer->alarm != 0;
+    pthread_mutex_unlock(&timer_mutex);
+    return active;
+}
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE // SCHED_IDLE
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+struct EventGroupDef_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    EventBits_t bits;
+};
+
+struct task_start
+{
+    TaskFunction_t fn;
+    void *arg;
+};
+
+static void *task_main(void *arg)
+{
+    struct task_start start = *(struct task_start *)arg;
+    free(arg);
+
+    struct sched_param param = {.sched_priority = 0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    start.fn(start.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t pxTaskCode, const char *pcName, uint32_t usStackDepth,
+                       void *pvParameters, UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask)
+{
+    struct task_start *start = (struct task_start *)malloc(sizeof(*start));
+    if (start == NULL)
+    {
+        return pdFAIL;
+    }
+    start->fn = pxTaskCode;
+    start->arg = pvParameters;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, task_main, start) != 0)
+    {
+        free(start);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+
+    if (pxCreatedTask)
+    {
+        *pxCreatedTask = (TaskHandle_t)thread;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete)
+{
+    // Only self-deletion is supported
+    if (xTaskToDelete == NULL || (pthread_t)xTaskToDelete == pthread_self())
+    {
+        pthread_exit(NULL);
+    }
+    abort();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return (TaskHandle_t)pthread_self();
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t)(ts.tv_sec * configTICK_RATE_HZ + ts.tv_nsec / (1000000000 / configTICK_RATE_HZ));
+}
+
+void vTaskDelay(TickType_t xTicksToDelay)
+{
+    struct timespec ts = {
+        .tv_sec = xTicksToDelay / configTICK_RATE_HZ,
+        .tv_nsec = (long)(xTicksToDelay % configTICK_RATE_HZ) * (1000000000 / configTICK_RATE_HZ),
+    };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    {
+    }
+}
+
+static void ticks_to_abs_timespec(TickType_t ticks, struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ticks / configTICK_RATE_HZ;
+    ts->tv_nsec += (long)(ticks % configTICK_RATE_HZ) * (1000000000 / configTICK_RATE_HZ);
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    EventGroupHandle_t group = (EventGroupHandle_t)calloc(1, sizeof(*group));
+    if (group == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->cond, NULL);
+    return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t xEventGroup)
+{
+    pthread_cond_destroy(&xEventGroup->cond);
+    pthread_mutex_destroy(&xEventGroup->mutex);
+    free(xEventGroup);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, EventBits_t uxBitsToSet)
+{
+    pthread_mutex_lock(&xEventGroup->mutex);
+    EventBits_t bits = (xEventGroup->bits |= uxBitsToSet);
+    pthread_cond_broadcast(&xEventGroup->cond);
+    pthread_mutex_unlock(&xEventGroup->mutex);
+    return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, EventBits_t uxBitsToClear)
+{
+    pthread_mutex_lock(&xEventGroup->mutex);
+    EventBits_t bits = xEventGroup->bits;
+    xEventGroup->bits &= ~uxBitsToClear;
+    pthread_mutex_unlock(&xEventGroup->mutex);
+    return bits; // FreeRTOS returns value before clearing
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t xEventGroup)
+{
+    pthread_mutex_lock(&xEventGroup->mutex);
+    EventBits_t bits = xEventGroup->bits;
+    pthread_mutex_unlock(&xEventGroup->mutex);
+    return bits;
+}
+
+static bool event_group_satisfied(EventBits_t bits, EventBits_t wait_for, BaseType_t wait_for_all)
+{
+    return wait_for_all ? (bits & wait_for) == wait_for : (bits & wait_for) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, EventBits_t uxBitsToWaitFor, BaseType_t xClearOnExit,
+                                BaseType_t xWaitForAllBits, TickType_t xTicksToWait)
+{
+    struct timespec deadline;
+    if (xTicksToWait > 0 && xTicksToWait != portMAX_DELAY)
+    {
+        ticks_to_abs_timespec(xTicksToWait, &deadline);
+    }
+
+    pthread_mutex_lock(&xEventGroup->mutex);
+    while (!event_group_satisfied(xEventGroup->bits, uxBitsToWaitFor, xWaitForAllBits) && xTicksToWait > 0)
+    {
+        int rc = xTicksToWait == portMAX_DELAY
+                     ? pthread_cond_wait(&xEventGroup->cond, &xEventGroup->mutex)
+                     : pthread_cond_timedwait(&xEventGroup->cond, &xEventGroup->mutex, &deadline);
+        if (rc == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    EventBits_t bits = xEventGroup->bits;
+    if (xClearOnExit && event_group_satisfied(bits, uxBitsToWaitFor, xWaitForAllBits))
+    {
+        xEventGroup->bits &= ~uxBitsToWaitFor;
+    }
+    pthread_mutex_unlock(&xEventGroup->mutex);
+    return bits;
+}
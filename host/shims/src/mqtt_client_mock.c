@@ -0,0 +1,361 @@
+#include "mqtt_client_mock.h"
+#include <pthread.h>
+#include <string.h>
+
+// In-process stand-in for esp-mqtt. Nothing goes to the network, events are dispatched
+// synchronously to registered handlers by mock_mqtt_* functions, on the calling thread.
+
+struct mock_mqtt_handler
+{
+    esp_mqtt_event_id_t event;
+    esp_event_handler_t handler;
+    void *handler_arg;
+};
+
+struct mock_msg_ids
+{
+    int *ids;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+struct esp_mqtt_client
+{
+    pthread_mutex_t mutex;
+    esp_mqtt_client_config_t config;
+    bool connected;
+    int next_msg_id;
+
+    struct mock_mqtt_handler *handlers;
+    unsigned int handler_count;
+    unsigned int handler_capacity;
+
+    struct mock_msg_ids pending_subscriptions;
+    struct mock_msg_ids pending_publishes;
+    struct mock_mqtt_stats stats;
+
+    mock_mqtt_publish_hook_t publish_hook;
+    void *publish_hook_arg;
+};
+
+static bool mock_msg_ids_push(struct mock_msg_ids *list, int msg_id)
+{
+    if (list->count == list->capacity)
+    {
+        unsigned int capacity = list->capacity ? list->capacity * 2 : 16;
+        int *ids = (int *)realloc(list->ids, capacity * sizeof(*ids));
+        if (ids == NULL)
+        {
+            return false;
+        }
+        list->ids = ids;
+        list->capacity = capacity;
+    }
+    list->ids[list->count++] = msg_id;
+    return true;
+}
+
+static int mock_next_msg_id(esp_mqtt_client_handle_t client)
+{
+    // esp-mqtt uses 16-bit non-zero message ids
+    client->next_msg_id = (client->next_msg_id % 0xffff) + 1;
+    return client->next_msg_id;
+}
+
+static void mock_dispatch(esp_mqtt_client_handle_t client, esp_mqtt_event_handle_t event)
+{
+    event->client = client;
+    for (unsigned int i = 0; i < client->handler_count; i++)
+    {
+        const struct mock_mqtt_handler *h = &client->handlers[i];
+        if (h->event == MQTT_EVENT_ANY || h->event == event->event_id)
+        {
+            h->handler(h->handler_arg, "MQTT_EVENTS", event->event_id, event);
+        }
+    }
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+    esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)calloc(1, sizeof(*client));
+    if (client == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&client->mutex, NULL);
+    if (config)
+    {
+        client->config = *config;
+    }
+    return client;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    return client ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client)
+{
+    return client ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
+{
+    return client ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
+{
+    if (client == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_destroy(&client->mutex);
+    free(client->handlers);
+    free(client->pending_subscriptions.ids);
+    free(client->pending_publishes.ids);
+    free(client);
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event,
+                                         esp_event_handler_t event_handler, void *event_handler_arg)
+{
+    if (client == NULL || event_handler == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (client->handler_count == client->handler_capacity)
+    {
+        unsigned int capacity = client->handler_capacity ? client->handler_capacity * 2 : 4;
+        struct mock_mqtt_handler *handlers = (struct mock_mqtt_handler *)realloc(client->handlers, capacity * sizeof(*handlers));
+        if (handlers == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        client->handlers = handlers;
+        client->handler_capacity = capacity;
+    }
+
+    client->handlers[client->handler_count++] = (struct mock_mqtt_handler){
+        .event = event,
+        .handler = event_handler,
+        .handler_arg = event_handler_arg,
+    };
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_dispatch_custom_event(esp_mqtt_client_handle_t client, esp_mqtt_event_t *event)
+{
+    if (client == NULL || event == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // esp-mqtt posts a copy
+    esp_mqtt_event_t copy = *event;
+    copy.event_id = MQTT_USER_EVENT;
+    mock_dispatch(client, &copy);
+    return ESP_OK;
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, __attribute__((unused)) int qos)
+{
+    if (client == NULL || topic == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&client->mutex);
+    int msg_id = -1;
+    if (client->connected)
+    {
+        msg_id = mock_next_msg_id(client);
+        if (mock_msg_ids_push(&client->pending_subscriptions, msg_id))
+        {
+            client->stats.subscribe_count++;
+        }
+        else
+        {
+            msg_id = -1;
+        }
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return msg_id;
+}
+
+int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *topic)
+{
+    if (client == NULL || topic == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&client->mutex);
+    int msg_id = -1;
+    if (client->connected)
+    {
+        msg_id = mock_next_msg_id(client);
+        client->stats.unsubscribe_count++;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return msg_id;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos,
+                            __attribute__((unused)) int retain)
+{
+    if (client == NULL || topic == NULL)
+    {
+        return -1;
+    }
+    if (len <= 0 && data != NULL)
+    {
+        len = (int)strlen(data);
+    }
+
+    pthread_mutex_lock(&client->mutex);
+    int msg_id = 0; // QoS 0 messages have msg_id 0
+    if (qos > 0)
+    {
+        msg_id = mock_next_msg_id(client);
+        if (!mock_msg_ids_push(&client->pending_publishes, msg_id))
+        {
+            pthread_mutex_unlock(&client->mutex);
+            return -1;
+        }
+    }
+    else if (!client->connected)
+    {
+        pthread_mutex_unlock(&client->mutex);
+        return -1;
+    }
+    client->stats.publish_count++;
+    client->stats.publish_bytes += len > 0 ? (size_t)len : 0;
+
+    mock_mqtt_publish_hook_t hook = client->publish_hook;
+    void *hook_arg = client->publish_hook_arg;
+    pthread_mutex_unlock(&client->mutex);
+
+    if (hook)
+    {
+        hook(client, topic, data, len, hook_arg);
+    }
+    return msg_id;
+}
+
+void mock_mqtt_connect(esp_mqtt_client_handle_t client, bool session_present)
+{
+    pthread_mutex_lock(&client->mutex);
+    client->connected = true;
+    client->pending_subscriptions.count = 0;
+    pthread_mutex_unlock(&client->mutex);
+
+    esp_mqtt_event_t event = {
+        .event_id = MQTT_EVENT_CONNECTED,
+        .session_present = session_present,
+    };
+    mock_dispatch(client, &event);
+}
+
+void mock_mqtt_disconnect(esp_mqtt_client_handle_t client)
+{
+    pthread_mutex_lock(&client->mutex);
+    client->connected = false;
+    client->pending_subscriptions.count = 0;
+    pthread_mutex_unlock(&client->mutex);
+
+    esp_mqtt_event_t event = {
+        .event_id = MQTT_EVENT_DISCONNECTED,
+    };
+    mock_dispatch(client, &event);
+}
+
+static unsigned int mock_ack(esp_mqtt_client_handle_t client, struct mock_msg_ids *list, esp_mqtt_event_id_t event_id)
+{
+    unsigned int count = 0;
+    for (;;)
+    {
+        // Handlers may issue new requests while being dispatched, take one by one
+        pthread_mutex_lock(&client->mutex);
+        if (count >= list->count)
+        {
+            list->count = 0;
+            pthread_mutex_unlock(&client->mutex);
+            return count;
+        }
+        int msg_id = list->ids[count++];
+        pthread_mutex_unlock(&client->mutex);
+
+        esp_mqtt_event_t event = {
+            .event_id = event_id,
+            .msg_id = msg_id,
+        };
+        mock_dispatch(client, &event);
+    }
+}
+
+unsigned int mock_mqtt_ack_subscriptions(esp_mqtt_client_handle_t client)
+{
+    return mock_ack(client, &client->pending_subscriptions, MQTT_EVENT_SUBSCRIBED);
+}
+
+unsigned int mock_mqtt_ack_publishes(esp_mqtt_client_handle_t client)
+{
+    return mock_ack(client, &client->pending_publishes, MQTT_EVENT_PUBLISHED);
+}
+
+void mock_mqtt_deliver(esp_mqtt_client_handle_t client, const char *topic, const char *data, int data_len)
+{
+    int chunk_size = client->config.buffer_size > 0 ? client->config.buffer_size : data_len;
+    int offset = 0;
+
+    do
+    {
+        int len = data_len - offset < chunk_size ? data_len - offset : chunk_size;
+        esp_mqtt_event_t event = {
+            .event_id = MQTT_EVENT_DATA,
+            .data = (char *)data + offset,
+            .data_len = len,
+            .total_data_len = data_len,
+            .current_data_offset = offset,
+            .topic = offset == 0 ? (char *)topic : NULL,
+            .topic_len = offset == 0 ? (int)strlen(topic) : 0,
+            .qos = 1,
+        };
+        mock_dispatch(client, &event);
+        offset += len;
+    } while (offset < data_len);
+}
+
+void mock_mqtt_set_buffer_size(esp_mqtt_client_handle_t client, int buffer_size)
+{
+    client->config.buffer_size = buffer_size;
+}
+
+void mock_mqtt_set_publish_hook(esp_mqtt_client_handle_t client, mock_mqtt_publish_hook_t hook, void *arg)
+{
+    pthread_mutex_lock(&client->mutex);
+    client->publish_hook = hook;
+    client->publish_hook_arg = arg;
+    pthread_mutex_unlock(&client->mutex);
+}
+
+void mock_mqtt_get_stats(esp_mqtt_client_handle_t client, struct mock_mqtt_stats *stats)
+{
+    pthread_mutex_lock(&client->mutex);
+    *stats = client->stats;
+    stats->pending_subscriptions = client->pending_subscriptions.count;
+    stats->pending_publishes = client->pending_publishes.count;
+    pthread_mutex_unlock(&client->mutex);
+}
+
+void mock_mqtt_reset_stats(esp_mqtt_client_handle_t client)
+{
+    pthread_mutex_lock(&client->mutex);
+    memset(&client->stats, 0, sizeof(client->stats));
+    pthread_mutex_unlock(&client->mutex);
+}
@@ -0,0 +1,178 @@
+#include "freertos/semphr.h"
+#include <errno.h>
+#include <time.h>
+
+struct QueueDefinition
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max_count;
+    bool recursive;
+    pthread_mutex_t recursive_mutex; // recursive mutexes map directly to pthread ones
+    TaskHandle_t holder;             // of a recursive mutex, read atomically by other threads
+    UBaseType_t depth;
+};
+
+static BaseType_t recursive_taken(SemaphoreHandle_t xMutex, bool taken)
+{
+    if (!taken)
+    {
+        return pdFALSE;
+    }
+    if (xMutex->depth++ == 0)
+    {
+        __atomic_store_n(&xMutex->holder, (TaskHandle_t)pthread_self(), __ATOMIC_RELAXED);
+    }
+    return pdTRUE;
+}
+
+static SemaphoreHandle_t semaphore_create(UBaseType_t max_count, UBaseType_t initial_count, bool recursive)
+{
+    SemaphoreHandle_t sem = (SemaphoreHandle_t)calloc(1, sizeof(*sem));
+    if (sem == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&sem->mutex, NULL);
+    pthread_cond_init(&sem->cond, NULL);
+    sem->count = initial_count;
+    sem->max_count = max_count;
+    sem->recursive = recursive;
+
+    if (recursive)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&sem->recursive_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return semaphore_create(1, 1, false);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+    return semaphore_create(1, 1, true);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return semaphore_create(1, 0, false);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount)
+{
+    return semaphore_create(uxMaxCount, uxInitialCount, false);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+    if (xSemaphore->recursive)
+    {
+        pthread_mutex_destroy(&xSemaphore->recursive_mutex);
+    }
+    pthread_cond_destroy(&xSemaphore->cond);
+    pthread_mutex_destroy(&xSemaphore->mutex);
+    free(xSemaphore);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime)
+{
+    pthread_mutex_lock(&xSemaphore->mutex);
+    if (xSemaphore->count == 0 && xBlockTime > 0)
+    {
+        // Deadline only when actually blocking, clock_gettime is not free
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += xBlockTime / configTICK_RATE_HZ;
+        deadline.tv_nsec += (long)(xBlockTime % configTICK_RATE_HZ) * (1000000000 / configTICK_RATE_HZ);
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (xSemaphore->count == 0)
+        {
+            int rc = xBlockTime == portMAX_DELAY
+                         ? pthread_cond_wait(&xSemaphore->cond, &xSemaphore->mutex)
+                         : pthread_cond_timedwait(&xSemaphore->cond, &xSemaphore->mutex, &deadline);
+            if (rc == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+    }
+
+    BaseType_t result = pdFALSE;
+    if (xSemaphore->count > 0)
+    {
+        xSemaphore->count--;
+        result = pdTRUE;
+    }
+    pthread_mutex_unlock(&xSemaphore->mutex);
+    return result;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+    pthread_mutex_lock(&xSemaphore->mutex);
+    BaseType_t result = pdFALSE;
+    if (xSemaphore->count < xSemaphore->max_count)
+    {
+        xSemaphore->count++;
+        pthread_cond_signal(&xSemaphore->cond);
+        result = pdTRUE;
+    }
+    pthread_mutex_unlock(&xSemaphore->mutex);
+    return result;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t xMutex, TickType_t xBlockTime)
+{
+    if (xBlockTime == portMAX_DELAY)
+    {
+        return recursive_taken(xMutex, pthread_mutex_lock(&xMutex->recursive_mutex) == 0);
+    }
+    if (pthread_mutex_trylock(&xMutex->recursive_mutex) == 0)
+    {
+        return recursive_taken(xMutex, true);
+    }
+    if (xBlockTime == 0)
+    {
+        return pdFALSE;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += xBlockTime / configTICK_RATE_HZ;
+    deadline.tv_nsec += (long)(xBlockTime % configTICK_RATE_HZ) * (1000000000 / configTICK_RATE_HZ);
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return recursive_taken(xMutex, pthread_mutex_timedlock(&xMutex->recursive_mutex, &deadline) == 0);
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t xMutex)
+{
+    // Only the holder gives it back
+    if (--xMutex->depth == 0)
+    {
+        __atomic_store_n(&xMutex->holder, NULL, __ATOMIC_RELAXED);
+    }
+    return pthread_mutex_unlock(&xMutex->recursive_mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+TaskHandle_t xSemaphoreGetMutexHolder(SemaphoreHandle_t xMutex)
+{
+    return __atomic_load_n(&xMutex->holder, __ATOMIC_RELAXED);
+}
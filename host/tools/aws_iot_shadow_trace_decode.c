@@ -0,0 +1,120 @@
+// Decodes a dump of aws_iot_shadow_trace_dump(), e.g.
+//
+//   aws_iot_shadow_trace_decode trace.bin
+//   xxd -r -p trace.hex | aws_iot_shadow_trace_decode
+//
+#include "aws_iot_shadow.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+// By enum aws_iot_shadow_event
+static const char *const EVENT_NAMES[] = {
+    "ready",
+    "disconnected",
+    "get/accepted",
+    "get/rejected",
+    "update/accepted",
+    "update/rejected",
+    "update/delta",
+    "delete/accepted",
+    "delete/rejected",
+    "update/documents",
+};
+
+// By enum aws_iot_shadow_trace_op
+static const char *const OP_NAMES[] = {
+    "get",
+    "update",
+    "delete",
+};
+
+static void decode_record(const struct aws_iot_shadow_trace_record *record, uint32_t first_us)
+{
+    // Timestamps wrap around, records are in order, so differences do not
+    uint32_t offset_us = record->timestamp_us - first_us;
+    printf("%6" PRIu32 ".%06" PRIu32 "  shadow %-3u ", offset_us / 1000000, offset_us % 1000000, record->shadow);
+
+    const char *name = NULL;
+    switch (record->type)
+    {
+    case AWS_IOT_SHADOW_TRACE_EVENT:
+        name = record->arg < sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]) ? EVENT_NAMES[record->arg] : NULL;
+        printf("event    ");
+        break;
+    case AWS_IOT_SHADOW_TRACE_PUBLISH:
+        name = record->arg < sizeof(OP_NAMES) / sizeof(OP_NAMES[0]) ? OP_NAMES[record->arg] : NULL;
+        printf("publish  ");
+        break;
+    case AWS_IOT_SHADOW_TRACE_PUBLISH_THROTTLED:
+        name = record->arg < sizeof(OP_NAMES) / sizeof(OP_NAMES[0]) ? OP_NAMES[record->arg] : NULL;
+        printf("dequeued ");
+        break;
+    default:
+        printf("type %-4u", record->type);
+        break;
+    }
+
+    if (name != NULL)
+    {
+        printf("%-16s", name);
+    }
+    else
+    {
+        printf("%-16u", record->arg);
+    }
+    printf(" %" PRIu32 " bytes\n", record->len);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0))
+    {
+        fprintf(stderr, "usage: %s [dump]\n  reads stdin when dump is not given\n", argv[0]);
+        return 2;
+    }
+
+    FILE *in = argc == 2 ? fopen(argv[1], "rb") : stdin;
+    if (in == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    struct aws_iot_shadow_trace_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != AWS_IOT_SHADOW_TRACE_MAGIC)
+    {
+        fprintf(stderr, "not a shadow trace dump\n");
+        return 1;
+    }
+    if (header.version != AWS_IOT_SHADOW_TRACE_VERSION || header.record_size != sizeof(struct aws_iot_shadow_trace_record))
+    {
+        fprintf(stderr, "unsupported trace version %u, record size %u\n", header.version, header.record_size);
+        return 1;
+    }
+
+    printf("%" PRIu32 " records, %" PRIu32 " older ones overwritten\n", header.count, header.overwritten);
+
+    struct aws_iot_shadow_trace_record record;
+    uint32_t first_us = 0;
+    uint32_t n = 0;
+    for (; n < header.count && fread(&record, sizeof(record), 1, in) == 1; n++)
+    {
+        if (n == 0)
+        {
+            first_us = record.timestamp_us;
+        }
+        decode_record(&record, first_us);
+    }
+
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+    if (n != header.count)
+    {
+        fprintf(stderr, "dump is truncated, %" PRIu32 " of %" PRIu32 " records\n", n, header.count);
+        return 1;
+    }
+    return 0;
+}
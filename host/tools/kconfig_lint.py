@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+# Parses the component Kconfig, and checks that every CONFIG_AWS_IOT_SHADOW_* used by the sources is defined
+# there. The host build takes its configuration from sdkconfig.h and CMake instead, so it cannot catch either.
+#
+#   pip install kconfiglib
+#   python host/tools/kconfig_lint.py
+#
+import glob
+import os
+import re
+import sys
+
+import kconfiglib
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..")
+
+
+def main():
+    # Raises KconfigError on syntax errors, e.g. a prompt without its config line
+    kconfig = kconfiglib.Kconfig(os.path.join(ROOT, "Kconfig"), warn_to_stderr=False)
+    errors = list(kconfig.warnings)
+
+    used = set()
+    for path in glob.glob(os.path.join(ROOT, "include", "*.h")) + glob.glob(os.path.join(ROOT, "src", "*.[ch]")):
+        with open(path) as f:
+            used.update(re.findall(r"\bCONFIG_(AWS_IOT_SHADOW_\w+)", f.read()))
+
+    for name in sorted(used):
+        sym = kconfig.syms.get(name)
+        if sym is None or not sym.nodes:
+            errors.append("CONFIG_%s is used, but not defined in Kconfig" % name)
+
+    for error in errors:
+        print(error, file=sys.stderr)
+    return 1 if errors else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
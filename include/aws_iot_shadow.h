@@ -16,6 +16,8 @@ extern "C" {
 #define AWS_IOT_SHADOW_JSON_CLIENT_TOKEN "clientToken"
 #define AWS_IOT_SHADOW_JSON_MESSAGE "message"
 #define AWS_IOT_SHADOW_JSON_CODE "code"
+#define AWS_IOT_SHADOW_JSON_PREVIOUS "previous"
+#define AWS_IOT_SHADOW_JSON_CURRENT "current"
 
 #ifndef AWS_IOT_SHADOW_SUPPORT_DELTA
 #define AWS_IOT_SHADOW_SUPPORT_DELTA CONFIG_AWS_IOT_SHADOW_SUPPORT_DELTA
@@ -25,6 +27,196 @@ extern "C" {
 #define AWS_IOT_SHADOW_SUPPORT_DELETE CONFIG_AWS_IOT_SHADOW_SUPPORT_DELETE
 #endif
 
+#ifndef AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+#define AWS_IOT_SHADOW_SUPPORT_DOCUMENTS CONFIG_AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+#endif
+
+#ifndef AWS_IOT_SHADOW_WILDCARD_SUBSCRIPTION
+#define AWS_IOT_SHADOW_WILDCARD_SUBSCRIPTION CONFIG_AWS_IOT_SHADOW_WILDCARD_SUBSCRIPTION
+#endif
+
+#ifndef AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+#define AWS_IOT_SHADOW_LAZY_SUBSCRIPTION CONFIG_AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+#endif
+#if AWS_IOT_SHADOW_WILDCARD_SUBSCRIPTION
+// Single subscription covers all responses
+#undef AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+#define AWS_IOT_SHADOW_LAZY_SUBSCRIPTION 0
+#endif
+
+#ifndef AWS_IOT_SHADOW_SESSION_RESUME
+#define AWS_IOT_SHADOW_SESSION_RESUME CONFIG_AWS_IOT_SHADOW_SESSION_RESUME
+#endif
+
+#ifndef AWS_IOT_SHADOW_REASSEMBLY_MAX_SIZE
+#define AWS_IOT_SHADOW_REASSEMBLY_MAX_SIZE CONFIG_AWS_IOT_SHADOW_REASSEMBLY_MAX_SIZE
+#endif
+
+#ifndef AWS_IOT_SHADOW_DIRECT_DISPATCH
+#define AWS_IOT_SHADOW_DIRECT_DISPATCH CONFIG_AWS_IOT_SHADOW_DIRECT_DISPATCH
+#endif
+
+#ifndef AWS_IOT_SHADOW_DIRECT_DISPATCH_MAX_HANDLERS
+#define AWS_IOT_SHADOW_DIRECT_DISPATCH_MAX_HANDLERS CONFIG_AWS_IOT_SHADOW_DIRECT_DISPATCH_MAX_HANDLERS
+#endif
+
+#ifndef AWS_IOT_SHADOW_KEY_HANDLERS
+#define AWS_IOT_SHADOW_KEY_HANDLERS CONFIG_AWS_IOT_SHADOW_KEY_HANDLERS
+#endif
+
+#ifndef AWS_IOT_SHADOW_KEY_HANDLERS_MAX
+#define AWS_IOT_SHADOW_KEY_HANDLERS_MAX CONFIG_AWS_IOT_SHADOW_KEY_HANDLERS_MAX
+#endif
+
+#ifndef AWS_IOT_SHADOW_ASYNC_DISPATCH
+#define AWS_IOT_SHADOW_ASYNC_DISPATCH CONFIG_AWS_IOT_SHADOW_ASYNC_DISPATCH
+#endif
+
+#ifndef AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH
+#define AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH CONFIG_AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH
+#endif
+
+#ifndef AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE
+#define AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE CONFIG_AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE
+#endif
+
+#define AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK 1
+#define AWS_IOT_SHADOW_ASYNC_OVERFLOW_DROP_OLDEST 2
+#define AWS_IOT_SHADOW_ASYNC_OVERFLOW_COALESCE_DELTA 3
+
+#ifndef AWS_IOT_SHADOW_ASYNC_OVERFLOW
+#if CONFIG_AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK
+#define AWS_IOT_SHADOW_ASYNC_OVERFLOW AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK
+#elif CONFIG_AWS_IOT_SHADOW_ASYNC_OVERFLOW_COALESCE_DELTA
+#define AWS_IOT_SHADOW_ASYNC_OVERFLOW AWS_IOT_SHADOW_ASYNC_OVERFLOW_COALESCE_DELTA
+#else
+#define AWS_IOT_SHADOW_ASYNC_OVERFLOW AWS_IOT_SHADOW_ASYNC_OVERFLOW_DROP_OLDEST
+#endif
+#endif
+
+#ifndef AWS_IOT_SHADOW_ASYNC_BLOCK_TIMEOUT_MS
+#define AWS_IOT_SHADOW_ASYNC_BLOCK_TIMEOUT_MS CONFIG_AWS_IOT_SHADOW_ASYNC_BLOCK_TIMEOUT_MS
+#endif
+
+#ifndef AWS_IOT_SHADOW_ASYNC_TASK_STACK_SIZE
+#define AWS_IOT_SHADOW_ASYNC_TASK_STACK_SIZE CONFIG_AWS_IOT_SHADOW_ASYNC_TASK_STACK_SIZE
+#endif
+
+#ifndef AWS_IOT_SHADOW_ASYNC_TASK_PRIORITY
+#define AWS_IOT_SHADOW_ASYNC_TASK_PRIORITY CONFIG_AWS_IOT_SHADOW_ASYNC_TASK_PRIORITY
+#endif
+
+#ifndef AWS_IOT_SHADOW_DOCUMENT_CACHE
+#define AWS_IOT_SHADOW_DOCUMENT_CACHE CONFIG_AWS_IOT_SHADOW_DOCUMENT_CACHE
+#endif
+
+#ifndef AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE
+#define AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE CONFIG_AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE
+#endif
+
+#ifndef AWS_IOT_SHADOW_PERSISTENCE
+#define AWS_IOT_SHADOW_PERSISTENCE CONFIG_AWS_IOT_SHADOW_PERSISTENCE
+#endif
+
+#ifndef AWS_IOT_SHADOW_VERSION_FILTER
+#define AWS_IOT_SHADOW_VERSION_FILTER CONFIG_AWS_IOT_SHADOW_VERSION_FILTER
+#endif
+
+#ifndef AWS_IOT_SHADOW_REQUEST_TRACKING
+#define AWS_IOT_SHADOW_REQUEST_TRACKING CONFIG_AWS_IOT_SHADOW_REQUEST_TRACKING
+#endif
+
+#ifndef AWS_IOT_SHADOW_REQUEST_MAX_PENDING
+#define AWS_IOT_SHADOW_REQUEST_MAX_PENDING CONFIG_AWS_IOT_SHADOW_REQUEST_MAX_PENDING
+#endif
+
+#ifndef AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS
+#define AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS CONFIG_AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS
+#endif
+
+#ifndef AWS_IOT_SHADOW_UPDATE_COALESCING
+#define AWS_IOT_SHADOW_UPDATE_COALESCING CONFIG_AWS_IOT_SHADOW_UPDATE_COALESCING
+#endif
+
+#ifndef AWS_IOT_SHADOW_COALESCE_WINDOW_MS
+#define AWS_IOT_SHADOW_COALESCE_WINDOW_MS CONFIG_AWS_IOT_SHADOW_COALESCE_WINDOW_MS
+#endif
+
+#ifndef AWS_IOT_SHADOW_COALESCE_MAX_SIZE
+#define AWS_IOT_SHADOW_COALESCE_MAX_SIZE CONFIG_AWS_IOT_SHADOW_COALESCE_MAX_SIZE
+#endif
+
+#ifndef AWS_IOT_SHADOW_COALESCE_MAX_WAITERS
+#define AWS_IOT_SHADOW_COALESCE_MAX_WAITERS CONFIG_AWS_IOT_SHADOW_COALESCE_MAX_WAITERS
+#endif
+
+#ifndef AWS_IOT_SHADOW_PUBLISH_THROTTLE
+#define AWS_IOT_SHADOW_PUBLISH_THROTTLE CONFIG_AWS_IOT_SHADOW_PUBLISH_THROTTLE
+#endif
+
+#ifndef AWS_IOT_SHADOW_THROTTLE_RATE
+#define AWS_IOT_SHADOW_THROTTLE_RATE CONFIG_AWS_IOT_SHADOW_THROTTLE_RATE
+#endif
+
+#ifndef AWS_IOT_SHADOW_THROTTLE_BURST
+#define AWS_IOT_SHADOW_THROTTLE_BURST CONFIG_AWS_IOT_SHADOW_THROTTLE_BURST
+#endif
+
+#ifndef AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT
+#define AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT CONFIG_AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT
+#endif
+
+#ifndef AWS_IOT_SHADOW_THROTTLE_QUEUE_LENGTH
+#define AWS_IOT_SHADOW_THROTTLE_QUEUE_LENGTH CONFIG_AWS_IOT_SHADOW_THROTTLE_QUEUE_LENGTH
+#endif
+
+#ifndef AWS_IOT_SHADOW_OFFLINE_JOURNAL
+#define AWS_IOT_SHADOW_OFFLINE_JOURNAL CONFIG_AWS_IOT_SHADOW_OFFLINE_JOURNAL
+#endif
+
+#define AWS_IOT_SHADOW_OFFLINE_JOURNAL_LATEST 1
+#define AWS_IOT_SHADOW_OFFLINE_JOURNAL_ALL 2
+
+#ifndef AWS_IOT_SHADOW_OFFLINE_JOURNAL_POLICY
+#if CONFIG_AWS_IOT_SHADOW_OFFLINE_JOURNAL_ALL
+#define AWS_IOT_SHADOW_OFFLINE_JOURNAL_POLICY AWS_IOT_SHADOW_OFFLINE_JOURNAL_ALL
+#else
+#define AWS_IOT_SHADOW_OFFLINE_JOURNAL_POLICY AWS_IOT_SHADOW_OFFLINE_JOURNAL_LATEST
+#endif
+#endif
+
+#ifndef AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE
+#define AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE CONFIG_AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE
+#endif
+
+#ifndef AWS_IOT_SHADOW_STATS
+#define AWS_IOT_SHADOW_STATS CONFIG_AWS_IOT_SHADOW_STATS
+#endif
+
+#ifndef AWS_IOT_SHADOW_TRACE
+#define AWS_IOT_SHADOW_TRACE CONFIG_AWS_IOT_SHADOW_TRACE
+#endif
+
+#ifndef AWS_IOT_SHADOW_TRACE_RECORDS
+#define AWS_IOT_SHADOW_TRACE_RECORDS CONFIG_AWS_IOT_SHADOW_TRACE_RECORDS
+#endif
+
+#ifndef AWS_IOT_SHADOW_GATEWAY
+#define AWS_IOT_SHADOW_GATEWAY CONFIG_AWS_IOT_SHADOW_GATEWAY
+#endif
+
+#ifndef AWS_IOT_SHADOW_GATEWAY_MAX_THINGS
+#define AWS_IOT_SHADOW_GATEWAY_MAX_THINGS CONFIG_AWS_IOT_SHADOW_GATEWAY_MAX_THINGS
+#endif
+
+#ifndef AWS_IOT_SHADOW_GATEWAY_NAMES_SIZE
+#define AWS_IOT_SHADOW_GATEWAY_NAMES_SIZE CONFIG_AWS_IOT_SHADOW_GATEWAY_NAMES_SIZE
+#endif
+
+#ifndef AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED
+#define AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED CONFIG_AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED
+#endif
+
 ESP_EVENT_DECLARE_BASE(AWS_IOT_SHADOW_EVENT);
 
 typedef struct aws_iot_shadow_handle *aws_iot_shadow_handle_ptr;
@@ -32,8 +224,8 @@ typedef struct aws_iot_shadow_handle *aws_iot_shadow_handle_ptr;
 /**
  * @brief Event types for a shadow.
  *
- * Note that handlers are dispatched on custom event loop, therefore
- * they be registered via aws_iot_shadow_handler_register() and not default
+ * Note that handlers are dispatched on custom event loop (or directly, with AWS_IOT_SHADOW_DIRECT_DISPATCH),
+ * therefore they be registered via aws_iot_shadow_handler_register() and not default
  * functions.
  *
  * @see aws_iot_shadow_handler_register
@@ -64,11 +256,17 @@ enum aws_iot_shadow_event
     AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED = 7,
     /** @brief Received error to a delete action */
     AWS_IOT_SHADOW_EVENT_DELETE_REJECTED = 8,
+#endif
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    /** @brief Shadow was updated, with previous and current state, see aws_iot_shadow_event_data.documents */
+    AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS = 9,
 #endif
     /** Invalid event ID */
-    AWS_IOT_SHADOW_EVENT_MAX = 9,
+    AWS_IOT_SHADOW_EVENT_MAX = 10,
 };
 
+struct aws_iot_shadow_json_documents;
+
 struct aws_iot_shadow_event_data
 {
     enum aws_iot_shadow_event event_id;
@@ -77,11 +275,21 @@ struct aws_iot_shadow_event_data
     const char *shadow_name;
     const char *data;
     size_t data_len;
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    /** @brief Parsed data of AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS, NULL for other events or malformed message.
+     * Valid only while the handler runs, as data. */
+    const struct aws_iot_shadow_json_documents *documents;
+#endif
 };
 
 esp_err_t aws_iot_shadow_init(esp_mqtt_client_handle_t client, const char *thing_name, const char *shadow_name,
                               aws_iot_shadow_handle_ptr *handle);
 
+/**
+ * @brief Must not be called from an esp_timer callback, it waits for callbacks of the handle on the esp_timer task.
+ *
+ * Synchronous requests in progress return ESP_ERR_INVALID_STATE, and are waited for.
+ */
 esp_err_t aws_iot_shadow_delete(aws_iot_shadow_handle_ptr handle);
 
 /**
@@ -103,6 +311,42 @@ esp_err_t aws_iot_shadow_handler_instance_register(aws_iot_shadow_handle_ptr han
 esp_err_t aws_iot_shadow_handler_instance_unregister(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
                                                      esp_event_handler_instance_t handler_ctx_arg);
 
+#if AWS_IOT_SHADOW_KEY_HANDLERS
+struct aws_iot_shadow_json_value;
+
+/**
+ * @brief Handler of a state key path, see aws_iot_shadow_key_handler_register().
+ *
+ * @param event Event being dispatched, as passed to event handlers.
+ * @param value Value at the registered path, references event data (see aws_iot_shadow_json.h).
+ */
+typedef void (*aws_iot_shadow_key_handler_t)(void *arg, const struct aws_iot_shadow_event_data *event,
+                                             const struct aws_iot_shadow_json_value *value);
+
+/**
+ * @brief Registers a handler of a dot separated key path under state of an event, e.g. `desired.led.brightness`
+ * for AWS_IOT_SHADOW_EVENT_GET_ACCEPTED, or `led.brightness` for AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, whose
+ * state holds the changed keys directly. For AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS, path is under `current.state`.
+ *
+ * Top-level state members of each message are scanned once, and only handlers of paths present in the message
+ * are called, after event handlers. Up to AWS_IOT_SHADOW_KEY_HANDLERS_MAX handlers can be registered per shadow.
+ *
+ * @param path Copied, it need not outlive the call.
+ * @return ESP_ERR_INVALID_ARG for events without state (and AWS_IOT_SHADOW_EVENT_ANY), ESP_ERR_NO_MEM when full
+ *         or out of memory.
+ */
+esp_err_t aws_iot_shadow_key_handler_register(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                              const char *path, aws_iot_shadow_key_handler_t handler, void *handler_arg);
+
+/**
+ * @brief Unregisters a handler registered with the same arguments, it can be called from a handler.
+ *
+ * @return ESP_ERR_NOT_FOUND if there is no such handler.
+ */
+esp_err_t aws_iot_shadow_key_handler_unregister(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                                const char *path, aws_iot_shadow_key_handler_t handler, void *handler_arg);
+#endif
+
 bool aws_iot_shadow_is_ready(aws_iot_shadow_handle_ptr handle);
 
 bool aws_iot_shadow_wait_for_ready(aws_iot_shadow_handle_ptr handle, TickType_t ticks_to_wait);
@@ -115,6 +359,528 @@ esp_err_t aws_iot_shadow_request_update(aws_iot_shadow_handle_ptr handle, const
 esp_err_t aws_iot_shadow_request_delete(aws_iot_shadow_handle_ptr handle);
 #endif
 
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+/**
+ * @brief Order of throttled requests.
+ *
+ * With AWS_IOT_SHADOW_PUBLISH_THROTTLE, requests of all shadows of a thing share a token bucket of
+ * AWS_IOT_SHADOW_THROTTLE_RATE requests per second (AWS_IOT_SHADOW_THROTTLE_BURST at once), and at most
+ * AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT of them can wait for PUBACK. Requests over the limits are queued,
+ * higher priority first, and published from the esp_timer task. aws_iot_shadow_request_get(), _update()
+ * and _delete() then return ESP_OK when queued, and ESP_ERR_NO_MEM when the queue is full.
+ */
+enum aws_iot_shadow_priority
+{
+    /** @brief HIGH for get and delete, NORMAL for update */
+    AWS_IOT_SHADOW_PRIORITY_DEFAULT = 0,
+    /** @brief E.g. get at boot, goes before queued updates */
+    AWS_IOT_SHADOW_PRIORITY_HIGH = 1,
+    AWS_IOT_SHADOW_PRIORITY_NORMAL = 2,
+    /** @brief E.g. periodic telemetry, can fill half of the queue only */
+    AWS_IOT_SHADOW_PRIORITY_LOW = 3,
+};
+
+struct aws_iot_shadow_throttle_stats
+{
+    /** @brief Requests published right away */
+    uint32_t sent;
+    /** @brief Requests queued, to be published later */
+    uint32_t deferred;
+    /** @brief Requests refused, since the queue was full */
+    uint32_t refused;
+    /** @brief Requests in the queue now */
+    uint8_t queued;
+    /** @brief Requests waiting for PUBACK now */
+    uint8_t in_flight;
+};
+
+/**
+ * @brief Publishes an update with given priority, same as aws_iot_shadow_request_update().
+ */
+esp_err_t aws_iot_shadow_request_update_priority(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len,
+                                                 enum aws_iot_shadow_priority priority);
+
+/**
+ * @brief Tells whether a request with given priority would be queued (or refused) instead of published now.
+ *
+ * Does not wait for the limits and changes nothing, e.g. for telemetry to skip a sample rather than queue it.
+ */
+bool aws_iot_shadow_would_throttle(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_priority priority);
+
+/**
+ * @brief Counters of the thing of the handle, shared by all its shadows.
+ */
+esp_err_t aws_iot_shadow_throttle_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_throttle_stats *stats);
+#endif
+
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+struct aws_iot_shadow_journal_stats
+{
+    /** @brief Updates requested while the shadow was not ready */
+    uint32_t journaled;
+    /** @brief Updates merged into a journaled one (latest wins policy) */
+    uint32_t merged;
+    /** @brief Updates dropped, or refused, since the journal was full */
+    uint32_t dropped;
+    /** @brief Updates published from the journal, once the shadow was ready */
+    uint32_t flushed;
+};
+
+/**
+ * @brief Counters of the offline journal of the shadow.
+ *
+ * With AWS_IOT_SHADOW_OFFLINE_JOURNAL, aws_iot_shadow_request_update() does not publish until the shadow is ready
+ * (connected and subscribed). Updates are kept in a journal of up to AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE bytes,
+ * and published right after the get request which follows AWS_IOT_SHADOW_EVENT_READY. With the latest wins policy,
+ * updates are merged into a single document (later members win, nested objects are merged, nulls are kept),
+ * and an update which would grow it over the limit is refused with ESP_ERR_NO_MEM. With the journal all policy,
+ * updates are published one by one in order, and the oldest ones are dropped to make room.
+ * Tracked requests are not journaled.
+ */
+esp_err_t aws_iot_shadow_journal_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_journal_stats *stats);
+#endif
+
+#if AWS_IOT_SHADOW_STATS
+#define AWS_IOT_SHADOW_HISTOGRAM_BUCKETS 24
+
+/**
+ * @brief Durations in microseconds, bucket 0 counts values below 2 us, bucket i values of [2^i, 2^(i+1)) us,
+ * the last one everything from 2^23 us (8.4 s) up.
+ */
+struct aws_iot_shadow_histogram
+{
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t buckets[AWS_IOT_SHADOW_HISTOGRAM_BUCKETS];
+};
+
+struct aws_iot_shadow_stats
+{
+    /** @brief Messages received per event, before filters, indexed by enum aws_iot_shadow_event */
+    uint32_t received[AWS_IOT_SHADOW_EVENT_MAX];
+    /** @brief Messages not dispatched: duplicates, stale versions, state known already, full async queue, failed reassembly */
+    uint32_t dropped;
+    /** @brief Messages received in chunks (larger than MQTT buffer), partial payloads are reassembled */
+    uint32_t fragmented;
+    /** @brief Requests published, including throttled and journaled ones, once they are sent */
+    uint32_t published;
+    uint32_t publish_failed;
+    /** @brief From (re)connect until AWS_IOT_SHADOW_EVENT_READY */
+    struct aws_iot_shadow_histogram ready;
+    /** @brief Time spent running all handlers of a dispatched event together, one sample per event, not per handler.
+     * Includes esp_event loop overhead when used */
+    struct aws_iot_shadow_histogram handler;
+    /** @brief From publish until /get/accepted of a tracked request, matched by client token.
+     * Empty without AWS_IOT_SHADOW_REQUEST_TRACKING */
+    struct aws_iot_shadow_histogram get_latency;
+    /** @brief From publish until /update/accepted of a tracked request, same as get_latency */
+    struct aws_iot_shadow_histogram update_latency;
+    /** @brief From publish until /delete/accepted of a tracked request, same as get_latency */
+    struct aws_iot_shadow_histogram delete_latency;
+};
+
+/**
+ * @brief Counters of the shadow, since it was initialized.
+ *
+ * Counters are updated with relaxed atomic operations and read one by one, so the snapshot is not consistent
+ * across fields, e.g. a histogram count can be ahead of its buckets by a sample.
+ */
+esp_err_t aws_iot_shadow_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_stats *stats);
+
+/**
+ * @brief Upper bound of the bucket holding given fraction of samples, capped at max, 0 when empty.
+ *
+ * @param permille E.g. 500 for median, 990 for 99th percentile.
+ */
+uint32_t aws_iot_shadow_histogram_percentile(const struct aws_iot_shadow_histogram *histogram, uint32_t permille);
+
+/**
+ * @brief Formats stats as a JSON object, e.g. to be reported in a shadow.
+ *
+ * Histograms are `{"n":count,"max":us,"p50":us,"p99":us,"buckets":[...]}`, percentiles are the upper bound
+ * of their bucket, trailing empty buckets are left out.
+ *
+ * @param written Receives length of the result, buf is NUL terminated. Can be NULL.
+ * @return ESP_OK, or ESP_ERR_INVALID_SIZE if buf is too small.
+ */
+esp_err_t aws_iot_shadow_stats_json(const struct aws_iot_shadow_stats *stats, char *buf, size_t buf_len, size_t *written);
+#endif
+
+#if AWS_IOT_SHADOW_TRACE
+enum aws_iot_shadow_trace_type
+{
+    /** @brief Event dispatched, arg is enum aws_iot_shadow_event, len is payload length */
+    AWS_IOT_SHADOW_TRACE_EVENT = 1,
+    /** @brief Request published (or queued, when throttled), arg is enum aws_iot_shadow_trace_op */
+    AWS_IOT_SHADOW_TRACE_PUBLISH = 2,
+    /** @brief Throttled request published from the queue, arg is enum aws_iot_shadow_trace_op */
+    AWS_IOT_SHADOW_TRACE_PUBLISH_THROTTLED = 3,
+};
+
+enum aws_iot_shadow_trace_op
+{
+    AWS_IOT_SHADOW_TRACE_OP_GET = 0,
+    AWS_IOT_SHADOW_TRACE_OP_UPDATE = 1,
+    AWS_IOT_SHADOW_TRACE_OP_DELETE = 2,
+    AWS_IOT_SHADOW_TRACE_OP_UNKNOWN = 0xFF,
+};
+
+/**
+ * @brief Fixed-size binary trace record, replaces INFO logging of every message with AWS_IOT_SHADOW_TRACE.
+ */
+struct aws_iot_shadow_trace_record
+{
+    uint32_t timestamp_us; // esp_timer_get_time(), wraps around every 71 minutes
+    uint16_t shadow;       // index of the shadow, logged by aws_iot_shadow_init()
+    uint8_t type;          // enum aws_iot_shadow_trace_type
+    uint8_t arg;
+    uint32_t len;
+};
+
+#define AWS_IOT_SHADOW_TRACE_MAGIC (0x52544853U) // "SHTR"
+#define AWS_IOT_SHADOW_TRACE_VERSION (1U)
+
+/**
+ * @brief Header of a dump, followed by count records, oldest first. Little endian, as written by the device.
+ */
+struct aws_iot_shadow_trace_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t overwritten; // older records lost since the ring was cleared
+};
+
+/**
+ * @brief Copies the trace ring of all shadows into buf, to be decoded by host/tools/aws_iot_shadow_trace_decode.
+ *
+ * Records are written without a lock, those written while dumping may be torn, so dump from a quiet moment,
+ * e.g. after an error has been detected.
+ *
+ * @param buf Receives header and as many of the newest records as fit.
+ * @param written Receives number of bytes written. Can be NULL.
+ * @return ESP_ERR_INVALID_SIZE if buf cannot hold the header.
+ */
+esp_err_t aws_iot_shadow_trace_dump(void *buf, size_t buf_len, size_t *written);
+
+/**
+ * @brief Empties the trace ring.
+ */
+void aws_iot_shadow_trace_clear();
+#endif
+
+#if AWS_IOT_SHADOW_GATEWAY
+/**
+ * @brief Classic shadows of child things, sharing the MQTT connection, without a shadow handle each.
+ *
+ * Things are compact records in a table of AWS_IOT_SHADOW_GATEWAY_MAX_THINGS, allocated once with the gateway,
+ * names are kept in a pool of AWS_IOT_SHADOW_GATEWAY_NAMES_SIZE bytes. Up to AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED
+ * things are subscribed at a time, with a single `<prefix>/+/+` subscription each. Requesting get or update of
+ * another thing unsubscribes the least recently used one. Messages received are routed to the gateway when
+ * no shadow handle of the client has their topic.
+ */
+typedef struct aws_iot_shadow_gateway *aws_iot_shadow_gateway_ptr;
+
+/**
+ * @brief Called for responses, deltas (and documents) of subscribed things.
+ *
+ * event->handle and event->shadow_name are NULL, event->thing_name is the child thing.
+ * Runs on the MQTT task with the dispatcher lock held, regardless of dispatch options, so it must not block.
+ * It may request get and update of any thing, it must not delete the gateway.
+ */
+typedef void (*aws_iot_shadow_gateway_handler_t)(void *arg, const struct aws_iot_shadow_event_data *event);
+
+struct aws_iot_shadow_gateway_stats
+{
+    /** @brief Things added now */
+    uint16_t things;
+    /** @brief Things with a subscription now, acknowledged or not */
+    uint16_t subscribed;
+    /** @brief Subscriptions sent */
+    uint32_t subscribes;
+    /** @brief Least recently used things unsubscribed to make room */
+    uint32_t evictions;
+    /** @brief Messages dispatched to the handler */
+    uint32_t received;
+    /** @brief Messages of things not subscribed (anymore), or larger than MQTT buffer */
+    uint32_t dropped;
+    /** @brief Bytes of the name pool in use */
+    size_t names_used;
+    /** @brief Memory of the gateway, allocated at once */
+    size_t memory;
+};
+
+/**
+ * @brief Creates the gateway of the client, at most one per client.
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM, or ESP_ERR_INVALID_STATE if the client has a gateway already.
+ */
+esp_err_t aws_iot_shadow_gateway_create(esp_mqtt_client_handle_t client, aws_iot_shadow_gateway_handler_t handler,
+                                        void *handler_arg, aws_iot_shadow_gateway_ptr *gateway);
+
+/**
+ * @brief Unsubscribes all things and frees the gateway.
+ */
+esp_err_t aws_iot_shadow_gateway_delete(aws_iot_shadow_gateway_ptr gateway);
+
+/**
+ * @brief Adds a child thing, it is not subscribed until its get or update is requested.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if it has been added already, or ESP_ERR_NO_MEM if the table
+ *         or the name pool is full.
+ */
+esp_err_t aws_iot_shadow_gateway_add(aws_iot_shadow_gateway_ptr gateway, const char *thing_name);
+
+/**
+ * @brief Removes a child thing, unsubscribing it.
+ *
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND.
+ */
+esp_err_t aws_iot_shadow_gateway_remove(aws_iot_shadow_gateway_ptr gateway, const char *thing_name);
+
+/**
+ * @brief Subscribes the thing, unless it is already, and publishes /get once the subscription is acknowledged.
+ *
+ * Thing stays subscribed until the response arrives, it is not evicted meanwhile. While not connected,
+ * get is published after connect.
+ *
+ * @return ESP_OK when published or waiting for the subscription, ESP_ERR_NOT_FOUND,
+ *         or ESP_ERR_NO_MEM if all subscribed things wait for their get response.
+ */
+esp_err_t aws_iot_shadow_gateway_request_get(aws_iot_shadow_gateway_ptr gateway, const char *thing_name);
+
+/**
+ * @brief Publishes an update of the thing right away, and subscribes the thing, unless it is already.
+ *
+ * Responses to an update of a thing which has not been subscribed yet can be missed, request get first
+ * to have them.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND, or ESP_FAIL if the update could not be published.
+ */
+esp_err_t aws_iot_shadow_gateway_request_update(aws_iot_shadow_gateway_ptr gateway, const char *thing_name,
+                                                const char *data, size_t data_len);
+
+esp_err_t aws_iot_shadow_gateway_stats(aws_iot_shadow_gateway_ptr gateway, struct aws_iot_shadow_gateway_stats *stats);
+#endif
+
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+struct aws_iot_shadow_cache_stats
+{
+    /** @brief Updates published by aws_iot_shadow_request_update_reported() */
+    uint32_t updates_sent;
+    /** @brief Updates not published, since nothing has changed */
+    uint32_t updates_skipped;
+    /** @brief Payload bytes not published, compared to full updates */
+    uint64_t bytes_saved;
+};
+
+/**
+ * @brief Publishes an update of reported state, with only the members changed since last accepted state.
+ *
+ * Reported state is compared to the cached one, nested objects recursively, and members missing in reported
+ * are published as null (deleted). Nothing is published if there is no change. Until the state is known
+ * (first /get/accepted), or if it is larger than AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE, whole reported
+ * state is published.
+ *
+ * Cache follows accepted updates only, so the same change is published again until it is accepted.
+ *
+ * @param reported Complete local reported state, a JSON object (not the whole shadow document).
+ */
+esp_err_t aws_iot_shadow_request_update_reported(aws_iot_shadow_handle_ptr handle, const char *reported, size_t reported_len);
+
+/**
+ * @brief Copies last accepted `state.reported` object.
+ *
+ * @param written Receives length of the copy, buf is NUL terminated. Can be NULL.
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if not known yet, or ESP_ERR_INVALID_SIZE if buf is too small.
+ */
+esp_err_t aws_iot_shadow_cached_reported(aws_iot_shadow_handle_ptr handle, char *buf, size_t buf_len, size_t *written);
+
+/**
+ * @brief Copies last accepted `state.desired` object, same as aws_iot_shadow_cached_reported().
+ */
+esp_err_t aws_iot_shadow_cached_desired(aws_iot_shadow_handle_ptr handle, char *buf, size_t buf_len, size_t *written);
+
+esp_err_t aws_iot_shadow_cache_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_cache_stats *stats);
+#endif
+
+#if AWS_IOT_SHADOW_VERSION_FILTER
+struct aws_iot_shadow_discard_stats
+{
+    /** @brief Messages with the same version as the last one, e.g. redelivered after reconnect */
+    uint32_t duplicate;
+    /** @brief Messages older than the last one, received out of order */
+    uint32_t stale;
+};
+
+/**
+ * @brief Counts of /update/accepted and /update/delta messages, which have not been dispatched.
+ */
+esp_err_t aws_iot_shadow_discard_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_discard_stats *stats);
+#endif
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+/**
+ * @brief Maximum length of a client token, including terminating NUL (AWS IoT allows 64 bytes).
+ */
+#define AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX (65)
+
+enum aws_iot_shadow_request_result
+{
+    /** @brief Received /accepted response */
+    AWS_IOT_SHADOW_REQUEST_ACCEPTED = 0,
+    /** @brief Received /rejected response */
+    AWS_IOT_SHADOW_REQUEST_REJECTED = 1,
+    /** @brief No response within the timeout */
+    AWS_IOT_SHADOW_REQUEST_TIMEOUT = 2,
+    /** @brief Handle was deleted before a response */
+    AWS_IOT_SHADOW_REQUEST_CANCELLED = 3,
+};
+
+struct aws_iot_shadow_request_completion
+{
+    enum aws_iot_shadow_request_result result;
+    /** @brief Response event, AWS_IOT_SHADOW_EVENT_ANY without response */
+    enum aws_iot_shadow_event event_id;
+    const char *client_token;
+    /** @brief Time from publish until the response has been dispatched (or timed out), in microseconds */
+    int64_t rtt_us;
+    /** @brief Response document, valid during the callback only. NULL without response */
+    const char *data;
+    size_t data_len;
+};
+
+/**
+ * @brief Called once per tracked request.
+ *
+ * Responses are completed the same way events are dispatched, after handlers of the response event ran.
+ * Timeouts are completed from the esp_timer task, cancelled requests from aws_iot_shadow_delete(), without any lock held.
+ */
+typedef void (*aws_iot_shadow_request_cb_t)(aws_iot_shadow_handle_ptr handle,
+                                            const struct aws_iot_shadow_request_completion *completion, void *arg);
+
+#define AWS_IOT_SHADOW_REQUEST_NO_TIMEOUT UINT32_MAX
+
+struct aws_iot_shadow_request_config
+{
+    /** @brief Client token, NULL to use the one of the update document, or to generate one */
+    const char *client_token;
+    aws_iot_shadow_request_cb_t callback;
+    void *arg;
+    /** @brief 0 for AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS, AWS_IOT_SHADOW_REQUEST_NO_TIMEOUT to wait for the response forever */
+    uint32_t timeout_ms;
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    /** @brief Timeout includes time in the throttle queue */
+    enum aws_iot_shadow_priority priority;
+#endif
+};
+
+/**
+ * @brief Publishes an update, and calls config->callback once it is accepted, rejected, or timed out.
+ *
+ * Response is matched by `clientToken`, which is inserted into the document, unless it has one already.
+ * Requests do not wait for each other, up to AWS_IOT_SHADOW_REQUEST_MAX_PENDING can be pending per shadow.
+ * Pending requests survive reconnects (QoS 1 publishes are resent), aws_iot_shadow_delete() completes them
+ * with AWS_IOT_SHADOW_REQUEST_CANCELLED.
+ *
+ * @return ESP_OK when published, ESP_ERR_NO_MEM if too many requests are pending,
+ *         ESP_ERR_INVALID_STATE if a request with the same client token is pending,
+ *         or error of the esp_timer of its timeout.
+ */
+esp_err_t aws_iot_shadow_request_update_tracked(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len,
+                                                const struct aws_iot_shadow_request_config *config);
+
+/**
+ * @brief Publishes a get request `{"clientToken":"..."}`, same as aws_iot_shadow_request_update_tracked().
+ */
+esp_err_t aws_iot_shadow_request_get_tracked(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_request_config *config);
+
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+/**
+ * @brief Publishes a delete request `{"clientToken":"..."}`, same as aws_iot_shadow_request_update_tracked().
+ */
+esp_err_t aws_iot_shadow_request_delete_tracked(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_request_config *config);
+#endif
+
+struct aws_iot_shadow_sync_response
+{
+    enum aws_iot_shadow_request_result result;
+    /** @brief Length of the response document, without NUL. Not written to buffer if it is not shorter than buf_len */
+    size_t len;
+    /** @brief Time from publish until the response has been dispatched (or timed out), in microseconds */
+    int64_t rtt_us;
+};
+
+/**
+ * @brief Waits until the shadow is ready, sends a tracked get request and waits for its response.
+ *
+ * Response document is copied into buf once, while it is dispatched, and NUL terminated. Timeout covers
+ * both waiting for ready and the round trip. With portMAX_DELAY, neither has a limit, see
+ * AWS_IOT_SHADOW_REQUEST_NO_TIMEOUT, so a response lost with the connection is awaited forever.
+ *
+ * One synchronous request per shadow can be in progress. Must not be called from event handlers, request
+ * callbacks or the gateway handler, since their task dispatches the response.
+ *
+ * @param response Can be NULL.
+ * @return ESP_OK when accepted, ESP_FAIL when rejected (buf has the error document), ESP_ERR_TIMEOUT,
+ *         ESP_ERR_INVALID_SIZE when the response does not fit, ESP_ERR_INVALID_STATE if another synchronous
+ *         request of the shadow is in progress, it is called while dispatching, or the shadow is deleted meanwhile,
+ *         or error of aws_iot_shadow_request_get_tracked().
+ */
+esp_err_t aws_iot_shadow_request_get_sync(aws_iot_shadow_handle_ptr handle, char *buf, size_t buf_len, TickType_t timeout,
+                                          struct aws_iot_shadow_sync_response *response);
+
+/**
+ * @brief Same as aws_iot_shadow_request_get_sync(), for an update, see aws_iot_shadow_request_update_tracked().
+ */
+esp_err_t aws_iot_shadow_request_update_sync(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len,
+                                             char *buf, size_t buf_len, TickType_t timeout,
+                                             struct aws_iot_shadow_sync_response *response);
+#endif
+
+#if AWS_IOT_SHADOW_UPDATE_COALESCING
+/**
+ * @brief Buffers a fragment of reported state, to be published merged with other fragments as a single update.
+ *
+ * The first fragment opens a window of AWS_IOT_SHADOW_COALESCE_WINDOW_MS, fragments added until it expires
+ * are merged into `{"state":{"reported":...}}`. Later fragments win, nested objects are merged, and null members
+ * (deletes) are kept. Merged state is published without waiting for the window to expire, once it has
+ * AWS_IOT_SHADOW_COALESCE_MAX_SIZE bytes.
+ *
+ * Merged updates are published from the esp_timer task, one at a time, so they are sent in order.
+ * Publish errors are logged only, use aws_iot_shadow_request_update_coalesced_tracked() to know the outcome.
+ * Buffered fragments are dropped by aws_iot_shadow_delete().
+ *
+ * @param reported Fragment of reported state, a JSON object (not the whole shadow document).
+ * @return ESP_OK when buffered, ESP_ERR_INVALID_ARG if it is not an object.
+ */
+esp_err_t aws_iot_shadow_request_update_coalesced(aws_iot_shadow_handle_ptr handle, const char *reported, size_t reported_len);
+
+/**
+ * @brief Ends the window early, buffered fragments are published from the esp_timer task right away.
+ */
+esp_err_t aws_iot_shadow_request_update_flush(aws_iot_shadow_handle_ptr handle);
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+/**
+ * @brief Same as aws_iot_shadow_request_update_coalesced(), config->callback is called once the merged update
+ * completes, same as for aws_iot_shadow_request_update_tracked().
+ *
+ * Every fragment merged into an update is completed with the same result and client token of the merged update.
+ * config->client_token must be NULL, merged update uses a generated one. Timeout of the merged update
+ * is the shortest one of its fragments. If the merged update cannot be published, callbacks are called
+ * with AWS_IOT_SHADOW_REQUEST_REJECTED and no data. aws_iot_shadow_delete() calls them with
+ * AWS_IOT_SHADOW_REQUEST_CANCELLED, for buffered fragments and merged updates still waiting for a response.
+ *
+ * @return ESP_OK when buffered, ESP_ERR_NO_MEM if AWS_IOT_SHADOW_COALESCE_MAX_WAITERS fragments are waiting
+ *         for the next merged update already (it is being published).
+ */
+esp_err_t aws_iot_shadow_request_update_coalesced_tracked(aws_iot_shadow_handle_ptr handle, const char *reported, size_t reported_len,
+                                                          const struct aws_iot_shadow_request_config *config);
+#endif
+#endif
+
 #ifdef __cplusplus
 }
 #endif
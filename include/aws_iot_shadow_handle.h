@@ -1,29 +1,182 @@
 #ifndef AWS_IOT_SHADOW_HANDLE_H
 #define AWS_IOT_SHADOW_HANDLE_H
 
+#include "aws_iot_shadow.h"
+#include "aws_iot_shadow_persistence.h"
 #include "aws_iot_shadow_topic.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+#include <freertos/semphr.h>
+#endif
+#if AWS_IOT_SHADOW_REQUEST_TRACKING || AWS_IOT_SHADOW_UPDATE_COALESCING || AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+#include <esp_timer.h>
+#endif
 #include <mqtt_client.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-struct topic_subscriptions;
+struct aws_iot_shadow_router;
+struct aws_iot_shadow_throttle;
+struct aws_iot_shadow_journal_entry;
+
+#if AWS_IOT_SHADOW_DIRECT_DISPATCH
+struct aws_iot_shadow_handler
+{
+    esp_event_handler_t fn; // NULL when unregistered during dispatch, until compacted
+    void *arg;
+    int32_t event_id;
+    uint32_t instance;
+};
+#endif
+
+#if AWS_IOT_SHADOW_KEY_HANDLERS
+struct aws_iot_shadow_key_handler
+{
+    aws_iot_shadow_key_handler_t fn; // NULL when unregistered during dispatch, until compacted
+    void *arg;
+    char *path; // copy, owned by the registration
+    uint8_t head_len; // of the first path segment, a top-level state key
+    int8_t event_id;
+};
+#endif
+
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+struct aws_iot_shadow_cached_document
+{
+    char *data; // NUL terminated, NULL when not known
+    size_t len;
+};
+#endif
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+struct aws_iot_shadow_pending_request
+{
+    char client_token[AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX]; // empty when the slot is free
+    enum aws_iot_shadow_event accepted_event; // rejected event follows it
+    int64_t sent_at;
+    int64_t deadline;
+    aws_iot_shadow_request_cb_t callback;
+    void *arg;
+};
+#endif
+
+#if AWS_IOT_SHADOW_UPDATE_COALESCING && AWS_IOT_SHADOW_REQUEST_TRACKING
+struct aws_iot_shadow_coalesce_waiter
+{
+    aws_iot_shadow_request_cb_t callback;
+    void *arg;
+};
+#endif
 
 struct aws_iot_shadow_handle
 {
     esp_mqtt_client_handle_t client;
+    struct aws_iot_shadow_router *router;
+    bool deleting; // set by aws_iot_shadow_delete(), read atomically, timer callbacks return right away
+#if AWS_IOT_SHADOW_DIRECT_DISPATCH
+    struct aws_iot_shadow_handler handlers[AWS_IOT_SHADOW_DIRECT_DISPATCH_MAX_HANDLERS];
+    uint8_t handler_count;
+    uint8_t dispatch_depth;
+    bool handlers_removed;
+    uint32_t handler_instance_seq;
+#else
     esp_event_loop_handle_t event_loop;
+#endif
+#if AWS_IOT_SHADOW_KEY_HANDLERS
+    // Guarded by dispatch lock
+    struct aws_iot_shadow_key_handler key_handlers[AWS_IOT_SHADOW_KEY_HANDLERS_MAX];
+    uint8_t key_handler_count;
+    uint8_t key_dispatch_depth;
+    bool key_handlers_removed;
+#endif
     EventGroupHandle_t event_group;
+    EventBits_t subscriptions; // response topics requested from the broker, guarded by router lock
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    // Registered handlers, updated atomically, so registration takes no lock
+    uint16_t handler_counts[AWS_IOT_SHADOW_EVENT_MAX];
+    uint16_t handler_any_count;
+    esp_timer_handle_t subscription_timer; // (un)subscribes on the esp_timer task
+#endif
     char topic_prefix[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
     uint8_t topic_prefix_len;
+    uint32_t topic_prefix_hash;
+#if AWS_IOT_SHADOW_TRACE
+    uint16_t trace_index;
+#endif
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+    // Guarded by dispatch lock
+    struct aws_iot_shadow_cached_document cached_reported;
+    struct aws_iot_shadow_cached_document cached_desired;
+    struct aws_iot_shadow_cache_stats cache_stats;
+#endif
+#if AWS_IOT_SHADOW_PERSISTENCE
+    // Guarded by dispatch lock
+    struct aws_iot_shadow_persistence persistence; // store is NULL until aws_iot_shadow_restore()
+    char snapshot_key[AWS_IOT_SHADOW_PERSISTENCE_KEY_LENGTH_MAX];
+    int64_t snapshot_version;
+    bool has_snapshot_version;
+    int64_t cached_version; // latest accepted, stored on /get/accepted and at delete
+    bool has_cached_version;
+    int64_t restored_version;
+    bool restore_pending; // restored state has not been confirmed by /get/accepted yet
+#endif
+#if AWS_IOT_SHADOW_VERSION_FILTER
+    // 0 when not known (versions start at 1)
+    int64_t delta_version;    // guarded by router lock, deltas are dropped before being queued
+    int64_t accepted_version; // guarded by dispatch lock, so responses still complete tracked requests
+    struct aws_iot_shadow_discard_stats delta_discards;    // guarded by router lock
+    struct aws_iot_shadow_discard_stats accepted_discards; // guarded by dispatch lock
+#endif
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    // Guarded by dispatch lock
+    struct aws_iot_shadow_pending_request pending_requests[AWS_IOT_SHADOW_REQUEST_MAX_PENDING];
+    uint8_t pending_count;
+    uint32_t client_token_salt;
+    uint32_t client_token_seq;
+    esp_timer_handle_t request_timer; // created on first request
+    int64_t request_timer_alarm;      // 0 when not armed
+    bool sync_pending;                // synchronous request in progress, read atomically, delete waits for it
+#endif
+#if AWS_IOT_SHADOW_UPDATE_COALESCING
+    // Guarded by dispatch lock
+    char *coalesce_doc;                // `{"state":{"reported":` and merged fragments, NULL when nothing is buffered
+    size_t coalesce_len;               // length of merged fragments
+    esp_timer_handle_t coalesce_timer; // created on first fragment, the only task publishing merged updates
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    struct aws_iot_shadow_coalesce_waiter coalesce_waiters[AWS_IOT_SHADOW_COALESCE_MAX_WAITERS];
+    uint8_t coalesce_waiter_count;
+    uint32_t coalesce_timeout_ms; // shortest one of waiters
+#endif
+#endif
+
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    struct aws_iot_shadow_throttle *throttle; // of the thing, set by the dispatcher
+#endif
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+    // Guarded by journal_mutex, which is never held while publishing
+    SemaphoreHandle_t journal_mutex;
+    bool journal_online; // set once the journal has been published after READY
+    struct aws_iot_shadow_journal_entry *journal_head; // a single merged one with the latest wins policy
+    struct aws_iot_shadow_journal_entry *journal_tail;
+    size_t journal_size;
+    struct aws_iot_shadow_journal_stats journal_stats;
+#endif
+
+#if AWS_IOT_SHADOW_STATS
+    // Updated with relaxed atomic operations, from any task
+    struct aws_iot_shadow_stats stats;
+    uint32_t stats_connected_at; // guarded by router lock
+#endif
 
     char thing_name[AWS_IOT_SHADOW_THINGNAME_LENGTH_MAX];
     char shadow_name[AWS_IOT_SHADOW_NAME_LENGTH_MAX];
 
-    struct topic_subscriptions *topic_subscriptions;
+    // Intrusive links of the shared MQTT dispatcher
+    struct aws_iot_shadow_handle *router_bucket_next;
+    struct aws_iot_shadow_handle *router_list_next;
 };
 
 #ifdef __cplusplus
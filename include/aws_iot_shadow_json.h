@@ -0,0 +1,401 @@
+#ifndef AWS_IOT_SHADOW_JSON_H
+#define AWS_IOT_SHADOW_JSON_H
+
+#include "aws_iot_shadow.h"
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Type of a JSON value.
+ */
+enum aws_iot_shadow_json_type
+{
+    /** @brief Missing or malformed value */
+    AWS_IOT_SHADOW_JSON_TYPE_INVALID = 0,
+    AWS_IOT_SHADOW_JSON_TYPE_NULL,
+    AWS_IOT_SHADOW_JSON_TYPE_BOOL,
+    AWS_IOT_SHADOW_JSON_TYPE_NUMBER,
+    AWS_IOT_SHADOW_JSON_TYPE_STRING,
+    AWS_IOT_SHADOW_JSON_TYPE_OBJECT,
+    AWS_IOT_SHADOW_JSON_TYPE_ARRAY,
+};
+
+/**
+ * @brief Reference to a JSON value inside of a source buffer.
+ *
+ * Nothing is copied or decoded. For strings, data points past the opening quote and len excludes quotes,
+ * escape sequences are kept as they are. For objects and arrays, data and len span the whole value,
+ * including brackets, so it can be used as a JSON document on its own (e.g. published as-is).
+ */
+struct aws_iot_shadow_json_value
+{
+    enum aws_iot_shadow_json_type type;
+    const char *data;
+    size_t len;
+};
+
+/**
+ * @brief Iterator over members of an object, or elements of an array.
+ */
+struct aws_iot_shadow_json_iter
+{
+    /** @brief Current position, NULL once malformed input was found */
+    const char *pos;
+    const char *end;
+    bool object;
+    bool first;
+};
+
+/**
+ * @brief Values of interest of a shadow document, as received in shadow events.
+ *
+ * Missing members have type AWS_IOT_SHADOW_JSON_TYPE_INVALID.
+ */
+struct aws_iot_shadow_json_document
+{
+    /** @brief `state` object */
+    struct aws_iot_shadow_json_value state;
+    /** @brief `state.desired` object */
+    struct aws_iot_shadow_json_value desired;
+    /** @brief `state.reported` object */
+    struct aws_iot_shadow_json_value reported;
+    /** @brief `state.delta` object, or `state` itself for AWS_IOT_SHADOW_EVENT_UPDATE_DELTA */
+    struct aws_iot_shadow_json_value delta;
+    /** @brief `clientToken` string */
+    struct aws_iot_shadow_json_value client_token;
+    /** @brief `version`, valid only if has_version is set */
+    int64_t version;
+    bool has_version;
+};
+
+#define AWS_IOT_SHADOW_JSON_CHANGES_MAX (8U)
+
+/**
+ * @brief Top level members which differ between two versions of an object.
+ */
+struct aws_iot_shadow_json_changes
+{
+    /** @brief Keys of changed, added and removed members (string values), first AWS_IOT_SHADOW_JSON_CHANGES_MAX of them */
+    struct aws_iot_shadow_json_value keys[AWS_IOT_SHADOW_JSON_CHANGES_MAX];
+    /** @brief Number of changed members, can be more than keys holds */
+    uint8_t count;
+};
+
+/**
+ * @brief Both versions of a shadow document of an /update/documents message, with a summary of what has changed.
+ */
+struct aws_iot_shadow_json_documents
+{
+    /** @brief `previous` document, all members are invalid if there was none */
+    struct aws_iot_shadow_json_document previous;
+    /** @brief `current` document */
+    struct aws_iot_shadow_json_document current;
+    /** @brief Members of `state.desired` */
+    struct aws_iot_shadow_json_changes desired;
+    /** @brief Members of `state.reported` */
+    struct aws_iot_shadow_json_changes reported;
+};
+
+/**
+ * @brief Parses a single JSON value, without decoding it.
+ *
+ * Objects and arrays are only scanned for their end, their content is validated lazily, during iteration.
+ * Input does not need to be NUL terminated, nothing past data_len is read.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_INVALID_RESPONSE for malformed input.
+ */
+esp_err_t aws_iot_shadow_json_parse(const char *data, size_t data_len, struct aws_iot_shadow_json_value *value);
+
+/**
+ * @brief Starts iteration over an object or an array.
+ */
+esp_err_t aws_iot_shadow_json_iter_init(struct aws_iot_shadow_json_iter *iter, const struct aws_iot_shadow_json_value *container);
+
+/**
+ * @brief Moves to next member of an object, or element of an array.
+ *
+ * @param key Receives key of object member (as a string value), can be NULL. Not set for arrays.
+ * @param value Receives the value, can be NULL.
+ * @return true if there was a next member, false at the end or on malformed input.
+ */
+bool aws_iot_shadow_json_iter_next(struct aws_iot_shadow_json_iter *iter, struct aws_iot_shadow_json_value *key,
+                                   struct aws_iot_shadow_json_value *value);
+
+/**
+ * @brief Finds an object member by key.
+ *
+ * @return ESP_OK or ESP_ERR_NOT_FOUND.
+ */
+esp_err_t aws_iot_shadow_json_object_get(const struct aws_iot_shadow_json_value *object, const char *key,
+                                         struct aws_iot_shadow_json_value *value);
+
+/**
+ * @brief Finds a value by a dot separated path of object keys, e.g. `state.desired.led`.
+ *
+ * @return ESP_OK or ESP_ERR_NOT_FOUND.
+ */
+esp_err_t aws_iot_shadow_json_find(const struct aws_iot_shadow_json_value *root, const char *path,
+                                   struct aws_iot_shadow_json_value *value);
+
+/**
+ * @brief Extracts shadow state, version and clientToken from a shadow document, in a single pass.
+ *
+ * Does not allocate, all values reference data buffer.
+ */
+esp_err_t aws_iot_shadow_json_parse_document(const char *data, size_t data_len, struct aws_iot_shadow_json_document *doc);
+
+/**
+ * @brief Finds top level `version` of a shadow document, without parsing it.
+ *
+ * Document is scanned backwards from its end, AWS IoT puts `version` after `state` and `metadata`,
+ * so usually only a few trailing members are touched. Content is not validated.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND, or ESP_ERR_INVALID_RESPONSE if the document or version is malformed.
+ */
+esp_err_t aws_iot_shadow_json_peek_version(const char *data, size_t data_len, int64_t *version);
+
+/**
+ * @brief Parses both documents of an /update/documents message, and compares top level members of their
+ * desired and reported state.
+ *
+ * Members are compared as aws_iot_shadow_json_diff() does, without writing anything. When both documents
+ * have members in the same order, as AWS IoT sends them, it is a single pass over each.
+ *
+ * @return ESP_OK, or ESP_ERR_INVALID_RESPONSE if the message is malformed or has no `current` document.
+ */
+esp_err_t aws_iot_shadow_json_parse_documents(const char *data, size_t data_len, struct aws_iot_shadow_json_documents *docs);
+
+/**
+ * @brief Same as aws_iot_shadow_json_parse_document(), with event specifics (e.g. delta) resolved.
+ *
+ * For AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS, the `current` document is parsed.
+ */
+esp_err_t aws_iot_shadow_json_parse_event(const struct aws_iot_shadow_event_data *event, struct aws_iot_shadow_json_document *doc);
+
+/**
+ * @brief Compares string value with a NUL terminated string, escape sequences are decoded.
+ */
+bool aws_iot_shadow_json_string_equals(const struct aws_iot_shadow_json_value *value, const char *str);
+
+/**
+ * @brief Decodes string value into a NUL terminated string.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if buf is too small, or ESP_ERR_INVALID_ARG if value is not a string.
+ */
+esp_err_t aws_iot_shadow_json_string_copy(const struct aws_iot_shadow_json_value *value, char *buf, size_t buf_len);
+
+esp_err_t aws_iot_shadow_json_get_bool(const struct aws_iot_shadow_json_value *value, bool *out);
+
+/**
+ * @brief Converts integer number value. Fails for fractions and out of range numbers.
+ */
+esp_err_t aws_iot_shadow_json_get_int64(const struct aws_iot_shadow_json_value *value, int64_t *out);
+
+esp_err_t aws_iot_shadow_json_get_double(const struct aws_iot_shadow_json_value *value, double *out);
+
+/**
+ * @brief Applies JSON merge patch (RFC 7386) to target, result is written to buf.
+ *
+ * Objects are merged recursively, patch members replace those of target, and null removes a member.
+ * If target is NULL or not an object, patch is applied to an empty object.
+ *
+ * @param written Receives length of the result, buf is NUL terminated. Can be NULL.
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if buf is too small, or ESP_ERR_INVALID_RESPONSE for malformed input.
+ */
+esp_err_t aws_iot_shadow_json_merge_patch(const struct aws_iot_shadow_json_value *target, const struct aws_iot_shadow_json_value *patch,
+                                          char *buf, size_t buf_len, size_t *written);
+
+/**
+ * @brief Merges two updates into one, same as aws_iot_shadow_json_merge_patch(), except null members are kept.
+ *
+ * Result has the same effect as publishing target and then patch: patch members win, and members
+ * removed (null) by either of them are still removed.
+ */
+esp_err_t aws_iot_shadow_json_merge_update(const struct aws_iot_shadow_json_value *target, const struct aws_iot_shadow_json_value *patch,
+                                           char *buf, size_t buf_len, size_t *written);
+
+/**
+ * @brief Computes JSON merge patch, which turns prev into next (inverse of aws_iot_shadow_json_merge_patch()).
+ *
+ * Only changed members are written, nested objects are compared recursively, and members missing in next
+ * are written as null. Result is `{}` if nothing has changed. If prev is NULL or not an object,
+ * result is next as it is.
+ *
+ * @param written Receives length of the result, buf is NUL terminated. Can be NULL.
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if next is not an object, ESP_ERR_INVALID_SIZE if buf is too small,
+ *         or ESP_ERR_INVALID_RESPONSE for malformed input.
+ */
+esp_err_t aws_iot_shadow_json_diff(const struct aws_iot_shadow_json_value *prev, const struct aws_iot_shadow_json_value *next,
+                                   char *buf, size_t buf_len, size_t *written);
+
+/**
+ * @brief Type of a member of a C struct, described by a schema field.
+ */
+enum aws_iot_shadow_json_field_type
+{
+    /** @brief bool */
+    AWS_IOT_SHADOW_JSON_FIELD_BOOL = 0,
+    /** @brief int32_t */
+    AWS_IOT_SHADOW_JSON_FIELD_INT32,
+    /** @brief uint32_t */
+    AWS_IOT_SHADOW_JSON_FIELD_UINT32,
+    /** @brief int64_t */
+    AWS_IOT_SHADOW_JSON_FIELD_INT64,
+    /** @brief float, non-finite values are written as null */
+    AWS_IOT_SHADOW_JSON_FIELD_FLOAT,
+    /** @brief double, non-finite values are written as null */
+    AWS_IOT_SHADOW_JSON_FIELD_DOUBLE,
+    /** @brief NUL terminated char array, escaped as needed */
+    AWS_IOT_SHADOW_JSON_FIELD_STRING,
+};
+
+/**
+ * @brief Member of a C struct written as a member of reported state, see AWS_IOT_SHADOW_JSON_FIELD().
+ */
+struct aws_iot_shadow_json_field
+{
+    /** @brief Key in reported state, nested objects separated by dots (e.g. "led.color"), written without escaping */
+    const char *path;
+    enum aws_iot_shadow_json_field_type type;
+    /** @brief offsetof() of the member */
+    uint16_t offset;
+    /** @brief sizeof() of the member, length limit of strings */
+    uint16_t size;
+};
+
+/**
+ * @brief Schema field of a struct member, e.g. `AWS_IOT_SHADOW_JSON_FIELD(struct state, led_on, BOOL, "led.on")`.
+ */
+#define AWS_IOT_SHADOW_JSON_FIELD(struct_type, member, field_type, field_path) \
+    {                                                                          \
+        .path = (field_path),                                                  \
+        .type = AWS_IOT_SHADOW_JSON_FIELD_##field_type,                        \
+        .offset = offsetof(struct_type, member),                               \
+        .size = sizeof(((struct_type *)0)->member),                            \
+    }
+
+/**
+ * @brief Writes an update `{"state":{"reported":{...}}}` of fields of state straight into buf.
+ *
+ * Fields are written in schema order, fields of the same nested object must be next to each other.
+ * If prev is given (e.g. copy of state as last published), only fields which differ from it are written,
+ * floating point values are compared bitwise, strings up to their NUL.
+ *
+ * @param state Struct described by fields.
+ * @param prev Struct of the same type, or NULL to write all fields.
+ * @param written Receives length of the update, buf is NUL terminated. Can be NULL.
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if no field differs from prev, ESP_ERR_INVALID_SIZE if buf is too small,
+ *         or ESP_ERR_INVALID_ARG if a field does not match its type.
+ */
+esp_err_t aws_iot_shadow_json_write_reported(const struct aws_iot_shadow_json_field *fields, size_t field_count,
+                                             const void *state, const void *prev, char *buf, size_t buf_len, size_t *written);
+
+#define AWS_IOT_SHADOW_JSON_SCHEMA_FIELDS_MAX (32U)
+#define AWS_IOT_SHADOW_JSON_SCHEMA_SLOTS (128U)
+
+/**
+ * @brief Fields with a perfect hash of their paths, for aws_iot_shadow_json_apply().
+ */
+struct aws_iot_shadow_json_schema
+{
+    const struct aws_iot_shadow_json_field *fields;
+    size_t field_count;
+    /** @brief Seed of the hash, which maps all paths to distinct slots */
+    uint32_t seed;
+    /** @brief Number of slots used, minus 1 */
+    uint8_t mask;
+    /** @brief Field index + 1 by slot, 0 for an empty one */
+    uint8_t slots[AWS_IOT_SHADOW_JSON_SCHEMA_SLOTS];
+};
+
+/**
+ * @brief Searches for a perfect hash of field paths, once, e.g. at boot. Fields are referenced, not copied.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if there are more than AWS_IOT_SHADOW_JSON_SCHEMA_FIELDS_MAX fields,
+ *         or ESP_ERR_INVALID_ARG if a field does not match its type, or paths are not unique.
+ */
+esp_err_t aws_iot_shadow_json_schema_init(struct aws_iot_shadow_json_schema *schema, const struct aws_iot_shadow_json_field *fields,
+                                          size_t field_count);
+
+/**
+ * @brief Called for each field whose value has changed, after it has been stored.
+ */
+typedef void (*aws_iot_shadow_json_field_changed_t)(void *arg, const struct aws_iot_shadow_json_field *field);
+
+/**
+ * @brief Stores members of object (e.g. `doc.delta` or `doc.desired`) matching schema fields into state, walking it once.
+ *
+ * Members are looked up by path, nested objects included, with a single hash each. Values which can't be
+ * converted to the type of their field (e.g. out of range, or too long strings) are skipped, members without
+ * a field are ignored.
+ *
+ * @param changed Called for fields which have changed, can be NULL.
+ * @param ack Receives `{"state":{"reported":{...}}}` of all fields stored, to be published as acknowledgement,
+ *            empty if none has been. Can be NULL.
+ * @param ack_written Receives length of ack, can be NULL.
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if ack is too small, or ESP_ERR_INVALID_RESPONSE for malformed input,
+ *         fields found until then are stored and acknowledged.
+ */
+esp_err_t aws_iot_shadow_json_apply(const struct aws_iot_shadow_json_schema *schema, const struct aws_iot_shadow_json_value *object,
+                                    void *state, aws_iot_shadow_json_field_changed_t changed, void *changed_arg,
+                                    char *ack, size_t ack_len, size_t *ack_written);
+
+#define AWS_IOT_SHADOW_JSON_TEMPLATE_SLOTS_MAX (16U)
+#define AWS_IOT_SHADOW_JSON_TEMPLATE_WIDTH_MAX (24U)
+
+/**
+ * @brief Pre-serialized document of a fixed shape, with numbers patched in place, see aws_iot_shadow_json_template_init().
+ */
+struct aws_iot_shadow_json_template
+{
+    /** @brief Document, NUL terminated, always valid JSON */
+    char *buf;
+    /** @brief Length of the document, it never changes */
+    size_t len;
+    struct
+    {
+        uint16_t offset;
+        uint8_t width;
+    } slots[AWS_IOT_SHADOW_JSON_TEMPLATE_SLOTS_MAX];
+    uint8_t slot_count;
+};
+
+/**
+ * @brief Compiles a skeleton into buf, once. It is JSON, where each `%<width>` (e.g. `%12`) outside of strings
+ * reserves a numeric slot of that width, numbered in order from 0.
+ *
+ * Slots are right aligned, padded with spaces, which JSON allows between tokens, so the document keeps its
+ * length and is valid at any time, e.g. to be published with aws_iot_shadow_request_update(handle, tpl.buf, tpl.len).
+ * Slots are 0 initially.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if buf is too small or there are more than AWS_IOT_SHADOW_JSON_TEMPLATE_SLOTS_MAX
+ *         slots, or ESP_ERR_INVALID_ARG if a width is not 1 - AWS_IOT_SHADOW_JSON_TEMPLATE_WIDTH_MAX.
+ */
+esp_err_t aws_iot_shadow_json_template_init(struct aws_iot_shadow_json_template *tpl, const char *skeleton, char *buf, size_t buf_len);
+
+/**
+ * @brief Writes an integer into a slot.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for an unknown slot, or ESP_ERR_INVALID_SIZE if it does not fit, slot is kept then.
+ */
+esp_err_t aws_iot_shadow_json_template_set_int(struct aws_iot_shadow_json_template *tpl, uint8_t slot, int64_t value);
+
+/**
+ * @brief Writes a number with fixed decimals (0 - 9) into a slot, rounded, non-finite values as null.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for an unknown slot, or ESP_ERR_INVALID_SIZE if it does not fit, slot is kept then.
+ */
+esp_err_t aws_iot_shadow_json_template_set_double(struct aws_iot_shadow_json_template *tpl, uint8_t slot, double value,
+                                                  uint8_t decimals);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
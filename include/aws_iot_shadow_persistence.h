@@ -0,0 +1,79 @@
+#ifndef AWS_IOT_SHADOW_PERSISTENCE_H
+#define AWS_IOT_SHADOW_PERSISTENCE_H
+
+#include "aws_iot_shadow.h"
+#include <esp_err.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Maximum length of a snapshot key, including terminating NUL (fits NVS keys).
+ */
+#define AWS_IOT_SHADOW_PERSISTENCE_KEY_LENGTH_MAX (16)
+
+/**
+ * @brief Storage of shadow snapshots, a blob per shadow.
+ *
+ * Functions are called under dispatch lock, from the MQTT task (or the worker with AWS_IOT_SHADOW_ASYNC_DISPATCH),
+ * and from aws_iot_shadow_restore().
+ */
+struct aws_iot_shadow_persistence
+{
+    /**
+     * @brief Reads a blob into buf.
+     *
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if there is none, or ESP_ERR_INVALID_SIZE if buf is too small.
+     */
+    esp_err_t (*load)(void *ctx, const char *key, void *buf, size_t buf_len, size_t *len);
+    /**
+     * @brief Replaces a blob.
+     */
+    esp_err_t (*store)(void *ctx, const char *key, const void *data, size_t len);
+    void *ctx;
+};
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+/**
+ * @brief Backend storing snapshots as files `<dir>/<key>`, e.g. on SPIFFS, LittleFS, or Linux.
+ *
+ * @param dir Existing directory, referenced (not copied), it must stay valid while used.
+ */
+esp_err_t aws_iot_shadow_persistence_file_init(const char *dir, struct aws_iot_shadow_persistence *persistence);
+
+#ifdef ESP_PLATFORM
+/**
+ * @brief Backend storing snapshots as NVS blobs. NVS must be already initialized (nvs_flash_init()).
+ *
+ * @param nvs_namespace NVS namespace, referenced (not copied), it must stay valid while used.
+ */
+esp_err_t aws_iot_shadow_persistence_nvs_init(const char *nvs_namespace, struct aws_iot_shadow_persistence *persistence);
+#endif
+
+/**
+ * @brief Sets the persistence backend of the shadow, and dispatches its stored state.
+ *
+ * Stored state is dispatched as AWS_IOT_SHADOW_EVENT_GET_ACCEPTED, in format of /get/accepted
+ * (`{"state":{"desired":{...},"reported":{...}},"version":N}`, without metadata). It is not dispatched,
+ * if state has been already received from the server. Call it after handlers have been registered,
+ * usually before the MQTT client is started, handlers then run before it returns. Later, they run on the MQTT task
+ * (or the worker with AWS_IOT_SHADOW_ASYNC_DISPATCH), as esp-mqtt holds its lock while it delivers events.
+ * With synchronous dispatch and esp-mqtt older than ESP-IDF 5.1, handlers that publish require the former.
+ *
+ * /get is still requested once the shadow is ready. If its version matches the restored one, it is not
+ * dispatched, otherwise it is dispatched as usual. Until then, aws_iot_shadow_request_update_reported()
+ * publishes whole reported state, since the stored state might be outdated.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if there is no stored state (the backend is still set),
+ *         or ESP_ERR_INVALID_RESPONSE if stored state is corrupted.
+ */
+esp_err_t aws_iot_shadow_restore(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_persistence *persistence);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
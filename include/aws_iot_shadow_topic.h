@@ -21,6 +21,15 @@
  */
 #define AWS_IOT_SHADOW_THING_NAME_PREFIX ":thing/"
 
+#define AWS_IOT_SHADOW_TOPIC_THINGS "$aws/things/"
+#define AWS_IOT_SHADOW_TOPIC_THINGS_LENGTH (12U)
+
+#define AWS_IOT_SHADOW_TOPIC_SHADOW "/shadow"
+#define AWS_IOT_SHADOW_TOPIC_SHADOW_LENGTH (7U)
+
+#define AWS_IOT_SHADOW_TOPIC_NAME "/name/"
+#define AWS_IOT_SHADOW_TOPIC_NAME_LENGTH (6U)
+
 #define AWS_IOT_SHADOW_PREFIX_CLASSIC_FORMAT "$aws/things/%s/shadow"
 #define AWS_IOT_SHADOW_PREFIX_NAMED_FORMAT "$aws/things/%s/shadow/name/%s"
 
@@ -45,4 +54,11 @@
 #define AWS_IOT_SHADOW_SUFFIX_DELTA "/delta"
 #define AWS_IOT_SHADOW_SUFFIX_DELTA_LENGTH (6U)
 
+/**
+ * @brief Matches all `<op>/<suffix>` response topics of a shadow, e.g. /get/accepted or /update/delta.
+ *
+ * Unlike `/#`, it does not match request topics (/get, /update), therefore own requests are not echoed back.
+ */
+#define AWS_IOT_SHADOW_SUFFIX_WILDCARD "/+/+"
+
 #endif
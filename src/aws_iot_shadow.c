@@ -1,7 +1,20 @@
 #include "aws_iot_shadow.h"
+#include "aws_iot_shadow_async.h"
+#include "aws_iot_shadow_cache.h"
+#include "aws_iot_shadow_coalesce.h"
 #include "aws_iot_shadow_handle.h"
+#include "aws_iot_shadow_journal.h"
+#include "aws_iot_shadow_json.h"
+#include "aws_iot_shadow_request.h"
+#include "aws_iot_shadow_router.h"
+#include "aws_iot_shadow_stats.h"
+#include "aws_iot_shadow_throttle.h"
+#include "aws_iot_shadow_trace.h"
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <inttypes.h>
 #include <string.h>
 
 static const char TAG[] = "aws_iot_shadow";
@@ -19,6 +32,16 @@ ESP_EVENT_DEFINE_BASE(AWS_IOT_SHADOW_EVENT);
     }
 
 static const int CONNECTED_BIT = BIT0;
+#if AWS_IOT_SHADOW_SESSION_RESUME
+static const int SESSION_SUBSCRIBED_BIT = BIT1; // kept while disconnected, broker session has the subscriptions
+#endif
+static const int READY_BIT = BIT2; // subscriptions requested on connect have been acknowledged
+// BIT3 and BIT4 are used by synchronous requests, see aws_iot_shadow_request.c
+#if AWS_IOT_SHADOW_WILDCARD_SUBSCRIPTION
+static const int SUBSCRIBED_WILDCARD_BIT = BIT19;
+
+static const int SUBSCRIBED_ALL_BITS = SUBSCRIBED_WILDCARD_BIT;
+#else
 static const int SUBSCRIBED_GET_ACCEPTED_BIT = BIT12;
 static const int SUBSCRIBED_GET_REJECTED_BIT = BIT13;
 static const int SUBSCRIBED_UPDATE_ACCEPTED_BIT = BIT14;
@@ -35,23 +58,53 @@ static const int SUBSCRIBED_DELETE_REJECTED_BIT = BIT18;
 static const int SUBSCRIBED_DELETE_ACCEPTED_BIT = 0; // no bit, used in SUBSCRIBED_ALL_BITS
 static const int SUBSCRIBED_DELETE_REJECTED_BIT = 0; // no bit, used in SUBSCRIBED_ALL_BITS
 #endif
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+static const int SUBSCRIBED_UPDATE_DOCUMENTS_BIT = BIT20;
+#else
+static const int SUBSCRIBED_UPDATE_DOCUMENTS_BIT = 0; // no bit, used in SUBSCRIBED_ALL_BITS
+#endif
 
 static const int SUBSCRIBED_ALL_BITS =
-    SUBSCRIBED_GET_ACCEPTED_BIT | SUBSCRIBED_GET_REJECTED_BIT | SUBSCRIBED_UPDATE_ACCEPTED_BIT | SUBSCRIBED_UPDATE_REJECTED_BIT | SUBSCRIBED_UPDATE_DELTA_BIT | SUBSCRIBED_DELETE_ACCEPTED_BIT | SUBSCRIBED_DELETE_REJECTED_BIT;
+    SUBSCRIBED_GET_ACCEPTED_BIT | SUBSCRIBED_GET_REJECTED_BIT | SUBSCRIBED_UPDATE_ACCEPTED_BIT | SUBSCRIBED_UPDATE_REJECTED_BIT | SUBSCRIBED_UPDATE_DELTA_BIT | SUBSCRIBED_DELETE_ACCEPTED_BIT | SUBSCRIBED_DELETE_REJECTED_BIT | SUBSCRIBED_UPDATE_DOCUMENTS_BIT;
+#endif
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+// Responses the library consumes itself, subscribed even without handlers
+static const int SUBSCRIBED_INTERNAL_BITS = 0
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    | SUBSCRIBED_GET_ACCEPTED_BIT | SUBSCRIBED_GET_REJECTED_BIT | SUBSCRIBED_UPDATE_ACCEPTED_BIT | SUBSCRIBED_UPDATE_REJECTED_BIT | SUBSCRIBED_DELETE_ACCEPTED_BIT | SUBSCRIBED_DELETE_REJECTED_BIT
+#endif
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+    | SUBSCRIBED_GET_ACCEPTED_BIT | SUBSCRIBED_UPDATE_ACCEPTED_BIT | SUBSCRIBED_DELETE_ACCEPTED_BIT
+#endif
+    ;
+#endif
 
-// For MQTT_EVENT_SUBSCRIBED tracking
-struct topic_subscriptions
+struct aws_iot_shadow_response_topic
 {
-    int get_accepted_msg_id;
-    int get_rejected_msg_id;
-    int update_accepted_msg_id;
-    int update_rejected_msg_id;
+    const char *suffix;
+    EventBits_t bit;
+};
+
+static const struct aws_iot_shadow_response_topic RESPONSE_TOPICS[] = {
+#if AWS_IOT_SHADOW_WILDCARD_SUBSCRIPTION
+    // Single subscription for all responses, routed by their topic suffix in aws_iot_shadow_mqtt_data
+    {AWS_IOT_SHADOW_SUFFIX_WILDCARD, SUBSCRIBED_WILDCARD_BIT},
+#else
+    {AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_ACCEPTED, SUBSCRIBED_GET_ACCEPTED_BIT},
+    {AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_REJECTED, SUBSCRIBED_GET_REJECTED_BIT},
+    {AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_ACCEPTED, SUBSCRIBED_UPDATE_ACCEPTED_BIT},
+    {AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_REJECTED, SUBSCRIBED_UPDATE_REJECTED_BIT},
 #if AWS_IOT_SHADOW_SUPPORT_DELTA
-    int update_delta_msg_id;
+    {AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA, SUBSCRIBED_UPDATE_DELTA_BIT},
+#endif
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    {AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DOCUMENT, SUBSCRIBED_UPDATE_DOCUMENTS_BIT},
 #endif
 #if AWS_IOT_SHADOW_SUPPORT_DELETE
-    int delete_accepted_msg_id;
-    int delete_rejected_msg_id;
+    {AWS_IOT_SHADOW_OP_DELETE AWS_IOT_SHADOW_SUFFIX_ACCEPTED, SUBSCRIBED_DELETE_ACCEPTED_BIT},
+    {AWS_IOT_SHADOW_OP_DELETE AWS_IOT_SHADOW_SUFFIX_REJECTED, SUBSCRIBED_DELETE_REJECTED_BIT},
+#endif
 #endif
 };
 
@@ -78,19 +131,168 @@ inline static char *aws_iot_shadow_topic_name(aws_iot_shadow_handle_ptr handle,
     return topic_buf;
 }
 
-static void aws_iot_shadow_event_dispatch(aws_iot_shadow_handle_ptr handle,
-                                          enum aws_iot_shadow_event event_id,
-                                          esp_mqtt_event_handle_t mqtt_event)
+#if AWS_IOT_SHADOW_DIRECT_DISPATCH
+static void aws_iot_shadow_handlers_compact(aws_iot_shadow_handle_ptr handle)
+{
+    // Keeps registration order
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < handle->handler_count; i++)
+    {
+        if (handle->handlers[i].fn != NULL)
+        {
+            handle->handlers[count++] = handle->handlers[i];
+        }
+    }
+    handle->handler_count = count;
+    handle->handlers_removed = false;
+}
+#endif
+
+#if AWS_IOT_SHADOW_KEY_HANDLERS
+static void aws_iot_shadow_key_handlers_compact(aws_iot_shadow_handle_ptr handle)
+{
+    // Keeps registration order
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < handle->key_handler_count; i++)
+    {
+        if (handle->key_handlers[i].fn != NULL)
+        {
+            handle->key_handlers[count++] = handle->key_handlers[i];
+        }
+        else
+        {
+            free(handle->key_handlers[i].path);
+        }
+    }
+    handle->key_handler_count = count;
+    handle->key_handlers_removed = false;
+}
+
+static void aws_iot_shadow_key_handlers_free(aws_iot_shadow_handle_ptr handle)
+{
+    for (uint8_t i = 0; i < handle->key_handler_count; i++)
+    {
+        free(handle->key_handlers[i].path);
+    }
+    handle->key_handler_count = 0;
+}
+
+/**
+ * @brief Calls handlers of state key paths present in the message, scanning its top-level state members once.
+ */
+static void aws_iot_shadow_key_handlers_run(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_event_data *event)
+{
+    // Most events have no key handlers, nothing is parsed then
+    bool handled = false;
+    for (uint8_t i = 0; i < handle->key_handler_count && !handled; i++)
+    {
+        handled = handle->key_handlers[i].fn != NULL && handle->key_handlers[i].event_id == event->event_id;
+    }
+    if (!handled)
+    {
+        return;
+    }
+
+    struct aws_iot_shadow_json_document doc;
+    if (aws_iot_shadow_json_parse_event(event, &doc) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "%s malformed document of event %d", handle->topic_prefix, event->event_id);
+        return;
+    }
+
+    // State is missing e.g. in /update/accepted of a clientToken only update
+    struct aws_iot_shadow_json_iter iter;
+    if (doc.state.type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT || aws_iot_shadow_json_iter_init(&iter, &doc.state) != ESP_OK)
+    {
+        return;
+    }
+
+    // Handlers may (un)register during dispatch, removed entries are only cleared until the outermost dispatch ends
+    handle->key_dispatch_depth++;
+
+    struct aws_iot_shadow_json_value key, member;
+    while (aws_iot_shadow_json_iter_next(&iter, &key, &member))
+    {
+        for (uint8_t i = 0; i < handle->key_handler_count; i++)
+        {
+            // Keys are compared as they are, a path segment has no escape sequences
+            const struct aws_iot_shadow_key_handler *handler = &handle->key_handlers[i];
+            if (handler->fn == NULL || handler->event_id != event->event_id || handler->head_len != key.len
+                || memcmp(handler->path, key.data, key.len) != 0)
+            {
+                continue;
+            }
+
+            struct aws_iot_shadow_json_value value = member;
+            const char *rest = handler->path + handler->head_len;
+            if (*rest == '.' && aws_iot_shadow_json_find(&member, rest + 1, &value) != ESP_OK)
+            {
+                continue;
+            }
+            handler->fn(handler->arg, event, &value);
+        }
+    }
+
+    if (--handle->key_dispatch_depth == 0 && handle->key_handlers_removed)
+    {
+        aws_iot_shadow_key_handlers_compact(handle);
+    }
+}
+#endif
+
+static void aws_iot_shadow_event_handlers_run(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                              const char *data, size_t data_len)
 {
     // Prepare event
     struct aws_iot_shadow_event_data shadow_event = AWS_IOT_SHADOW_EVENT_DATA_INITIALIZER(handle, event_id);
+    shadow_event.data = data;
+    shadow_event.data_len = data_len;
 
-    if (mqtt_event)
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    // Parsed once for all handlers, they run before this returns in every dispatch mode
+    struct aws_iot_shadow_json_documents documents;
+    if (event_id == AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS)
     {
-        shadow_event.data = mqtt_event->data;
-        shadow_event.data_len = mqtt_event->data_len;
+        if (aws_iot_shadow_json_parse_documents(data, data_len, &documents) == ESP_OK)
+        {
+            shadow_event.documents = &documents;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "%s malformed update documents", handle->topic_prefix);
+        }
+    }
+#endif
+
+#if AWS_IOT_SHADOW_DIRECT_DISPATCH
+    // Called under dispatch lock, same as registration. Handlers may (un)register during dispatch,
+    // removed entries are only cleared, so indexes stay valid until the outermost dispatch ends.
+    ESP_LOGD(TAG, "dispatching event %d for %s", shadow_event.event_id, handle->topic_prefix);
+    handle->dispatch_depth++;
+
+    // Same order as esp_event, handlers of any event first
+    for (uint8_t i = 0; i < handle->handler_count; i++)
+    {
+        const struct aws_iot_shadow_handler *handler = &handle->handlers[i];
+        if (handler->fn != NULL && handler->event_id == AWS_IOT_SHADOW_EVENT_ANY)
+        {
+            handler->fn(handler->arg, AWS_IOT_SHADOW_EVENT, event_id, &shadow_event);
+        }
+    }
+    for (uint8_t i = 0; i < handle->handler_count; i++)
+    {
+        const struct aws_iot_shadow_handler *handler = &handle->handlers[i];
+        if (handler->fn != NULL && handler->event_id == event_id)
+        {
+            handler->fn(handler->arg, AWS_IOT_SHADOW_EVENT, event_id, &shadow_event);
+        }
     }
 
+    if (--handle->dispatch_depth == 0 && handle->handlers_removed)
+    {
+        aws_iot_shadow_handlers_compact(handle);
+    }
+#else
     // Add to queue
     ESP_LOGD(TAG, "dispatching event %d for %s", shadow_event.event_id, handle->topic_prefix);
     esp_err_t err = esp_event_post_to(handle->event_loop, AWS_IOT_SHADOW_EVENT, shadow_event.event_id, &shadow_event, sizeof(shadow_event), portMAX_DELAY);
@@ -107,96 +309,354 @@ static void aws_iot_shadow_event_dispatch(aws_iot_shadow_handle_ptr handle,
         ESP_LOGE(TAG, "failed to dispatch event %d: %d (%s)", shadow_event.event_id, err, esp_err_to_name(err));
         return;
     }
+#endif
+
+#if AWS_IOT_SHADOW_KEY_HANDLERS
+    aws_iot_shadow_key_handlers_run(handle, &shadow_event);
+#endif
 }
 
-static void aws_iot_shadow_mqtt_connected(aws_iot_shadow_handle_ptr handle)
+#if AWS_IOT_SHADOW_VERSION_FILTER
+/**
+ * @brief Compares message version with the last one seen, counts it if it is not newer.
+ *
+ * @return false if the message must be dropped.
+ */
+static bool aws_iot_shadow_version_check(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                         const char *data, size_t data_len, int64_t *last,
+                                         struct aws_iot_shadow_discard_stats *stats)
 {
-    // Reset tracking
-    xEventGroupClearBits(handle->event_group, SUBSCRIBED_ALL_BITS);
-    memset(handle->topic_subscriptions, 0, sizeof(*handle->topic_subscriptions));
+    int64_t version = 0;
+    if (aws_iot_shadow_json_peek_version(data, data_len, &version) != ESP_OK || version > *last)
+    {
+        *last = version > *last ? version : *last;
+        return true;
+    }
+    if (version == 1)
+    {
+        // Shadow has been deleted and created again, /delete/accepted was not seen
+        ESP_LOGD(TAG, "%s event %d version 1, last seen %lld, shadow recreated", handle->topic_prefix, event_id,
+                 (long long)*last);
+        *last = version;
+        return true;
+    }
 
-    // Subscribe
-    char topic_name[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH] = {};
+    if (version == *last)
+    {
+        stats->duplicate++;
+    }
+    else
+    {
+        stats->stale++;
+    }
+    ESP_LOGD(TAG, "%s event %d version %lld dropped, last seen %lld", handle->topic_prefix, event_id,
+             (long long)version, (long long)*last);
+    return false;
+}
 
-    handle->topic_subscriptions->get_accepted_msg_id = esp_mqtt_client_subscribe(handle->client, aws_iot_shadow_topic_name(handle, (AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_ACCEPTED), topic_name, sizeof(topic_name)), 0);
-    handle->topic_subscriptions->get_rejected_msg_id = esp_mqtt_client_subscribe(handle->client, aws_iot_shadow_topic_name(handle, (AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_REJECTED), topic_name, sizeof(topic_name)), 0);
-    handle->topic_subscriptions->update_accepted_msg_id = esp_mqtt_client_subscribe(handle->client, aws_iot_shadow_topic_name(handle, (AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_ACCEPTED), topic_name, sizeof(topic_name)), 0);
-    handle->topic_subscriptions->update_rejected_msg_id = esp_mqtt_client_subscribe(handle->client, aws_iot_shadow_topic_name(handle, (AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_REJECTED), topic_name, sizeof(topic_name)), 0);
+/**
+ * @brief Drops duplicate and out of order deltas, before they are queued. Called under router lock.
+ *
+ * @return false if the event must not be dispatched.
+ */
+static bool aws_iot_shadow_delta_filter(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                        const char *data, size_t data_len)
+{
+    switch ((int)event_id) // includes private AWS_IOT_SHADOW_EVENT_RESTORED, not tracked
+    {
+    case AWS_IOT_SHADOW_EVENT_GET_ACCEPTED:
+        // Whole state, anything not newer is already included
+        handle->delta_version = 0;
+        aws_iot_shadow_json_peek_version(data, data_len, &handle->delta_version);
+        return true;
+    case AWS_IOT_SHADOW_EVENT_READY:
+        // Shadow might have been deleted while disconnected
+    case AWS_IOT_SHADOW_EVENT_GET_REJECTED:
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+    case AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED:
+#endif
+        // Shadow might not exist, versions start again
+        handle->delta_version = 0;
+        return true;
 #if AWS_IOT_SHADOW_SUPPORT_DELTA
-    handle->topic_subscriptions->update_delta_msg_id = esp_mqtt_client_subscribe(handle->client, aws_iot_shadow_topic_name(handle, (AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA), topic_name, sizeof(topic_name)), 0);
+    case AWS_IOT_SHADOW_EVENT_UPDATE_DELTA:
+        return aws_iot_shadow_version_check(handle, event_id, data, data_len, &handle->delta_version,
+                                            &handle->delta_discards);
 #endif
+    default:
+        return true;
+    }
+}
+
+/**
+ * @brief Drops duplicate and out of order accepted updates, once tracked requests have been matched.
+ * Called under dispatch lock.
+ *
+ * @return false if the event must not be dispatched to handlers.
+ */
+static bool aws_iot_shadow_accepted_filter(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                           const char *data, size_t data_len)
+{
+    switch ((int)event_id)
+    {
+    case AWS_IOT_SHADOW_EVENT_GET_ACCEPTED:
+        handle->accepted_version = 0;
+        aws_iot_shadow_json_peek_version(data, data_len, &handle->accepted_version);
+        return true;
+    case AWS_IOT_SHADOW_EVENT_READY:
+    case AWS_IOT_SHADOW_EVENT_GET_REJECTED:
 #if AWS_IOT_SHADOW_SUPPORT_DELETE
-    handle->topic_subscriptions->delete_accepted_msg_id = esp_mqtt_client_subscribe(handle->client, aws_iot_shadow_topic_name(handle, (AWS_IOT_SHADOW_OP_DELETE AWS_IOT_SHADOW_SUFFIX_ACCEPTED), topic_name, sizeof(topic_name)), 0);
-    handle->topic_subscriptions->delete_rejected_msg_id = esp_mqtt_client_subscribe(handle->client, aws_iot_shadow_topic_name(handle, (AWS_IOT_SHADOW_OP_DELETE AWS_IOT_SHADOW_SUFFIX_REJECTED), topic_name, sizeof(topic_name)), 0);
+    case AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED:
 #endif
-
-    // Connected state
-    xEventGroupSetBits(handle->event_group, CONNECTED_BIT);
-    ESP_LOGI(TAG, "%s connected to mqtt server", handle->topic_prefix);
+        handle->accepted_version = 0;
+        return true;
+    case AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED:
+        return aws_iot_shadow_version_check(handle, event_id, data, data_len, &handle->accepted_version,
+                                            &handle->accepted_discards);
+    default:
+        return true;
+    }
 }
+#endif
 
-static void aws_iot_shadow_mqtt_disconnected(aws_iot_shadow_handle_ptr handle)
+void aws_iot_shadow_event_run(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                              const char *data, size_t data_len)
 {
-    xEventGroupClearBits(handle->event_group, CONNECTED_BIT | SUBSCRIBED_ALL_BITS);
-    aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_DISCONNECTED, NULL);
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    // Matched even if handlers do not see the response
+    struct aws_iot_shadow_pending_request request;
+    bool completed = aws_iot_shadow_request_match(handle, event_id, data, data_len, &request);
+#endif
+
+    bool dispatch = true;
+#if AWS_IOT_SHADOW_VERSION_FILTER
+    // Before the cache, so it never goes back to older state
+    dispatch = aws_iot_shadow_accepted_filter(handle, event_id, data, data_len);
+#endif
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+    // Handlers already see the new state in the cache
+    dispatch = dispatch && aws_iot_shadow_cache_event(handle, &event_id, data, data_len);
+#endif
+
+    if (dispatch)
+    {
+#if AWS_IOT_SHADOW_STATS
+        uint32_t start = aws_iot_shadow_stats_now();
+        aws_iot_shadow_event_handlers_run(handle, event_id, data, data_len);
+        aws_iot_shadow_stats_record(&handle->stats.handler, start);
+#else
+        aws_iot_shadow_event_handlers_run(handle, event_id, data, data_len);
+#endif
+    }
+#if AWS_IOT_SHADOW_STATS
+    else
+    {
+        aws_iot_shadow_stats_dropped(handle);
+    }
+#endif
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    if (completed)
+    {
+        aws_iot_shadow_request_complete(handle, &request, event_id, data, data_len);
+    }
+#endif
 }
 
-static void aws_iot_shadow_mqtt_subscribed(aws_iot_shadow_handle_ptr handle, esp_mqtt_event_handle_t event)
+static void aws_iot_shadow_event_dispatch(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                          const char *data, size_t data_len)
 {
-    EventBits_t bits = 0;
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_stats_received(handle, event_id);
+#endif
+#if AWS_IOT_SHADOW_TRACE
+    aws_iot_shadow_trace(handle, AWS_IOT_SHADOW_TRACE_EVENT, (uint8_t)event_id, data_len);
+#endif
 
-    if (event->msg_id == -1)
+#if AWS_IOT_SHADOW_VERSION_FILTER
+    // Redelivered deltas do not even take a queue slot
+    if (!aws_iot_shadow_delta_filter(handle, event_id, data, data_len))
     {
-        ESP_LOGD(TAG, "invalid subscription msg_id");
+#if AWS_IOT_SHADOW_STATS
+        aws_iot_shadow_stats_dropped(handle);
+#endif
         return;
     }
-    else if (event->msg_id == handle->topic_subscriptions->get_accepted_msg_id)
+#endif
+
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+    // Handlers run on the worker task
+    aws_iot_shadow_router_post(handle, event_id, data, data_len);
+#else
+    aws_iot_shadow_event_run(handle, event_id, data, data_len);
+#endif
+}
+
+/**
+ * @brief Dispatches an event raised outside of MQTT events. Called without router lock, unless on the MQTT task,
+ * as handlers might publish.
+ */
+static void aws_iot_shadow_event_raise(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                       const char *data, size_t data_len)
+{
+    if (aws_iot_shadow_router_defer(handle, event_id, data, data_len))
     {
-        ESP_LOGD(TAG, "subscribed to %s" AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_ACCEPTED, handle->topic_prefix);
-        bits = xEventGroupSetBits(handle->event_group, SUBSCRIBED_GET_ACCEPTED_BIT);
+        return;
     }
-    else if (event->msg_id == handle->topic_subscriptions->get_rejected_msg_id)
+
+    aws_iot_shadow_router_lock();
+    aws_iot_shadow_event_dispatch(handle, event_id, data, data_len);
+    aws_iot_shadow_router_unlock();
+}
+
+void aws_iot_shadow_mqtt_deferred(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                  const char *data, size_t data_len)
+{
+    // Disconnected meanwhile
+    if (event_id == AWS_IOT_SHADOW_EVENT_READY && !(xEventGroupGetBits(handle->event_group) & READY_BIT))
     {
-        ESP_LOGD(TAG, "subscribed to %s" AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_REJECTED, handle->topic_prefix);
-        bits = xEventGroupSetBits(handle->event_group, SUBSCRIBED_GET_REJECTED_BIT);
+        return;
     }
-    else if (event->msg_id == handle->topic_subscriptions->update_accepted_msg_id)
+    aws_iot_shadow_event_dispatch(handle, event_id, data, data_len);
+}
+
+static void aws_iot_shadow_subscribe(aws_iot_shadow_handle_ptr handle, const char *topic_suffix, EventBits_t bit)
+{
+    char topic_name[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH] = {};
+    if (aws_iot_shadow_router_subscribe(handle, aws_iot_shadow_topic_name(handle, topic_suffix, topic_name, sizeof(topic_name)), bit) == -1)
     {
-        ESP_LOGD(TAG, "subscribed to %s" AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_ACCEPTED, handle->topic_prefix);
-        bits = xEventGroupSetBits(handle->event_group, SUBSCRIBED_UPDATE_ACCEPTED_BIT);
+        ESP_LOGE(TAG, "failed to subscribe %s%s", handle->topic_prefix, topic_suffix);
     }
-    else if (event->msg_id == handle->topic_subscriptions->update_rejected_msg_id)
+}
+
+static void aws_iot_shadow_unsubscribe(aws_iot_shadow_handle_ptr handle, const char *topic_suffix)
+{
+    char topic_name[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH] = {};
+    if (esp_mqtt_client_unsubscribe(handle->client, aws_iot_shadow_topic_name(handle, topic_suffix, topic_name, sizeof(topic_name))) == -1)
     {
-        ESP_LOGD(TAG, "subscribed to %s" AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_REJECTED, handle->topic_prefix);
-        bits = xEventGroupSetBits(handle->event_group, SUBSCRIBED_UPDATE_REJECTED_BIT);
+        ESP_LOGE(TAG, "failed to unsubscribe %s%s", handle->topic_prefix, topic_suffix);
     }
-#if AWS_IOT_SHADOW_SUPPORT_DELTA
-    else if (event->msg_id == handle->topic_subscriptions->update_delta_msg_id)
+}
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+static EventBits_t aws_iot_shadow_event_subscription(int32_t event_id)
+{
+    switch (event_id)
     {
-        ESP_LOGD(TAG, "subscribed to %s" AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA, handle->topic_prefix);
-        bits = xEventGroupSetBits(handle->event_group, SUBSCRIBED_UPDATE_DELTA_BIT);
-    }
+    case AWS_IOT_SHADOW_EVENT_GET_ACCEPTED:
+        return SUBSCRIBED_GET_ACCEPTED_BIT;
+    case AWS_IOT_SHADOW_EVENT_GET_REJECTED:
+        return SUBSCRIBED_GET_REJECTED_BIT;
+    case AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED:
+        return SUBSCRIBED_UPDATE_ACCEPTED_BIT;
+    case AWS_IOT_SHADOW_EVENT_UPDATE_REJECTED:
+        return SUBSCRIBED_UPDATE_REJECTED_BIT;
+#if AWS_IOT_SHADOW_SUPPORT_DELTA
+    case AWS_IOT_SHADOW_EVENT_UPDATE_DELTA:
+        return SUBSCRIBED_UPDATE_DELTA_BIT;
+#endif
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    case AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS:
+        return SUBSCRIBED_UPDATE_DOCUMENTS_BIT;
 #endif
 #if AWS_IOT_SHADOW_SUPPORT_DELETE
-    else if (event->msg_id == handle->topic_subscriptions->delete_accepted_msg_id)
+    case AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED:
+        return SUBSCRIBED_DELETE_ACCEPTED_BIT;
+    case AWS_IOT_SHADOW_EVENT_DELETE_REJECTED:
+        return SUBSCRIBED_DELETE_REJECTED_BIT;
+#endif
+    case AWS_IOT_SHADOW_EVENT_ANY:
+        return SUBSCRIBED_ALL_BITS;
+    default:
+        return 0;
+    }
+}
+#endif
+
+/**
+ * @brief Response topics someone listens to.
+ */
+static EventBits_t aws_iot_shadow_subscriptions_wanted(aws_iot_shadow_handle_ptr handle)
+{
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    EventBits_t wanted = SUBSCRIBED_INTERNAL_BITS;
+    if (__atomic_load_n(&handle->handler_any_count, __ATOMIC_RELAXED) > 0)
     {
-        ESP_LOGD(TAG, "subscribed to %s" AWS_IOT_SHADOW_OP_DELETE AWS_IOT_SHADOW_SUFFIX_ACCEPTED, handle->topic_prefix);
-        bits = xEventGroupSetBits(handle->event_group, SUBSCRIBED_DELETE_ACCEPTED_BIT);
+        wanted |= SUBSCRIBED_ALL_BITS;
     }
-    else if (event->msg_id == handle->topic_subscriptions->delete_rejected_msg_id)
+    for (int32_t event_id = 0; event_id < AWS_IOT_SHADOW_EVENT_MAX; event_id++)
     {
-        ESP_LOGD(TAG, "subscribed to %s" AWS_IOT_SHADOW_OP_DELETE AWS_IOT_SHADOW_SUFFIX_REJECTED, handle->topic_prefix);
-        bits = xEventGroupSetBits(handle->event_group, SUBSCRIBED_DELETE_REJECTED_BIT);
+        if (__atomic_load_n(&handle->handler_counts[event_id], __ATOMIC_RELAXED) > 0)
+        {
+            wanted |= aws_iot_shadow_event_subscription(event_id);
+        }
     }
+    return wanted;
+#else
+    return SUBSCRIBED_ALL_BITS;
 #endif
+}
+
+/**
+ * @brief Takes wanted topics as requested ones, and finds which of them to subscribe and unsubscribe.
+ * Called under router lock, while connected.
+ */
+static void aws_iot_shadow_subscriptions_diff(aws_iot_shadow_handle_ptr handle, EventBits_t *subscribe, EventBits_t *unsubscribe)
+{
+    EventBits_t wanted = aws_iot_shadow_subscriptions_wanted(handle);
+    *subscribe = wanted & ~handle->subscriptions;
+    *unsubscribe = handle->subscriptions & ~wanted;
+    handle->subscriptions = wanted;
 
-    // Ready?
-    if ((bits & SUBSCRIBED_ALL_BITS) == SUBSCRIBED_ALL_BITS)
+    // Pending SUBACKs of unsubscribed topics are ignored
+    xEventGroupClearBits(handle->event_group, *unsubscribe);
+}
+
+/**
+ * @brief Sends SUBSCRIBE and UNSUBSCRIBE of the topics. Called without router lock, unless on the MQTT task.
+ */
+static void aws_iot_shadow_subscriptions_send(aws_iot_shadow_handle_ptr handle, EventBits_t subscribe, EventBits_t unsubscribe)
+{
+    for (size_t i = 0; i < sizeof(RESPONSE_TOPICS) / sizeof(RESPONSE_TOPICS[0]); i++)
     {
-        ESP_LOGI(TAG, "%s is ready", handle->topic_prefix);
+        const struct aws_iot_shadow_response_topic *topic = &RESPONSE_TOPICS[i];
+        if (subscribe & topic->bit)
+        {
+            aws_iot_shadow_subscribe(handle, topic->suffix, topic->bit);
+        }
+        else if (unsubscribe & topic->bit)
+        {
+            aws_iot_shadow_unsubscribe(handle, topic->suffix);
+        }
+    }
+}
 
-        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_READY, NULL);
+/**
+ * @brief Announces the handle has become ready and requests the state. Called without router lock,
+ * unless on the MQTT task, as it publishes.
+ */
+static void aws_iot_shadow_mqtt_ready(aws_iot_shadow_handle_ptr handle)
+{
+    ESP_LOGI(TAG, "%s is ready", handle->topic_prefix);
+
+    // Lazy subscription timer and late init run it on other tasks
+    aws_iot_shadow_event_raise(handle, AWS_IOT_SHADOW_EVENT_READY, NULL, 0);
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    aws_iot_shadow_router_lock();
+    EventBits_t subscriptions = handle->subscriptions;
+    aws_iot_shadow_router_unlock();
+#endif
 
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    // Nobody would receive the response
+    if (!(subscriptions & (SUBSCRIBED_GET_ACCEPTED_BIT | SUBSCRIBED_GET_REJECTED_BIT)))
+    {
+        ESP_LOGD(TAG, "%s" AWS_IOT_SHADOW_OP_GET " responses are not subscribed, not requested", handle->topic_prefix);
+    }
+    else
+#endif
+    {
         // Request data
         esp_err_t err = aws_iot_shadow_request_get(handle);
         if (err != ESP_OK)
@@ -204,6 +664,157 @@ static void aws_iot_shadow_mqtt_subscribed(aws_iot_shadow_handle_ptr handle, esp
             ESP_LOGE(TAG, "failed to publish %s" AWS_IOT_SHADOW_OP_GET, handle->topic_prefix);
         }
     }
+
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+    // Updates requested while not ready
+    aws_iot_shadow_journal_flush(handle);
+#endif
+}
+
+/**
+ * @brief Ready once every requested subscription is acknowledged, if not yet. Called under router lock.
+ *
+ * @return true if the handle has become ready, aws_iot_shadow_mqtt_ready() must follow.
+ */
+static bool aws_iot_shadow_ready_check(aws_iot_shadow_handle_ptr handle, EventBits_t bits)
+{
+    if (!(bits & CONNECTED_BIT) || (bits & READY_BIT) || (bits & handle->subscriptions) != handle->subscriptions)
+    {
+        return false;
+    }
+
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_stats_record(&handle->stats.ready, handle->stats_connected_at);
+#endif
+#if AWS_IOT_SHADOW_SESSION_RESUME
+    xEventGroupSetBits(handle->event_group, READY_BIT | SESSION_SUBSCRIBED_BIT);
+#else
+    xEventGroupSetBits(handle->event_group, READY_BIT);
+#endif
+    return true;
+}
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+/**
+ * @brief Follows handlers (un)registered since the last sync. Runs on the esp_timer task,
+ * so registration from handlers never waits for the router lock.
+ */
+static void aws_iot_shadow_subscriptions_update(void *arg)
+{
+    aws_iot_shadow_handle_ptr handle = (aws_iot_shadow_handle_ptr)arg;
+    EventBits_t subscribe = 0, unsubscribe = 0;
+    bool ready = false;
+    if (__atomic_load_n(&handle->deleting, __ATOMIC_ACQUIRE))
+    {
+        return; // event group may be gone already
+    }
+
+    aws_iot_shadow_router_lock();
+    if (xEventGroupGetBits(handle->event_group) & CONNECTED_BIT)
+    {
+        aws_iot_shadow_subscriptions_diff(handle, &subscribe, &unsubscribe);
+        // Removed topic can be the last one pending
+        ready = aws_iot_shadow_ready_check(handle, xEventGroupGetBits(handle->event_group));
+    }
+    aws_iot_shadow_router_unlock();
+
+    // esp-mqtt might be waiting for router lock, while it holds its own
+    aws_iot_shadow_subscriptions_send(handle, subscribe, unsubscribe);
+    if (ready)
+    {
+        aws_iot_shadow_mqtt_ready(handle);
+    }
+}
+
+static void aws_iot_shadow_handler_count(aws_iot_shadow_handle_ptr handle, int32_t event_id, int16_t delta)
+{
+    if (aws_iot_shadow_event_subscription(event_id) == 0)
+    {
+        return;
+    }
+
+    uint16_t *count = event_id == AWS_IOT_SHADOW_EVENT_ANY ? &handle->handler_any_count : &handle->handler_counts[event_id];
+    uint16_t prev = __atomic_fetch_add(count, (uint16_t)delta, __ATOMIC_RELAXED);
+
+    // First handler of the event, or the last one gone
+    if (prev == 0 || (uint16_t)(prev + delta) == 0)
+    {
+        // Already armed is fine, counts are read when it fires
+        esp_timer_start_once(handle->subscription_timer, 0);
+    }
+}
+#endif
+
+void aws_iot_shadow_mqtt_connected(aws_iot_shadow_handle_ptr handle, bool session_present)
+{
+    aws_iot_shadow_router_lock();
+
+    // Reset tracking
+    xEventGroupClearBits(handle->event_group, READY_BIT | SUBSCRIBED_ALL_BITS);
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+    aws_iot_shadow_journal_offline(handle);
+#endif
+#if AWS_IOT_SHADOW_STATS
+    handle->stats_connected_at = aws_iot_shadow_stats_now();
+#endif
+
+#if AWS_IOT_SHADOW_SESSION_RESUME
+    if (session_present && (xEventGroupGetBits(handle->event_group) & SESSION_SUBSCRIBED_BIT))
+    {
+        // Subscriptions of the previous connection are still there
+        xEventGroupSetBits(handle->event_group, handle->subscriptions);
+        ESP_LOGI(TAG, "%s connected to mqtt server, session resumed", handle->topic_prefix);
+    }
+    else
+#endif
+    {
+#if AWS_IOT_SHADOW_SESSION_RESUME
+        // Clean session, or the handle did not subscribe everything in it
+        xEventGroupClearBits(handle->event_group, SESSION_SUBSCRIBED_BIT);
+#endif
+        // Clean session has no subscriptions
+        handle->subscriptions = 0;
+        ESP_LOGI(TAG, "%s connected to mqtt server", handle->topic_prefix);
+    }
+
+    EventBits_t subscribe, unsubscribe;
+    aws_iot_shadow_subscriptions_diff(handle, &subscribe, &unsubscribe);
+
+    // Connected state
+    bool ready = aws_iot_shadow_ready_check(handle, xEventGroupSetBits(handle->event_group, CONNECTED_BIT));
+
+    aws_iot_shadow_router_unlock();
+
+    // Late init runs on an application task, where esp-mqtt might be waiting for router lock
+    aws_iot_shadow_subscriptions_send(handle, subscribe, unsubscribe);
+    if (ready)
+    {
+        aws_iot_shadow_mqtt_ready(handle);
+    }
+}
+
+void aws_iot_shadow_mqtt_disconnected(aws_iot_shadow_handle_ptr handle)
+{
+    xEventGroupClearBits(handle->event_group, CONNECTED_BIT | READY_BIT | SUBSCRIBED_ALL_BITS);
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+    aws_iot_shadow_journal_offline(handle);
+#endif
+    aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_DISCONNECTED, NULL, 0);
+}
+
+void aws_iot_shadow_mqtt_subscribed(aws_iot_shadow_handle_ptr handle, EventBits_t bit)
+{
+    ESP_LOGD(TAG, "%s subscription 0x%x acknowledged", handle->topic_prefix, (unsigned int)bit);
+
+    aws_iot_shadow_router_lock();
+    // Unless unsubscribed meanwhile
+    bool ready = (handle->subscriptions & bit) && aws_iot_shadow_ready_check(handle, xEventGroupSetBits(handle->event_group, bit));
+    aws_iot_shadow_router_unlock();
+
+    if (ready)
+    {
+        aws_iot_shadow_mqtt_ready(handle);
+    }
 }
 
 static void aws_iot_shadow_mqtt_data_get_op(aws_iot_shadow_handle_ptr handle, esp_mqtt_event_handle_t event,
@@ -216,13 +827,13 @@ static void aws_iot_shadow_mqtt_data_get_op(aws_iot_shadow_handle_ptr handle, es
         && strncmp(op, AWS_IOT_SHADOW_SUFFIX_ACCEPTED, AWS_IOT_SHADOW_SUFFIX_ACCEPTED_LENGTH) == 0)
     {
         // /get/accepted
-        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_GET_ACCEPTED, event);
+        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_GET_ACCEPTED, event->data, event->data_len);
     }
     else if (op_len == AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH
              && strncmp(op, AWS_IOT_SHADOW_SUFFIX_REJECTED, AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH) == 0)
     {
         // /get/rejected
-        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_GET_REJECTED, event);
+        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_GET_REJECTED, event->data, event->data_len);
     }
 }
 
@@ -236,19 +847,27 @@ static void aws_iot_shadow_mqtt_data_update_op(aws_iot_shadow_handle_ptr handle,
         && strncmp(op, AWS_IOT_SHADOW_SUFFIX_ACCEPTED, AWS_IOT_SHADOW_SUFFIX_ACCEPTED_LENGTH) == 0)
     {
         // /update/accepted
-        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED, event);
+        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED, event->data, event->data_len);
     }
     else if (op_len == AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH
              && strncmp(op, AWS_IOT_SHADOW_SUFFIX_REJECTED, AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH) == 0)
     {
         // /update/rejected
-        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_UPDATE_REJECTED, event);
+        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_UPDATE_REJECTED, event->data, event->data_len);
     }
 #if AWS_IOT_SHADOW_SUPPORT_DELTA
     else if (op_len == AWS_IOT_SHADOW_SUFFIX_DELTA_LENGTH && strncmp(op, AWS_IOT_SHADOW_SUFFIX_DELTA, AWS_IOT_SHADOW_SUFFIX_DELTA_LENGTH) == 0)
     {
         // /update/delta
-        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, event);
+        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_UPDATE_DELTA, event->data, event->data_len);
+    }
+#endif
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    else if (op_len == AWS_IOT_SHADOW_SUFFIX_DOCUMENT_LENGTH
+             && strncmp(op, AWS_IOT_SHADOW_SUFFIX_DOCUMENT, AWS_IOT_SHADOW_SUFFIX_DOCUMENT_LENGTH) == 0)
+    {
+        // /update/documents
+        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS, event->data, event->data_len);
     }
 #endif
 }
@@ -264,88 +883,47 @@ static void aws_iot_shadow_mqtt_data_delete_op(aws_iot_shadow_handle_ptr handle,
         && strncmp(op, AWS_IOT_SHADOW_SUFFIX_ACCEPTED, AWS_IOT_SHADOW_SUFFIX_ACCEPTED_LENGTH) == 0)
     {
         // /delete/accepted
-        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED, event);
+        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED, event->data, event->data_len);
     }
     else if (op_len == AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH
              && strncmp(op, AWS_IOT_SHADOW_SUFFIX_REJECTED, AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH) == 0)
     {
         // /delete/rejected
-        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_DELETE_REJECTED, event);
+        aws_iot_shadow_event_dispatch(handle, AWS_IOT_SHADOW_EVENT_DELETE_REJECTED, event->data, event->data_len);
     }
 }
 #endif
 
-static void aws_iot_shadow_mqtt_data(aws_iot_shadow_handle_ptr handle, esp_mqtt_event_handle_t event)
+void aws_iot_shadow_mqtt_data(aws_iot_shadow_handle_ptr handle, esp_mqtt_event_handle_t event)
 {
-    ESP_LOGD(TAG, "received %.*s payload (%d bytes): %.*s", event->topic_len, event->topic, event->data_len, event->data_len, event->data ? event->data : "");
+    // Topic prefix has been already matched by the dispatcher
+    const char *action = event->topic + handle->topic_prefix_len;
+    uint16_t action_len = event->topic_len - handle->topic_prefix_len;
+
+#if !AWS_IOT_SHADOW_TRACE
+    // Traced once dispatched, with the event
+    ESP_LOGI(TAG, "%s action %.*s (%d bytes)", handle->topic_prefix, action_len, action, event->total_data_len);
+#endif
 
-    if (event->total_data_len > event->data_len)
+    if (action_len >= AWS_IOT_SHADOW_OP_GET_LENGTH && strncmp(action, AWS_IOT_SHADOW_OP_GET, AWS_IOT_SHADOW_OP_GET_LENGTH) == 0)
     {
-        ESP_LOGE(TAG, "received partial data, this is not supported, please increase esp_mqtt_client_config_t.buffer_size to > %d (or set CONFIG_MQTT_BUFFER_SIZE)", event->total_data_len);
-        return;
+        // Get operation
+        aws_iot_shadow_mqtt_data_get_op(handle, event, action, action_len);
     }
-
-    if (event->topic_len > handle->topic_prefix_len && event->topic_len < AWS_IOT_SHADOW_TOPIC_MAX_LENGTH
-        && strncmp(event->topic, handle->topic_prefix, handle->topic_prefix_len) == 0)
+    else if (action_len >= AWS_IOT_SHADOW_OP_UPDATE_LENGTH
+             && strncmp(action, AWS_IOT_SHADOW_OP_UPDATE, AWS_IOT_SHADOW_OP_UPDATE_LENGTH) == 0)
     {
-        const char *action = event->topic + handle->topic_prefix_len;
-        uint16_t action_len = event->topic_len - handle->topic_prefix_len;
-
-        ESP_LOGI(TAG, "%s action %.*s (%d bytes)", handle->topic_prefix, action_len, action, event->total_data_len);
-
-        if (action_len >= AWS_IOT_SHADOW_OP_GET_LENGTH && strncmp(action, AWS_IOT_SHADOW_OP_GET, AWS_IOT_SHADOW_OP_GET_LENGTH) == 0)
-        {
-            // Get operation
-            aws_iot_shadow_mqtt_data_get_op(handle, event, action, action_len);
-        }
-        else if (action_len >= AWS_IOT_SHADOW_OP_UPDATE_LENGTH
-                 && strncmp(action, AWS_IOT_SHADOW_OP_UPDATE, AWS_IOT_SHADOW_OP_UPDATE_LENGTH) == 0)
-        {
-            // Update operation
-            aws_iot_shadow_mqtt_data_update_op(handle, event, action, action_len);
-        }
-#if AWS_IOT_SHADOW_SUPPORT_DELETE
-        else if (action_len >= AWS_IOT_SHADOW_OP_DELETE_LENGTH
-                 && strncmp(action, AWS_IOT_SHADOW_OP_DELETE, AWS_IOT_SHADOW_OP_DELETE_LENGTH) == 0)
-        {
-            // Delete operation
-            aws_iot_shadow_mqtt_data_delete_op(handle, event, action, action_len);
-        }
-#endif
+        // Update operation
+        aws_iot_shadow_mqtt_data_update_op(handle, event, action, action_len);
     }
-}
-
-static void aws_iot_shadow_mqtt_handler(void *handler_args, __unused esp_event_base_t base, __unused int32_t event_id, void *event_data)
-{
-    aws_iot_shadow_handle_ptr handle = (aws_iot_shadow_handle_ptr)handler_args;
-    esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
-
-    switch (event->event_id)
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+    else if (action_len >= AWS_IOT_SHADOW_OP_DELETE_LENGTH
+             && strncmp(action, AWS_IOT_SHADOW_OP_DELETE, AWS_IOT_SHADOW_OP_DELETE_LENGTH) == 0)
     {
-    case MQTT_EVENT_CONNECTED:
-        aws_iot_shadow_mqtt_connected(handle);
-        break;
-
-    case MQTT_EVENT_DISCONNECTED:
-        aws_iot_shadow_mqtt_disconnected(handle);
-        break;
-
-    case MQTT_EVENT_SUBSCRIBED:
-        aws_iot_shadow_mqtt_subscribed(handle, event);
-        break;
-
-    case MQTT_EVENT_DATA:
-        aws_iot_shadow_mqtt_data(handle, event);
-        break;
-
-    case MQTT_EVENT_ERROR:
-        ESP_LOGD(TAG, "got mqtt error type: %d", event->error_handle->error_type);
-        break;
-
-    default:
-        ESP_LOGD(TAG, "unhandled mqtt event %d", event->event_id);
-        break;
+        // Delete operation
+        aws_iot_shadow_mqtt_data_delete_op(handle, event, action, action_len);
     }
+#endif
 }
 
 const char *aws_iot_shadow_thing_name(const char *client_id)
@@ -392,29 +970,28 @@ esp_err_t aws_iot_shadow_init(esp_mqtt_client_handle_t client, const char *thing
     // Init
     memset(result, 0, sizeof(*result));
 
-    result->topic_subscriptions = (struct topic_subscriptions *)malloc(sizeof(*result->topic_subscriptions));
-    if (result->topic_subscriptions == NULL)
-    {
-        aws_iot_shadow_delete(result);
-        return ESP_ERR_NO_MEM;
-    }
-    memset(result->topic_subscriptions, 0, sizeof(*result->topic_subscriptions));
-
     result->client = client;
     result->event_group = xEventGroupCreate();
     assert(result->event_group);
+#if AWS_IOT_SHADOW_TRACE
+    result->trace_index = aws_iot_shadow_trace_register();
+#endif
+
+    esp_err_t err;
 
+#if !AWS_IOT_SHADOW_DIRECT_DISPATCH
     // Create event loop
     esp_event_loop_args_t event_loop_args = {
         .queue_size = 1,
     };
-    esp_err_t err = esp_event_loop_create(&event_loop_args, &result->event_loop);
+    err = esp_event_loop_create(&event_loop_args, &result->event_loop);
     if (err != ESP_OK)
     {
         ESP_LOGE(TAG, "failed to create event loop: %d", err);
         aws_iot_shadow_delete(result);
         return err;
     }
+#endif
 
     // Initialize names
     strcpy(result->thing_name, thing_name);
@@ -439,21 +1016,67 @@ esp_err_t aws_iot_shadow_init(esp_mqtt_client_handle_t client, const char *thing
         return ESP_FAIL;
     }
 
-    // Handler
-    err = esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, aws_iot_shadow_mqtt_handler, result);
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    esp_timer_create_args_t timer_args = {
+        .callback = aws_iot_shadow_subscriptions_update,
+        .arg = result,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "aws_iot_shadow_subscriptions",
+    };
+    err = esp_timer_create(&timer_args, &result->subscription_timer);
     if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "failed to register mqtt event handler: %d", err);
+        aws_iot_shadow_delete(result);
+        return err;
+    }
+#endif
+
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+    err = aws_iot_shadow_journal_init(result);
+    if (err != ESP_OK)
+    {
+        aws_iot_shadow_delete(result);
+        return err;
+    }
+#endif
+
+    // Shared MQTT dispatcher
+    err = aws_iot_shadow_router_add(client, result);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "failed to register %s with mqtt dispatcher: %d", result->topic_prefix, err);
         aws_iot_shadow_delete(result);
         return err;
     }
 
     // Success
     *handle = result;
+#if AWS_IOT_SHADOW_TRACE
+    ESP_LOGI(TAG, "initialized %s, trace shadow %u", result->topic_prefix, result->trace_index);
+#else
     ESP_LOGI(TAG, "initialized %s", result->topic_prefix);
+#endif
     return ESP_OK;
 }
 
+static void aws_iot_shadow_timer_barrier_reached(void *arg)
+{
+    xSemaphoreGive((SemaphoreHandle_t)arg);
+}
+
+/**
+ * @brief Waits for callbacks running or due on the esp_timer task, it runs them one at a time, in order of expiry.
+ *
+ * esp_timer_stop() and esp_timer_delete() do not wait for a running callback.
+ */
+static void aws_iot_shadow_timer_barrier(esp_timer_handle_t barrier, SemaphoreHandle_t reached)
+{
+    if (esp_timer_start_once(barrier, 0) == ESP_OK)
+    {
+        xSemaphoreTake(reached, portMAX_DELAY);
+    }
+}
+
 esp_err_t aws_iot_shadow_delete(aws_iot_shadow_handle_ptr handle)
 {
     if (handle == NULL)
@@ -461,20 +1084,86 @@ esp_err_t aws_iot_shadow_delete(aws_iot_shadow_handle_ptr handle)
         return ESP_ERR_INVALID_ARG;
     }
 
-    // Unregister event handler
-    // TODO esp_mqtt_client_unregister_event is not implemented, without it there is a leak, but in real life this won't be used anyway
-    // esp_err_t err = esp_mqtt_client_unregister_event(client, MQTT_EVENT_ANY, aws_iot_shadow_mqtt_handler, result);
-    // if (err != ESP_OK)
-    // {
-    //     ESP_LOGW(TAG, "failed to unregister event handler: %d", err);
-    // }
+    // Allocated first, nothing is released if it fails
+    SemaphoreHandle_t reached = xSemaphoreCreateBinary();
+    if (reached == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_timer_handle_t barrier = NULL;
+    esp_timer_create_args_t barrier_args = {
+        .callback = aws_iot_shadow_timer_barrier_reached,
+        .arg = reached,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "aws_iot_shadow_delete",
+    };
+    esp_err_t err = esp_timer_create(&barrier_args, &barrier);
+    if (err != ESP_OK)
+    {
+        vSemaphoreDelete(reached);
+        return err;
+    }
+
+    // Callbacks started from now on return right away, wait for those already running
+    __atomic_store_n(&handle->deleting, true, __ATOMIC_RELEASE);
+    aws_iot_shadow_timer_barrier(barrier, reached);
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+    // Versions accepted since last /get/accepted. Backend is set once the handle is initialized.
+    if (handle->persistence.store != NULL)
+    {
+        aws_iot_shadow_router_dispatch_lock(handle);
+        if (handle->has_cached_version)
+        {
+            aws_iot_shadow_snapshot_save(handle, handle->cached_version);
+        }
+        aws_iot_shadow_router_dispatch_unlock(handle);
+    }
+#endif
+
+#if AWS_IOT_SHADOW_UPDATE_COALESCING
+    // Completes waiters under dispatch lock
+    aws_iot_shadow_coalesce_free(handle);
+#endif
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    aws_iot_shadow_request_free(handle);
+#endif
+
+    // Stop receiving events
+    aws_iot_shadow_router_remove(handle);
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    if (handle->subscription_timer != NULL)
+    {
+        esp_timer_stop(handle->subscription_timer);
+        esp_timer_delete(handle->subscription_timer);
+    }
+#endif
 
     // Properly destroy
-    free(handle->topic_subscriptions);
+#if !AWS_IOT_SHADOW_DIRECT_DISPATCH
+    if (handle->event_loop)
+    {
+        esp_event_loop_delete(handle->event_loop);
+    }
+#endif
     if (handle->event_group)
     {
         vEventGroupDelete(handle->event_group);
     }
+#if AWS_IOT_SHADOW_KEY_HANDLERS
+    aws_iot_shadow_key_handlers_free(handle);
+#endif
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+    aws_iot_shadow_cache_free(handle);
+#endif
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+    aws_iot_shadow_journal_free(handle);
+#endif
+    // Stopped timers can still have been due, their callbacks only check the flag
+    aws_iot_shadow_timer_barrier(barrier, reached);
+    esp_timer_delete(barrier);
+    vSemaphoreDelete(reached);
 
     // Release handle
     free(handle);
@@ -498,8 +1187,56 @@ inline esp_err_t aws_iot_shadow_handler_instance_register(aws_iot_shadow_handle_
         return ESP_ERR_INVALID_ARG;
     }
 
-    return esp_event_handler_instance_register_with(handle->event_loop, AWS_IOT_SHADOW_EVENT, event_id,
-                                                    event_handler, event_handler_arg, handler_ctx_arg);
+#if AWS_IOT_SHADOW_DIRECT_DISPATCH
+    if (event_handler == NULL || (event_id != AWS_IOT_SHADOW_EVENT_ANY && (event_id < 0 || event_id >= AWS_IOT_SHADOW_EVENT_MAX)))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+
+    if (handle->dispatch_depth == 0 && handle->handlers_removed)
+    {
+        aws_iot_shadow_handlers_compact(handle);
+    }
+    if (handle->handler_count >= AWS_IOT_SHADOW_DIRECT_DISPATCH_MAX_HANDLERS)
+    {
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        ESP_LOGE(TAG, "%s has too many handlers, see CONFIG_AWS_IOT_SHADOW_DIRECT_DISPATCH_MAX_HANDLERS", handle->topic_prefix);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Instance is a non-zero sequence number, entries move when compacted
+    if (++handle->handler_instance_seq == 0)
+    {
+        handle->handler_instance_seq = 1;
+    }
+
+    struct aws_iot_shadow_handler *handler = &handle->handlers[handle->handler_count++];
+    handler->fn = event_handler;
+    handler->arg = event_handler_arg;
+    handler->event_id = event_id;
+    handler->instance = handle->handler_instance_seq;
+
+    if (handler_ctx_arg)
+    {
+        *handler_ctx_arg = (esp_event_handler_instance_t)(uintptr_t)handler->instance;
+    }
+
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    esp_err_t err = ESP_OK;
+#else
+    esp_err_t err = esp_event_handler_instance_register_with(handle->event_loop, AWS_IOT_SHADOW_EVENT, event_id,
+                                                             event_handler, event_handler_arg, handler_ctx_arg);
+#endif
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    if (err == ESP_OK)
+    {
+        aws_iot_shadow_handler_count(handle, event_id, 1);
+    }
+#endif
+    return err;
 }
 
 inline esp_err_t aws_iot_shadow_handler_instance_unregister(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
@@ -510,9 +1247,155 @@ inline esp_err_t aws_iot_shadow_handler_instance_unregister(aws_iot_shadow_handl
         return ESP_ERR_INVALID_ARG;
     }
 
-    return esp_event_handler_instance_unregister_with(handle->event_loop, AWS_IOT_SHADOW_EVENT, event_id, handler_ctx_arg);
+#if AWS_IOT_SHADOW_DIRECT_DISPATCH
+    if (handler_ctx_arg == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t instance = (uint32_t)(uintptr_t)handler_ctx_arg;
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+    for (uint8_t i = 0; i < handle->handler_count; i++)
+    {
+        struct aws_iot_shadow_handler *handler = &handle->handlers[i];
+        if (handler->fn != NULL && handler->instance == instance && handler->event_id == event_id)
+        {
+            handler->fn = NULL;
+            handle->handlers_removed = true;
+            err = ESP_OK;
+            break;
+        }
+    }
+    if (handle->dispatch_depth == 0 && handle->handlers_removed)
+    {
+        aws_iot_shadow_handlers_compact(handle);
+    }
+    aws_iot_shadow_router_dispatch_unlock(handle);
+#else
+    esp_err_t err = esp_event_handler_instance_unregister_with(handle->event_loop, AWS_IOT_SHADOW_EVENT, event_id, handler_ctx_arg);
+#endif
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    if (err == ESP_OK)
+    {
+        aws_iot_shadow_handler_count(handle, event_id, -1);
+    }
+#endif
+    return err;
+}
+
+#if AWS_IOT_SHADOW_KEY_HANDLERS
+static bool aws_iot_shadow_key_event(enum aws_iot_shadow_event event_id)
+{
+    switch (event_id)
+    {
+    case AWS_IOT_SHADOW_EVENT_GET_ACCEPTED:
+    case AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED:
+#if AWS_IOT_SHADOW_SUPPORT_DELTA
+    case AWS_IOT_SHADOW_EVENT_UPDATE_DELTA:
+#endif
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    case AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS:
+#endif
+        return true;
+    default:
+        return false;
+    }
 }
 
+esp_err_t aws_iot_shadow_key_handler_register(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                              const char *path, aws_iot_shadow_key_handler_t handler, void *handler_arg)
+{
+    if (handle == NULL || handler == NULL || path == NULL || !aws_iot_shadow_key_event(event_id))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Non-empty segments only
+    size_t path_len = strlen(path);
+    size_t head_len = strcspn(path, ".");
+    if (head_len == 0 || head_len > UINT8_MAX || path[path_len - 1] == '.' || strstr(path, "..") != NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+
+    if (handle->key_dispatch_depth == 0 && handle->key_handlers_removed)
+    {
+        aws_iot_shadow_key_handlers_compact(handle);
+    }
+    if (handle->key_handler_count >= AWS_IOT_SHADOW_KEY_HANDLERS_MAX)
+    {
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        ESP_LOGE(TAG, "%s has too many key handlers, see CONFIG_AWS_IOT_SHADOW_KEY_HANDLERS_MAX", handle->topic_prefix);
+        return ESP_ERR_NO_MEM;
+    }
+
+    char *path_copy = (char *)malloc(path_len + 1);
+    if (path_copy == NULL)
+    {
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(path_copy, path, path_len + 1);
+
+    struct aws_iot_shadow_key_handler *key_handler = &handle->key_handlers[handle->key_handler_count++];
+    key_handler->fn = handler;
+    key_handler->arg = handler_arg;
+    key_handler->path = path_copy;
+    key_handler->head_len = (uint8_t)head_len;
+    key_handler->event_id = (int8_t)event_id;
+
+    aws_iot_shadow_router_dispatch_unlock(handle);
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    aws_iot_shadow_handler_count(handle, event_id, 1);
+#endif
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_key_handler_unregister(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                                const char *path, aws_iot_shadow_key_handler_t handler, void *handler_arg)
+{
+    if (handle == NULL || handler == NULL || path == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+    for (uint8_t i = 0; i < handle->key_handler_count; i++)
+    {
+        struct aws_iot_shadow_key_handler *key_handler = &handle->key_handlers[i];
+        if (key_handler->fn == handler && key_handler->arg == handler_arg && key_handler->event_id == event_id
+            && strcmp(key_handler->path, path) == 0)
+        {
+            key_handler->fn = NULL;
+            handle->key_handlers_removed = true;
+            err = ESP_OK;
+            break;
+        }
+    }
+    if (handle->key_dispatch_depth == 0 && handle->key_handlers_removed)
+    {
+        aws_iot_shadow_key_handlers_compact(handle);
+    }
+    aws_iot_shadow_router_dispatch_unlock(handle);
+
+#if AWS_IOT_SHADOW_LAZY_SUBSCRIPTION
+    if (err == ESP_OK)
+    {
+        aws_iot_shadow_handler_count(handle, event_id, -1);
+    }
+#endif
+    return err;
+}
+#endif
+
 bool aws_iot_shadow_is_ready(aws_iot_shadow_handle_ptr handle)
 {
     if (handle == NULL)
@@ -520,8 +1403,7 @@ bool aws_iot_shadow_is_ready(aws_iot_shadow_handle_ptr handle)
         return ESP_ERR_INVALID_ARG;
     }
 
-    EventBits_t bits = xEventGroupGetBits(handle->event_group);
-    return (bits & SUBSCRIBED_ALL_BITS) == SUBSCRIBED_ALL_BITS;
+    return (xEventGroupGetBits(handle->event_group) & READY_BIT) != 0;
 }
 
 bool aws_iot_shadow_wait_for_ready(aws_iot_shadow_handle_ptr handle, TickType_t ticks_to_wait)
@@ -531,9 +1413,70 @@ bool aws_iot_shadow_wait_for_ready(aws_iot_shadow_handle_ptr handle, TickType_t
         return ESP_ERR_INVALID_ARG;
     }
 
-    EventBits_t bits = xEventGroupWaitBits(handle->event_group, SUBSCRIBED_ALL_BITS, pdFALSE, pdTRUE, ticks_to_wait);
-    return (bits & SUBSCRIBED_ALL_BITS) == SUBSCRIBED_ALL_BITS;
+    EventBits_t bits = xEventGroupWaitBits(handle->event_group, READY_BIT, pdFALSE, pdTRUE, ticks_to_wait);
+    return (bits & READY_BIT) != 0;
+}
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+bool aws_iot_shadow_wait_for_ready_unless(aws_iot_shadow_handle_ptr handle, EventBits_t cancel_bits, TickType_t ticks_to_wait)
+{
+    EventBits_t bits = xEventGroupWaitBits(handle->event_group, READY_BIT | cancel_bits, pdFALSE, pdFALSE, ticks_to_wait);
+    return (bits & READY_BIT) != 0 && (bits & cancel_bits) == 0;
+}
+#endif
+
+#if AWS_IOT_SHADOW_VERSION_FILTER
+esp_err_t aws_iot_shadow_discard_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_discard_stats *stats)
+{
+    if (handle == NULL || stats == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // One lock at a time, the MQTT task can hold the router lock while waiting for the worker
+    aws_iot_shadow_router_dispatch_lock(handle);
+    *stats = handle->accepted_discards;
+    aws_iot_shadow_router_dispatch_unlock(handle);
+
+    aws_iot_shadow_router_lock();
+    stats->duplicate += handle->delta_discards.duplicate;
+    stats->stale += handle->delta_discards.stale;
+    aws_iot_shadow_router_unlock();
+    return ESP_OK;
+}
+#endif
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+esp_err_t aws_iot_shadow_restore(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_persistence *persistence)
+{
+    if (handle == NULL || persistence == NULL || persistence->load == NULL || persistence->store == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char *data = NULL;
+    size_t data_len = 0;
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+    handle->persistence = *persistence;
+    snprintf(handle->snapshot_key, sizeof(handle->snapshot_key), "shadow%08" PRIx32, handle->topic_prefix_hash);
+    esp_err_t err = aws_iot_shadow_snapshot_load(handle, &data, &data_len);
+    aws_iot_shadow_router_dispatch_unlock(handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGI(TAG, "%s has no stored state: %d (%s)", handle->topic_prefix, err, esp_err_to_name(err));
+        return err;
+    }
+
+    // Same path as received messages, so it is ordered with them
+    ESP_LOGI(TAG, "%s restored stored state (%zu bytes)", handle->topic_prefix, data_len);
+    aws_iot_shadow_event_raise(handle, AWS_IOT_SHADOW_EVENT_RESTORED, data, data_len);
+
+    free(data);
+    return ESP_OK;
 }
+#endif
 
 esp_err_t aws_iot_shadow_request_get(aws_iot_shadow_handle_ptr handle)
 {
@@ -543,29 +1486,73 @@ esp_err_t aws_iot_shadow_request_get(aws_iot_shadow_handle_ptr handle)
         return ESP_ERR_INVALID_SIZE; // buffer overflow
     }
 
+#if AWS_IOT_SHADOW_TRACE
+    aws_iot_shadow_trace(handle, AWS_IOT_SHADOW_TRACE_PUBLISH, AWS_IOT_SHADOW_TRACE_OP_GET, 0);
+#else
     ESP_LOGI(TAG, "sending %s", topic_name);
+#endif
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    return aws_iot_shadow_throttle_publish(handle, topic_name, NULL, 0, AWS_IOT_SHADOW_PRIORITY_HIGH);
+#else
     int msg_id = esp_mqtt_client_publish(handle->client, topic_name, NULL, 0, 1, 0);
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_stats_published(handle, msg_id);
+#endif
     return msg_id != -1 ? ESP_OK : ESP_FAIL;
+#endif
+}
+
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+esp_err_t aws_iot_shadow_request_update(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len)
+{
+    return aws_iot_shadow_request_update_priority(handle, data, data_len, AWS_IOT_SHADOW_PRIORITY_NORMAL);
 }
 
+esp_err_t aws_iot_shadow_request_update_priority(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len,
+                                                 enum aws_iot_shadow_priority priority)
+#else
 esp_err_t aws_iot_shadow_request_update(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len)
+#endif
 {
     if (handle == NULL || data == NULL || data_len > INT_MAX)
     {
         return ESP_ERR_INVALID_ARG;
     }
 
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+    esp_err_t err = aws_iot_shadow_journal_add(handle, data, data_len);
+    if (err != ESP_ERR_INVALID_STATE)
+    {
+        return err; // journaled until ready, or failed
+    }
+#endif
+
     char topic_name[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH] = {};
     if (aws_iot_shadow_topic_name(handle, AWS_IOT_SHADOW_OP_UPDATE, topic_name, sizeof(topic_name)) == NULL)
     {
         return ESP_ERR_INVALID_SIZE; // buffer overflow
     }
 
+#if AWS_IOT_SHADOW_TRACE
+    aws_iot_shadow_trace(handle, AWS_IOT_SHADOW_TRACE_PUBLISH, AWS_IOT_SHADOW_TRACE_OP_UPDATE, data_len);
+#else
     ESP_LOGI(TAG, "sending %s (%zu bytes)", topic_name, data_len);
+#endif
     ESP_LOGD(TAG, "sending %s payload: %.*s", topic_name, (int)data_len, data);
 
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    if (priority == AWS_IOT_SHADOW_PRIORITY_DEFAULT)
+    {
+        priority = AWS_IOT_SHADOW_PRIORITY_NORMAL;
+    }
+    return aws_iot_shadow_throttle_publish(handle, topic_name, data, data_len, priority);
+#else
     int msg_id = esp_mqtt_client_publish(handle->client, topic_name, data, (int)data_len, 1, 0);
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_stats_published(handle, msg_id);
+#endif
     return msg_id != -1 ? ESP_OK : ESP_FAIL;
+#endif
 }
 
 #if AWS_IOT_SHADOW_SUPPORT_DELETE
@@ -582,8 +1569,19 @@ esp_err_t aws_iot_shadow_request_delete(aws_iot_shadow_handle_ptr handle)
         return ESP_ERR_INVALID_SIZE; // buffer overflow
     }
 
+#if AWS_IOT_SHADOW_TRACE
+    aws_iot_shadow_trace(handle, AWS_IOT_SHADOW_TRACE_PUBLISH, AWS_IOT_SHADOW_TRACE_OP_DELETE, 0);
+#else
     ESP_LOGI(TAG, "sending %s", topic_name);
+#endif
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    return aws_iot_shadow_throttle_publish(handle, topic_name, NULL, 0, AWS_IOT_SHADOW_PRIORITY_HIGH);
+#else
     int msg_id = esp_mqtt_client_publish(handle->client, topic_name, NULL, 0, 1, 0);
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_stats_published(handle, msg_id);
+#endif
     return msg_id != -1 ? ESP_OK : ESP_FAIL;
+#endif
 }
 #endif
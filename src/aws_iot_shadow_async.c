@@ -0,0 +1,460 @@
+#include "aws_iot_shadow_async.h"
+#include "aws_iot_shadow_handle.h"
+#include "aws_iot_shadow_json.h"
+#include "aws_iot_shadow_stats.h"
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+
+static const char TAG[] = "aws_iot_shadow";
+
+// Ring positions are free running 32-bit counters, so its size must be a power of 2
+#define ASYNC_RING_SIZE                              \
+    (AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH <= 1    ? 1U  \
+     : AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH <= 2  ? 2U  \
+     : AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH <= 4  ? 4U  \
+     : AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH <= 8  ? 8U  \
+     : AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH <= 16 ? 16U \
+                                               : 32U)
+#define ASYNC_RING_MASK (ASYNC_RING_SIZE - 1)
+
+// Queued events, plus one held by the worker, plus one for the producer to merge deltas into
+#define ASYNC_BUFFER_COUNT (AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH + 2)
+#define ASYNC_BUFFER_NONE (0xFFU)
+
+_Static_assert(ASYNC_BUFFER_COUNT <= 32, "free buffers are tracked in a 32-bit mask");
+
+/**
+ * @brief Ring entry, sequence follows the bounded queue of D. Vyukov.
+ *
+ * sequence == position: free for the producer, sequence == position + 1: queued.
+ * Both the worker and the producer (dropping the oldest event) may dequeue, by advancing the tail.
+ */
+struct async_entry
+{
+    atomic_uint sequence;
+    _Atomic(aws_iot_shadow_handle_ptr) handle; // NULL when purged
+    enum aws_iot_shadow_event event_id;
+    atomic_uint_least8_t buffer; // pool index, swapped when deltas are merged
+    char *heap_data;             // payload larger than a pooled buffer
+    size_t heap_len;
+};
+
+struct async_event
+{
+    aws_iot_shadow_handle_ptr handle;
+    enum aws_iot_shadow_event event_id;
+    uint8_t buffer;
+    char *heap_data;
+    size_t heap_len;
+};
+
+struct aws_iot_shadow_async
+{
+    struct async_entry entries[ASYNC_RING_SIZE];
+    atomic_uint head; // written by producer only
+    atomic_uint tail;
+
+    char *buffers;
+    size_t buffer_len[ASYNC_BUFFER_COUNT];
+    atomic_uint free_buffers; // bit per buffer
+
+    SemaphoreHandle_t mutex; // held by worker while running handlers
+    SemaphoreHandle_t wake;
+#if AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK
+    SemaphoreHandle_t space;
+#endif
+    TaskHandle_t task;
+    atomic_bool stop;
+
+    uint32_t dropped;
+    uint32_t coalesced;
+};
+
+static uint8_t aws_iot_shadow_async_buffer_alloc(struct aws_iot_shadow_async *async)
+{
+    unsigned int free_buffers = atomic_load(&async->free_buffers);
+    while (free_buffers != 0)
+    {
+        unsigned int bit = free_buffers & -free_buffers;
+        if (atomic_compare_exchange_weak(&async->free_buffers, &free_buffers, free_buffers & ~bit))
+        {
+            return (uint8_t)__builtin_ctz(bit);
+        }
+    }
+    return ASYNC_BUFFER_NONE;
+}
+
+static void aws_iot_shadow_async_buffer_free(struct aws_iot_shadow_async *async, uint8_t buffer)
+{
+    if (buffer != ASYNC_BUFFER_NONE)
+    {
+        atomic_fetch_or(&async->free_buffers, 1U << buffer);
+    }
+}
+
+static inline char *aws_iot_shadow_async_buffer(struct aws_iot_shadow_async *async, uint8_t buffer)
+{
+    return async->buffers + (size_t)buffer * AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE;
+}
+
+static void aws_iot_shadow_async_event_release(struct aws_iot_shadow_async *async, struct async_event *event)
+{
+    aws_iot_shadow_async_buffer_free(async, event->buffer);
+    free(event->heap_data);
+}
+
+static bool aws_iot_shadow_async_dequeue(struct aws_iot_shadow_async *async, struct async_event *event)
+{
+    unsigned int pos = atomic_load_explicit(&async->tail, memory_order_relaxed);
+    struct async_entry *entry;
+
+    for (;;)
+    {
+        entry = &async->entries[pos & ASYNC_RING_MASK];
+        unsigned int seq = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+        int diff = (int)(seq - (pos + 1));
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&async->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false; // empty
+        }
+        else
+        {
+            pos = atomic_load_explicit(&async->tail, memory_order_relaxed);
+        }
+    }
+
+    // Copy out and release the entry right away, payload buffer stays owned by the caller
+    event->handle = atomic_load(&entry->handle);
+    event->event_id = entry->event_id;
+    event->buffer = atomic_exchange(&entry->buffer, ASYNC_BUFFER_NONE);
+    event->heap_data = entry->heap_data;
+    event->heap_len = entry->heap_len;
+
+    atomic_store_explicit(&entry->sequence, pos + ASYNC_RING_SIZE, memory_order_release);
+    return true;
+}
+
+static bool aws_iot_shadow_async_has_room(struct aws_iot_shadow_async *async)
+{
+    unsigned int pos = atomic_load_explicit(&async->head, memory_order_relaxed);
+    if (pos - atomic_load_explicit(&async->tail, memory_order_acquire) >= AWS_IOT_SHADOW_ASYNC_QUEUE_LENGTH)
+    {
+        return false;
+    }
+
+    // Entry might be still being copied out by the worker
+    return atomic_load_explicit(&async->entries[pos & ASYNC_RING_MASK].sequence, memory_order_acquire) == pos;
+}
+
+#if AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_COALESCE_DELTA && AWS_IOT_SHADOW_SUPPORT_DELTA
+static bool aws_iot_shadow_async_coalesce(struct aws_iot_shadow_async *async, aws_iot_shadow_handle_ptr handle,
+                                          const char *data, size_t data_len)
+{
+    if (data == NULL || data_len >= AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE)
+    {
+        return false;
+    }
+
+    unsigned int head = atomic_load_explicit(&async->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&async->tail, memory_order_acquire);
+
+    // Newest queued event of the shadow must be a delta, so order of its events does not change
+    for (unsigned int pos = head; pos != tail;)
+    {
+        pos--;
+        struct async_entry *entry = &async->entries[pos & ASYNC_RING_MASK];
+        if (atomic_load(&entry->handle) != handle)
+        {
+            continue;
+        }
+
+        uint8_t queued = atomic_load(&entry->buffer);
+        if (entry->event_id != AWS_IOT_SHADOW_EVENT_UPDATE_DELTA || queued == ASYNC_BUFFER_NONE)
+        {
+            return false; // not a delta, taken by the worker meanwhile, or not pooled
+        }
+
+        // Only producer allocates buffers, so queued one stays intact while it is read here,
+        // even if the worker takes it meanwhile
+        uint8_t merged = aws_iot_shadow_async_buffer_alloc(async);
+        if (merged == ASYNC_BUFFER_NONE)
+        {
+            return false;
+        }
+
+        struct aws_iot_shadow_json_value target, patch;
+        size_t merged_len;
+        if (aws_iot_shadow_json_parse(aws_iot_shadow_async_buffer(async, queued), async->buffer_len[queued], &target) != ESP_OK
+            || aws_iot_shadow_json_parse(data, data_len, &patch) != ESP_OK
+            || aws_iot_shadow_json_merge_patch(&target, &patch, aws_iot_shadow_async_buffer(async, merged),
+                                               AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE, &merged_len)
+                   != ESP_OK)
+        {
+            aws_iot_shadow_async_buffer_free(async, merged);
+            return false;
+        }
+        async->buffer_len[merged] = merged_len;
+
+        // Fails if the worker took the entry meanwhile
+        if (!atomic_compare_exchange_strong(&entry->buffer, &queued, merged))
+        {
+            aws_iot_shadow_async_buffer_free(async, merged);
+            return false;
+        }
+
+        aws_iot_shadow_async_buffer_free(async, queued);
+        async->coalesced++;
+        ESP_LOGD(TAG, "event queue full, merged delta of %s", handle->topic_prefix);
+        return true;
+    }
+    return false;
+}
+#endif
+
+void aws_iot_shadow_async_post(struct aws_iot_shadow_async *async, aws_iot_shadow_handle_ptr handle,
+                               enum aws_iot_shadow_event event_id, const char *data, size_t data_len)
+{
+    while (!aws_iot_shadow_async_has_room(async))
+    {
+#if AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK
+        if (xSemaphoreTake(async->space, pdMS_TO_TICKS(AWS_IOT_SHADOW_ASYNC_BLOCK_TIMEOUT_MS)) == pdTRUE)
+        {
+            continue;
+        }
+        // Worker is stuck, e.g. its handler waits for a lock of the MQTT task
+        ESP_LOGW(TAG, "worker did not take an event in %d ms", AWS_IOT_SHADOW_ASYNC_BLOCK_TIMEOUT_MS);
+#elif AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_COALESCE_DELTA && AWS_IOT_SHADOW_SUPPORT_DELTA
+        if (event_id == AWS_IOT_SHADOW_EVENT_UPDATE_DELTA && aws_iot_shadow_async_coalesce(async, handle, data, data_len))
+        {
+            return;
+        }
+#endif
+        struct async_event dropped;
+        if (aws_iot_shadow_async_dequeue(async, &dropped))
+        {
+            async->dropped++;
+            ESP_LOGW(TAG, "event queue full, dropped event %d of %s", dropped.event_id,
+                     dropped.handle ? dropped.handle->topic_prefix : "deleted shadow");
+#if AWS_IOT_SHADOW_STATS
+            if (dropped.handle != NULL)
+            {
+                aws_iot_shadow_stats_dropped(dropped.handle);
+            }
+#endif
+            aws_iot_shadow_async_event_release(async, &dropped);
+        }
+        else
+        {
+            taskYIELD(); // worker is just releasing an entry
+        }
+    }
+
+    // Copy payload
+    uint8_t buffer = ASYNC_BUFFER_NONE;
+    char *heap_data = NULL;
+    if (data != NULL && data_len > 0)
+    {
+        if (data_len <= AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE && (buffer = aws_iot_shadow_async_buffer_alloc(async)) != ASYNC_BUFFER_NONE)
+        {
+            memcpy(aws_iot_shadow_async_buffer(async, buffer), data, data_len);
+            async->buffer_len[buffer] = data_len;
+        }
+        else
+        {
+            heap_data = (char *)malloc(data_len);
+            if (heap_data == NULL)
+            {
+                ESP_LOGE(TAG, "failed to allocate %zu bytes, dropped event %d of %s", data_len, event_id, handle->topic_prefix);
+#if AWS_IOT_SHADOW_STATS
+                aws_iot_shadow_stats_dropped(handle);
+#endif
+                return;
+            }
+            memcpy(heap_data, data, data_len);
+        }
+    }
+
+    // Enqueue, there is a room
+    unsigned int pos = atomic_load_explicit(&async->head, memory_order_relaxed);
+    struct async_entry *entry = &async->entries[pos & ASYNC_RING_MASK];
+    atomic_store(&entry->handle, handle);
+    entry->event_id = event_id;
+    atomic_store(&entry->buffer, buffer);
+    entry->heap_data = heap_data;
+    entry->heap_len = heap_data ? data_len : 0;
+
+    atomic_store_explicit(&entry->sequence, pos + 1, memory_order_release);
+    atomic_store_explicit(&async->head, pos + 1, memory_order_release);
+
+    xSemaphoreGive(async->wake);
+}
+
+void aws_iot_shadow_async_purge(struct aws_iot_shadow_async *async, aws_iot_shadow_handle_ptr handle)
+{
+    // Worker takes events only while holding the lock
+    xSemaphoreTakeRecursive(async->mutex, portMAX_DELAY);
+
+    unsigned int head = atomic_load_explicit(&async->head, memory_order_acquire);
+    for (unsigned int pos = atomic_load(&async->tail); pos != head; pos++)
+    {
+        aws_iot_shadow_handle_ptr expected = handle;
+        atomic_compare_exchange_strong(&async->entries[pos & ASYNC_RING_MASK].handle, &expected, NULL);
+    }
+
+    xSemaphoreGiveRecursive(async->mutex);
+}
+
+void aws_iot_shadow_async_lock(struct aws_iot_shadow_async *async)
+{
+    xSemaphoreTakeRecursive(async->mutex, portMAX_DELAY);
+}
+
+void aws_iot_shadow_async_unlock(struct aws_iot_shadow_async *async)
+{
+    xSemaphoreGiveRecursive(async->mutex);
+}
+
+bool aws_iot_shadow_async_lock_held(struct aws_iot_shadow_async *async)
+{
+    return xSemaphoreGetMutexHolder(async->mutex) == xTaskGetCurrentTaskHandle();
+}
+
+static void aws_iot_shadow_async_delete(struct aws_iot_shadow_async *async);
+
+static void aws_iot_shadow_async_worker(void *arg)
+{
+    struct aws_iot_shadow_async *async = (struct aws_iot_shadow_async *)arg;
+
+    for (;;)
+    {
+        xSemaphoreTake(async->wake, portMAX_DELAY);
+        if (atomic_load(&async->stop))
+        {
+            aws_iot_shadow_async_delete(async);
+            vTaskDelete(NULL);
+        }
+
+        // Drain
+        bool more = true;
+        while (more)
+        {
+            xSemaphoreTakeRecursive(async->mutex, portMAX_DELAY);
+
+            struct async_event event;
+            more = aws_iot_shadow_async_dequeue(async, &event);
+            if (more)
+            {
+#if AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK
+                xSemaphoreGive(async->space);
+#endif
+                if (event.handle != NULL)
+                {
+                    if (event.buffer != ASYNC_BUFFER_NONE)
+                    {
+                        aws_iot_shadow_event_run(event.handle, event.event_id, aws_iot_shadow_async_buffer(async, event.buffer),
+                                                 async->buffer_len[event.buffer]);
+                    }
+                    else
+                    {
+                        aws_iot_shadow_event_run(event.handle, event.event_id, event.heap_data, event.heap_len);
+                    }
+                }
+                aws_iot_shadow_async_event_release(async, &event);
+            }
+
+            xSemaphoreGiveRecursive(async->mutex);
+        }
+    }
+}
+
+static void aws_iot_shadow_async_delete(struct aws_iot_shadow_async *async)
+{
+    if (async->mutex)
+    {
+        vSemaphoreDelete(async->mutex);
+    }
+    if (async->wake)
+    {
+        vSemaphoreDelete(async->wake);
+    }
+#if AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK
+    if (async->space)
+    {
+        vSemaphoreDelete(async->space);
+    }
+#endif
+    free(async->buffers);
+    free(async);
+}
+
+esp_err_t aws_iot_shadow_async_create(struct aws_iot_shadow_async **async)
+{
+    struct aws_iot_shadow_async *result = (struct aws_iot_shadow_async *)calloc(1, sizeof(*result));
+    if (result == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    result->buffers = (char *)malloc((size_t)ASYNC_BUFFER_COUNT * AWS_IOT_SHADOW_ASYNC_BUFFER_SIZE);
+    result->mutex = xSemaphoreCreateRecursiveMutex();
+    result->wake = xSemaphoreCreateBinary();
+#if AWS_IOT_SHADOW_ASYNC_OVERFLOW == AWS_IOT_SHADOW_ASYNC_OVERFLOW_BLOCK
+    result->space = xSemaphoreCreateBinary();
+    if (result->space == NULL)
+    {
+        aws_iot_shadow_async_delete(result);
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    if (result->buffers == NULL || result->mutex == NULL || result->wake == NULL)
+    {
+        aws_iot_shadow_async_delete(result);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (unsigned int i = 0; i < ASYNC_RING_SIZE; i++)
+    {
+        atomic_init(&result->entries[i].sequence, i);
+        atomic_init(&result->entries[i].handle, NULL);
+        atomic_init(&result->entries[i].buffer, ASYNC_BUFFER_NONE);
+    }
+    atomic_init(&result->head, 0);
+    atomic_init(&result->tail, 0);
+    atomic_init(&result->stop, false);
+    atomic_init(&result->free_buffers, ASYNC_BUFFER_COUNT == 32 ? UINT32_MAX : (1U << ASYNC_BUFFER_COUNT) - 1);
+
+    // Deleted only if the dispatcher owning it fails to start
+    if (xTaskCreate(aws_iot_shadow_async_worker, "aws_iot_shadow", AWS_IOT_SHADOW_ASYNC_TASK_STACK_SIZE, result,
+                    AWS_IOT_SHADOW_ASYNC_TASK_PRIORITY, &result->task)
+        != pdPASS)
+    {
+        ESP_LOGE(TAG, "failed to create worker task");
+        aws_iot_shadow_async_delete(result);
+        return ESP_ERR_NO_MEM;
+    }
+
+    *async = result;
+    return ESP_OK;
+}
+
+void aws_iot_shadow_async_destroy(struct aws_iot_shadow_async *async)
+{
+    atomic_store(&async->stop, true);
+    xSemaphoreGive(async->wake);
+}
+
+#endif
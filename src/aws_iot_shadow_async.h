@@ -0,0 +1,64 @@
+#ifndef AWS_IOT_SHADOW_ASYNC_H
+#define AWS_IOT_SHADOW_ASYNC_H
+
+#include "aws_iot_shadow.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Event queue and worker task, calling shadow handlers off the MQTT task.
+ *
+ * There is a single producer, the dispatcher of a MQTT client (serialized by its lock),
+ * and a single consumer, the worker task.
+ */
+struct aws_iot_shadow_async;
+
+esp_err_t aws_iot_shadow_async_create(struct aws_iot_shadow_async **async);
+
+/**
+ * @brief Stops the worker and releases everything, the worker task exits on its own.
+ * Only before any event has been posted.
+ */
+void aws_iot_shadow_async_destroy(struct aws_iot_shadow_async *async);
+
+/**
+ * @brief Queues an event, payload is copied. Must be called under dispatcher lock.
+ *
+ * With the block overflow policy, a full queue makes it wait for the worker, up to
+ * AWS_IOT_SHADOW_ASYNC_BLOCK_TIMEOUT_MS, before the oldest event is dropped. The caller holds the MQTT client
+ * lock meanwhile, so a handler sending anything waits as long.
+ */
+void aws_iot_shadow_async_post(struct aws_iot_shadow_async *async, aws_iot_shadow_handle_ptr handle,
+                               enum aws_iot_shadow_event event_id, const char *data, size_t data_len);
+
+/**
+ * @brief Discards queued events of the handle, after it has been removed from the dispatcher.
+ *
+ * When it returns, worker is not running any handler of the handle.
+ */
+void aws_iot_shadow_async_purge(struct aws_iot_shadow_async *async, aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Lock held by the worker while it runs handlers (recursive).
+ */
+void aws_iot_shadow_async_lock(struct aws_iot_shadow_async *async);
+
+void aws_iot_shadow_async_unlock(struct aws_iot_shadow_async *async);
+
+/**
+ * @brief Whether the calling task holds the lock, e.g. it is the worker running a handler.
+ */
+bool aws_iot_shadow_async_lock_held(struct aws_iot_shadow_async *async);
+
+// Implemented by aws_iot_shadow.c
+
+void aws_iot_shadow_event_run(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                              const char *data, size_t data_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,341 @@
+#include "aws_iot_shadow_cache.h"
+#include "aws_iot_shadow_handle.h"
+#include "aws_iot_shadow_json.h"
+#include "aws_iot_shadow_router.h"
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+
+static const char TAG[] = "aws_iot_shadow";
+
+#define CACHE_UPDATE_PREFIX "{\"" AWS_IOT_SHADOW_JSON_STATE "\":{\"" AWS_IOT_SHADOW_JSON_REPORTED "\":"
+#define CACHE_UPDATE_PREFIX_LENGTH (sizeof(CACHE_UPDATE_PREFIX) - 1)
+#define CACHE_UPDATE_SUFFIX "}}"
+#define CACHE_UPDATE_SUFFIX_LENGTH (sizeof(CACHE_UPDATE_SUFFIX) - 1)
+
+static void aws_iot_shadow_cache_clear(struct aws_iot_shadow_cached_document *doc)
+{
+    free(doc->data);
+    doc->data = NULL;
+    doc->len = 0;
+}
+
+/**
+ * @brief Takes ownership of data, or forgets the state if it is too large.
+ */
+static void aws_iot_shadow_cache_store(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_cached_document *doc,
+                                       char *data, size_t len)
+{
+    aws_iot_shadow_cache_clear(doc);
+    if (len > AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE)
+    {
+        ESP_LOGW(TAG, "%s state has %zu bytes, not cached, see CONFIG_AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE",
+                 handle->topic_prefix, len);
+        free(data);
+        return;
+    }
+    doc->data = data;
+    doc->len = len;
+}
+
+/**
+ * @brief Replaces cached state, missing or null state is an empty object.
+ */
+static void aws_iot_shadow_cache_replace(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_cached_document *doc,
+                                         const struct aws_iot_shadow_json_value *value)
+{
+    const char *data = "{}";
+    size_t len = 2;
+    if (value->type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        data = value->data;
+        len = value->len;
+    }
+
+    char *copy = (char *)malloc(len + 1);
+    if (copy == NULL)
+    {
+        ESP_LOGE(TAG, "failed to allocate %zu bytes for cached state", len + 1);
+        aws_iot_shadow_cache_clear(doc);
+        return;
+    }
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    aws_iot_shadow_cache_store(handle, doc, copy, len);
+}
+
+/**
+ * @brief Applies accepted update to cached state, if it is known.
+ */
+static void aws_iot_shadow_cache_merge(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_cached_document *doc,
+                                       const struct aws_iot_shadow_json_value *patch)
+{
+    if (doc->data == NULL || patch->type == AWS_IOT_SHADOW_JSON_TYPE_INVALID)
+    {
+        return;
+    }
+    if (patch->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        // null deletes whole state
+        aws_iot_shadow_cache_replace(handle, doc, patch);
+        return;
+    }
+
+    struct aws_iot_shadow_json_value target = {
+        .type = AWS_IOT_SHADOW_JSON_TYPE_OBJECT,
+        .data = doc->data,
+        .len = doc->len,
+    };
+
+    // Merged members come from either document, plus a separator each
+    size_t buf_len = doc->len + patch->len + 2;
+    char *buf = (char *)malloc(buf_len);
+    if (buf == NULL)
+    {
+        ESP_LOGE(TAG, "failed to allocate %zu bytes for cached state", buf_len);
+        aws_iot_shadow_cache_clear(doc);
+        return;
+    }
+
+    size_t len = 0;
+    esp_err_t err = aws_iot_shadow_json_merge_patch(&target, patch, buf, buf_len, &len);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "%s failed to merge accepted state: %d, cache cleared", handle->topic_prefix, err);
+        free(buf);
+        aws_iot_shadow_cache_clear(doc);
+        return;
+    }
+    aws_iot_shadow_cache_store(handle, doc, buf, len);
+}
+
+bool aws_iot_shadow_cache_event(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event *event_id,
+                                const char *data, size_t data_len)
+{
+    __unused bool restored = false;
+    switch ((int)*event_id) // includes private AWS_IOT_SHADOW_EVENT_RESTORED
+    {
+#if AWS_IOT_SHADOW_PERSISTENCE
+    case AWS_IOT_SHADOW_EVENT_RESTORED:
+        // Live state, received before restored one was processed, is newer
+        if (handle->cached_reported.data != NULL || handle->cached_desired.data != NULL)
+        {
+            ESP_LOGD(TAG, "%s state already known, restored state discarded", handle->topic_prefix);
+            return false;
+        }
+        *event_id = AWS_IOT_SHADOW_EVENT_GET_ACCEPTED;
+        restored = true;
+        break;
+#endif
+    case AWS_IOT_SHADOW_EVENT_GET_ACCEPTED:
+    case AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED:
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+    case AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED:
+#endif
+        break;
+    default:
+        return true;
+    }
+
+    struct aws_iot_shadow_json_document doc;
+    esp_err_t err = aws_iot_shadow_json_parse_document(data, data_len, &doc);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "%s failed to parse accepted state: %d, cache cleared", handle->topic_prefix, err);
+        aws_iot_shadow_cache_clear(&handle->cached_reported);
+        aws_iot_shadow_cache_clear(&handle->cached_desired);
+        return true;
+    }
+
+    bool dispatch = true;
+#if AWS_IOT_SHADOW_PERSISTENCE
+    if (restored)
+    {
+        // Until confirmed or replaced by next /get/accepted
+        handle->restored_version = doc.version;
+        handle->restore_pending = true;
+    }
+    else if (*event_id == AWS_IOT_SHADOW_EVENT_GET_ACCEPTED && handle->restore_pending)
+    {
+        handle->restore_pending = false;
+        if (doc.has_version && doc.version == handle->restored_version)
+        {
+            ESP_LOGI(TAG, "%s state has not changed since restored version %lld", handle->topic_prefix,
+                     (long long)doc.version);
+            dispatch = false;
+        }
+    }
+#endif
+
+    if (*event_id == AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED)
+    {
+        aws_iot_shadow_cache_merge(handle, &handle->cached_reported, &doc.reported);
+        aws_iot_shadow_cache_merge(handle, &handle->cached_desired, &doc.desired);
+    }
+    else
+    {
+        // Deleted shadow exists again, empty, after next update
+        aws_iot_shadow_cache_replace(handle, &handle->cached_reported, &doc.reported);
+        aws_iot_shadow_cache_replace(handle, &handle->cached_desired, &doc.desired);
+    }
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+    if (!restored && doc.has_version)
+    {
+        handle->cached_version = doc.version;
+        handle->has_cached_version = true;
+
+        // Writes block the dispatching task and wear flash, so once per connection, later versions at delete
+        if (*event_id == AWS_IOT_SHADOW_EVENT_GET_ACCEPTED)
+        {
+            aws_iot_shadow_snapshot_save(handle, doc.version);
+        }
+    }
+#endif
+    return dispatch;
+}
+
+void aws_iot_shadow_cache_free(aws_iot_shadow_handle_ptr handle)
+{
+    aws_iot_shadow_cache_clear(&handle->cached_reported);
+    aws_iot_shadow_cache_clear(&handle->cached_desired);
+}
+
+esp_err_t aws_iot_shadow_request_update_reported(aws_iot_shadow_handle_ptr handle, const char *reported, size_t reported_len)
+{
+    if (handle == NULL || reported == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct aws_iot_shadow_json_value next;
+    esp_err_t err = aws_iot_shadow_json_parse(reported, reported_len, &next);
+    if (err != ESP_OK || next.type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+
+    struct aws_iot_shadow_json_value prev = {
+        .type = handle->cached_reported.data ? AWS_IOT_SHADOW_JSON_TYPE_OBJECT : AWS_IOT_SHADOW_JSON_TYPE_INVALID,
+        .data = handle->cached_reported.data,
+        .len = handle->cached_reported.len,
+    };
+#if AWS_IOT_SHADOW_PERSISTENCE
+    if (handle->restore_pending)
+    {
+        // Restored state might be outdated
+        prev.type = AWS_IOT_SHADOW_JSON_TYPE_INVALID;
+        prev.len = 0;
+    }
+#endif
+
+    // Removed members are written as `"key":null`, at most twice their size in prev
+    size_t full_len = CACHE_UPDATE_PREFIX_LENGTH + next.len + CACHE_UPDATE_SUFFIX_LENGTH;
+    size_t buf_len = full_len + 2 * prev.len + 1;
+    char *buf = (char *)malloc(buf_len);
+    if (buf == NULL)
+    {
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t diff_len = 0;
+    memcpy(buf, CACHE_UPDATE_PREFIX, CACHE_UPDATE_PREFIX_LENGTH);
+    err = aws_iot_shadow_json_diff(&prev, &next, buf + CACHE_UPDATE_PREFIX_LENGTH,
+                                   buf_len - CACHE_UPDATE_PREFIX_LENGTH - CACHE_UPDATE_SUFFIX_LENGTH, &diff_len);
+    if (err != ESP_OK)
+    {
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        free(buf);
+        return err == ESP_ERR_INVALID_SIZE ? err : ESP_ERR_INVALID_ARG;
+    }
+
+    if (diff_len == 2) // {}
+    {
+        handle->cache_stats.updates_skipped++;
+        handle->cache_stats.bytes_saved += full_len;
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        free(buf);
+        ESP_LOGD(TAG, "%s reported state has not changed", handle->topic_prefix);
+        return ESP_OK;
+    }
+
+    size_t len = CACHE_UPDATE_PREFIX_LENGTH + diff_len;
+    memcpy(buf + len, CACHE_UPDATE_SUFFIX, CACHE_UPDATE_SUFFIX_LENGTH);
+    len += CACHE_UPDATE_SUFFIX_LENGTH;
+    aws_iot_shadow_router_dispatch_unlock(handle);
+
+    // Dispatch lock might be router lock, esp-mqtt might be waiting for it while holding its own
+    err = aws_iot_shadow_request_update(handle, buf, len);
+    free(buf);
+    if (err == ESP_OK)
+    {
+        aws_iot_shadow_router_dispatch_lock(handle);
+        handle->cache_stats.updates_sent++;
+        if (len < full_len)
+        {
+            handle->cache_stats.bytes_saved += full_len - len;
+        }
+        aws_iot_shadow_router_dispatch_unlock(handle);
+    }
+    return err;
+}
+
+static esp_err_t aws_iot_shadow_cache_copy(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_cached_document *doc,
+                                           char *buf, size_t buf_len, size_t *written)
+{
+    if (handle == NULL || buf == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_OK;
+    aws_iot_shadow_router_dispatch_lock(handle);
+    if (doc->data == NULL)
+    {
+        err = ESP_ERR_NOT_FOUND;
+    }
+    else if (doc->len >= buf_len)
+    {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    else
+    {
+        memcpy(buf, doc->data, doc->len + 1);
+        if (written)
+        {
+            *written = doc->len;
+        }
+    }
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    return err;
+}
+
+esp_err_t aws_iot_shadow_cached_reported(aws_iot_shadow_handle_ptr handle, char *buf, size_t buf_len, size_t *written)
+{
+    return aws_iot_shadow_cache_copy(handle, handle ? &handle->cached_reported : NULL, buf, buf_len, written);
+}
+
+esp_err_t aws_iot_shadow_cached_desired(aws_iot_shadow_handle_ptr handle, char *buf, size_t buf_len, size_t *written)
+{
+    return aws_iot_shadow_cache_copy(handle, handle ? &handle->cached_desired : NULL, buf, buf_len, written);
+}
+
+esp_err_t aws_iot_shadow_cache_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_cache_stats *stats)
+{
+    if (handle == NULL || stats == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+    *stats = handle->cache_stats;
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    return ESP_OK;
+}
+
+#endif
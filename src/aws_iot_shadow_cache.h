@@ -0,0 +1,49 @@
+#ifndef AWS_IOT_SHADOW_CACHE_H
+#define AWS_IOT_SHADOW_CACHE_H
+
+#include "aws_iot_shadow.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+// Restored state, dispatched to handlers as AWS_IOT_SHADOW_EVENT_GET_ACCEPTED
+#define AWS_IOT_SHADOW_EVENT_RESTORED ((enum aws_iot_shadow_event)(AWS_IOT_SHADOW_EVENT_MAX + 1))
+#endif
+
+#if AWS_IOT_SHADOW_DOCUMENT_CACHE
+/**
+ * @brief Updates cached state from an accepted response, before handlers run. Called under dispatch lock.
+ *
+ * @param event_id Event to dispatch, AWS_IOT_SHADOW_EVENT_RESTORED is changed to AWS_IOT_SHADOW_EVENT_GET_ACCEPTED.
+ * @return false if the event must not be dispatched to handlers.
+ */
+bool aws_iot_shadow_cache_event(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event *event_id,
+                                const char *data, size_t data_len);
+
+/**
+ * @brief Releases cached state, once the handle has been removed from the dispatcher.
+ */
+void aws_iot_shadow_cache_free(aws_iot_shadow_handle_ptr handle);
+#endif
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+/**
+ * @brief Reads stored snapshot, as a /get/accepted document. Called under dispatch lock.
+ *
+ * @param data Receives allocated document, caller frees it.
+ */
+esp_err_t aws_iot_shadow_snapshot_load(aws_iot_shadow_handle_ptr handle, char **data, size_t *data_len);
+
+/**
+ * @brief Stores cached state, unless the version has been already stored. Called under dispatch lock.
+ */
+void aws_iot_shadow_snapshot_save(aws_iot_shadow_handle_ptr handle, int64_t version);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
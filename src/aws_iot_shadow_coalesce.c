@@ -0,0 +1,359 @@
+#include "aws_iot_shadow_coalesce.h"
+#include "aws_iot_shadow_json.h"
+#include "aws_iot_shadow_router.h"
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_UPDATE_COALESCING
+
+static const char TAG[] = "aws_iot_shadow";
+
+#define COALESCE_UPDATE_PREFIX "{\"" AWS_IOT_SHADOW_JSON_STATE "\":{\"" AWS_IOT_SHADOW_JSON_REPORTED "\":"
+#define COALESCE_UPDATE_PREFIX_LENGTH (sizeof(COALESCE_UPDATE_PREFIX) - 1)
+#define COALESCE_UPDATE_SUFFIX "}}"
+#define COALESCE_UPDATE_SUFFIX_LENGTH (sizeof(COALESCE_UPDATE_SUFFIX) - 1)
+
+#if !AWS_IOT_SHADOW_REQUEST_TRACKING
+struct aws_iot_shadow_request_config; // fragments are never tracked, always NULL
+#endif
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+/**
+ * @brief Waiters of a merged update, owned by its pending request.
+ */
+struct aws_iot_shadow_coalesce_fanout
+{
+    uint8_t count;
+    struct aws_iot_shadow_coalesce_waiter waiters[];
+};
+
+static void aws_iot_shadow_coalesce_done(aws_iot_shadow_handle_ptr handle,
+                                         const struct aws_iot_shadow_request_completion *completion, void *arg)
+{
+    struct aws_iot_shadow_coalesce_fanout *fanout = (struct aws_iot_shadow_coalesce_fanout *)arg;
+    for (uint8_t i = 0; i < fanout->count; i++)
+    {
+        fanout->waiters[i].callback(handle, completion, fanout->waiters[i].arg);
+    }
+    free(fanout);
+}
+
+/**
+ * @brief Completes waiters of fragments which have no request, so no client token either.
+ */
+static void aws_iot_shadow_coalesce_fail(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_request_result result,
+                                         const struct aws_iot_shadow_coalesce_waiter *waiters, uint8_t waiter_count)
+{
+    struct aws_iot_shadow_request_completion completion = {
+        .result = result,
+        .event_id = AWS_IOT_SHADOW_EVENT_ANY,
+        .client_token = "",
+        .rtt_us = 0,
+        .data = NULL,
+        .data_len = 0,
+    };
+    for (uint8_t i = 0; i < waiter_count; i++)
+    {
+        waiters[i].callback(handle, &completion, waiters[i].arg);
+    }
+}
+
+static esp_err_t aws_iot_shadow_coalesce_send_tracked(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len,
+                                                      const struct aws_iot_shadow_coalesce_waiter *waiters,
+                                                      uint8_t waiter_count, uint32_t timeout_ms)
+{
+    esp_err_t err = ESP_ERR_NO_MEM;
+    struct aws_iot_shadow_coalesce_fanout *fanout =
+        (struct aws_iot_shadow_coalesce_fanout *)malloc(sizeof(*fanout) + waiter_count * sizeof(*waiters));
+    if (fanout != NULL)
+    {
+        fanout->count = waiter_count;
+        memcpy(fanout->waiters, waiters, waiter_count * sizeof(*waiters));
+
+        struct aws_iot_shadow_request_config config = {
+            .client_token = NULL,
+            .callback = aws_iot_shadow_coalesce_done,
+            .arg = fanout,
+            .timeout_ms = timeout_ms,
+        };
+        // Response can complete it before this returns
+        err = aws_iot_shadow_request_update_tracked(handle, data, data_len, &config);
+        if (err == ESP_OK)
+        {
+            return ESP_OK;
+        }
+        free(fanout);
+    }
+
+    aws_iot_shadow_coalesce_fail(handle, AWS_IOT_SHADOW_REQUEST_REJECTED, waiters, waiter_count);
+    return err;
+}
+#endif
+
+/**
+ * @brief Publishes merged fragments. Runs on the esp_timer task only, so merged updates are sent in order.
+ */
+static void aws_iot_shadow_coalesce_publish(void *arg)
+{
+    aws_iot_shadow_handle_ptr handle = (aws_iot_shadow_handle_ptr)arg;
+    if (__atomic_load_n(&handle->deleting, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    // Fragments added from now on open a new window
+    aws_iot_shadow_router_dispatch_lock(handle);
+    char *doc = handle->coalesce_doc;
+    size_t len = handle->coalesce_len;
+    handle->coalesce_doc = NULL;
+    handle->coalesce_len = 0;
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    struct aws_iot_shadow_coalesce_waiter waiters[AWS_IOT_SHADOW_COALESCE_MAX_WAITERS];
+    uint8_t waiter_count = handle->coalesce_waiter_count;
+    uint32_t timeout_ms = handle->coalesce_timeout_ms;
+    memcpy(waiters, handle->coalesce_waiters, waiter_count * sizeof(*waiters));
+    handle->coalesce_waiter_count = 0;
+    handle->coalesce_timeout_ms = 0;
+#endif
+    aws_iot_shadow_router_dispatch_unlock(handle);
+
+    if (doc == NULL)
+    {
+        return;
+    }
+
+    // Space for the suffix was allocated with the fragments
+    memcpy(doc + COALESCE_UPDATE_PREFIX_LENGTH + len, COALESCE_UPDATE_SUFFIX, COALESCE_UPDATE_SUFFIX_LENGTH);
+    len += COALESCE_UPDATE_PREFIX_LENGTH + COALESCE_UPDATE_SUFFIX_LENGTH;
+    ESP_LOGD(TAG, "%s publishing coalesced update (%zu bytes)", handle->topic_prefix, len);
+
+    esp_err_t err;
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    if (waiter_count > 0)
+    {
+        err = aws_iot_shadow_coalesce_send_tracked(handle, doc, len, waiters, waiter_count, timeout_ms);
+    }
+    else
+#endif
+    {
+        err = aws_iot_shadow_request_update(handle, doc, len);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s failed to publish coalesced update: %d (%s)", handle->topic_prefix, err, esp_err_to_name(err));
+    }
+    free(doc);
+}
+
+/**
+ * @brief Publishes merged fragments after given time. Called under dispatch lock.
+ */
+static void aws_iot_shadow_coalesce_schedule(aws_iot_shadow_handle_ptr handle, uint64_t timeout_us)
+{
+    // Not running is fine
+    esp_timer_stop(handle->coalesce_timer);
+    esp_err_t err = esp_timer_start_once(handle->coalesce_timer, timeout_us);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s failed to start coalescing timer: %d (%s)", handle->topic_prefix, err, esp_err_to_name(err));
+    }
+}
+
+static esp_err_t aws_iot_shadow_coalesce_add(aws_iot_shadow_handle_ptr handle, const char *reported, size_t reported_len,
+                                             const struct aws_iot_shadow_request_config *config)
+{
+    struct aws_iot_shadow_json_value fragment;
+    esp_err_t err = aws_iot_shadow_json_parse(reported, reported_len, &fragment);
+    if (err != ESP_OK || fragment.type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+
+    if (handle->coalesce_timer == NULL)
+    {
+        esp_timer_create_args_t timer_args = {
+            .callback = aws_iot_shadow_coalesce_publish,
+            .arg = handle,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "aws_iot_shadow_coalesce",
+        };
+        err = esp_timer_create(&timer_args, &handle->coalesce_timer);
+        if (err != ESP_OK)
+        {
+            aws_iot_shadow_router_dispatch_unlock(handle);
+            return err;
+        }
+    }
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    if (config != NULL && handle->coalesce_waiter_count >= AWS_IOT_SHADOW_COALESCE_MAX_WAITERS)
+    {
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+
+    // First fragment is merged into nothing as well, so it is validated the same way
+    struct aws_iot_shadow_json_value merged = {
+        .type = handle->coalesce_doc ? AWS_IOT_SHADOW_JSON_TYPE_OBJECT : AWS_IOT_SHADOW_JSON_TYPE_INVALID,
+        .data = handle->coalesce_doc ? handle->coalesce_doc + COALESCE_UPDATE_PREFIX_LENGTH : NULL,
+        .len = handle->coalesce_len,
+    };
+
+    // Merged members come from either fragment, plus a separator each
+    size_t merged_cap = handle->coalesce_len + fragment.len + 2;
+    char *doc = (char *)malloc(COALESCE_UPDATE_PREFIX_LENGTH + merged_cap + COALESCE_UPDATE_SUFFIX_LENGTH + 1);
+    if (doc == NULL)
+    {
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t len = 0;
+    memcpy(doc, COALESCE_UPDATE_PREFIX, COALESCE_UPDATE_PREFIX_LENGTH);
+    err = aws_iot_shadow_json_merge_update(&merged, &fragment, doc + COALESCE_UPDATE_PREFIX_LENGTH, merged_cap + 1, &len);
+    if (err != ESP_OK)
+    {
+        // Buffered fragments are kept
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        free(doc);
+        return err == ESP_ERR_INVALID_SIZE ? err : ESP_ERR_INVALID_ARG;
+    }
+
+    bool window_start = handle->coalesce_doc == NULL;
+    free(handle->coalesce_doc);
+    handle->coalesce_doc = doc;
+    handle->coalesce_len = len;
+
+    bool full = len >= AWS_IOT_SHADOW_COALESCE_MAX_SIZE;
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    if (config != NULL)
+    {
+        uint32_t timeout_ms = config->timeout_ms > 0 ? config->timeout_ms : AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS;
+        if (handle->coalesce_waiter_count == 0 || timeout_ms < handle->coalesce_timeout_ms)
+        {
+            handle->coalesce_timeout_ms = timeout_ms;
+        }
+
+        struct aws_iot_shadow_coalesce_waiter *waiter = &handle->coalesce_waiters[handle->coalesce_waiter_count++];
+        waiter->callback = config->callback;
+        waiter->arg = config->arg;
+        full = full || handle->coalesce_waiter_count >= AWS_IOT_SHADOW_COALESCE_MAX_WAITERS;
+    }
+#endif
+
+    if (full)
+    {
+        aws_iot_shadow_coalesce_schedule(handle, 0);
+    }
+    else if (window_start)
+    {
+        aws_iot_shadow_coalesce_schedule(handle, (uint64_t)AWS_IOT_SHADOW_COALESCE_WINDOW_MS * 1000);
+    }
+
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_request_update_coalesced(aws_iot_shadow_handle_ptr handle, const char *reported, size_t reported_len)
+{
+    if (handle == NULL || reported == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return aws_iot_shadow_coalesce_add(handle, reported, reported_len, NULL);
+}
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+esp_err_t aws_iot_shadow_request_update_coalesced_tracked(aws_iot_shadow_handle_ptr handle, const char *reported, size_t reported_len,
+                                                          const struct aws_iot_shadow_request_config *config)
+{
+    if (handle == NULL || reported == NULL || config == NULL || config->callback == NULL || config->client_token != NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return aws_iot_shadow_coalesce_add(handle, reported, reported_len, config);
+}
+#endif
+
+esp_err_t aws_iot_shadow_request_update_flush(aws_iot_shadow_handle_ptr handle)
+{
+    if (handle == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+    if (handle->coalesce_doc != NULL)
+    {
+        aws_iot_shadow_coalesce_schedule(handle, 0);
+    }
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    return ESP_OK;
+}
+
+void aws_iot_shadow_coalesce_free(aws_iot_shadow_handle_ptr handle)
+{
+    if (handle->coalesce_timer == NULL)
+    {
+        return; // nothing has been buffered
+    }
+    esp_timer_stop(handle->coalesce_timer);
+    esp_timer_delete(handle->coalesce_timer);
+    handle->coalesce_timer = NULL;
+
+    aws_iot_shadow_router_dispatch_lock(handle);
+    char *doc = handle->coalesce_doc;
+    handle->coalesce_doc = NULL;
+    handle->coalesce_len = 0;
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    struct aws_iot_shadow_coalesce_waiter waiters[AWS_IOT_SHADOW_COALESCE_MAX_WAITERS];
+    uint8_t waiter_count = handle->coalesce_waiter_count;
+    memcpy(waiters, handle->coalesce_waiters, waiter_count * sizeof(*waiters));
+    handle->coalesce_waiter_count = 0;
+#endif
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    free(doc);
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+    aws_iot_shadow_coalesce_fail(handle, AWS_IOT_SHADOW_REQUEST_CANCELLED, waiters, waiter_count);
+
+    // Merged updates waiting for a response, one at a time, callbacks run without lock
+    for (;;)
+    {
+        struct aws_iot_shadow_pending_request request = {.callback = NULL};
+        aws_iot_shadow_router_dispatch_lock(handle);
+        for (unsigned int i = 0; i < AWS_IOT_SHADOW_REQUEST_MAX_PENDING; i++)
+        {
+            struct aws_iot_shadow_pending_request *pending = &handle->pending_requests[i];
+            if (pending->client_token[0] != '\0' && pending->callback == aws_iot_shadow_coalesce_done)
+            {
+                request = *pending;
+                pending->client_token[0] = '\0';
+                handle->pending_count--;
+                break;
+            }
+        }
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        if (request.callback == NULL)
+        {
+            break;
+        }
+
+        struct aws_iot_shadow_request_completion completion = {
+            .result = AWS_IOT_SHADOW_REQUEST_CANCELLED,
+            .event_id = AWS_IOT_SHADOW_EVENT_ANY,
+            .client_token = request.client_token,
+            .rtt_us = esp_timer_get_time() - request.sent_at,
+            .data = NULL,
+            .data_len = 0,
+        };
+        aws_iot_shadow_coalesce_done(handle, &completion, request.arg);
+    }
+#endif
+}
+
+#endif
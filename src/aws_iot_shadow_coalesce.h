@@ -0,0 +1,25 @@
+#ifndef AWS_IOT_SHADOW_COALESCE_H
+#define AWS_IOT_SHADOW_COALESCE_H
+
+#include "aws_iot_shadow.h"
+#include "aws_iot_shadow_handle.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if AWS_IOT_SHADOW_UPDATE_COALESCING
+/**
+ * @brief Drops buffered fragments and the timer, waiters of fragments and of merged updates still pending
+ * are completed with AWS_IOT_SHADOW_REQUEST_CANCELLED. Takes dispatch lock, the handle must still be attached.
+ *
+ * Must be called before aws_iot_shadow_request_free(), merged updates still pending own their waiters.
+ */
+void aws_iot_shadow_coalesce_free(aws_iot_shadow_handle_ptr handle);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,771 @@
+#include "aws_iot_shadow_gateway.h"
+#include "aws_iot_shadow_json.h"
+#include "aws_iot_shadow_router.h"
+#include "aws_iot_shadow_topic.h"
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_GATEWAY
+
+static const char TAG[] = "aws_iot_shadow";
+
+#define GATEWAY_THING_NONE (0xFFFFU)
+#define GATEWAY_SLOT_NONE (0xFFU)
+#define GATEWAY_SUBSCRIBING (-1) // msg_id of a SUBSCRIBE being sent without router lock
+
+_Static_assert(AWS_IOT_SHADOW_GATEWAY_MAX_THINGS > 0 && AWS_IOT_SHADOW_GATEWAY_MAX_THINGS < GATEWAY_THING_NONE,
+               "AWS_IOT_SHADOW_GATEWAY_MAX_THINGS must be 1 - 65534");
+_Static_assert(AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED > 0 && AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED < GATEWAY_SLOT_NONE,
+               "AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED must be 1 - 254");
+
+// Thing flags
+#define GATEWAY_GET_PENDING (1U << 0) // get requested, response not received yet
+#define GATEWAY_GET_SENT (1U << 1)    // get published in this connection
+
+/**
+ * @brief Compact record of a child thing, instead of a whole shadow handle.
+ */
+struct gateway_thing
+{
+    uint32_t hash;
+    uint32_t name_offset; // in the name pool, NUL terminated
+    uint16_t next;        // in a hash bucket, or in the free list
+    uint8_t slot;         // subscription, GATEWAY_SLOT_NONE when not subscribed
+    uint8_t name_len;     // 0 for a free record
+    uint8_t flags;
+};
+
+struct gateway_slot
+{
+    uint16_t thing;     // GATEWAY_THING_NONE for a free slot
+    uint8_t prev, next; // LRU list of used slots, most recently used first
+    bool subscribed;    // acknowledged, kept by a resumed session
+    int msg_id;         // SUBSCRIBE waiting for SUBACK, 0 when none
+};
+
+/**
+ * @brief Messages of an API call, sent once router lock is released, as esp-mqtt might be waiting for it
+ * while it holds its own lock.
+ */
+struct gateway_outbox
+{
+    uint16_t thing; // requested one
+    char thing_name[AWS_IOT_SHADOW_THINGNAME_LENGTH_MAX];
+    bool subscribe;
+    bool publish_get;
+    char unsubscribe_name[AWS_IOT_SHADOW_THINGNAME_LENGTH_MAX]; // evicted or removed thing, empty when none
+};
+
+// Response topics, after the thing prefix
+struct gateway_response
+{
+    const char *suffix;
+    uint8_t suffix_len;
+    enum aws_iot_shadow_event event_id;
+};
+
+static const struct gateway_response GATEWAY_RESPONSES[] = {
+    {AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_ACCEPTED, AWS_IOT_SHADOW_OP_GET_LENGTH + AWS_IOT_SHADOW_SUFFIX_ACCEPTED_LENGTH, AWS_IOT_SHADOW_EVENT_GET_ACCEPTED},
+    {AWS_IOT_SHADOW_OP_GET AWS_IOT_SHADOW_SUFFIX_REJECTED, AWS_IOT_SHADOW_OP_GET_LENGTH + AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH, AWS_IOT_SHADOW_EVENT_GET_REJECTED},
+    {AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_ACCEPTED, AWS_IOT_SHADOW_OP_UPDATE_LENGTH + AWS_IOT_SHADOW_SUFFIX_ACCEPTED_LENGTH, AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED},
+    {AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_REJECTED, AWS_IOT_SHADOW_OP_UPDATE_LENGTH + AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH, AWS_IOT_SHADOW_EVENT_UPDATE_REJECTED},
+#if AWS_IOT_SHADOW_SUPPORT_DELTA
+    {AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DELTA, AWS_IOT_SHADOW_OP_UPDATE_LENGTH + AWS_IOT_SHADOW_SUFFIX_DELTA_LENGTH, AWS_IOT_SHADOW_EVENT_UPDATE_DELTA},
+#endif
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    {AWS_IOT_SHADOW_OP_UPDATE AWS_IOT_SHADOW_SUFFIX_DOCUMENT, AWS_IOT_SHADOW_OP_UPDATE_LENGTH + AWS_IOT_SHADOW_SUFFIX_DOCUMENT_LENGTH, AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS},
+#endif
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+    {AWS_IOT_SHADOW_OP_DELETE AWS_IOT_SHADOW_SUFFIX_ACCEPTED, AWS_IOT_SHADOW_OP_DELETE_LENGTH + AWS_IOT_SHADOW_SUFFIX_ACCEPTED_LENGTH, AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED},
+    {AWS_IOT_SHADOW_OP_DELETE AWS_IOT_SHADOW_SUFFIX_REJECTED, AWS_IOT_SHADOW_OP_DELETE_LENGTH + AWS_IOT_SHADOW_SUFFIX_REJECTED_LENGTH, AWS_IOT_SHADOW_EVENT_DELETE_REJECTED},
+#endif
+};
+
+/**
+ * @brief Whole gateway is a single allocation of fixed size, guarded by router lock.
+ */
+struct aws_iot_shadow_gateway
+{
+    esp_mqtt_client_handle_t client;
+    aws_iot_shadow_gateway_handler_t handler;
+    void *handler_arg;
+    bool connected;
+
+    struct gateway_thing things[AWS_IOT_SHADOW_GATEWAY_MAX_THINGS];
+    uint16_t buckets[AWS_IOT_SHADOW_GATEWAY_MAX_THINGS]; // by name hash, load factor <= 1
+    uint16_t free_head;
+
+    struct gateway_slot slots[AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED];
+    uint8_t lru_head;
+    uint8_t lru_tail;
+
+    char names[AWS_IOT_SHADOW_GATEWAY_NAMES_SIZE];
+    size_t names_used;
+
+    struct aws_iot_shadow_gateway_stats stats;
+};
+
+static inline const char *aws_iot_shadow_gateway_name(aws_iot_shadow_gateway_ptr gateway, const struct gateway_thing *thing)
+{
+    return &gateway->names[thing->name_offset];
+}
+
+static uint16_t aws_iot_shadow_gateway_find(aws_iot_shadow_gateway_ptr gateway, const char *name, size_t name_len)
+{
+    uint32_t hash = aws_iot_shadow_router_hash(name, name_len);
+    uint16_t index = gateway->buckets[hash % AWS_IOT_SHADOW_GATEWAY_MAX_THINGS];
+
+    while (index != GATEWAY_THING_NONE)
+    {
+        const struct gateway_thing *thing = &gateway->things[index];
+        if (thing->hash == hash && thing->name_len == name_len
+            && memcmp(aws_iot_shadow_gateway_name(gateway, thing), name, name_len) == 0)
+        {
+            return index;
+        }
+        index = thing->next;
+    }
+    return GATEWAY_THING_NONE;
+}
+
+static char *aws_iot_shadow_gateway_topic(const char *name, const char *suffix, char *buf, size_t buf_len)
+{
+    int len = snprintf(buf, buf_len, AWS_IOT_SHADOW_PREFIX_CLASSIC_FORMAT "%s", name, suffix);
+    return len > 0 && (size_t)len < buf_len ? buf : NULL;
+}
+
+static void aws_iot_shadow_gateway_lru_unlink(aws_iot_shadow_gateway_ptr gateway, uint8_t slot)
+{
+    struct gateway_slot *s = &gateway->slots[slot];
+    if (s->prev != GATEWAY_SLOT_NONE)
+    {
+        gateway->slots[s->prev].next = s->next;
+    }
+    else
+    {
+        gateway->lru_head = s->next;
+    }
+    if (s->next != GATEWAY_SLOT_NONE)
+    {
+        gateway->slots[s->next].prev = s->prev;
+    }
+    else
+    {
+        gateway->lru_tail = s->prev;
+    }
+    s->prev = s->next = GATEWAY_SLOT_NONE;
+}
+
+static void aws_iot_shadow_gateway_lru_push(aws_iot_shadow_gateway_ptr gateway, uint8_t slot)
+{
+    struct gateway_slot *s = &gateway->slots[slot];
+    s->prev = GATEWAY_SLOT_NONE;
+    s->next = gateway->lru_head;
+    if (gateway->lru_head != GATEWAY_SLOT_NONE)
+    {
+        gateway->slots[gateway->lru_head].prev = slot;
+    }
+    else
+    {
+        gateway->lru_tail = slot;
+    }
+    gateway->lru_head = slot;
+}
+
+static void aws_iot_shadow_gateway_touch(aws_iot_shadow_gateway_ptr gateway, uint8_t slot)
+{
+    if (gateway->lru_head != slot)
+    {
+        aws_iot_shadow_gateway_lru_unlink(gateway, slot);
+        aws_iot_shadow_gateway_lru_push(gateway, slot);
+    }
+}
+
+static esp_err_t aws_iot_shadow_gateway_publish(aws_iot_shadow_gateway_ptr gateway, const char *name, const char *op,
+                                                const char *data, size_t data_len)
+{
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    if (aws_iot_shadow_gateway_topic(name, op, topic, sizeof(topic)) == NULL)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ESP_LOGD(TAG, "sending %s", topic);
+    if (esp_mqtt_client_publish(gateway->client, topic, data, (int)data_len, 1, 0) == -1)
+    {
+        ESP_LOGE(TAG, "failed to publish %s", topic);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Sends SUBSCRIBE of the slot. Called on the MQTT task, so SUBACK can't be processed before msg_id is stored.
+ */
+static void aws_iot_shadow_gateway_subscribe(aws_iot_shadow_gateway_ptr gateway, uint8_t slot)
+{
+    struct gateway_slot *s = &gateway->slots[slot];
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    if (aws_iot_shadow_gateway_topic(aws_iot_shadow_gateway_name(gateway, &gateway->things[s->thing]), AWS_IOT_SHADOW_SUFFIX_WILDCARD,
+                                     topic, sizeof(topic))
+        == NULL)
+    {
+        return;
+    }
+
+    int msg_id = esp_mqtt_client_subscribe(gateway->client, topic, 0);
+    if (msg_id <= 0)
+    {
+        ESP_LOGE(TAG, "failed to subscribe %s", topic);
+        return;
+    }
+    s->msg_id = msg_id;
+    gateway->stats.subscribes++;
+}
+
+/**
+ * @brief SUBACK of the slot has been received.
+ *
+ * @return true if get of its thing must be published now.
+ */
+static bool aws_iot_shadow_gateway_slot_subscribed(aws_iot_shadow_gateway_ptr gateway, uint8_t slot)
+{
+    struct gateway_slot *s = &gateway->slots[slot];
+    s->msg_id = 0;
+    s->subscribed = true;
+
+    struct gateway_thing *thing = &gateway->things[s->thing];
+    if ((thing->flags & (GATEWAY_GET_PENDING | GATEWAY_GET_SENT)) == GATEWAY_GET_PENDING)
+    {
+        thing->flags |= GATEWAY_GET_SENT;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Frees the slot of the thing.
+ *
+ * @return true if UNSUBSCRIBE of the thing must be sent.
+ */
+static bool aws_iot_shadow_gateway_release(aws_iot_shadow_gateway_ptr gateway, uint16_t index)
+{
+    struct gateway_thing *thing = &gateway->things[index];
+    uint8_t slot = thing->slot;
+    if (slot == GATEWAY_SLOT_NONE)
+    {
+        return false;
+    }
+
+    struct gateway_slot *s = &gateway->slots[slot];
+    bool unsubscribe = (s->subscribed || s->msg_id != 0) && gateway->connected;
+    s->subscribed = false;
+    s->msg_id = 0;
+
+    aws_iot_shadow_gateway_lru_unlink(gateway, slot);
+    s->thing = GATEWAY_THING_NONE;
+    gateway->stats.subscribed--;
+    thing->slot = GATEWAY_SLOT_NONE;
+    thing->flags = 0;
+    return unsubscribe;
+}
+
+static void aws_iot_shadow_gateway_unsubscribe(aws_iot_shadow_gateway_ptr gateway, const char *name)
+{
+    char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    if (aws_iot_shadow_gateway_topic(name, AWS_IOT_SHADOW_SUFFIX_WILDCARD, topic, sizeof(topic)) != NULL
+        && esp_mqtt_client_unsubscribe(gateway->client, topic) < 0)
+    {
+        ESP_LOGE(TAG, "failed to unsubscribe %s", topic);
+    }
+}
+
+/**
+ * @brief Sends messages of an API call, without router lock.
+ *
+ * @return Result of publishing get, ESP_OK if there is none.
+ */
+static esp_err_t aws_iot_shadow_gateway_outbox_send(aws_iot_shadow_gateway_ptr gateway, struct gateway_outbox *outbox)
+{
+    if (outbox->unsubscribe_name[0] != '\0')
+    {
+        aws_iot_shadow_gateway_unsubscribe(gateway, outbox->unsubscribe_name);
+    }
+
+    if (outbox->subscribe)
+    {
+        char topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+        int msg_id = aws_iot_shadow_gateway_topic(outbox->thing_name, AWS_IOT_SHADOW_SUFFIX_WILDCARD, topic, sizeof(topic)) != NULL
+                         ? esp_mqtt_client_subscribe(gateway->client, topic, 0)
+                         : -1;
+
+        aws_iot_shadow_router_lock();
+        bool acked = aws_iot_shadow_router_gateway_subscribe_end(gateway->client, msg_id);
+
+        // Unless the thing has been released meanwhile
+        struct gateway_thing *thing = &gateway->things[outbox->thing];
+        struct gateway_slot *s = thing->slot != GATEWAY_SLOT_NONE ? &gateway->slots[thing->slot] : NULL;
+        if (s != NULL && s->msg_id == GATEWAY_SUBSCRIBING && strcmp(aws_iot_shadow_gateway_name(gateway, thing), outbox->thing_name) == 0)
+        {
+            if (msg_id <= 0)
+            {
+                ESP_LOGE(TAG, "failed to subscribe %s", topic);
+                s->msg_id = 0;
+            }
+            else
+            {
+                gateway->stats.subscribes++;
+                s->msg_id = msg_id;
+                if (acked)
+                {
+                    // SUBACK has been processed before msg_id was stored
+                    outbox->publish_get = aws_iot_shadow_gateway_slot_subscribed(gateway, thing->slot);
+                }
+            }
+        }
+        aws_iot_shadow_router_unlock();
+    }
+
+    return outbox->publish_get ? aws_iot_shadow_gateway_publish(gateway, outbox->thing_name, AWS_IOT_SHADOW_OP_GET, NULL, 0) : ESP_OK;
+}
+
+/**
+ * @brief Subscribes the thing, unless it is already, evicting the least recently used thing not waiting for get.
+ * Messages are left in the outbox.
+ */
+static esp_err_t aws_iot_shadow_gateway_acquire(aws_iot_shadow_gateway_ptr gateway, uint16_t index, struct gateway_outbox *outbox)
+{
+    struct gateway_thing *thing = &gateway->things[index];
+    outbox->thing = index;
+    strcpy(outbox->thing_name, aws_iot_shadow_gateway_name(gateway, thing));
+
+    if (thing->slot != GATEWAY_SLOT_NONE)
+    {
+        aws_iot_shadow_gateway_touch(gateway, thing->slot);
+        return ESP_OK;
+    }
+
+    uint8_t slot = GATEWAY_SLOT_NONE;
+    if (gateway->stats.subscribed < AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED)
+    {
+        for (slot = 0; gateway->slots[slot].thing != GATEWAY_THING_NONE; slot++)
+        {
+        }
+    }
+    else
+    {
+        for (uint8_t victim = gateway->lru_tail; victim != GATEWAY_SLOT_NONE; victim = gateway->slots[victim].prev)
+        {
+            if (!(gateway->things[gateway->slots[victim].thing].flags & GATEWAY_GET_PENDING))
+            {
+                slot = victim;
+                break;
+            }
+        }
+        if (slot == GATEWAY_SLOT_NONE)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        const char *evicted = aws_iot_shadow_gateway_name(gateway, &gateway->things[gateway->slots[slot].thing]);
+        ESP_LOGD(TAG, "evicting %s", evicted);
+        if (aws_iot_shadow_gateway_release(gateway, gateway->slots[slot].thing))
+        {
+            strcpy(outbox->unsubscribe_name, evicted);
+        }
+        gateway->stats.evictions++;
+    }
+
+    struct gateway_slot *s = &gateway->slots[slot];
+    s->thing = index;
+    s->subscribed = false;
+    s->msg_id = 0;
+    aws_iot_shadow_gateway_lru_push(gateway, slot);
+    thing->slot = slot;
+    gateway->stats.subscribed++;
+
+    if (gateway->connected)
+    {
+        s->msg_id = GATEWAY_SUBSCRIBING;
+        outbox->subscribe = true;
+        aws_iot_shadow_router_gateway_subscribe_begin(gateway->client);
+    }
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_gateway_create(esp_mqtt_client_handle_t client, aws_iot_shadow_gateway_handler_t handler,
+                                        void *handler_arg, aws_iot_shadow_gateway_ptr *gateway)
+{
+    if (client == NULL || handler == NULL || gateway == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_gateway_ptr result = (aws_iot_shadow_gateway_ptr)calloc(1, sizeof(*result));
+    if (result == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    result->client = client;
+    result->handler = handler;
+    result->handler_arg = handler_arg;
+
+    memset(result->buckets, 0xFF, sizeof(result->buckets));
+    for (uint16_t i = 0; i < AWS_IOT_SHADOW_GATEWAY_MAX_THINGS; i++)
+    {
+        result->things[i].next = i + 1 < AWS_IOT_SHADOW_GATEWAY_MAX_THINGS ? i + 1 : GATEWAY_THING_NONE;
+        result->things[i].slot = GATEWAY_SLOT_NONE;
+    }
+    result->free_head = 0;
+    for (uint8_t i = 0; i < AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED; i++)
+    {
+        result->slots[i].thing = GATEWAY_THING_NONE;
+        result->slots[i].prev = result->slots[i].next = GATEWAY_SLOT_NONE;
+    }
+    result->lru_head = result->lru_tail = GATEWAY_SLOT_NONE;
+    result->stats.memory = sizeof(*result);
+
+    esp_err_t err = aws_iot_shadow_router_gateway_attach(client, result);
+    if (err != ESP_OK)
+    {
+        free(result);
+        return err;
+    }
+
+    ESP_LOGI(TAG, "gateway created, %u things, %u subscribed, %zu bytes", AWS_IOT_SHADOW_GATEWAY_MAX_THINGS,
+             AWS_IOT_SHADOW_GATEWAY_MAX_SUBSCRIBED, sizeof(*result));
+    *gateway = result;
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_gateway_delete(aws_iot_shadow_gateway_ptr gateway)
+{
+    if (gateway == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Nothing else touches a detached gateway, so it unsubscribes without router lock
+    aws_iot_shadow_router_gateway_detach(gateway->client, gateway);
+    while (gateway->lru_head != GATEWAY_SLOT_NONE)
+    {
+        uint16_t index = gateway->slots[gateway->lru_head].thing;
+        if (aws_iot_shadow_gateway_release(gateway, index))
+        {
+            aws_iot_shadow_gateway_unsubscribe(gateway, aws_iot_shadow_gateway_name(gateway, &gateway->things[index]));
+        }
+    }
+
+    free(gateway);
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_gateway_add(aws_iot_shadow_gateway_ptr gateway, const char *thing_name)
+{
+    if (gateway == NULL || thing_name == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t name_len = strlen(thing_name);
+    if (name_len == 0 || name_len >= AWS_IOT_SHADOW_THINGNAME_LENGTH_MAX || memchr(thing_name, '/', name_len) != NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_lock();
+
+    if (aws_iot_shadow_gateway_find(gateway, thing_name, name_len) != GATEWAY_THING_NONE)
+    {
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (gateway->free_head == GATEWAY_THING_NONE || gateway->names_used + name_len + 1 > sizeof(gateway->names))
+    {
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint16_t index = gateway->free_head;
+    struct gateway_thing *thing = &gateway->things[index];
+    gateway->free_head = thing->next;
+
+    memcpy(&gateway->names[gateway->names_used], thing_name, name_len + 1);
+    thing->name_offset = gateway->names_used;
+    thing->name_len = name_len;
+    gateway->names_used += name_len + 1;
+
+    thing->hash = aws_iot_shadow_router_hash(thing_name, name_len);
+    thing->slot = GATEWAY_SLOT_NONE;
+    thing->flags = 0;
+    uint16_t *bucket = &gateway->buckets[thing->hash % AWS_IOT_SHADOW_GATEWAY_MAX_THINGS];
+    thing->next = *bucket;
+    *bucket = index;
+    gateway->stats.things++;
+
+    aws_iot_shadow_router_unlock();
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_gateway_remove(aws_iot_shadow_gateway_ptr gateway, const char *thing_name)
+{
+    if (gateway == NULL || thing_name == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_lock();
+
+    uint16_t index = aws_iot_shadow_gateway_find(gateway, thing_name, strlen(thing_name));
+    if (index == GATEWAY_THING_NONE)
+    {
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_NOT_FOUND;
+    }
+    struct gateway_thing *thing = &gateway->things[index];
+    char unsubscribe_name[AWS_IOT_SHADOW_THINGNAME_LENGTH_MAX] = {};
+    if (aws_iot_shadow_gateway_release(gateway, index))
+    {
+        strcpy(unsubscribe_name, aws_iot_shadow_gateway_name(gateway, thing));
+    }
+
+    uint16_t *it = &gateway->buckets[thing->hash % AWS_IOT_SHADOW_GATEWAY_MAX_THINGS];
+    while (*it != index)
+    {
+        it = &gateway->things[*it].next;
+    }
+    *it = thing->next;
+
+    // Keep the name pool packed, removal is rare compared to lookups
+    size_t removed_offset = thing->name_offset;
+    size_t removed_len = thing->name_len + 1U;
+    memmove(&gateway->names[removed_offset], &gateway->names[removed_offset + removed_len],
+            gateway->names_used - removed_offset - removed_len);
+    gateway->names_used -= removed_len;
+    for (uint16_t i = 0; i < AWS_IOT_SHADOW_GATEWAY_MAX_THINGS; i++)
+    {
+        if (gateway->things[i].name_len != 0 && gateway->things[i].name_offset > removed_offset)
+        {
+            gateway->things[i].name_offset -= removed_len;
+        }
+    }
+
+    memset(thing, 0, sizeof(*thing));
+    thing->slot = GATEWAY_SLOT_NONE;
+    thing->next = gateway->free_head;
+    gateway->free_head = index;
+    gateway->stats.things--;
+
+    aws_iot_shadow_router_unlock();
+
+    if (unsubscribe_name[0] != '\0')
+    {
+        aws_iot_shadow_gateway_unsubscribe(gateway, unsubscribe_name);
+    }
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_gateway_request_get(aws_iot_shadow_gateway_ptr gateway, const char *thing_name)
+{
+    if (gateway == NULL || thing_name == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_lock();
+
+    uint16_t index = aws_iot_shadow_gateway_find(gateway, thing_name, strlen(thing_name));
+    if (index == GATEWAY_THING_NONE)
+    {
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    struct gateway_outbox outbox = {};
+    esp_err_t err = aws_iot_shadow_gateway_acquire(gateway, index, &outbox);
+    if (err == ESP_OK)
+    {
+        struct gateway_thing *thing = &gateway->things[index];
+        thing->flags |= GATEWAY_GET_PENDING;
+        thing->flags &= ~GATEWAY_GET_SENT;
+        if (gateway->connected && gateway->slots[thing->slot].subscribed)
+        {
+            thing->flags |= GATEWAY_GET_SENT;
+            outbox.publish_get = true;
+        }
+        // Otherwise published once subscribed
+    }
+
+    aws_iot_shadow_router_unlock();
+
+    esp_err_t send_err = aws_iot_shadow_gateway_outbox_send(gateway, &outbox);
+    return err == ESP_OK ? send_err : err;
+}
+
+esp_err_t aws_iot_shadow_gateway_request_update(aws_iot_shadow_gateway_ptr gateway, const char *thing_name,
+                                                const char *data, size_t data_len)
+{
+    if (gateway == NULL || thing_name == NULL || data == NULL || data_len > INT_MAX)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_lock();
+
+    uint16_t index = aws_iot_shadow_gateway_find(gateway, thing_name, strlen(thing_name));
+    if (index == GATEWAY_THING_NONE)
+    {
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Published even when all slots wait for get responses, only its responses are missed then
+    struct gateway_outbox outbox = {};
+    aws_iot_shadow_gateway_acquire(gateway, index, &outbox);
+
+    aws_iot_shadow_router_unlock();
+
+    aws_iot_shadow_gateway_outbox_send(gateway, &outbox);
+    return aws_iot_shadow_gateway_publish(gateway, outbox.thing_name, AWS_IOT_SHADOW_OP_UPDATE, data, data_len);
+}
+
+esp_err_t aws_iot_shadow_gateway_stats(aws_iot_shadow_gateway_ptr gateway, struct aws_iot_shadow_gateway_stats *stats)
+{
+    if (gateway == NULL || stats == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_router_lock();
+    *stats = gateway->stats;
+    stats->names_used = gateway->names_used;
+    aws_iot_shadow_router_unlock();
+    return ESP_OK;
+}
+
+void aws_iot_shadow_gateway_mqtt_connected(aws_iot_shadow_gateway_ptr gateway, bool session_present)
+{
+    gateway->connected = true;
+
+    for (uint8_t slot = gateway->lru_head; slot != GATEWAY_SLOT_NONE; slot = gateway->slots[slot].next)
+    {
+        struct gateway_slot *s = &gateway->slots[slot];
+        struct gateway_thing *thing = &gateway->things[s->thing];
+        thing->flags &= ~GATEWAY_GET_SENT;
+
+#if AWS_IOT_SHADOW_SESSION_RESUME
+        if (session_present && s->subscribed)
+        {
+            // Broker kept the subscription
+            if (thing->flags & GATEWAY_GET_PENDING)
+            {
+                thing->flags |= GATEWAY_GET_SENT;
+                aws_iot_shadow_gateway_publish(gateway, aws_iot_shadow_gateway_name(gateway, thing), AWS_IOT_SHADOW_OP_GET, NULL, 0);
+            }
+            continue;
+        }
+#endif
+        s->subscribed = false;
+        aws_iot_shadow_gateway_subscribe(gateway, slot);
+    }
+}
+
+void aws_iot_shadow_gateway_mqtt_disconnected(aws_iot_shadow_gateway_ptr gateway)
+{
+    gateway->connected = false;
+
+    // Subscriptions are kept, they are renewed on connect, unless the session is resumed
+    for (uint8_t slot = gateway->lru_head; slot != GATEWAY_SLOT_NONE; slot = gateway->slots[slot].next)
+    {
+        gateway->slots[slot].msg_id = 0;
+    }
+}
+
+bool aws_iot_shadow_gateway_mqtt_subscribed(aws_iot_shadow_gateway_ptr gateway, int msg_id)
+{
+    for (uint8_t slot = gateway->lru_head; slot != GATEWAY_SLOT_NONE; slot = gateway->slots[slot].next)
+    {
+        struct gateway_slot *s = &gateway->slots[slot];
+        if (s->msg_id != msg_id)
+        {
+            continue;
+        }
+
+        if (aws_iot_shadow_gateway_slot_subscribed(gateway, slot))
+        {
+            struct gateway_thing *thing = &gateway->things[s->thing];
+            aws_iot_shadow_gateway_publish(gateway, aws_iot_shadow_gateway_name(gateway, thing), AWS_IOT_SHADOW_OP_GET, NULL, 0);
+        }
+        return true;
+    }
+    return false;
+}
+
+void aws_iot_shadow_gateway_mqtt_data(aws_iot_shadow_gateway_ptr gateway, esp_mqtt_event_handle_t event, size_t prefix_len)
+{
+    // Classic shadows only, `$aws/things/<thing>/shadow`
+    const char *name = event->topic + AWS_IOT_SHADOW_TOPIC_THINGS_LENGTH;
+    size_t name_len = prefix_len - AWS_IOT_SHADOW_TOPIC_THINGS_LENGTH - AWS_IOT_SHADOW_TOPIC_SHADOW_LENGTH;
+    if (prefix_len <= AWS_IOT_SHADOW_TOPIC_THINGS_LENGTH + AWS_IOT_SHADOW_TOPIC_SHADOW_LENGTH
+        || memcmp(name + name_len, AWS_IOT_SHADOW_TOPIC_SHADOW, AWS_IOT_SHADOW_TOPIC_SHADOW_LENGTH) != 0
+        || memchr(name, '/', name_len) != NULL)
+    {
+        return;
+    }
+
+    uint16_t index = aws_iot_shadow_gateway_find(gateway, name, name_len);
+    if (index == GATEWAY_THING_NONE)
+    {
+        return;
+    }
+    struct gateway_thing *thing = &gateway->things[index];
+
+    const char *suffix = event->topic + prefix_len;
+    size_t suffix_len = event->topic_len - prefix_len;
+    const struct gateway_response *response = NULL;
+    for (size_t i = 0; i < sizeof(GATEWAY_RESPONSES) / sizeof(GATEWAY_RESPONSES[0]); i++)
+    {
+        if (GATEWAY_RESPONSES[i].suffix_len == suffix_len && memcmp(GATEWAY_RESPONSES[i].suffix, suffix, suffix_len) == 0)
+        {
+            response = &GATEWAY_RESPONSES[i];
+            break;
+        }
+    }
+    if (response == NULL)
+    {
+        return;
+    }
+
+    if (thing->slot == GATEWAY_SLOT_NONE || event->total_data_len > event->data_len)
+    {
+        // Evicted, until the broker processes UNSUBSCRIBE, or larger than MQTT buffer
+        gateway->stats.dropped++;
+        return;
+    }
+    aws_iot_shadow_gateway_touch(gateway, thing->slot);
+    if (response->event_id == AWS_IOT_SHADOW_EVENT_GET_ACCEPTED || response->event_id == AWS_IOT_SHADOW_EVENT_GET_REJECTED)
+    {
+        thing->flags &= ~(GATEWAY_GET_PENDING | GATEWAY_GET_SENT);
+    }
+
+    struct aws_iot_shadow_event_data shadow_event = {
+        .event_id = response->event_id,
+        .handle = NULL,
+        .thing_name = aws_iot_shadow_gateway_name(gateway, thing),
+        .shadow_name = NULL,
+        .data = event->data,
+        .data_len = event->data_len,
+    };
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    struct aws_iot_shadow_json_documents documents;
+    if (response->event_id == AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS
+        && aws_iot_shadow_json_parse_documents(event->data, event->data_len, &documents) == ESP_OK)
+    {
+        shadow_event.documents = &documents;
+    }
+#endif
+
+    gateway->stats.received++;
+    gateway->handler(gateway->handler_arg, &shadow_event);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef AWS_IOT_SHADOW_GATEWAY_H
+#define AWS_IOT_SHADOW_GATEWAY_H
+
+#include "aws_iot_shadow.h"
+#include <mqtt_client.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if AWS_IOT_SHADOW_GATEWAY
+// Callbacks of the dispatcher, called under router lock
+
+void aws_iot_shadow_gateway_mqtt_connected(aws_iot_shadow_gateway_ptr gateway, bool session_present);
+
+void aws_iot_shadow_gateway_mqtt_disconnected(aws_iot_shadow_gateway_ptr gateway);
+
+/**
+ * @return false if the SUBACK is not one of the gateway.
+ */
+bool aws_iot_shadow_gateway_mqtt_subscribed(aws_iot_shadow_gateway_ptr gateway, int msg_id);
+
+/**
+ * @brief Message of a topic no shadow handle has.
+ *
+ * @param prefix_len Length of the shadow topic prefix, as found by the dispatcher.
+ */
+void aws_iot_shadow_gateway_mqtt_data(aws_iot_shadow_gateway_ptr gateway, esp_mqtt_event_handle_t event, size_t prefix_len);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
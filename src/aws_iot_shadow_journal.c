@@ -0,0 +1,258 @@
+#include "aws_iot_shadow_journal.h"
+#include "aws_iot_shadow_json.h"
+#include "aws_iot_shadow_stats.h"
+#include "aws_iot_shadow_throttle.h"
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+
+static const char TAG[] = "aws_iot_shadow";
+
+struct aws_iot_shadow_journal_entry
+{
+    struct aws_iot_shadow_journal_entry *next;
+    size_t len;
+    char data[]; // NUL terminated
+};
+
+static void aws_iot_shadow_journal_lock(aws_iot_shadow_handle_ptr handle)
+{
+    xSemaphoreTake(handle->journal_mutex, portMAX_DELAY);
+}
+
+static void aws_iot_shadow_journal_unlock(aws_iot_shadow_handle_ptr handle)
+{
+    xSemaphoreGive(handle->journal_mutex);
+}
+
+static struct aws_iot_shadow_journal_entry *aws_iot_shadow_journal_pop(aws_iot_shadow_handle_ptr handle)
+{
+    struct aws_iot_shadow_journal_entry *entry = handle->journal_head;
+    if (entry != NULL)
+    {
+        handle->journal_head = entry->next;
+        if (handle->journal_head == NULL)
+        {
+            handle->journal_tail = NULL;
+        }
+        handle->journal_size -= entry->len;
+    }
+    return entry;
+}
+
+static void aws_iot_shadow_journal_push(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_journal_entry *entry)
+{
+    entry->next = NULL;
+    if (handle->journal_tail != NULL)
+    {
+        handle->journal_tail->next = entry;
+    }
+    else
+    {
+        handle->journal_head = entry;
+    }
+    handle->journal_tail = entry;
+    handle->journal_size += entry->len;
+}
+
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL_POLICY == AWS_IOT_SHADOW_OFFLINE_JOURNAL_LATEST
+/**
+ * @brief Replaces the journaled document with its merge with the update. Called under journal lock.
+ */
+static esp_err_t aws_iot_shadow_journal_merge(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len)
+{
+    struct aws_iot_shadow_json_value update;
+    esp_err_t err = aws_iot_shadow_json_parse(data, data_len, &update);
+    if (err != ESP_OK || update.type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // First update is merged into nothing as well, so it is validated the same way
+    struct aws_iot_shadow_journal_entry *prev = handle->journal_head;
+    struct aws_iot_shadow_json_value target = {
+        .type = prev ? AWS_IOT_SHADOW_JSON_TYPE_OBJECT : AWS_IOT_SHADOW_JSON_TYPE_INVALID,
+        .data = prev ? prev->data : NULL,
+        .len = prev ? prev->len : 0,
+    };
+
+    // Merged members come from either document, plus a separator each
+    size_t cap = target.len + update.len + 2;
+    struct aws_iot_shadow_journal_entry *entry =
+        (struct aws_iot_shadow_journal_entry *)malloc(sizeof(*entry) + cap + 1);
+    if (entry == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    err = aws_iot_shadow_json_merge_update(&target, &update, entry->data, cap + 1, &entry->len);
+    if (err == ESP_OK && entry->len > AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE)
+    {
+        err = ESP_ERR_NO_MEM;
+    }
+    if (err != ESP_OK)
+    {
+        // Journaled document is kept
+        free(entry);
+        return err == ESP_ERR_NO_MEM ? err : ESP_ERR_INVALID_ARG;
+    }
+
+    if (prev != NULL)
+    {
+        free(aws_iot_shadow_journal_pop(handle));
+        handle->journal_stats.merged++;
+    }
+    aws_iot_shadow_journal_push(handle, entry);
+    return ESP_OK;
+}
+#else
+/**
+ * @brief Appends a copy of the update, dropping the oldest ones to make room. Called under journal lock.
+ */
+static esp_err_t aws_iot_shadow_journal_append(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len)
+{
+    if (data_len > AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    struct aws_iot_shadow_journal_entry *entry =
+        (struct aws_iot_shadow_journal_entry *)malloc(sizeof(*entry) + data_len + 1);
+    if (entry == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(entry->data, data, data_len);
+    entry->data[data_len] = '\0';
+    entry->len = data_len;
+
+    while (handle->journal_size + data_len > AWS_IOT_SHADOW_OFFLINE_JOURNAL_MAX_SIZE)
+    {
+        free(aws_iot_shadow_journal_pop(handle));
+        handle->journal_stats.dropped++;
+        ESP_LOGW(TAG, "%s journal is full, dropped the oldest update", handle->topic_prefix);
+    }
+    aws_iot_shadow_journal_push(handle, entry);
+    return ESP_OK;
+}
+#endif
+
+esp_err_t aws_iot_shadow_journal_init(aws_iot_shadow_handle_ptr handle)
+{
+    handle->journal_mutex = xSemaphoreCreateMutex();
+    return handle->journal_mutex != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t aws_iot_shadow_journal_add(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len)
+{
+    aws_iot_shadow_journal_lock(handle);
+    if (handle->journal_online)
+    {
+        aws_iot_shadow_journal_unlock(handle);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL_POLICY == AWS_IOT_SHADOW_OFFLINE_JOURNAL_LATEST
+    esp_err_t err = aws_iot_shadow_journal_merge(handle, data, data_len);
+#else
+    esp_err_t err = aws_iot_shadow_journal_append(handle, data, data_len);
+#endif
+    if (err == ESP_OK)
+    {
+        handle->journal_stats.journaled++;
+    }
+    else if (err == ESP_ERR_NO_MEM)
+    {
+        handle->journal_stats.dropped++;
+    }
+    size_t size = handle->journal_size;
+    aws_iot_shadow_journal_unlock(handle);
+
+    if (err == ESP_OK)
+    {
+        ESP_LOGD(TAG, "%s is not ready, journaled update (%zu bytes in journal)", handle->topic_prefix, size);
+    }
+    return err;
+}
+
+void aws_iot_shadow_journal_offline(aws_iot_shadow_handle_ptr handle)
+{
+    aws_iot_shadow_journal_lock(handle);
+    handle->journal_online = false;
+    aws_iot_shadow_journal_unlock(handle);
+}
+
+void aws_iot_shadow_journal_flush(aws_iot_shadow_handle_ptr handle)
+{
+    char topic_name[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    int topic_len = snprintf(topic_name, sizeof(topic_name), "%s%s", handle->topic_prefix, AWS_IOT_SHADOW_OP_UPDATE);
+    if (topic_len <= 0 || (size_t)topic_len >= sizeof(topic_name))
+    {
+        ESP_LOGE(TAG, "%s update topic is too long, journal is not published", handle->topic_prefix);
+        aws_iot_shadow_journal_lock(handle);
+        handle->journal_online = true;
+        aws_iot_shadow_journal_unlock(handle);
+        return;
+    }
+
+    // Updates requested meanwhile are journaled too, so they are published after these
+    aws_iot_shadow_journal_lock(handle);
+    struct aws_iot_shadow_journal_entry *entry;
+    while ((entry = aws_iot_shadow_journal_pop(handle)) != NULL)
+    {
+        handle->journal_stats.flushed++;
+        aws_iot_shadow_journal_unlock(handle);
+
+        ESP_LOGI(TAG, "sending %s from journal (%zu bytes)", topic_name, entry->len);
+        ESP_LOGD(TAG, "sending %s payload: %.*s", topic_name, (int)entry->len, entry->data);
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+        esp_err_t err = aws_iot_shadow_throttle_publish(handle, topic_name, entry->data, entry->len, AWS_IOT_SHADOW_PRIORITY_NORMAL);
+#else
+        int msg_id = esp_mqtt_client_publish(handle->client, topic_name, entry->data, (int)entry->len, 1, 0);
+#if AWS_IOT_SHADOW_STATS
+        aws_iot_shadow_stats_published(handle, msg_id);
+#endif
+        esp_err_t err = msg_id != -1 ? ESP_OK : ESP_FAIL;
+#endif
+        if (err != ESP_OK)
+        {
+            ESP_LOGW(TAG, "failed to publish journaled update of %s: %d", handle->topic_prefix, err);
+        }
+        free(entry);
+
+        aws_iot_shadow_journal_lock(handle);
+    }
+    handle->journal_online = true;
+    aws_iot_shadow_journal_unlock(handle);
+}
+
+void aws_iot_shadow_journal_free(aws_iot_shadow_handle_ptr handle)
+{
+    struct aws_iot_shadow_journal_entry *entry;
+    while ((entry = aws_iot_shadow_journal_pop(handle)) != NULL)
+    {
+        free(entry);
+    }
+    if (handle->journal_mutex != NULL)
+    {
+        vSemaphoreDelete(handle->journal_mutex);
+        handle->journal_mutex = NULL;
+    }
+}
+
+esp_err_t aws_iot_shadow_journal_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_journal_stats *stats)
+{
+    if (handle == NULL || stats == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    aws_iot_shadow_journal_lock(handle);
+    *stats = handle->journal_stats;
+    aws_iot_shadow_journal_unlock(handle);
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef AWS_IOT_SHADOW_JOURNAL_H
+#define AWS_IOT_SHADOW_JOURNAL_H
+
+#include "aws_iot_shadow.h"
+#include "aws_iot_shadow_handle.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if AWS_IOT_SHADOW_OFFLINE_JOURNAL
+/**
+ * @brief Creates the journal lock, before the handle is added to the dispatcher. Journal starts offline.
+ */
+esp_err_t aws_iot_shadow_journal_init(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Keeps an update until the shadow is ready.
+ *
+ * @return ESP_ERR_INVALID_STATE when the shadow is ready and the update has to be published,
+ *         ESP_OK when journaled, or ESP_ERR_NO_MEM / ESP_ERR_INVALID_ARG when it could not be.
+ */
+esp_err_t aws_iot_shadow_journal_add(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len);
+
+/**
+ * @brief Updates are journaled from now on. Called on (re)connect and disconnect.
+ */
+void aws_iot_shadow_journal_offline(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Publishes journaled updates, then lets updates through. Called once the shadow is ready.
+ */
+void aws_iot_shadow_journal_flush(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Drops journaled updates and the lock, once the handle has been removed from the dispatcher.
+ */
+void aws_iot_shadow_journal_free(aws_iot_shadow_handle_ptr handle);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
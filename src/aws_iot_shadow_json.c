@@ -0,0 +1,2156 @@
+#include "aws_iot_shadow_json.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_NUMBER_MAX_LENGTH (64U)
+#define JSON_KEY_MAX_LENGTH (128U)
+#define JSON_MERGE_MAX_DEPTH (16U) // also for diff
+
+struct json_writer
+{
+    char *buf;
+    size_t len;
+    size_t pos;
+    esp_err_t err;
+};
+
+static inline const char *json_skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    {
+        p++;
+    }
+    return p;
+}
+
+static inline bool json_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/**
+ * @brief Scans string body, p points past the opening quote.
+ *
+ * @return Pointer past the closing quote, or NULL.
+ */
+static const char *json_scan_string(const char *p, const char *end)
+{
+    while (p < end)
+    {
+        char c = *p++;
+        if (c == '"')
+        {
+            return p;
+        }
+        else if (c == '\\')
+        {
+            if (p >= end)
+            {
+                return NULL;
+            }
+            p++;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            return NULL; // control characters must be escaped
+        }
+    }
+    return NULL;
+}
+
+static const char *json_scan_number(const char *p, const char *end)
+{
+    if (p < end && *p == '-')
+    {
+        p++;
+    }
+
+    // Integer part
+    if (p < end && *p == '0')
+    {
+        p++;
+    }
+    else if (p < end && json_is_digit(*p))
+    {
+        while (p < end && json_is_digit(*p)) p++;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    // Fraction
+    if (p < end && *p == '.')
+    {
+        p++;
+        if (p >= end || !json_is_digit(*p))
+        {
+            return NULL;
+        }
+        while (p < end && json_is_digit(*p)) p++;
+    }
+
+    // Exponent
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+        {
+            p++;
+        }
+        if (p >= end || !json_is_digit(*p))
+        {
+            return NULL;
+        }
+        while (p < end && json_is_digit(*p)) p++;
+    }
+
+    return p;
+}
+
+static const char *json_scan_literal(const char *p, const char *end, const char *literal, size_t literal_len)
+{
+    if ((size_t)(end - p) < literal_len || memcmp(p, literal, literal_len) != 0)
+    {
+        return NULL;
+    }
+    return p + literal_len;
+}
+
+/**
+ * @brief Scans a single value, p must point to its first character.
+ *
+ * Nested objects and arrays are skipped by bracket counting only.
+ *
+ * @return Pointer past the value, or NULL.
+ */
+static const char *json_scan_value(const char *p, const char *end, struct aws_iot_shadow_json_value *value)
+{
+    const char *start = p;
+    enum aws_iot_shadow_json_type type;
+
+    if (p >= end)
+    {
+        return NULL;
+    }
+
+    switch (*p)
+    {
+    case '"':
+        p = json_scan_string(p + 1, end);
+        if (p == NULL)
+        {
+            return NULL;
+        }
+        value->type = AWS_IOT_SHADOW_JSON_TYPE_STRING;
+        value->data = start + 1;
+        value->len = p - start - 2;
+        return p;
+
+    case '{':
+    case '[': {
+        unsigned int depth = 0;
+        type = *p == '{' ? AWS_IOT_SHADOW_JSON_TYPE_OBJECT : AWS_IOT_SHADOW_JSON_TYPE_ARRAY;
+        while (p < end)
+        {
+            char c = *p++;
+            if (c == '"')
+            {
+                p = json_scan_string(p, end);
+                if (p == NULL)
+                {
+                    return NULL;
+                }
+            }
+            else if (c == '{' || c == '[')
+            {
+                depth++;
+            }
+            else if ((c == '}' || c == ']') && --depth == 0)
+            {
+                break;
+            }
+        }
+        if (depth != 0)
+        {
+            return NULL;
+        }
+        break;
+    }
+
+    case 't':
+        p = json_scan_literal(p, end, "true", 4);
+        type = AWS_IOT_SHADOW_JSON_TYPE_BOOL;
+        break;
+
+    case 'f':
+        p = json_scan_literal(p, end, "false", 5);
+        type = AWS_IOT_SHADOW_JSON_TYPE_BOOL;
+        break;
+
+    case 'n':
+        p = json_scan_literal(p, end, "null", 4);
+        type = AWS_IOT_SHADOW_JSON_TYPE_NULL;
+        break;
+
+    default:
+        p = json_scan_number(p, end);
+        type = AWS_IOT_SHADOW_JSON_TYPE_NUMBER;
+        break;
+    }
+
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    value->type = type;
+    value->data = start;
+    value->len = p - start;
+    return p;
+}
+
+static int json_hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static const char *json_decode_hex4(const char *p, const char *end, uint32_t *code)
+{
+    if (end - p < 4)
+    {
+        return NULL;
+    }
+
+    *code = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int v = json_hex_value(p[i]);
+        if (v < 0)
+        {
+            return NULL;
+        }
+        *code = (*code << 4) | (uint32_t)v;
+    }
+    return p + 4;
+}
+
+/**
+ * @brief Decodes one escape sequence as UTF-8, p points past the backslash.
+ *
+ * @return Pointer past the sequence, or NULL.
+ */
+static const char *json_decode_escape(const char *p, const char *end, char out[4], size_t *out_len)
+{
+    if (p >= end)
+    {
+        return NULL;
+    }
+
+    char c = *p++;
+    *out_len = 1;
+    switch (c)
+    {
+    case '"':
+    case '\\':
+    case '/':
+        out[0] = c;
+        return p;
+    case 'b':
+        out[0] = '\b';
+        return p;
+    case 'f':
+        out[0] = '\f';
+        return p;
+    case 'n':
+        out[0] = '\n';
+        return p;
+    case 'r':
+        out[0] = '\r';
+        return p;
+    case 't':
+        out[0] = '\t';
+        return p;
+    case 'u':
+        break;
+    default:
+        return NULL;
+    }
+
+    uint32_t code;
+    p = json_decode_hex4(p, end, &code);
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    // Surrogate pair
+    if (code >= 0xD800 && code <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+    {
+        uint32_t low;
+        const char *q = json_decode_hex4(p + 2, end, &low);
+        if (q != NULL && low >= 0xDC00 && low <= 0xDFFF)
+        {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            p = q;
+        }
+    }
+
+    if (code < 0x80)
+    {
+        out[0] = (char)code;
+    }
+    else if (code < 0x800)
+    {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        *out_len = 2;
+    }
+    else if (code < 0x10000)
+    {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        *out_len = 3;
+    }
+    else
+    {
+        out[0] = (char)(0xF0 | (code >> 18));
+        out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (code & 0x3F));
+        *out_len = 4;
+    }
+    return p;
+}
+
+static bool json_string_equals_n(const struct aws_iot_shadow_json_value *value, const char *str, size_t str_len)
+{
+    if (value->type != AWS_IOT_SHADOW_JSON_TYPE_STRING)
+    {
+        return false;
+    }
+
+    // Fast path, keys are rarely escaped
+    const char *escape = memchr(value->data, '\\', value->len);
+    if (escape == NULL)
+    {
+        return value->len == str_len && memcmp(value->data, str, str_len) == 0;
+    }
+
+    const char *p = value->data;
+    const char *end = value->data + value->len;
+    const char *s = str;
+    const char *s_end = str + str_len;
+
+    while (p < end)
+    {
+        if (*p != '\\')
+        {
+            if (s >= s_end || *s++ != *p++)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        char decoded[4];
+        size_t decoded_len;
+        p = json_decode_escape(p + 1, end, decoded, &decoded_len);
+        if (p == NULL || (size_t)(s_end - s) < decoded_len || memcmp(s, decoded, decoded_len) != 0)
+        {
+            return false;
+        }
+        s += decoded_len;
+    }
+    return s == s_end;
+}
+
+static esp_err_t json_object_get_n(const struct aws_iot_shadow_json_value *object, const char *key, size_t key_len,
+                                   struct aws_iot_shadow_json_value *value)
+{
+    struct aws_iot_shadow_json_iter iter;
+    if (object == NULL || object->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT
+        || aws_iot_shadow_json_iter_init(&iter, object) != ESP_OK)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    struct aws_iot_shadow_json_value k, v;
+    while (aws_iot_shadow_json_iter_next(&iter, &k, &v))
+    {
+        if (json_string_equals_n(&k, key, key_len))
+        {
+            if (value)
+            {
+                *value = v;
+            }
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t aws_iot_shadow_json_parse(const char *data, size_t data_len, struct aws_iot_shadow_json_value *value)
+{
+    if (data == NULL || value == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const char *end = data + data_len;
+    const char *p = json_skip_ws(data, end);
+
+    value->type = AWS_IOT_SHADOW_JSON_TYPE_INVALID;
+    p = json_scan_value(p, end, value);
+    if (p == NULL || json_skip_ws(p, end) != end)
+    {
+        value->type = AWS_IOT_SHADOW_JSON_TYPE_INVALID;
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_json_iter_init(struct aws_iot_shadow_json_iter *iter, const struct aws_iot_shadow_json_value *container)
+{
+    if (iter == NULL || container == NULL
+        || (container->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT && container->type != AWS_IOT_SHADOW_JSON_TYPE_ARRAY)
+        || container->len < 2)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    iter->pos = container->data + 1;
+    iter->end = container->data + container->len - 1; // closing bracket
+    iter->object = container->type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT;
+    iter->first = true;
+    return ESP_OK;
+}
+
+bool aws_iot_shadow_json_iter_next(struct aws_iot_shadow_json_iter *iter, struct aws_iot_shadow_json_value *key,
+                                   struct aws_iot_shadow_json_value *value)
+{
+    struct aws_iot_shadow_json_value k, v;
+    if (iter->pos == NULL)
+    {
+        return false;
+    }
+
+    const char *end = iter->end;
+    const char *p = json_skip_ws(iter->pos, end);
+
+    if (p >= end)
+    {
+        iter->pos = end;
+        return false;
+    }
+
+    if (!iter->first)
+    {
+        if (*p != ',')
+        {
+            goto malformed;
+        }
+        p = json_skip_ws(p + 1, end);
+    }
+
+    if (iter->object)
+    {
+        if (p >= end || *p != '"' || (p = json_scan_value(p, end, &k)) == NULL)
+        {
+            goto malformed;
+        }
+        p = json_skip_ws(p, end);
+        if (p >= end || *p != ':')
+        {
+            goto malformed;
+        }
+        p = json_skip_ws(p + 1, end);
+    }
+
+    p = json_scan_value(p, end, &v);
+    if (p == NULL)
+    {
+        goto malformed;
+    }
+
+    iter->pos = p;
+    iter->first = false;
+    if (key && iter->object)
+    {
+        *key = k;
+    }
+    if (value)
+    {
+        *value = v;
+    }
+    return true;
+
+malformed:
+    iter->pos = NULL;
+    return false;
+}
+
+esp_err_t aws_iot_shadow_json_object_get(const struct aws_iot_shadow_json_value *object, const char *key,
+                                         struct aws_iot_shadow_json_value *value)
+{
+    if (key == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return json_object_get_n(object, key, strlen(key), value);
+}
+
+esp_err_t aws_iot_shadow_json_find(const struct aws_iot_shadow_json_value *root, const char *path,
+                                   struct aws_iot_shadow_json_value *value)
+{
+    if (root == NULL || path == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct aws_iot_shadow_json_value current = *root;
+    while (*path)
+    {
+        const char *dot = strchr(path, '.');
+        size_t segment_len = dot ? (size_t)(dot - path) : strlen(path);
+
+        if (json_object_get_n(&current, path, segment_len, &current) != ESP_OK)
+        {
+            return ESP_ERR_NOT_FOUND;
+        }
+        path += segment_len + (dot ? 1 : 0);
+    }
+
+    if (value)
+    {
+        *value = current;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Root object of a document, without scanning it. Its members are validated by iterating them,
+ * which saves a whole pass over the document.
+ */
+static esp_err_t json_root_object(const char *data, size_t data_len, struct aws_iot_shadow_json_value *root)
+{
+    const char *end = data + data_len;
+    const char *start = json_skip_ws(data, end);
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+    {
+        end--;
+    }
+    if (end - start < 2 || *start != '{' || end[-1] != '}')
+    {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    root->type = AWS_IOT_SHADOW_JSON_TYPE_OBJECT;
+    root->data = start;
+    root->len = end - start;
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_json_parse_document(const char *data, size_t data_len, struct aws_iot_shadow_json_document *doc)
+{
+    if (doc == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(doc, 0, sizeof(*doc));
+
+    if (data == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct aws_iot_shadow_json_value root;
+    if (json_root_object(data, data_len, &root) != ESP_OK)
+    {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    // Single pass over top level members, nested values are skipped
+    struct aws_iot_shadow_json_iter iter;
+    struct aws_iot_shadow_json_value key, value;
+    aws_iot_shadow_json_iter_init(&iter, &root);
+    while (aws_iot_shadow_json_iter_next(&iter, &key, &value))
+    {
+        if (value.type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT && json_string_equals_n(&key, AWS_IOT_SHADOW_JSON_STATE, sizeof(AWS_IOT_SHADOW_JSON_STATE) - 1))
+        {
+            doc->state = value;
+        }
+        else if (value.type == AWS_IOT_SHADOW_JSON_TYPE_NUMBER && json_string_equals_n(&key, AWS_IOT_SHADOW_JSON_VERSION, sizeof(AWS_IOT_SHADOW_JSON_VERSION) - 1))
+        {
+            doc->has_version = aws_iot_shadow_json_get_int64(&value, &doc->version) == ESP_OK;
+        }
+        else if (value.type == AWS_IOT_SHADOW_JSON_TYPE_STRING && json_string_equals_n(&key, AWS_IOT_SHADOW_JSON_CLIENT_TOKEN, sizeof(AWS_IOT_SHADOW_JSON_CLIENT_TOKEN) - 1))
+        {
+            doc->client_token = value;
+        }
+    }
+    if (iter.pos == NULL)
+    {
+        memset(doc, 0, sizeof(*doc));
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    if (doc->state.type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        aws_iot_shadow_json_iter_init(&iter, &doc->state);
+        while (aws_iot_shadow_json_iter_next(&iter, &key, &value))
+        {
+            if (json_string_equals_n(&key, AWS_IOT_SHADOW_JSON_DESIRED, sizeof(AWS_IOT_SHADOW_JSON_DESIRED) - 1))
+            {
+                doc->desired = value;
+            }
+            else if (json_string_equals_n(&key, AWS_IOT_SHADOW_JSON_REPORTED, sizeof(AWS_IOT_SHADOW_JSON_REPORTED) - 1))
+            {
+                doc->reported = value;
+            }
+            else if (json_string_equals_n(&key, AWS_IOT_SHADOW_JSON_DELTA, sizeof(AWS_IOT_SHADOW_JSON_DELTA) - 1))
+            {
+                doc->delta = value;
+            }
+        }
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Finds opening quote of a string, p points to its closing quote.
+ *
+ * @return Pointer to the opening quote, or NULL.
+ */
+static const char *json_scan_string_backwards(const char *p, const char *start)
+{
+    while (p > start)
+    {
+        p--;
+        if (*p != '"')
+        {
+            continue;
+        }
+
+        // Escaped by an odd number of backslashes
+        const char *q = p;
+        while (q > start && q[-1] == '\\')
+        {
+            q--;
+        }
+        if ((p - q) % 2 == 0)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t aws_iot_shadow_json_peek_version(const char *data, size_t data_len, int64_t *version)
+{
+    if (data == NULL || version == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const char *end = data + data_len;
+    const char *p = end;
+    unsigned int depth = 0;
+
+    while (p > data)
+    {
+        char c = *--p;
+        if (c == '}' || c == ']')
+        {
+            depth++;
+        }
+        else if (c == '{' || c == '[')
+        {
+            if (depth <= 1)
+            {
+                // Root start
+                return depth == 1 ? ESP_ERR_NOT_FOUND : ESP_ERR_INVALID_RESPONSE;
+            }
+            depth--;
+        }
+        else if (c == '"')
+        {
+            const char *close = p;
+            p = json_scan_string_backwards(close, data);
+            if (p == NULL)
+            {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+
+            // Top level key?
+            const char *colon = json_skip_ws(close + 1, end);
+            if (depth != 1 || colon >= end || *colon != ':' || (size_t)(close - p - 1) != sizeof(AWS_IOT_SHADOW_JSON_VERSION) - 1
+                || memcmp(p + 1, AWS_IOT_SHADOW_JSON_VERSION, sizeof(AWS_IOT_SHADOW_JSON_VERSION) - 1) != 0)
+            {
+                continue;
+            }
+
+            struct aws_iot_shadow_json_value value = {
+                .type = AWS_IOT_SHADOW_JSON_TYPE_NUMBER,
+                .data = json_skip_ws(colon + 1, end),
+            };
+            const char *value_end = json_scan_number(value.data, end);
+            if (value_end == NULL)
+            {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            value.len = value_end - value.data;
+            return aws_iot_shadow_json_get_int64(&value, version) == ESP_OK ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    return ESP_ERR_INVALID_RESPONSE;
+}
+
+esp_err_t aws_iot_shadow_json_parse_event(const struct aws_iot_shadow_event_data *event, struct aws_iot_shadow_json_document *doc)
+{
+    if (event == NULL || event->data == NULL || doc == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+#if AWS_IOT_SHADOW_SUPPORT_DOCUMENTS
+    if (event->event_id == AWS_IOT_SHADOW_EVENT_UPDATE_DOCUMENTS)
+    {
+        struct aws_iot_shadow_json_value root, current;
+        if (json_root_object(event->data, event->data_len, &root) != ESP_OK
+            || aws_iot_shadow_json_object_get(&root, AWS_IOT_SHADOW_JSON_CURRENT, &current) != ESP_OK)
+        {
+            memset(doc, 0, sizeof(*doc));
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        return aws_iot_shadow_json_parse_document(current.data, current.len, doc);
+    }
+#endif
+
+    esp_err_t err = aws_iot_shadow_json_parse_document(event->data, event->data_len, doc);
+#if AWS_IOT_SHADOW_SUPPORT_DELTA
+    if (err == ESP_OK && event->event_id == AWS_IOT_SHADOW_EVENT_UPDATE_DELTA)
+    {
+        // Delta message has changed keys directly in state
+        doc->delta = doc->state;
+    }
+#endif
+    return err;
+}
+
+bool aws_iot_shadow_json_string_equals(const struct aws_iot_shadow_json_value *value, const char *str)
+{
+    return value != NULL && str != NULL && json_string_equals_n(value, str, strlen(str));
+}
+
+esp_err_t aws_iot_shadow_json_string_copy(const struct aws_iot_shadow_json_value *value, char *buf, size_t buf_len)
+{
+    if (value == NULL || value->type != AWS_IOT_SHADOW_JSON_TYPE_STRING || buf == NULL || buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const char *p = value->data;
+    const char *end = value->data + value->len;
+    size_t len = 0;
+
+    while (p < end)
+    {
+        char decoded[4];
+        size_t decoded_len = 1;
+
+        if (*p == '\\')
+        {
+            p = json_decode_escape(p + 1, end, decoded, &decoded_len);
+            if (p == NULL)
+            {
+                buf[0] = '\0';
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+        else
+        {
+            decoded[0] = *p++;
+        }
+
+        if (len + decoded_len >= buf_len)
+        {
+            buf[len] = '\0';
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(buf + len, decoded, decoded_len);
+        len += decoded_len;
+    }
+
+    buf[len] = '\0';
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_json_get_bool(const struct aws_iot_shadow_json_value *value, bool *out)
+{
+    if (value == NULL || out == NULL || value->type != AWS_IOT_SHADOW_JSON_TYPE_BOOL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *out = value->data[0] == 't';
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_json_get_int64(const struct aws_iot_shadow_json_value *value, int64_t *out)
+{
+    if (value == NULL || out == NULL || value->type != AWS_IOT_SHADOW_JSON_TYPE_NUMBER || value->len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const char *p = value->data;
+    const char *end = value->data + value->len;
+    bool negative = *p == '-';
+    if (negative)
+    {
+        p++;
+    }
+
+    // Accumulate as negative, so INT64_MIN fits
+    int64_t result = 0;
+    for (; p < end; p++)
+    {
+        if (!json_is_digit(*p))
+        {
+            return ESP_ERR_INVALID_ARG; // fraction or exponent
+        }
+
+        int digit = *p - '0';
+        if (result < (INT64_MIN + digit) / 10)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        result = result * 10 - digit;
+    }
+
+    if (!negative)
+    {
+        if (result == INT64_MIN)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        result = -result;
+    }
+
+    *out = result;
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_json_get_double(const struct aws_iot_shadow_json_value *value, double *out)
+{
+    if (value == NULL || out == NULL || value->type != AWS_IOT_SHADOW_JSON_TYPE_NUMBER)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (value->len >= JSON_NUMBER_MAX_LENGTH)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // strtod needs NUL terminated input
+    char buf[JSON_NUMBER_MAX_LENGTH];
+    memcpy(buf, value->data, value->len);
+    buf[value->len] = '\0';
+
+    *out = strtod(buf, NULL);
+    return ESP_OK;
+}
+
+static void json_write(struct json_writer *w, const char *data, size_t len)
+{
+    if (w->err != ESP_OK)
+    {
+        return;
+    }
+    if (w->pos + len >= w->len)
+    {
+        w->err = ESP_ERR_INVALID_SIZE;
+        return;
+    }
+    memcpy(w->buf + w->pos, data, len);
+    w->pos += len;
+}
+
+static void json_write_value(struct json_writer *w, const struct aws_iot_shadow_json_value *value)
+{
+    if (value->type == AWS_IOT_SHADOW_JSON_TYPE_STRING)
+    {
+        json_write(w, value->data - 1, value->len + 2); // including quotes
+    }
+    else
+    {
+        json_write(w, value->data, value->len);
+    }
+}
+
+static void json_write_key(struct json_writer *w, const struct aws_iot_shadow_json_value *key, bool *first)
+{
+    if (!*first)
+    {
+        json_write(w, ",", 1);
+    }
+    *first = false;
+    json_write_value(w, key);
+    json_write(w, ":", 1);
+}
+
+/**
+ * @brief Finds member by a key, as found in another object.
+ */
+static bool json_object_get_key(const struct aws_iot_shadow_json_value *object, const struct aws_iot_shadow_json_value *key,
+                                struct aws_iot_shadow_json_value *value)
+{
+    if (object == NULL || object->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        return false;
+    }
+    if (memchr(key->data, '\\', key->len) == NULL)
+    {
+        return json_object_get_n(object, key->data, key->len, value) == ESP_OK;
+    }
+
+    char decoded[JSON_KEY_MAX_LENGTH];
+    return aws_iot_shadow_json_string_copy(key, decoded, sizeof(decoded)) == ESP_OK
+           && json_object_get_n(object, decoded, strlen(decoded), value) == ESP_OK;
+}
+
+/**
+ * @brief Writes patch applied to target, keep_null writes null members instead of removing them.
+ */
+static void json_merge(struct json_writer *w, const struct aws_iot_shadow_json_value *target,
+                       const struct aws_iot_shadow_json_value *patch, bool keep_null, unsigned int depth)
+{
+    if (patch->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        json_write_value(w, patch);
+        return;
+    }
+    if (depth >= JSON_MERGE_MAX_DEPTH)
+    {
+        w->err = ESP_ERR_INVALID_RESPONSE;
+        return;
+    }
+    if (target != NULL && target->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        target = NULL;
+    }
+
+    struct aws_iot_shadow_json_iter iter;
+    struct aws_iot_shadow_json_value key, value, patch_value;
+    bool first = true;
+
+    json_write(w, "{", 1);
+
+    // Members of target, replaced or removed by patch
+    if (target != NULL)
+    {
+        aws_iot_shadow_json_iter_init(&iter, target);
+        while (w->err == ESP_OK && aws_iot_shadow_json_iter_next(&iter, &key, &value))
+        {
+            if (!json_object_get_key(patch, &key, &patch_value))
+            {
+                json_write_key(w, &key, &first);
+                json_write_value(w, &value);
+            }
+            else if (keep_null || patch_value.type != AWS_IOT_SHADOW_JSON_TYPE_NULL)
+            {
+                json_write_key(w, &key, &first);
+                json_merge(w, &value, &patch_value, keep_null, depth + 1);
+            }
+        }
+        if (iter.pos == NULL)
+        {
+            w->err = ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+
+    // New members of patch
+    aws_iot_shadow_json_iter_init(&iter, patch);
+    while (w->err == ESP_OK && aws_iot_shadow_json_iter_next(&iter, &key, &patch_value))
+    {
+        if ((keep_null || patch_value.type != AWS_IOT_SHADOW_JSON_TYPE_NULL) && !json_object_get_key(target, &key, NULL))
+        {
+            json_write_key(w, &key, &first);
+            json_merge(w, NULL, &patch_value, keep_null, depth + 1);
+        }
+    }
+    if (iter.pos == NULL)
+    {
+        w->err = ESP_ERR_INVALID_RESPONSE;
+    }
+
+    json_write(w, "}", 1);
+}
+
+static esp_err_t json_merge_to(const struct aws_iot_shadow_json_value *target, const struct aws_iot_shadow_json_value *patch,
+                               bool keep_null, char *buf, size_t buf_len, size_t *written)
+{
+    if (patch == NULL || patch->type == AWS_IOT_SHADOW_JSON_TYPE_INVALID || buf == NULL || buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct json_writer w = {
+        .buf = buf,
+        .len = buf_len,
+        .pos = 0,
+        .err = ESP_OK,
+    };
+    json_merge(&w, target, patch, keep_null, 0);
+
+    if (w.err != ESP_OK)
+    {
+        w.pos = 0;
+    }
+    buf[w.pos] = '\0';
+    if (written)
+    {
+        *written = w.pos;
+    }
+    return w.err;
+}
+
+esp_err_t aws_iot_shadow_json_merge_patch(const struct aws_iot_shadow_json_value *target, const struct aws_iot_shadow_json_value *patch,
+                                          char *buf, size_t buf_len, size_t *written)
+{
+    return json_merge_to(target, patch, false, buf, buf_len, written);
+}
+
+esp_err_t aws_iot_shadow_json_merge_update(const struct aws_iot_shadow_json_value *target, const struct aws_iot_shadow_json_value *patch,
+                                           char *buf, size_t buf_len, size_t *written)
+{
+    return json_merge_to(target, patch, true, buf, buf_len, written);
+}
+
+/**
+ * @brief Same as json_object_get_key(), trying the member at hint first. Hint is moved past the found member.
+ *
+ * Compared documents usually have members in the same order, lookups do not rescan the object then.
+ * in_order is cleared, unless the member was found at hint.
+ */
+static bool json_object_get_key_hinted(const struct aws_iot_shadow_json_value *object, struct aws_iot_shadow_json_iter *hint,
+                                       const struct aws_iot_shadow_json_value *key, struct aws_iot_shadow_json_value *value,
+                                       bool *in_order)
+{
+    struct aws_iot_shadow_json_iter peek = *hint;
+    struct aws_iot_shadow_json_value k, v;
+    if (aws_iot_shadow_json_iter_next(&peek, &k, &v) && k.len == key->len && memcmp(k.data, key->data, k.len) == 0)
+    {
+        *hint = peek;
+        *value = v;
+        return true;
+    }
+
+    *in_order = false;
+    if (!json_object_get_key(object, key, value))
+    {
+        return false;
+    }
+    hint->pos = value->data + value->len + (value->type == AWS_IOT_SHADOW_JSON_TYPE_STRING ? 1 : 0); // closing quote
+    hint->first = false;
+    return true;
+}
+
+static bool json_equal(const struct aws_iot_shadow_json_value *a, const struct aws_iot_shadow_json_value *b, unsigned int depth)
+{
+    if (a->type != b->type || depth >= JSON_MERGE_MAX_DEPTH)
+    {
+        return false;
+    }
+    if (a->len == b->len && memcmp(a->data, b->data, a->len) == 0)
+    {
+        return true;
+    }
+
+    struct aws_iot_shadow_json_iter iter_a, iter_b;
+    struct aws_iot_shadow_json_value key, value_a, value_b;
+
+    switch (a->type)
+    {
+    case AWS_IOT_SHADOW_JSON_TYPE_OBJECT:
+    {
+        // Member order does not matter, same number of members and each of a found in b
+        size_t count_a = 0, count_b = 0;
+        aws_iot_shadow_json_iter_init(&iter_a, a);
+        aws_iot_shadow_json_iter_init(&iter_b, b);
+        while (aws_iot_shadow_json_iter_next(&iter_a, &key, &value_a))
+        {
+            bool in_order = true;
+            if (!json_object_get_key_hinted(b, &iter_b, &key, &value_b, &in_order) || !json_equal(&value_a, &value_b, depth + 1))
+            {
+                return false;
+            }
+            count_a++;
+        }
+        aws_iot_shadow_json_iter_init(&iter_b, b);
+        while (aws_iot_shadow_json_iter_next(&iter_b, NULL, NULL))
+        {
+            count_b++;
+        }
+        return iter_a.pos != NULL && iter_b.pos != NULL && count_a == count_b;
+    }
+    case AWS_IOT_SHADOW_JSON_TYPE_ARRAY:
+    {
+        aws_iot_shadow_json_iter_init(&iter_a, a);
+        aws_iot_shadow_json_iter_init(&iter_b, b);
+        for (;;)
+        {
+            bool has_a = aws_iot_shadow_json_iter_next(&iter_a, NULL, &value_a);
+            bool has_b = aws_iot_shadow_json_iter_next(&iter_b, NULL, &value_b);
+            if (has_a != has_b)
+            {
+                return false;
+            }
+            if (!has_a)
+            {
+                return iter_a.pos != NULL && iter_b.pos != NULL;
+            }
+            if (!json_equal(&value_a, &value_b, depth + 1))
+            {
+                return false;
+            }
+        }
+    }
+    case AWS_IOT_SHADOW_JSON_TYPE_NUMBER:
+    {
+        // 1, 1.0 and 1e0 are the same number
+        double number_a, number_b;
+        return aws_iot_shadow_json_get_double(a, &number_a) == ESP_OK
+               && aws_iot_shadow_json_get_double(b, &number_b) == ESP_OK
+               && number_a == number_b;
+    }
+    default:
+        // Strings are compared as encoded, differently escaped equal strings are reported as a change
+        return false;
+    }
+}
+
+/**
+ * @brief Writes members of next, which differ from prev, as a merge patch object.
+ *
+ * @return true if anything has changed.
+ */
+static bool json_diff(struct json_writer *w, const struct aws_iot_shadow_json_value *prev,
+                      const struct aws_iot_shadow_json_value *next, unsigned int depth)
+{
+    if (depth >= JSON_MERGE_MAX_DEPTH)
+    {
+        w->err = ESP_ERR_INVALID_RESPONSE;
+        return false;
+    }
+
+    struct aws_iot_shadow_json_iter iter = {0}, hint = {0};
+    struct aws_iot_shadow_json_value key, value, prev_value;
+    bool first = true;
+    bool in_order = true;
+
+    json_write(w, "{", 1);
+
+    // Unchanged state is the common case
+    if (prev->len == next->len && memcmp(prev->data, next->data, next->len) == 0)
+    {
+        json_write(w, "}", 1);
+        return false;
+    }
+
+    // Changed and new members
+    aws_iot_shadow_json_iter_init(&iter, next);
+    aws_iot_shadow_json_iter_init(&hint, prev);
+    while (w->err == ESP_OK && aws_iot_shadow_json_iter_next(&iter, &key, &value))
+    {
+        if (!json_object_get_key_hinted(prev, &hint, &key, &prev_value, &in_order))
+        {
+            json_write_key(w, &key, &first);
+            json_write_value(w, &value);
+        }
+        else if (value.type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT && prev_value.type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+        {
+            // Nested object is written only if any of its members has changed
+            size_t pos = w->pos;
+            bool was_first = first;
+            json_write_key(w, &key, &first);
+            if (!json_diff(w, &prev_value, &value, depth + 1) && w->err == ESP_OK)
+            {
+                w->pos = pos;
+                first = was_first;
+            }
+        }
+        else if (!json_equal(&prev_value, &value, depth + 1))
+        {
+            json_write_key(w, &key, &first);
+            json_write_value(w, &value);
+        }
+    }
+    if (iter.pos == NULL)
+    {
+        w->err = ESP_ERR_INVALID_RESPONSE;
+    }
+
+    // Removed members, none if all members of prev were matched in order
+    if (in_order && !aws_iot_shadow_json_iter_next(&hint, NULL, NULL) && hint.pos != NULL)
+    {
+        json_write(w, "}", 1);
+        return !first;
+    }
+    aws_iot_shadow_json_iter_init(&iter, prev);
+    aws_iot_shadow_json_iter_init(&hint, next);
+    while (w->err == ESP_OK && aws_iot_shadow_json_iter_next(&iter, &key, NULL))
+    {
+        if (!json_object_get_key_hinted(next, &hint, &key, &value, &in_order))
+        {
+            json_write_key(w, &key, &first);
+            json_write(w, "null", 4);
+        }
+    }
+    if (iter.pos == NULL)
+    {
+        w->err = ESP_ERR_INVALID_RESPONSE;
+    }
+
+    json_write(w, "}", 1);
+    return !first;
+}
+
+esp_err_t aws_iot_shadow_json_diff(const struct aws_iot_shadow_json_value *prev, const struct aws_iot_shadow_json_value *next,
+                                   char *buf, size_t buf_len, size_t *written)
+{
+    if (next == NULL || next->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT || buf == NULL || buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct json_writer w = {
+        .buf = buf,
+        .len = buf_len,
+        .pos = 0,
+        .err = ESP_OK,
+    };
+    if (prev == NULL || prev->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        json_write_value(&w, next);
+    }
+    else
+    {
+        json_diff(&w, prev, next, 0);
+    }
+
+    if (w.err != ESP_OK)
+    {
+        w.pos = 0;
+    }
+    buf[w.pos] = '\0';
+    if (written)
+    {
+        *written = w.pos;
+    }
+    return w.err;
+}
+
+static void json_changes_add(struct aws_iot_shadow_json_changes *changes, const struct aws_iot_shadow_json_value *key)
+{
+    if (changes->count < AWS_IOT_SHADOW_JSON_CHANGES_MAX)
+    {
+        changes->keys[changes->count] = *key;
+    }
+    if (changes->count < UINT8_MAX)
+    {
+        changes->count++;
+    }
+}
+
+/**
+ * @brief Collects keys of top level members of next, which differ from prev, and of those removed from prev.
+ */
+static void json_changes(const struct aws_iot_shadow_json_value *prev, const struct aws_iot_shadow_json_value *next,
+                         struct aws_iot_shadow_json_changes *changes)
+{
+    memset(changes, 0, sizeof(*changes));
+
+    bool has_prev = prev->type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT;
+    bool has_next = next->type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT;
+    if (has_prev && has_next && prev->len == next->len && memcmp(prev->data, next->data, next->len) == 0)
+    {
+        return;
+    }
+
+    struct aws_iot_shadow_json_iter iter = {0}, hint = {0};
+    struct aws_iot_shadow_json_value key, value, prev_value;
+    bool in_order = true;
+
+    // Changed and new members
+    if (has_next)
+    {
+        aws_iot_shadow_json_iter_init(&iter, next);
+        if (has_prev)
+        {
+            aws_iot_shadow_json_iter_init(&hint, prev);
+        }
+        while (aws_iot_shadow_json_iter_next(&iter, &key, &value))
+        {
+            if (!has_prev || !json_object_get_key_hinted(prev, &hint, &key, &prev_value, &in_order)
+                || !json_equal(&prev_value, &value, 0))
+            {
+                json_changes_add(changes, &key);
+            }
+        }
+    }
+    if (!has_prev)
+    {
+        return;
+    }
+
+    // Removed members, none if all members of prev were matched in order
+    if (has_next && in_order && !aws_iot_shadow_json_iter_next(&hint, NULL, NULL) && hint.pos != NULL)
+    {
+        return;
+    }
+    aws_iot_shadow_json_iter_init(&iter, prev);
+    while (aws_iot_shadow_json_iter_next(&iter, &key, NULL))
+    {
+        if (!json_object_get_key(next, &key, NULL))
+        {
+            json_changes_add(changes, &key);
+        }
+    }
+}
+
+esp_err_t aws_iot_shadow_json_parse_documents(const char *data, size_t data_len, struct aws_iot_shadow_json_documents *docs)
+{
+    if (docs == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(docs, 0, sizeof(*docs));
+
+    if (data == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Single pass over top level members, as in aws_iot_shadow_json_parse_document()
+    struct aws_iot_shadow_json_value root, key, value, previous = {0}, current = {0};
+    struct aws_iot_shadow_json_iter iter;
+    if (json_root_object(data, data_len, &root) != ESP_OK)
+    {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    aws_iot_shadow_json_iter_init(&iter, &root);
+    while (aws_iot_shadow_json_iter_next(&iter, &key, &value))
+    {
+        if (value.type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+        {
+            // previous is null for a new shadow
+            continue;
+        }
+        if (json_string_equals_n(&key, AWS_IOT_SHADOW_JSON_PREVIOUS, sizeof(AWS_IOT_SHADOW_JSON_PREVIOUS) - 1))
+        {
+            previous = value;
+        }
+        else if (json_string_equals_n(&key, AWS_IOT_SHADOW_JSON_CURRENT, sizeof(AWS_IOT_SHADOW_JSON_CURRENT) - 1))
+        {
+            current = value;
+        }
+    }
+    if (iter.pos == NULL || current.type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (previous.type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+    {
+        err = aws_iot_shadow_json_parse_document(previous.data, previous.len, &docs->previous);
+    }
+    if (err == ESP_OK)
+    {
+        err = aws_iot_shadow_json_parse_document(current.data, current.len, &docs->current);
+    }
+    if (err != ESP_OK)
+    {
+        memset(docs, 0, sizeof(*docs));
+        return err;
+    }
+
+    json_changes(&docs->previous.desired, &docs->current.desired, &docs->desired);
+    json_changes(&docs->previous.reported, &docs->current.reported, &docs->reported);
+    return ESP_OK;
+}
+
+/**
+ * @brief Formats decimal digits of value backwards, ending before end, returns their number (at least min_digits).
+ */
+static size_t json_format_uint64(char *end, uint64_t value, size_t min_digits)
+{
+    size_t len = 0;
+    do
+    {
+        *--end = (char)('0' + value % 10);
+        value /= 10;
+        len++;
+    } while (value != 0 || len < min_digits);
+    return len;
+}
+
+static void json_write_uint64(struct json_writer *w, uint64_t value, bool negative)
+{
+    char digits[21];
+    size_t len = json_format_uint64(digits + sizeof(digits), value, 1);
+    if (negative)
+    {
+        digits[sizeof(digits) - ++len] = '-';
+    }
+    json_write(w, digits + sizeof(digits) - len, len);
+}
+
+static void json_write_int64(struct json_writer *w, int64_t value)
+{
+    json_write_uint64(w, value < 0 ? 0 - (uint64_t)value : (uint64_t)value, value < 0);
+}
+
+static void json_write_double(struct json_writer *w, double value, bool single)
+{
+    if (!isfinite(value))
+    {
+        json_write(w, "null", 4);
+        return;
+    }
+
+    // Shortest of the usual precisions which reads back the same, as cJSON does
+    char number[JSON_NUMBER_MAX_LENGTH];
+    int len = snprintf(number, sizeof(number), single ? "%.7g" : "%.15g", value);
+    if (single ? (float)strtod(number, NULL) != (float)value : strtod(number, NULL) != value)
+    {
+        len = snprintf(number, sizeof(number), single ? "%.9g" : "%.17g", value);
+    }
+    json_write(w, number, (size_t)len);
+}
+
+static void json_write_string(struct json_writer *w, const char *str, size_t size)
+{
+    static const char HEX[] = "0123456789abcdef";
+    size_t len = strnlen(str, size);
+
+    json_write(w, "\"", 1);
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)str[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+
+        json_write(w, str + start, i - start);
+        start = i + 1;
+        char escape[6] = {'\\', (char)c};
+        size_t escape_len = 2;
+        switch (c)
+        {
+        case '"':
+        case '\\':
+            break;
+        case '\b':
+            escape[1] = 'b';
+            break;
+        case '\f':
+            escape[1] = 'f';
+            break;
+        case '\n':
+            escape[1] = 'n';
+            break;
+        case '\r':
+            escape[1] = 'r';
+            break;
+        case '\t':
+            escape[1] = 't';
+            break;
+        default:
+            memcpy(escape + 1, "u00", 3);
+            escape[4] = HEX[c >> 4];
+            escape[5] = HEX[c & 0xF];
+            escape_len = 6;
+            break;
+        }
+        json_write(w, escape, escape_len);
+    }
+    json_write(w, str + start, len - start);
+    json_write(w, "\"", 1);
+}
+
+static size_t json_field_size(enum aws_iot_shadow_json_field_type type)
+{
+    switch (type)
+    {
+    case AWS_IOT_SHADOW_JSON_FIELD_BOOL:
+        return sizeof(bool);
+    case AWS_IOT_SHADOW_JSON_FIELD_INT32:
+    case AWS_IOT_SHADOW_JSON_FIELD_UINT32:
+        return sizeof(int32_t);
+    case AWS_IOT_SHADOW_JSON_FIELD_INT64:
+        return sizeof(int64_t);
+    case AWS_IOT_SHADOW_JSON_FIELD_FLOAT:
+        return sizeof(float);
+    case AWS_IOT_SHADOW_JSON_FIELD_DOUBLE:
+        return sizeof(double);
+    default:
+        return 0;
+    }
+}
+
+static bool json_field_changed(const struct aws_iot_shadow_json_field *field, const char *value, const char *prev)
+{
+    if (field->type == AWS_IOT_SHADOW_JSON_FIELD_STRING)
+    {
+        return strncmp(value, prev, field->size) != 0;
+    }
+    return memcmp(value, prev, field->size) != 0;
+}
+
+static void json_write_field(struct json_writer *w, const struct aws_iot_shadow_json_field *field, const char *value)
+{
+    // Members might not be aligned in packed structs
+    switch (field->type)
+    {
+    case AWS_IOT_SHADOW_JSON_FIELD_BOOL:
+    {
+        bool b;
+        memcpy(&b, value, sizeof(b));
+        json_write(w, b ? "true" : "false", b ? 4 : 5);
+        break;
+    }
+    case AWS_IOT_SHADOW_JSON_FIELD_INT32:
+    {
+        int32_t i;
+        memcpy(&i, value, sizeof(i));
+        json_write_int64(w, i);
+        break;
+    }
+    case AWS_IOT_SHADOW_JSON_FIELD_UINT32:
+    {
+        uint32_t u;
+        memcpy(&u, value, sizeof(u));
+        json_write_uint64(w, u, false);
+        break;
+    }
+    case AWS_IOT_SHADOW_JSON_FIELD_INT64:
+    {
+        int64_t i;
+        memcpy(&i, value, sizeof(i));
+        json_write_int64(w, i);
+        break;
+    }
+    case AWS_IOT_SHADOW_JSON_FIELD_FLOAT:
+    {
+        float f;
+        memcpy(&f, value, sizeof(f));
+        json_write_double(w, f, true);
+        break;
+    }
+    case AWS_IOT_SHADOW_JSON_FIELD_DOUBLE:
+    {
+        double d;
+        memcpy(&d, value, sizeof(d));
+        json_write_double(w, d, false);
+        break;
+    }
+    case AWS_IOT_SHADOW_JSON_FIELD_STRING:
+        json_write_string(w, value, field->size);
+        break;
+    }
+}
+
+/**
+ * @brief Length of the longest common prefix of whole path segments, each ending with a dot.
+ */
+static size_t json_path_common(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    size_t common = 0;
+    for (size_t i = 0; i < a_len && i < b_len && a[i] == b[i]; i++)
+    {
+        if (a[i] == '.')
+        {
+            common = i + 1;
+        }
+    }
+    return common;
+}
+
+static bool json_field_valid(const struct aws_iot_shadow_json_field *field)
+{
+    return field->path != NULL && field->size != 0
+           && (field->type == AWS_IOT_SHADOW_JSON_FIELD_STRING || field->size == json_field_size(field->type));
+}
+
+/**
+ * @brief Writes `{"state":{"reported":{...}}}` of fields which differ from prev (if given) and are in mask (if given).
+ *
+ * @return Number of fields written.
+ */
+static size_t json_write_fields(struct json_writer *w, const struct aws_iot_shadow_json_field *fields, size_t field_count,
+                                const void *state, const void *prev, const uint32_t *mask)
+{
+    static const char HEAD[] = "{\"" AWS_IOT_SHADOW_JSON_STATE "\":{\"" AWS_IOT_SHADOW_JSON_REPORTED "\":{";
+    json_write(w, HEAD, sizeof(HEAD) - 1);
+
+    // Nested objects open now, as the parent part of the path of the last field written, e.g. "led."
+    const char *open = "";
+    size_t open_len = 0;
+    bool first = true;
+    size_t count = 0;
+
+    for (size_t i = 0; i < field_count && w->err == ESP_OK; i++)
+    {
+        const struct aws_iot_shadow_json_field *field = &fields[i];
+        if (!json_field_valid(field))
+        {
+            w->err = ESP_ERR_INVALID_ARG;
+            break;
+        }
+
+        const char *value = (const char *)state + field->offset;
+        if ((mask != NULL && !(*mask & (1UL << i)))
+            || (prev != NULL && !json_field_changed(field, value, (const char *)prev + field->offset)))
+        {
+            continue;
+        }
+
+        const char *name = strrchr(field->path, '.');
+        name = name != NULL ? name + 1 : field->path;
+        size_t parent_len = (size_t)(name - field->path);
+
+        // Close objects down to the common parent, then open the rest of this path
+        size_t common = json_path_common(open, open_len, field->path, parent_len);
+        for (size_t p = common; p < open_len; p++)
+        {
+            if (open[p] == '.')
+            {
+                json_write(w, "}", 1);
+                first = false;
+            }
+        }
+        for (size_t start = common, p = common; p < parent_len; p++)
+        {
+            if (field->path[p] == '.')
+            {
+                json_write(w, first ? "\"" : ",\"", first ? 1 : 2);
+                json_write(w, field->path + start, p - start);
+                json_write(w, "\":{", 3);
+                first = true;
+                start = p + 1;
+            }
+        }
+        open = field->path;
+        open_len = parent_len;
+
+        json_write(w, first ? "\"" : ",\"", first ? 1 : 2);
+        json_write(w, name, strlen(name));
+        json_write(w, "\":", 2);
+        json_write_field(w, field, value);
+        first = false;
+        count++;
+    }
+
+    for (size_t p = 0; p < open_len; p++)
+    {
+        if (open[p] == '.')
+        {
+            json_write(w, "}", 1);
+        }
+    }
+    json_write(w, "}}}", 3);
+    return count;
+}
+
+esp_err_t aws_iot_shadow_json_write_reported(const struct aws_iot_shadow_json_field *fields, size_t field_count,
+                                             const void *state, const void *prev, char *buf, size_t buf_len, size_t *written)
+{
+    if (fields == NULL || state == NULL || buf == NULL || buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct json_writer w = {
+        .buf = buf,
+        .len = buf_len,
+        .pos = 0,
+        .err = ESP_OK,
+    };
+    size_t count = json_write_fields(&w, fields, field_count, state, prev, NULL);
+
+    if (w.err == ESP_OK && count == 0 && prev != NULL)
+    {
+        w.err = ESP_ERR_NOT_FOUND;
+    }
+    if (w.err != ESP_OK)
+    {
+        w.pos = 0;
+    }
+    buf[w.pos] = '\0';
+    if (written)
+    {
+        *written = w.pos;
+    }
+    return w.err;
+}
+
+// FNV-1a, seeded, so that a seed without collisions can be searched for
+#define JSON_HASH_BASIS (2166136261U)
+#define JSON_HASH_PRIME (16777619U)
+#define JSON_SCHEMA_SEEDS (1024U)
+
+static inline uint32_t json_hash_update(uint32_t hash, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= JSON_HASH_PRIME;
+    }
+    return hash;
+}
+
+static inline uint8_t json_hash_slot(uint32_t hash, uint8_t mask)
+{
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6dU;
+    hash ^= hash >> 12;
+    return (uint8_t)(hash & mask);
+}
+
+esp_err_t aws_iot_shadow_json_schema_init(struct aws_iot_shadow_json_schema *schema, const struct aws_iot_shadow_json_field *fields,
+                                          size_t field_count)
+{
+    if (schema == NULL || fields == NULL || field_count == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (field_count > AWS_IOT_SHADOW_JSON_SCHEMA_FIELDS_MAX)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t i = 0; i < field_count; i++)
+    {
+        if (!json_field_valid(&fields[i]))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    memset(schema, 0, sizeof(*schema));
+    schema->fields = fields;
+    schema->field_count = field_count;
+
+    // Smallest table with a seed, which maps all paths to distinct slots
+    size_t slots = 8;
+    while (slots < field_count * 2)
+    {
+        slots *= 2;
+    }
+    for (; slots <= AWS_IOT_SHADOW_JSON_SCHEMA_SLOTS; slots *= 2)
+    {
+        for (uint32_t seed = 0; seed < JSON_SCHEMA_SEEDS; seed++)
+        {
+            memset(schema->slots, 0, sizeof(schema->slots));
+            size_t i = 0;
+            for (; i < field_count; i++)
+            {
+                uint32_t hash = json_hash_update(JSON_HASH_BASIS ^ seed, fields[i].path, strlen(fields[i].path));
+                uint8_t slot = json_hash_slot(hash, (uint8_t)(slots - 1));
+                if (schema->slots[slot] != 0)
+                {
+                    break;
+                }
+                schema->slots[slot] = (uint8_t)(i + 1);
+            }
+            if (i == field_count)
+            {
+                schema->seed = seed;
+                schema->mask = (uint8_t)(slots - 1);
+                return ESP_OK;
+            }
+        }
+    }
+
+    // Duplicate paths
+    memset(schema, 0, sizeof(*schema));
+    return ESP_ERR_INVALID_ARG;
+}
+
+struct json_apply
+{
+    const struct aws_iot_shadow_json_schema *schema;
+    char *state;
+    aws_iot_shadow_json_field_changed_t changed;
+    void *changed_arg;
+    uint32_t applied; // bits of field indexes
+    char path[JSON_KEY_MAX_LENGTH];
+};
+
+/**
+ * @brief Length of a string value once decoded, SIZE_MAX if malformed.
+ */
+static size_t json_string_decoded_len(const struct aws_iot_shadow_json_value *value)
+{
+    const char *p = value->data;
+    const char *end = value->data + value->len;
+    size_t len = 0;
+    while (p < end)
+    {
+        if (*p == '\\')
+        {
+            char decoded[4];
+            size_t decoded_len = 0;
+            p = json_decode_escape(p + 1, end, decoded, &decoded_len);
+            if (p == NULL)
+            {
+                return SIZE_MAX;
+            }
+            len += decoded_len;
+        }
+        else
+        {
+            p++;
+            len++;
+        }
+    }
+    return len;
+}
+
+/**
+ * @brief Converts value to the type of the field and stores it into dst, unless it is not convertible.
+ *
+ * @return true if value has been stored, changed tells if it differs from what was there.
+ */
+static bool json_apply_value(const struct aws_iot_shadow_json_field *field, const struct aws_iot_shadow_json_value *value,
+                             char *dst, bool *changed)
+{
+    union
+    {
+        bool b;
+        int32_t i32;
+        uint32_t u32;
+        int64_t i64;
+        float f;
+        double d;
+    } converted;
+    int64_t i;
+    double d;
+
+    switch (field->type)
+    {
+    case AWS_IOT_SHADOW_JSON_FIELD_BOOL:
+        if (aws_iot_shadow_json_get_bool(value, &converted.b) != ESP_OK)
+        {
+            return false;
+        }
+        break;
+    case AWS_IOT_SHADOW_JSON_FIELD_INT32:
+        if (aws_iot_shadow_json_get_int64(value, &i) != ESP_OK || i < INT32_MIN || i > INT32_MAX)
+        {
+            return false;
+        }
+        converted.i32 = (int32_t)i;
+        break;
+    case AWS_IOT_SHADOW_JSON_FIELD_UINT32:
+        if (aws_iot_shadow_json_get_int64(value, &i) != ESP_OK || i < 0 || i > UINT32_MAX)
+        {
+            return false;
+        }
+        converted.u32 = (uint32_t)i;
+        break;
+    case AWS_IOT_SHADOW_JSON_FIELD_INT64:
+        if (aws_iot_shadow_json_get_int64(value, &converted.i64) != ESP_OK)
+        {
+            return false;
+        }
+        break;
+    case AWS_IOT_SHADOW_JSON_FIELD_FLOAT:
+        if (aws_iot_shadow_json_get_double(value, &d) != ESP_OK)
+        {
+            return false;
+        }
+        converted.f = (float)d;
+        break;
+    case AWS_IOT_SHADOW_JSON_FIELD_DOUBLE:
+        if (aws_iot_shadow_json_get_double(value, &converted.d) != ESP_OK)
+        {
+            return false;
+        }
+        break;
+    case AWS_IOT_SHADOW_JSON_FIELD_STRING:
+        // Decoded in place, only when it fits, so the member is never left truncated
+        if (value->type != AWS_IOT_SHADOW_JSON_TYPE_STRING || json_string_decoded_len(value) >= field->size)
+        {
+            return false;
+        }
+        *changed = !json_string_equals_n(value, dst, strnlen(dst, field->size));
+        return !*changed || aws_iot_shadow_json_string_copy(value, dst, field->size) == ESP_OK;
+    default:
+        return false;
+    }
+
+    *changed = memcmp(dst, &converted, field->size) != 0;
+    memcpy(dst, &converted, field->size);
+    return true;
+}
+
+static esp_err_t json_apply_object(struct json_apply *a, const struct aws_iot_shadow_json_value *object, size_t path_len,
+                                   uint32_t path_hash, unsigned int depth)
+{
+    const struct aws_iot_shadow_json_schema *schema = a->schema;
+    struct aws_iot_shadow_json_iter iter;
+    struct aws_iot_shadow_json_value key, value;
+
+    aws_iot_shadow_json_iter_init(&iter, object);
+    while (aws_iot_shadow_json_iter_next(&iter, &key, &value))
+    {
+        if (path_len + key.len + 1 >= sizeof(a->path))
+        {
+            continue;
+        }
+        uint32_t hash = json_hash_update(path_hash, key.data, key.len);
+
+        if (value.type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT)
+        {
+            // Fields are never objects, members of nested ones might be fields
+            if (depth + 1 < JSON_MERGE_MAX_DEPTH)
+            {
+                memcpy(a->path + path_len, key.data, key.len);
+                a->path[path_len + key.len] = '.';
+                esp_err_t err = json_apply_object(a, &value, path_len + key.len + 1, json_hash_update(hash, ".", 1), depth + 1);
+                if (err != ESP_OK)
+                {
+                    return err;
+                }
+            }
+            continue;
+        }
+
+        uint8_t index = schema->slots[json_hash_slot(hash, schema->mask)];
+        if (index == 0)
+        {
+            continue;
+        }
+        const struct aws_iot_shadow_json_field *field = &schema->fields[index - 1];
+        if (strlen(field->path) != path_len + key.len || memcmp(field->path, a->path, path_len) != 0
+            || memcmp(field->path + path_len, key.data, key.len) != 0)
+        {
+            continue;
+        }
+
+        bool changed = false;
+        if (json_apply_value(field, &value, a->state + field->offset, &changed))
+        {
+            a->applied |= 1UL << (index - 1);
+            if (changed && a->changed != NULL)
+            {
+                a->changed(a->changed_arg, field);
+            }
+        }
+    }
+    return iter.pos != NULL ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
+
+esp_err_t aws_iot_shadow_json_apply(const struct aws_iot_shadow_json_schema *schema, const struct aws_iot_shadow_json_value *object,
+                                    void *state, aws_iot_shadow_json_field_changed_t changed, void *changed_arg,
+                                    char *ack, size_t ack_len, size_t *ack_written)
+{
+    if (schema == NULL || schema->fields == NULL || object == NULL || object->type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT
+        || state == NULL || (ack != NULL && ack_len == 0))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct json_apply a = {
+        .schema = schema,
+        .state = (char *)state,
+        .changed = changed,
+        .changed_arg = changed_arg,
+        .applied = 0,
+    };
+    esp_err_t err = json_apply_object(&a, object, 0, JSON_HASH_BASIS ^ schema->seed, 0);
+    if (ack == NULL)
+    {
+        return err;
+    }
+
+    // Fields applied, also those malformed input has ended with
+    struct json_writer w = {
+        .buf = ack,
+        .len = ack_len,
+        .pos = 0,
+        .err = ESP_OK,
+    };
+    if (a.applied != 0)
+    {
+        json_write_fields(&w, schema->fields, schema->field_count, state, NULL, &a.applied);
+    }
+    if (w.err != ESP_OK)
+    {
+        w.pos = 0;
+    }
+    ack[w.pos] = '\0';
+    if (ack_written)
+    {
+        *ack_written = w.pos;
+    }
+    return err != ESP_OK ? err : w.err;
+}
+
+esp_err_t aws_iot_shadow_json_template_init(struct aws_iot_shadow_json_template *tpl, const char *skeleton, char *buf, size_t buf_len)
+{
+    if (tpl == NULL || skeleton == NULL || buf == NULL || buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(tpl, 0, sizeof(*tpl));
+    size_t pos = 0;
+    bool in_string = false;
+    esp_err_t err = ESP_OK;
+
+    for (const char *p = skeleton; *p != '\0' && err == ESP_OK;)
+    {
+        if (in_string || *p != '%')
+        {
+            // Strings are copied as they are, a % there is not a slot
+            if (*p == '"')
+            {
+                in_string = !in_string;
+            }
+            else if (in_string && *p == '\\' && p[1] != '\0')
+            {
+                if (pos + 1 >= buf_len)
+                {
+                    err = ESP_ERR_INVALID_SIZE;
+                    break;
+                }
+                buf[pos++] = *p++;
+            }
+            if (pos + 1 >= buf_len)
+            {
+                err = ESP_ERR_INVALID_SIZE;
+                break;
+            }
+            buf[pos++] = *p++;
+            continue;
+        }
+
+        unsigned int width = 0;
+        for (p++; json_is_digit(*p) && width <= AWS_IOT_SHADOW_JSON_TEMPLATE_WIDTH_MAX; p++)
+        {
+            width = width * 10 + (unsigned int)(*p - '0');
+        }
+        if (width == 0 || width > AWS_IOT_SHADOW_JSON_TEMPLATE_WIDTH_MAX)
+        {
+            err = ESP_ERR_INVALID_ARG;
+        }
+        else if (tpl->slot_count >= AWS_IOT_SHADOW_JSON_TEMPLATE_SLOTS_MAX || pos + width >= buf_len || pos > UINT16_MAX)
+        {
+            err = ESP_ERR_INVALID_SIZE;
+        }
+        else
+        {
+            tpl->slots[tpl->slot_count].offset = (uint16_t)pos;
+            tpl->slots[tpl->slot_count].width = (uint8_t)width;
+            tpl->slot_count++;
+            memset(buf + pos, ' ', width - 1);
+            buf[pos + width - 1] = '0';
+            pos += width;
+        }
+    }
+
+    if (err != ESP_OK)
+    {
+        memset(tpl, 0, sizeof(*tpl));
+        pos = 0;
+    }
+    buf[pos] = '\0';
+    tpl->buf = err == ESP_OK ? buf : NULL;
+    tpl->len = pos;
+    return err;
+}
+
+/**
+ * @brief Copies formatted number, which ends at end, into the slot, right aligned.
+ */
+static esp_err_t json_template_fill(struct aws_iot_shadow_json_template *tpl, uint8_t slot, const char *end, size_t len)
+{
+    size_t width = tpl->slots[slot].width;
+    if (len > width)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    char *dst = tpl->buf + tpl->slots[slot].offset;
+    memset(dst, ' ', width - len);
+    memcpy(dst + width - len, end - len, len);
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_json_template_set_int(struct aws_iot_shadow_json_template *tpl, uint8_t slot, int64_t value)
+{
+    if (tpl == NULL || tpl->buf == NULL || slot >= tpl->slot_count)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char digits[AWS_IOT_SHADOW_JSON_TEMPLATE_WIDTH_MAX];
+    char *end = digits + sizeof(digits);
+    size_t len = json_format_uint64(end, value < 0 ? 0 - (uint64_t)value : (uint64_t)value, 1);
+    if (value < 0)
+    {
+        *(end - ++len) = '-';
+    }
+    return json_template_fill(tpl, slot, end, len);
+}
+
+esp_err_t aws_iot_shadow_json_template_set_double(struct aws_iot_shadow_json_template *tpl, uint8_t slot, double value,
+                                                  uint8_t decimals)
+{
+    static const double SCALES[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+    if (tpl == NULL || tpl->buf == NULL || slot >= tpl->slot_count || decimals >= sizeof(SCALES) / sizeof(SCALES[0]))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!isfinite(value))
+    {
+        return json_template_fill(tpl, slot, "null" + 4, 4);
+    }
+
+    // Fixed point, so formatting is integer only
+    double scaled = (value < 0 ? -value : value) * SCALES[decimals] + 0.5;
+    if (scaled >= 1e18)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint64_t fixed = (uint64_t)scaled;
+    bool negative = value < 0 && fixed != 0; // no -0.00
+
+    char digits[AWS_IOT_SHADOW_JSON_TEMPLATE_WIDTH_MAX + 2];
+    char *end = digits + sizeof(digits);
+    size_t len = 0;
+    if (decimals > 0)
+    {
+        len = json_format_uint64(end, fixed % (uint64_t)SCALES[decimals], decimals);
+        *(end - ++len) = '.';
+        fixed /= (uint64_t)SCALES[decimals];
+    }
+    len += json_format_uint64(end - len, fixed, 1);
+    if (negative)
+    {
+        *(end - ++len) = '-';
+    }
+    return json_template_fill(tpl, slot, end, len);
+}
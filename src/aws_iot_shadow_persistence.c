@@ -0,0 +1,241 @@
+#include "aws_iot_shadow_persistence.h"
+#include "aws_iot_shadow_cache.h"
+#include "aws_iot_shadow_handle.h"
+#include "aws_iot_shadow_json.h"
+#include <esp_log.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+
+static const char TAG[] = "aws_iot_shadow";
+
+// Snapshot layout, little endian:
+//   0  magic "AWSS"
+//   4  format version (1), 3 reserved bytes
+//   8  shadow version, int64
+//  16  length of reported state, uint32
+//  20  length of desired state, uint32
+//  24  reported state JSON, desired state JSON
+#define SNAPSHOT_MAGIC "AWSS"
+#define SNAPSHOT_FORMAT (1U)
+#define SNAPSHOT_HEADER_LENGTH (24U)
+#define SNAPSHOT_MAX_LENGTH (SNAPSHOT_HEADER_LENGTH + 2 * AWS_IOT_SHADOW_DOCUMENT_CACHE_MAX_SIZE)
+
+// Document dispatched as /get/accepted
+#define SNAPSHOT_DOCUMENT_FORMAT "{\"" AWS_IOT_SHADOW_JSON_STATE "\":{\"" AWS_IOT_SHADOW_JSON_DESIRED "\":%.*s,\"" \
+                                 AWS_IOT_SHADOW_JSON_REPORTED "\":%.*s},\"" AWS_IOT_SHADOW_JSON_VERSION "\":%lld}"
+
+#define FILE_PATH_MAX_LENGTH (128U)
+
+static inline void snapshot_put_u32(uint8_t *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static inline uint32_t snapshot_get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void snapshot_put_i64(uint8_t *p, int64_t value)
+{
+    snapshot_put_u32(p, (uint32_t)((uint64_t)value & 0xFFFFFFFFU));
+    snapshot_put_u32(p + 4, (uint32_t)((uint64_t)value >> 32));
+}
+
+static inline int64_t snapshot_get_i64(const uint8_t *p)
+{
+    return (int64_t)((uint64_t)snapshot_get_u32(p) | (uint64_t)snapshot_get_u32(p + 4) << 32);
+}
+
+static bool snapshot_is_object(const uint8_t *data, size_t len)
+{
+    struct aws_iot_shadow_json_value value;
+    return aws_iot_shadow_json_parse((const char *)data, len, &value) == ESP_OK
+           && value.type == AWS_IOT_SHADOW_JSON_TYPE_OBJECT;
+}
+
+esp_err_t aws_iot_shadow_snapshot_load(aws_iot_shadow_handle_ptr handle, char **data, size_t *data_len)
+{
+    uint8_t *snapshot = (uint8_t *)malloc(SNAPSHOT_MAX_LENGTH);
+    if (snapshot == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t len = 0;
+    esp_err_t err = handle->persistence.load(handle->persistence.ctx, handle->snapshot_key, snapshot, SNAPSHOT_MAX_LENGTH, &len);
+    if (err != ESP_OK)
+    {
+        free(snapshot);
+        return err;
+    }
+
+    // Validate, snapshot could have been written by a different build or damaged
+    uint32_t reported_len = len >= SNAPSHOT_HEADER_LENGTH ? snapshot_get_u32(snapshot + 16) : 0;
+    uint32_t desired_len = len >= SNAPSHOT_HEADER_LENGTH ? snapshot_get_u32(snapshot + 20) : 0;
+    const uint8_t *reported = snapshot + SNAPSHOT_HEADER_LENGTH;
+    const uint8_t *desired = reported + reported_len;
+
+    if (len < SNAPSHOT_HEADER_LENGTH || memcmp(snapshot, SNAPSHOT_MAGIC, 4) != 0 || snapshot[4] != SNAPSHOT_FORMAT
+        || (size_t)reported_len + desired_len != len - SNAPSHOT_HEADER_LENGTH
+        || !snapshot_is_object(reported, reported_len) || !snapshot_is_object(desired, desired_len))
+    {
+        ESP_LOGW(TAG, "%s snapshot %s is invalid (%zu bytes)", handle->topic_prefix, handle->snapshot_key, len);
+        free(snapshot);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    int64_t version = snapshot_get_i64(snapshot + 8);
+    int doc_len = snprintf(NULL, 0, SNAPSHOT_DOCUMENT_FORMAT, (int)desired_len, (const char *)desired,
+                           (int)reported_len, (const char *)reported, (long long)version);
+    char *doc = (char *)malloc((size_t)doc_len + 1);
+    if (doc == NULL)
+    {
+        free(snapshot);
+        return ESP_ERR_NO_MEM;
+    }
+    snprintf(doc, (size_t)doc_len + 1, SNAPSHOT_DOCUMENT_FORMAT, (int)desired_len, (const char *)desired,
+             (int)reported_len, (const char *)reported, (long long)version);
+    free(snapshot);
+
+    // Already stored
+    handle->snapshot_version = version;
+    handle->has_snapshot_version = true;
+
+    *data = doc;
+    *data_len = (size_t)doc_len;
+    return ESP_OK;
+}
+
+void aws_iot_shadow_snapshot_save(aws_iot_shadow_handle_ptr handle, int64_t version)
+{
+    if (handle->persistence.store == NULL || (handle->has_snapshot_version && handle->snapshot_version == version))
+    {
+        return;
+    }
+
+    const struct aws_iot_shadow_cached_document *reported = &handle->cached_reported;
+    const struct aws_iot_shadow_cached_document *desired = &handle->cached_desired;
+    if (reported->data == NULL || desired->data == NULL)
+    {
+        // Not cached, too large
+        return;
+    }
+
+    size_t len = SNAPSHOT_HEADER_LENGTH + reported->len + desired->len;
+    uint8_t *snapshot = (uint8_t *)malloc(len);
+    if (snapshot == NULL)
+    {
+        ESP_LOGE(TAG, "failed to allocate %zu bytes for snapshot", len);
+        return;
+    }
+
+    memcpy(snapshot, SNAPSHOT_MAGIC, 4);
+    snapshot[4] = SNAPSHOT_FORMAT;
+    snapshot[5] = snapshot[6] = snapshot[7] = 0;
+    snapshot_put_i64(snapshot + 8, version);
+    snapshot_put_u32(snapshot + 16, (uint32_t)reported->len);
+    snapshot_put_u32(snapshot + 20, (uint32_t)desired->len);
+    memcpy(snapshot + SNAPSHOT_HEADER_LENGTH, reported->data, reported->len);
+    memcpy(snapshot + SNAPSHOT_HEADER_LENGTH + reported->len, desired->data, desired->len);
+
+    esp_err_t err = handle->persistence.store(handle->persistence.ctx, handle->snapshot_key, snapshot, len);
+    free(snapshot);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "%s failed to store snapshot %s: %d (%s)", handle->topic_prefix, handle->snapshot_key, err, esp_err_to_name(err));
+        return;
+    }
+
+    ESP_LOGD(TAG, "%s stored snapshot %s, version %lld (%zu bytes)", handle->topic_prefix, handle->snapshot_key, (long long)version, len);
+    handle->snapshot_version = version;
+    handle->has_snapshot_version = true;
+}
+
+static esp_err_t aws_iot_shadow_persistence_file_path(const char *dir, const char *key, const char *suffix,
+                                                      char *path, size_t path_len)
+{
+    int len = snprintf(path, path_len, "%s/%s%s", dir, key, suffix);
+    return len > 0 && (size_t)len < path_len ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+static esp_err_t aws_iot_shadow_persistence_file_load(void *ctx, const char *key, void *buf, size_t buf_len, size_t *len)
+{
+    char path[FILE_PATH_MAX_LENGTH];
+    esp_err_t err = aws_iot_shadow_persistence_file_path((const char *)ctx, key, "", path, sizeof(path));
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        return errno == ENOENT ? ESP_ERR_NOT_FOUND : ESP_FAIL;
+    }
+
+    // Read one byte more, to detect a too small buffer
+    uint8_t extra;
+    size_t read = fread(buf, 1, buf_len, f);
+    bool larger = read == buf_len && fread(&extra, 1, 1, f) == 1;
+    err = ferror(f) ? ESP_FAIL : larger ? ESP_ERR_INVALID_SIZE : ESP_OK;
+    fclose(f);
+
+    *len = read;
+    return err;
+}
+
+static esp_err_t aws_iot_shadow_persistence_file_store(void *ctx, const char *key, const void *data, size_t len)
+{
+    char path[FILE_PATH_MAX_LENGTH];
+    char tmp_path[FILE_PATH_MAX_LENGTH];
+    if (aws_iot_shadow_persistence_file_path((const char *)ctx, key, "", path, sizeof(path)) != ESP_OK
+        || aws_iot_shadow_persistence_file_path((const char *)ctx, key, ".tmp", tmp_path, sizeof(tmp_path)) != ESP_OK)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Written aside and renamed, so a power loss does not leave a partial snapshot
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL)
+    {
+        return ESP_FAIL;
+    }
+    bool ok = fwrite(data, 1, len, f) == len;
+    ok = fclose(f) == 0 && ok;
+
+    // Some file systems (e.g. FAT) do not replace existing files
+    if (ok && rename(tmp_path, path) != 0)
+    {
+        remove(path);
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok)
+    {
+        remove(tmp_path);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t aws_iot_shadow_persistence_file_init(const char *dir, struct aws_iot_shadow_persistence *persistence)
+{
+    if (dir == NULL || persistence == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    persistence->load = aws_iot_shadow_persistence_file_load;
+    persistence->store = aws_iot_shadow_persistence_file_store;
+    persistence->ctx = (void *)dir;
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include "aws_iot_shadow_persistence.h"
+#include <nvs.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_PERSISTENCE
+
+static esp_err_t aws_iot_shadow_persistence_nvs_load(void *ctx, const char *key, void *buf, size_t buf_len, size_t *len)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open((const char *)ctx, NVS_READONLY, &nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        // Namespace does not exist yet
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    *len = buf_len;
+    err = nvs_get_blob(nvs, key, buf, len);
+    nvs_close(nvs);
+
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (err == ESP_ERR_NVS_INVALID_LENGTH)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return err;
+}
+
+static esp_err_t aws_iot_shadow_persistence_nvs_store(void *ctx, const char *key, const void *data, size_t len)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open((const char *)ctx, NVS_READWRITE, &nvs);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    err = nvs_set_blob(nvs, key, data, len);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+esp_err_t aws_iot_shadow_persistence_nvs_init(const char *nvs_namespace, struct aws_iot_shadow_persistence *persistence)
+{
+    if (nvs_namespace == NULL || persistence == NULL || strlen(nvs_namespace) >= NVS_KEY_NAME_MAX_SIZE)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    persistence->load = aws_iot_shadow_persistence_nvs_load;
+    persistence->store = aws_iot_shadow_persistence_nvs_store;
+    persistence->ctx = (void *)nvs_namespace;
+    return ESP_OK;
+}
+
+#endif
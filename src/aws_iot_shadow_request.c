@@ -0,0 +1,715 @@
+#include "aws_iot_shadow_request.h"
+#include "aws_iot_shadow_json.h"
+#include "aws_iot_shadow_router.h"
+#include "aws_iot_shadow_stats.h"
+#include "aws_iot_shadow_throttle.h"
+#include "aws_iot_shadow_trace.h"
+#include <esp_log.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+
+static const char TAG[] = "aws_iot_shadow";
+
+#define REQUEST_TOKEN_PREFIX "{\"" AWS_IOT_SHADOW_JSON_CLIENT_TOKEN "\":\""
+#define REQUEST_TOKEN_PREFIX_LENGTH (sizeof(REQUEST_TOKEN_PREFIX) - 1)
+
+static const int SYNC_DONE_BIT = BIT3; // of handle->event_group, other bits are owned by aws_iot_shadow.c
+static const int SYNC_CANCEL_BIT = BIT4; // set by aws_iot_shadow_delete(), never cleared
+
+struct aws_iot_shadow_sync_call
+{
+    char *buf;
+    size_t buf_len;
+    struct aws_iot_shadow_sync_response response;
+};
+
+static inline bool aws_iot_shadow_request_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/**
+ * @brief Token is inserted into JSON as is, it must not need escaping.
+ */
+static bool aws_iot_shadow_request_token_valid(const char *token)
+{
+    size_t len = strlen(token);
+    if (len == 0 || len >= AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if (token[i] < 0x20 || token[i] > 0x7e || token[i] == '"' || token[i] == '\\')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Arms the timer for the earliest deadline. Called under dispatch lock.
+ *
+ * @param force Re-arm even if the timer fires before the earliest deadline (it is re-armed then anyway).
+ */
+static esp_err_t aws_iot_shadow_request_timer_arm(aws_iot_shadow_handle_ptr handle, bool force)
+{
+    int64_t earliest = INT64_MAX;
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_REQUEST_MAX_PENDING; i++)
+    {
+        const struct aws_iot_shadow_pending_request *request = &handle->pending_requests[i];
+        if (request->client_token[0] != '\0' && request->deadline < earliest)
+        {
+            earliest = request->deadline;
+        }
+    }
+
+    if (!force && handle->request_timer_alarm != 0 && handle->request_timer_alarm <= earliest)
+    {
+        return ESP_OK;
+    }
+
+    // Not running is fine
+    esp_timer_stop(handle->request_timer);
+    handle->request_timer_alarm = 0;
+    if (earliest == INT64_MAX)
+    {
+        return ESP_OK;
+    }
+
+    int64_t now = esp_timer_get_time();
+    esp_err_t err = esp_timer_start_once(handle->request_timer, earliest > now ? (uint64_t)(earliest - now) : 0);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s failed to start request timer: %d (%s)", handle->topic_prefix, err, esp_err_to_name(err));
+        return err;
+    }
+    handle->request_timer_alarm = earliest;
+    return ESP_OK;
+}
+
+static void aws_iot_shadow_request_timeout(void *arg)
+{
+    aws_iot_shadow_handle_ptr handle = (aws_iot_shadow_handle_ptr)arg;
+
+    // One request at a time, callback runs without lock
+    for (;;)
+    {
+        if (__atomic_load_n(&handle->deleting, __ATOMIC_ACQUIRE))
+        {
+            return;
+        }
+        aws_iot_shadow_router_dispatch_lock(handle);
+
+        int64_t now = esp_timer_get_time();
+        struct aws_iot_shadow_pending_request *expired = NULL;
+        for (unsigned int i = 0; i < AWS_IOT_SHADOW_REQUEST_MAX_PENDING; i++)
+        {
+            struct aws_iot_shadow_pending_request *request = &handle->pending_requests[i];
+            if (request->client_token[0] != '\0' && request->deadline <= now
+                && (expired == NULL || request->deadline < expired->deadline))
+            {
+                expired = request;
+            }
+        }
+
+        if (expired == NULL)
+        {
+            // Failure is logged, the next request added arms it again
+            aws_iot_shadow_request_timer_arm(handle, true);
+            aws_iot_shadow_router_dispatch_unlock(handle);
+            return;
+        }
+
+        struct aws_iot_shadow_pending_request request = *expired;
+        expired->client_token[0] = '\0';
+        handle->pending_count--;
+        aws_iot_shadow_router_dispatch_unlock(handle);
+
+        ESP_LOGW(TAG, "%s request %s timed out", handle->topic_prefix, request.client_token);
+        struct aws_iot_shadow_request_completion completion = {
+            .result = AWS_IOT_SHADOW_REQUEST_TIMEOUT,
+            .event_id = AWS_IOT_SHADOW_EVENT_ANY,
+            .client_token = request.client_token,
+            .rtt_us = now - request.sent_at,
+            .data = NULL,
+            .data_len = 0,
+        };
+        request.callback(handle, &completion, request.arg);
+    }
+}
+
+static esp_err_t aws_iot_shadow_request_add(aws_iot_shadow_handle_ptr handle, const char *client_token,
+                                            enum aws_iot_shadow_event accepted_event,
+                                            const struct aws_iot_shadow_request_config *config)
+{
+    aws_iot_shadow_router_dispatch_lock(handle);
+    if (__atomic_load_n(&handle->deleting, __ATOMIC_ACQUIRE))
+    {
+        // Pending requests have been completed, or are being completed
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    struct aws_iot_shadow_pending_request *slot = NULL;
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_REQUEST_MAX_PENDING; i++)
+    {
+        struct aws_iot_shadow_pending_request *request = &handle->pending_requests[i];
+        if (request->client_token[0] == '\0')
+        {
+            slot = slot ? slot : request;
+        }
+        else if (strcmp(request->client_token, client_token) == 0)
+        {
+            aws_iot_shadow_router_dispatch_unlock(handle);
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    if (slot == NULL)
+    {
+        aws_iot_shadow_router_dispatch_unlock(handle);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (handle->request_timer == NULL)
+    {
+        esp_timer_create_args_t timer_args = {
+            .callback = aws_iot_shadow_request_timeout,
+            .arg = handle,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "aws_iot_shadow_request",
+        };
+        esp_err_t err = esp_timer_create(&timer_args, &handle->request_timer);
+        if (err != ESP_OK)
+        {
+            aws_iot_shadow_router_dispatch_unlock(handle);
+            return err;
+        }
+    }
+
+    uint32_t timeout_ms = config->timeout_ms > 0 ? config->timeout_ms : AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS;
+    strcpy(slot->client_token, client_token);
+    slot->accepted_event = accepted_event;
+    slot->sent_at = esp_timer_get_time();
+    slot->deadline = timeout_ms != AWS_IOT_SHADOW_REQUEST_NO_TIMEOUT ? slot->sent_at + (int64_t)timeout_ms * 1000 : INT64_MAX;
+    slot->callback = config->callback;
+    slot->arg = config->arg;
+    handle->pending_count++;
+
+    // Without the timer it would never time out
+    esp_err_t err = aws_iot_shadow_request_timer_arm(handle, false);
+    if (err != ESP_OK)
+    {
+        slot->client_token[0] = '\0';
+        handle->pending_count--;
+    }
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    return err;
+}
+
+static void aws_iot_shadow_request_remove(aws_iot_shadow_handle_ptr handle, const char *client_token)
+{
+    aws_iot_shadow_router_dispatch_lock(handle);
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_REQUEST_MAX_PENDING; i++)
+    {
+        struct aws_iot_shadow_pending_request *request = &handle->pending_requests[i];
+        if (request->client_token[0] != '\0' && strcmp(request->client_token, client_token) == 0)
+        {
+            request->client_token[0] = '\0';
+            handle->pending_count--;
+            break;
+        }
+    }
+    aws_iot_shadow_router_dispatch_unlock(handle);
+}
+
+/**
+ * @brief Removes the pending request of given callback argument, unless it is being completed already.
+ *
+ * @param request Receives the removed request.
+ */
+static bool aws_iot_shadow_request_withdraw(aws_iot_shadow_handle_ptr handle, const void *arg,
+                                            struct aws_iot_shadow_pending_request *request)
+{
+    bool found = false;
+    aws_iot_shadow_router_dispatch_lock(handle);
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_REQUEST_MAX_PENDING && !found; i++)
+    {
+        struct aws_iot_shadow_pending_request *pending = &handle->pending_requests[i];
+        if (pending->client_token[0] != '\0' && pending->arg == arg)
+        {
+            *request = *pending;
+            pending->client_token[0] = '\0';
+            handle->pending_count--;
+            found = true;
+        }
+    }
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    return found;
+}
+
+static esp_err_t aws_iot_shadow_request_publish(aws_iot_shadow_handle_ptr handle, const char *op, const char *data, size_t data_len,
+                                                const struct aws_iot_shadow_request_config *config)
+{
+    char topic_name[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    int topic_len = snprintf(topic_name, sizeof(topic_name), "%s%s", handle->topic_prefix, op);
+    if (topic_len <= 0 || (size_t)topic_len >= sizeof(topic_name))
+    {
+        return ESP_ERR_INVALID_SIZE; // buffer overflow
+    }
+
+#if AWS_IOT_SHADOW_TRACE
+    aws_iot_shadow_trace(handle, AWS_IOT_SHADOW_TRACE_PUBLISH, aws_iot_shadow_trace_op(op), data_len);
+#else
+    ESP_LOGI(TAG, "sending %s (%zu bytes)", topic_name, data_len);
+#endif
+    ESP_LOGD(TAG, "sending %s payload: %.*s", topic_name, (int)data_len, data);
+
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    enum aws_iot_shadow_priority priority = config->priority;
+    if (priority == AWS_IOT_SHADOW_PRIORITY_DEFAULT)
+    {
+        priority = strcmp(op, AWS_IOT_SHADOW_OP_UPDATE) == 0 ? AWS_IOT_SHADOW_PRIORITY_NORMAL : AWS_IOT_SHADOW_PRIORITY_HIGH;
+    }
+    return aws_iot_shadow_throttle_publish(handle, topic_name, data, data_len, priority);
+#else
+    int msg_id = esp_mqtt_client_publish(handle->client, topic_name, data, (int)data_len, 1, 0);
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_stats_published(handle, msg_id);
+#endif
+    return msg_id != -1 ? ESP_OK : ESP_FAIL;
+#endif
+}
+
+/**
+ * @brief Resolves client token of a request, from config or generated.
+ */
+static esp_err_t aws_iot_shadow_request_token(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_request_config *config,
+                                              char *client_token)
+{
+    if (config->client_token != NULL)
+    {
+        if (!aws_iot_shadow_request_token_valid(config->client_token))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        strcpy(client_token, config->client_token);
+        return ESP_OK;
+    }
+
+    // Unique per boot and shadow, responses are seen by every client subscribed to the shadow
+    aws_iot_shadow_router_dispatch_lock(handle);
+    if (handle->client_token_salt == 0)
+    {
+        handle->client_token_salt = ((uint32_t)esp_timer_get_time() ^ handle->topic_prefix_hash) | 1U;
+    }
+    uint32_t seq = ++handle->client_token_seq;
+    snprintf(client_token, AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX, "%08" PRIx32 "%08" PRIx32, handle->client_token_salt, seq);
+    aws_iot_shadow_router_dispatch_unlock(handle);
+    return ESP_OK;
+}
+
+/**
+ * @brief Adds a pending request and publishes its payload, not under dispatch lock (MQTT client has own lock).
+ */
+static esp_err_t aws_iot_shadow_request_send(aws_iot_shadow_handle_ptr handle, const char *op, enum aws_iot_shadow_event accepted_event,
+                                             const char *client_token, const char *data, size_t data_len,
+                                             const struct aws_iot_shadow_request_config *config)
+{
+    // Added first, response cannot arrive before publish
+    esp_err_t err = aws_iot_shadow_request_add(handle, client_token, accepted_event, config);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    err = aws_iot_shadow_request_publish(handle, op, data, data_len, config);
+    if (err != ESP_OK)
+    {
+        aws_iot_shadow_request_remove(handle, client_token);
+    }
+    return err;
+}
+
+static esp_err_t aws_iot_shadow_request_empty_tracked(aws_iot_shadow_handle_ptr handle, const char *op,
+                                                      enum aws_iot_shadow_event accepted_event,
+                                                      const struct aws_iot_shadow_request_config *config)
+{
+    if (handle == NULL || config == NULL || config->callback == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char client_token[AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX];
+    esp_err_t err = aws_iot_shadow_request_token(handle, config, client_token);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    // {"clientToken":"..."}
+    char payload[REQUEST_TOKEN_PREFIX_LENGTH + AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX + 2];
+    int len = snprintf(payload, sizeof(payload), REQUEST_TOKEN_PREFIX "%s\"}", client_token);
+    return aws_iot_shadow_request_send(handle, op, accepted_event, client_token, payload, (size_t)len, config);
+}
+
+esp_err_t aws_iot_shadow_request_update_tracked(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len,
+                                                const struct aws_iot_shadow_request_config *config)
+{
+    if (handle == NULL || data == NULL || data_len > INT_MAX || config == NULL || config->callback == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct aws_iot_shadow_json_document doc;
+    if (aws_iot_shadow_json_parse_document(data, data_len, &doc) != ESP_OK)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    char client_token[AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX];
+    if (doc.client_token.type != AWS_IOT_SHADOW_JSON_TYPE_INVALID)
+    {
+        // Document has its own, config can only repeat it
+        if (aws_iot_shadow_json_string_copy(&doc.client_token, client_token, sizeof(client_token)) != ESP_OK
+            || client_token[0] == '\0' || (config->client_token != NULL && strcmp(config->client_token, client_token) != 0))
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        return aws_iot_shadow_request_send(handle, AWS_IOT_SHADOW_OP_UPDATE, AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED,
+                                           client_token, data, data_len, config);
+    }
+
+    esp_err_t err = aws_iot_shadow_request_token(handle, config, client_token);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    // Insert as the first member, `{"clientToken":"...",` replaces `{`
+    const char *body = data;
+    while (aws_iot_shadow_request_is_space(*body))
+    {
+        body++;
+    }
+    body++;
+    const char *next = body;
+    while (aws_iot_shadow_request_is_space(*next))
+    {
+        next++;
+    }
+    bool empty = *next == '}';
+
+    size_t token_len = strlen(client_token);
+    size_t body_len = data_len - (size_t)(body - data);
+    size_t len = REQUEST_TOKEN_PREFIX_LENGTH + token_len + (empty ? 1 : 2) + body_len;
+    char *payload = (char *)malloc(len);
+    if (payload == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    char *p = payload;
+    memcpy(p, REQUEST_TOKEN_PREFIX, REQUEST_TOKEN_PREFIX_LENGTH);
+    p += REQUEST_TOKEN_PREFIX_LENGTH;
+    memcpy(p, client_token, token_len);
+    p += token_len;
+    *p++ = '"';
+    if (!empty)
+    {
+        *p++ = ',';
+    }
+    memcpy(p, body, body_len);
+
+    err = aws_iot_shadow_request_send(handle, AWS_IOT_SHADOW_OP_UPDATE, AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED,
+                                      client_token, payload, len, config);
+    free(payload);
+    return err;
+}
+
+esp_err_t aws_iot_shadow_request_get_tracked(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_request_config *config)
+{
+    return aws_iot_shadow_request_empty_tracked(handle, AWS_IOT_SHADOW_OP_GET, AWS_IOT_SHADOW_EVENT_GET_ACCEPTED, config);
+}
+
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+esp_err_t aws_iot_shadow_request_delete_tracked(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_request_config *config)
+{
+    return aws_iot_shadow_request_empty_tracked(handle, AWS_IOT_SHADOW_OP_DELETE, AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED, config);
+}
+#endif
+
+static void aws_iot_shadow_request_sync_done(aws_iot_shadow_handle_ptr handle,
+                                             const struct aws_iot_shadow_request_completion *completion, void *arg)
+{
+    // The only copy of the response, straight from the MQTT buffer
+    struct aws_iot_shadow_sync_call *call = (struct aws_iot_shadow_sync_call *)arg;
+    call->response.result = completion->result;
+    call->response.len = completion->data_len;
+    call->response.rtt_us = completion->rtt_us;
+    if (completion->data != NULL && completion->data_len < call->buf_len)
+    {
+        memcpy(call->buf, completion->data, completion->data_len);
+        call->buf[completion->data_len] = '\0';
+    }
+    xEventGroupSetBits(handle->event_group, SYNC_DONE_BIT);
+}
+
+/**
+ * @brief Sends a tracked get (data is NULL) or update, and blocks until it completes.
+ */
+static esp_err_t aws_iot_shadow_request_sync(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len,
+                                             char *buf, size_t buf_len, TickType_t timeout,
+                                             struct aws_iot_shadow_sync_response *response)
+{
+    if (handle == NULL || buf == NULL || buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (aws_iot_shadow_router_dispatching(handle))
+    {
+        ESP_LOGE(TAG, "%s synchronous request from a handler or callback would never complete", handle->topic_prefix);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (__atomic_exchange_n(&handle->sync_pending, true, __ATOMIC_ACQUIRE))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    struct aws_iot_shadow_sync_call call = {
+        .buf = buf,
+        .buf_len = buf_len,
+        .response = {.result = AWS_IOT_SHADOW_REQUEST_TIMEOUT},
+    };
+    buf[0] = '\0';
+
+    // Rest of the timeout is left for the round trip, tracking completes the request once it expires
+    TickType_t start = xTaskGetTickCount();
+    esp_err_t err = ESP_OK;
+    if (!aws_iot_shadow_wait_for_ready_unless(handle, SYNC_CANCEL_BIT, timeout))
+    {
+        err = (xEventGroupGetBits(handle->event_group) & SYNC_CANCEL_BIT) ? ESP_ERR_INVALID_STATE : ESP_ERR_TIMEOUT;
+    }
+    struct aws_iot_shadow_request_config config = {
+        .callback = aws_iot_shadow_request_sync_done,
+        .arg = &call,
+        .timeout_ms = AWS_IOT_SHADOW_REQUEST_NO_TIMEOUT,
+    };
+    if (err == ESP_OK && timeout != portMAX_DELAY)
+    {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        uint64_t timeout_ms = elapsed < timeout ? (uint64_t)(timeout - elapsed) * portTICK_PERIOD_MS : 0;
+        config.timeout_ms = timeout_ms < AWS_IOT_SHADOW_REQUEST_NO_TIMEOUT ? (uint32_t)timeout_ms
+                                                                           : AWS_IOT_SHADOW_REQUEST_NO_TIMEOUT - 1;
+        err = config.timeout_ms > 0 ? ESP_OK : ESP_ERR_TIMEOUT;
+    }
+
+    if (err == ESP_OK)
+    {
+        xEventGroupClearBits(handle->event_group, SYNC_DONE_BIT);
+        err = data != NULL ? aws_iot_shadow_request_update_tracked(handle, data, data_len, &config)
+                           : aws_iot_shadow_request_get_tracked(handle, &config);
+    }
+    if (err == ESP_OK)
+    {
+        // Completes by a response or the request timer, which is not relied on to have fired in time
+        TickType_t wait = portMAX_DELAY;
+        if (timeout != portMAX_DELAY)
+        {
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            wait = elapsed < timeout ? timeout - elapsed : 0;
+        }
+        EventBits_t bits = xEventGroupWaitBits(handle->event_group, SYNC_DONE_BIT, pdTRUE, pdTRUE, wait);
+        if ((bits & SYNC_DONE_BIT) == 0)
+        {
+            struct aws_iot_shadow_pending_request request;
+            if (aws_iot_shadow_request_withdraw(handle, &call, &request))
+            {
+                call.response.rtt_us = esp_timer_get_time() - request.sent_at;
+            }
+            else
+            {
+                // Callback is running, it sets the bit right away
+                xEventGroupWaitBits(handle->event_group, SYNC_DONE_BIT, pdTRUE, pdTRUE, portMAX_DELAY);
+            }
+        }
+
+        if (call.response.result == AWS_IOT_SHADOW_REQUEST_TIMEOUT)
+        {
+            err = ESP_ERR_TIMEOUT;
+        }
+        else if (call.response.result == AWS_IOT_SHADOW_REQUEST_CANCELLED)
+        {
+            err = ESP_ERR_INVALID_STATE;
+        }
+        else if (call.response.len >= buf_len)
+        {
+            err = ESP_ERR_INVALID_SIZE;
+        }
+        else
+        {
+            err = call.response.result == AWS_IOT_SHADOW_REQUEST_ACCEPTED ? ESP_OK : ESP_FAIL;
+        }
+    }
+
+    // Last access of the handle, aws_iot_shadow_delete() waits for it
+    __atomic_store_n(&handle->sync_pending, false, __ATOMIC_RELEASE);
+
+    if (response)
+    {
+        *response = call.response;
+    }
+    return err;
+}
+
+esp_err_t aws_iot_shadow_request_get_sync(aws_iot_shadow_handle_ptr handle, char *buf, size_t buf_len, TickType_t timeout,
+                                          struct aws_iot_shadow_sync_response *response)
+{
+    return aws_iot_shadow_request_sync(handle, NULL, 0, buf, buf_len, timeout, response);
+}
+
+esp_err_t aws_iot_shadow_request_update_sync(aws_iot_shadow_handle_ptr handle, const char *data, size_t data_len,
+                                             char *buf, size_t buf_len, TickType_t timeout,
+                                             struct aws_iot_shadow_sync_response *response)
+{
+    if (data == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return aws_iot_shadow_request_sync(handle, data, data_len, buf, buf_len, timeout, response);
+}
+
+bool aws_iot_shadow_request_match(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                  const char *data, size_t data_len, struct aws_iot_shadow_pending_request *request)
+{
+    if (handle->pending_count == 0 || data == NULL)
+    {
+        return false;
+    }
+
+    enum aws_iot_shadow_event accepted_event;
+    switch ((int)event_id)
+    {
+    case AWS_IOT_SHADOW_EVENT_GET_ACCEPTED:
+    case AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED:
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+    case AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED:
+#endif
+        accepted_event = event_id;
+        break;
+    case AWS_IOT_SHADOW_EVENT_GET_REJECTED:
+    case AWS_IOT_SHADOW_EVENT_UPDATE_REJECTED:
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+    case AWS_IOT_SHADOW_EVENT_DELETE_REJECTED:
+#endif
+        accepted_event = (enum aws_iot_shadow_event)(event_id - 1);
+        break;
+    default:
+        return false;
+    }
+
+    // clientToken is a top level member of every response
+    struct aws_iot_shadow_json_value root, token;
+    char client_token[AWS_IOT_SHADOW_CLIENT_TOKEN_LENGTH_MAX];
+    if (aws_iot_shadow_json_parse(data, data_len, &root) != ESP_OK || root.type != AWS_IOT_SHADOW_JSON_TYPE_OBJECT
+        || aws_iot_shadow_json_object_get(&root, AWS_IOT_SHADOW_JSON_CLIENT_TOKEN, &token) != ESP_OK
+        || aws_iot_shadow_json_string_copy(&token, client_token, sizeof(client_token)) != ESP_OK)
+    {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_REQUEST_MAX_PENDING; i++)
+    {
+        struct aws_iot_shadow_pending_request *pending = &handle->pending_requests[i];
+        if (pending->client_token[0] != '\0' && pending->accepted_event == accepted_event
+            && strcmp(pending->client_token, client_token) == 0)
+        {
+            *request = *pending;
+            pending->client_token[0] = '\0';
+            handle->pending_count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void aws_iot_shadow_request_complete(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_pending_request *request,
+                                     enum aws_iot_shadow_event event_id, const char *data, size_t data_len)
+{
+    struct aws_iot_shadow_request_completion completion = {
+        .result = event_id == request->accepted_event ? AWS_IOT_SHADOW_REQUEST_ACCEPTED : AWS_IOT_SHADOW_REQUEST_REJECTED,
+        .event_id = event_id,
+        .client_token = request->client_token,
+        .rtt_us = esp_timer_get_time() - request->sent_at,
+        .data = data,
+        .data_len = data_len,
+    };
+    ESP_LOGD(TAG, "%s request %s completed: %d, %lld us", handle->topic_prefix, request->client_token,
+             completion.result, (long long)completion.rtt_us);
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_stats_latency(handle, event_id, completion.rtt_us);
+#endif
+    request->callback(handle, &completion, request->arg);
+}
+
+void aws_iot_shadow_request_free(aws_iot_shadow_handle_ptr handle)
+{
+    // Pending requests have created the timer
+    if (handle->request_timer != NULL)
+    {
+        esp_timer_stop(handle->request_timer);
+        esp_timer_delete(handle->request_timer);
+        handle->request_timer = NULL;
+
+        // One request at a time, callback runs without lock
+        for (;;)
+        {
+            struct aws_iot_shadow_pending_request request = {.callback = NULL};
+            aws_iot_shadow_router_dispatch_lock(handle);
+            for (unsigned int i = 0; i < AWS_IOT_SHADOW_REQUEST_MAX_PENDING; i++)
+            {
+                struct aws_iot_shadow_pending_request *pending = &handle->pending_requests[i];
+                if (pending->client_token[0] != '\0')
+                {
+                    request = *pending;
+                    pending->client_token[0] = '\0';
+                    handle->pending_count--;
+                    break;
+                }
+            }
+            aws_iot_shadow_router_dispatch_unlock(handle);
+            if (request.callback == NULL)
+            {
+                break;
+            }
+
+            struct aws_iot_shadow_request_completion completion = {
+                .result = AWS_IOT_SHADOW_REQUEST_CANCELLED,
+                .event_id = AWS_IOT_SHADOW_EVENT_ANY,
+                .client_token = request.client_token,
+                .rtt_us = esp_timer_get_time() - request.sent_at,
+                .data = NULL,
+                .data_len = 0,
+            };
+            request.callback(handle, &completion, request.arg);
+        }
+    }
+
+    // Synchronous requests waiting for ready, the others have been completed above
+    if (handle->event_group != NULL)
+    {
+        xEventGroupSetBits(handle->event_group, SYNC_CANCEL_BIT);
+    }
+    while (__atomic_load_n(&handle->sync_pending, __ATOMIC_ACQUIRE))
+    {
+        vTaskDelay(1);
+    }
+}
+
+#endif
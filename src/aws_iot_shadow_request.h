@@ -0,0 +1,44 @@
+#ifndef AWS_IOT_SHADOW_REQUEST_H
+#define AWS_IOT_SHADOW_REQUEST_H
+
+#include "aws_iot_shadow.h"
+#include "aws_iot_shadow_handle.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+/**
+ * @brief Finds and removes the pending request a response belongs to. Called under dispatch lock.
+ *
+ * @param request Receives the removed request.
+ * @return true if the response completes a request.
+ */
+bool aws_iot_shadow_request_match(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                  const char *data, size_t data_len, struct aws_iot_shadow_pending_request *request);
+
+/**
+ * @brief Calls completion callback of a matched request. Called under dispatch lock, after handlers.
+ */
+void aws_iot_shadow_request_complete(aws_iot_shadow_handle_ptr handle, const struct aws_iot_shadow_pending_request *request,
+                                     enum aws_iot_shadow_event event_id, const char *data, size_t data_len);
+
+/**
+ * @brief Completes pending requests with AWS_IOT_SHADOW_REQUEST_CANCELLED, drops their timer, and waits for
+ * synchronous requests to return. Takes dispatch lock, the handle must still be attached.
+ */
+void aws_iot_shadow_request_free(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Same as aws_iot_shadow_wait_for_ready(), returns false once any of cancel_bits is set as well.
+ * Defined in aws_iot_shadow.c, which owns the ready bit.
+ */
+bool aws_iot_shadow_wait_for_ready_unless(aws_iot_shadow_handle_ptr handle, EventBits_t cancel_bits, TickType_t ticks_to_wait);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1002 @@
+#include "aws_iot_shadow_router.h"
+#include "aws_iot_shadow_async.h"
+#include "aws_iot_shadow_gateway.h"
+#include "aws_iot_shadow_handle.h"
+#include "aws_iot_shadow_stats.h"
+#include "aws_iot_shadow_throttle.h"
+#include <esp_idf_version.h>
+#include <esp_log.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string.h>
+
+static const char TAG[] = "aws_iot_shadow";
+
+#define ROUTER_INITIAL_BUCKETS (4U)
+#define ROUTER_INITIAL_SUBSCRIPTIONS (16U)
+#define ROUTER_EARLY_ACKS (4U)
+
+// Handlers of events raised on other tasks run on the MQTT task, the worker runs them with async dispatch
+#if !AWS_IOT_SHADOW_ASYNC_DISPATCH && ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+#define ROUTER_USER_EVENTS 1
+#else
+#define ROUTER_USER_EVENTS 0
+#endif
+
+// For MQTT_EVENT_SUBSCRIBED tracking
+struct router_subscription
+{
+    int msg_id; // 0 for an empty slot
+    aws_iot_shadow_handle_ptr handle;
+    EventBits_t bit;
+};
+
+#if ROUTER_USER_EVENTS
+// Event handed to the MQTT task as MQTT_USER_EVENT, see aws_iot_shadow_router_defer
+struct router_deferred
+{
+    aws_iot_shadow_handle_ptr handle; // NULL once removed
+    int32_t event_id;
+    size_t data_len;
+    struct router_deferred *next;
+    char data[];
+};
+#endif
+
+/**
+ * @brief Single MQTT event handler per client, routing events to shadow handles.
+ *
+ * Handles are hashed by their topic prefix (thing and shadow name), pending subscriptions
+ * by msg_id, so dispatch does not depend on number of shadows of the client.
+ */
+struct aws_iot_shadow_router
+{
+    esp_mqtt_client_handle_t client;
+    bool connected;
+    TaskHandle_t mqtt_task; // delivering events, NULL until the client is started
+#if ROUTER_USER_EVENTS
+    struct router_deferred *deferred; // posted, not delivered yet
+#endif
+
+    aws_iot_shadow_handle_ptr *buckets;
+    size_t bucket_count; // power of 2
+    size_t handle_count;
+    aws_iot_shadow_handle_ptr handles; // all handles, linked via router_list_next
+
+    struct router_subscription *subscriptions; // open addressing, linear probing
+    size_t subscription_capacity;              // power of 2
+    size_t subscription_count;
+    size_t subscription_reserved; // slots of SUBSCRIBE calls in progress
+
+    // SUBSCRIBE is sent without router lock, its SUBACK can be processed before msg_id is recorded
+    uint8_t subscribing;               // calls in progress
+    int early_acks[ROUTER_EARLY_ACKS]; // unmatched SUBACKs meanwhile, 0 for none
+    uint8_t early_ack_next;
+
+    // Fragmented message being reassembled, esp-mqtt delivers chunks of a message in sequence,
+    // topic is set on the first one only. Buffer is kept for reuse.
+    aws_iot_shadow_handle_ptr reassembly_handle; // NULL when idle
+    char *reassembly_buf;
+    size_t reassembly_capacity;
+    size_t reassembly_len;
+    size_t reassembly_total_len;
+    char reassembly_topic[AWS_IOT_SHADOW_TOPIC_MAX_LENGTH];
+    uint16_t reassembly_topic_len;
+
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+    struct aws_iot_shadow_async *async;
+#endif
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    struct aws_iot_shadow_throttle *throttles; // one per thing, never released
+#endif
+#if AWS_IOT_SHADOW_GATEWAY
+    aws_iot_shadow_gateway_ptr gateway; // fallback of topics no handle has, NULL when none
+#endif
+
+    struct aws_iot_shadow_router *next;
+};
+
+// Routers are never released, see aws_iot_shadow_router_remove
+static struct aws_iot_shadow_router *routers = NULL;
+static SemaphoreHandle_t routers_mutex = NULL;
+static portMUX_TYPE routers_mutex_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+void aws_iot_shadow_router_lock()
+{
+    if (routers_mutex == NULL)
+    {
+        // Cannot allocate inside critical section, create first and then swap
+        SemaphoreHandle_t mutex = xSemaphoreCreateRecursiveMutex();
+        assert(mutex);
+
+        portENTER_CRITICAL(&routers_mutex_spinlock);
+        if (routers_mutex == NULL)
+        {
+            routers_mutex = mutex;
+            mutex = NULL;
+        }
+        portEXIT_CRITICAL(&routers_mutex_spinlock);
+
+        if (mutex)
+        {
+            vSemaphoreDelete(mutex);
+        }
+    }
+
+    xSemaphoreTakeRecursive(routers_mutex, portMAX_DELAY);
+}
+
+void aws_iot_shadow_router_unlock()
+{
+    xSemaphoreGiveRecursive(routers_mutex);
+}
+
+uint32_t aws_iot_shadow_router_hash(const char *str, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t)str[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static size_t aws_iot_shadow_router_subscription_index(const struct aws_iot_shadow_router *router, int msg_id)
+{
+    return ((uint32_t)msg_id * 2654435761U) & (router->subscription_capacity - 1);
+}
+
+/**
+ * @brief Finds end of shadow topic prefix, that is `$aws/things/<thing>/shadow` or `$aws/things/<thing>/shadow/name/<shadow>`.
+ *
+ * @return Length of the prefix, or 0 if topic is not a shadow topic.
+ */
+static size_t aws_iot_shadow_router_topic_prefix_len(const char *topic, size_t topic_len)
+{
+    if (topic_len <= AWS_IOT_SHADOW_TOPIC_THINGS_LENGTH
+        || strncmp(topic, AWS_IOT_SHADOW_TOPIC_THINGS, AWS_IOT_SHADOW_TOPIC_THINGS_LENGTH) != 0)
+    {
+        return 0;
+    }
+
+    // Thing name
+    const char *end = topic + topic_len;
+    const char *p = memchr(topic + AWS_IOT_SHADOW_TOPIC_THINGS_LENGTH, '/', topic_len - AWS_IOT_SHADOW_TOPIC_THINGS_LENGTH);
+    if (p == NULL || (size_t)(end - p) < AWS_IOT_SHADOW_TOPIC_SHADOW_LENGTH
+        || strncmp(p, AWS_IOT_SHADOW_TOPIC_SHADOW, AWS_IOT_SHADOW_TOPIC_SHADOW_LENGTH) != 0)
+    {
+        return 0;
+    }
+    p += AWS_IOT_SHADOW_TOPIC_SHADOW_LENGTH;
+
+    // Named shadow
+    if ((size_t)(end - p) > AWS_IOT_SHADOW_TOPIC_NAME_LENGTH
+        && strncmp(p, AWS_IOT_SHADOW_TOPIC_NAME, AWS_IOT_SHADOW_TOPIC_NAME_LENGTH) == 0)
+    {
+        p += AWS_IOT_SHADOW_TOPIC_NAME_LENGTH;
+        p = memchr(p, '/', end - p);
+        if (p == NULL)
+        {
+            return 0;
+        }
+    }
+
+    return p - topic;
+}
+
+static aws_iot_shadow_handle_ptr aws_iot_shadow_router_find(const struct aws_iot_shadow_router *router, const char *prefix,
+                                                            size_t prefix_len)
+{
+    uint32_t hash = aws_iot_shadow_router_hash(prefix, prefix_len);
+    aws_iot_shadow_handle_ptr handle = router->buckets[hash & (router->bucket_count - 1)];
+
+    while (handle)
+    {
+        if (handle->topic_prefix_hash == hash && handle->topic_prefix_len == prefix_len
+            && memcmp(handle->topic_prefix, prefix, prefix_len) == 0)
+        {
+            return handle;
+        }
+        handle = handle->router_bucket_next;
+    }
+    return NULL;
+}
+
+static esp_err_t aws_iot_shadow_router_rehash(struct aws_iot_shadow_router *router, size_t bucket_count)
+{
+    aws_iot_shadow_handle_ptr *buckets = (aws_iot_shadow_handle_ptr *)calloc(bucket_count, sizeof(*buckets));
+    if (buckets == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (aws_iot_shadow_handle_ptr handle = router->handles; handle; handle = handle->router_list_next)
+    {
+        size_t index = handle->topic_prefix_hash & (bucket_count - 1);
+        handle->router_bucket_next = buckets[index];
+        buckets[index] = handle;
+    }
+
+    free(router->buckets);
+    router->buckets = buckets;
+    router->bucket_count = bucket_count;
+    return ESP_OK;
+}
+
+static void aws_iot_shadow_router_subscriptions_clear(struct aws_iot_shadow_router *router)
+{
+    memset(router->subscriptions, 0, router->subscription_capacity * sizeof(*router->subscriptions));
+    router->subscription_count = 0;
+    memset(router->early_acks, 0, sizeof(router->early_acks));
+}
+
+static void aws_iot_shadow_router_subscriptions_insert(struct aws_iot_shadow_router *router, const struct router_subscription *sub)
+{
+    size_t mask = router->subscription_capacity - 1;
+    size_t i = aws_iot_shadow_router_subscription_index(router, sub->msg_id);
+    while (router->subscriptions[i].msg_id != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    router->subscriptions[i] = *sub;
+    router->subscription_count++;
+}
+
+static esp_err_t aws_iot_shadow_router_subscriptions_grow(struct aws_iot_shadow_router *router)
+{
+    struct router_subscription *old = router->subscriptions;
+    size_t old_capacity = router->subscription_capacity;
+    size_t capacity = old_capacity ? old_capacity * 2 : ROUTER_INITIAL_SUBSCRIPTIONS;
+
+    router->subscriptions = (struct router_subscription *)calloc(capacity, sizeof(*router->subscriptions));
+    if (router->subscriptions == NULL)
+    {
+        router->subscriptions = old;
+        return ESP_ERR_NO_MEM;
+    }
+    router->subscription_capacity = capacity;
+    router->subscription_count = 0;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].msg_id != 0)
+        {
+            aws_iot_shadow_router_subscriptions_insert(router, &old[i]);
+        }
+    }
+    free(old);
+    return ESP_OK;
+}
+
+static bool aws_iot_shadow_router_subscriptions_take(struct aws_iot_shadow_router *router, int msg_id, struct router_subscription *sub)
+{
+    size_t mask = router->subscription_capacity - 1;
+    size_t i = aws_iot_shadow_router_subscription_index(router, msg_id);
+
+    while (router->subscriptions[i].msg_id != msg_id)
+    {
+        if (router->subscriptions[i].msg_id == 0)
+        {
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+    *sub = router->subscriptions[i];
+
+    // Backward shift deletion, keeps probe sequences intact without tombstones
+    size_t j = i;
+    for (;;)
+    {
+        router->subscriptions[i].msg_id = 0;
+        for (;;)
+        {
+            j = (j + 1) & mask;
+            if (router->subscriptions[j].msg_id == 0)
+            {
+                router->subscription_count--;
+                return true;
+            }
+            size_t k = aws_iot_shadow_router_subscription_index(router, router->subscriptions[j].msg_id);
+            // Entry at j can be moved to i, if its home slot k is not cyclically within (i, j]
+            if (i <= j ? (i >= k || k > j) : (i >= k && k > j))
+            {
+                break;
+            }
+        }
+        router->subscriptions[i] = router->subscriptions[j];
+        i = j;
+    }
+}
+
+static void aws_iot_shadow_router_subscriptions_remove_handle(struct aws_iot_shadow_router *router, aws_iot_shadow_handle_ptr handle)
+{
+    for (size_t i = 0; i < router->subscription_capacity; i++)
+    {
+        struct router_subscription sub;
+        // Removal shifts entries backwards, so re-check the same slot
+        while (router->subscriptions[i].msg_id != 0 && router->subscriptions[i].handle == handle)
+        {
+            aws_iot_shadow_router_subscriptions_take(router, router->subscriptions[i].msg_id, &sub);
+        }
+    }
+}
+
+/**
+ * @brief Ends a SUBSCRIBE call made without router lock. Called under router lock.
+ *
+ * @return true if its SUBACK has been already processed.
+ */
+static bool aws_iot_shadow_router_subscribe_end(struct aws_iot_shadow_router *router, int msg_id)
+{
+    bool acked = false;
+    for (size_t i = 0; i < ROUTER_EARLY_ACKS; i++)
+    {
+        if (msg_id > 0 && router->early_acks[i] == msg_id)
+        {
+            router->early_acks[i] = 0;
+            acked = true;
+        }
+    }
+
+    if (--router->subscribing == 0)
+    {
+        // Nobody else waits for a SUBACK
+        memset(router->early_acks, 0, sizeof(router->early_acks));
+    }
+    return acked;
+}
+
+static void aws_iot_shadow_router_reassembly_start(struct aws_iot_shadow_router *router, aws_iot_shadow_handle_ptr handle,
+                                                  esp_mqtt_event_handle_t event)
+{
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_stats_fragmented(handle);
+#endif
+
+    size_t total_len = event->total_data_len;
+    if (total_len > AWS_IOT_SHADOW_REASSEMBLY_MAX_SIZE)
+    {
+        ESP_LOGE(TAG, "received partial data of %d bytes, larger than reassembly limit, please increase CONFIG_AWS_IOT_SHADOW_REASSEMBLY_MAX_SIZE or esp_mqtt_client_config_t.buffer_size", event->total_data_len);
+#if AWS_IOT_SHADOW_STATS
+        aws_iot_shadow_stats_dropped(handle);
+#endif
+        return;
+    }
+    if (event->data_len < 0 || event->current_data_offset != 0 || (size_t)event->data_len > total_len
+        || event->topic_len < 0 || (size_t)event->topic_len > sizeof(router->reassembly_topic))
+    {
+        ESP_LOGE(TAG, "unexpected first chunk of %d bytes at offset %d of %d bytes, dropping message", event->data_len,
+                 event->current_data_offset, event->total_data_len);
+#if AWS_IOT_SHADOW_STATS
+        aws_iot_shadow_stats_dropped(handle);
+#endif
+        return;
+    }
+
+    // Buffer is pooled, grows up to the limit
+    if (total_len > router->reassembly_capacity)
+    {
+        char *buf = (char *)realloc(router->reassembly_buf, total_len);
+        if (buf == NULL)
+        {
+            ESP_LOGE(TAG, "failed to allocate %zu bytes for partial data", total_len);
+#if AWS_IOT_SHADOW_STATS
+            aws_iot_shadow_stats_dropped(handle);
+#endif
+            return;
+        }
+        router->reassembly_buf = buf;
+        router->reassembly_capacity = total_len;
+    }
+
+    ESP_LOGD(TAG, "reassembling %.*s payload (%d bytes)", event->topic_len, event->topic, event->total_data_len);
+
+    memcpy(router->reassembly_buf, event->data, event->data_len);
+    memcpy(router->reassembly_topic, event->topic, event->topic_len);
+    router->reassembly_topic_len = event->topic_len;
+    router->reassembly_len = event->data_len;
+    router->reassembly_total_len = total_len;
+    router->reassembly_handle = handle;
+}
+
+static void aws_iot_shadow_router_reassembly_continue(struct aws_iot_shadow_router *router, esp_mqtt_event_handle_t event)
+{
+    if (router->reassembly_handle == NULL)
+    {
+        // Not a shadow message, or its start has been dropped
+        return;
+    }
+
+    if (event->current_data_offset != router->reassembly_len || event->total_data_len != router->reassembly_total_len
+        || router->reassembly_len + event->data_len > router->reassembly_total_len)
+    {
+        ESP_LOGE(TAG, "unexpected chunk of %.*s at offset %d, dropping message", router->reassembly_topic_len, router->reassembly_topic, event->current_data_offset);
+#if AWS_IOT_SHADOW_STATS
+        aws_iot_shadow_stats_dropped(router->reassembly_handle);
+#endif
+        router->reassembly_handle = NULL;
+        return;
+    }
+
+    memcpy(router->reassembly_buf + router->reassembly_len, event->data, event->data_len);
+    router->reassembly_len += event->data_len;
+
+    if (router->reassembly_len == router->reassembly_total_len)
+    {
+        aws_iot_shadow_handle_ptr handle = router->reassembly_handle;
+        router->reassembly_handle = NULL;
+
+        // Complete message, as if it was delivered at once
+        esp_mqtt_event_t complete = *event;
+        complete.data = router->reassembly_buf;
+        complete.data_len = (int)router->reassembly_total_len;
+        complete.current_data_offset = 0;
+        complete.topic = router->reassembly_topic;
+        complete.topic_len = router->reassembly_topic_len;
+        aws_iot_shadow_mqtt_data(handle, &complete);
+    }
+}
+
+static void aws_iot_shadow_router_mqtt_data(struct aws_iot_shadow_router *router, esp_mqtt_event_handle_t event)
+{
+    if (event->current_data_offset > 0)
+    {
+        // Following chunks of a fragmented message, without a topic
+        aws_iot_shadow_router_reassembly_continue(router, event);
+        return;
+    }
+
+    ESP_LOGD(TAG, "received %.*s payload (%d bytes): %.*s", event->topic_len, event->topic, event->data_len, event->data_len, event->data ? event->data : "");
+
+    // Any unfinished message is abandoned
+#if AWS_IOT_SHADOW_STATS
+    if (router->reassembly_handle != NULL)
+    {
+        aws_iot_shadow_stats_dropped(router->reassembly_handle);
+    }
+#endif
+    router->reassembly_handle = NULL;
+
+    if (event->topic == NULL || event->topic_len >= AWS_IOT_SHADOW_TOPIC_MAX_LENGTH)
+    {
+        return;
+    }
+
+    size_t prefix_len = aws_iot_shadow_router_topic_prefix_len(event->topic, event->topic_len);
+    if (prefix_len == 0 || prefix_len >= event->topic_len)
+    {
+        return;
+    }
+
+    aws_iot_shadow_handle_ptr handle = aws_iot_shadow_router_find(router, event->topic, prefix_len);
+    if (handle == NULL)
+    {
+#if AWS_IOT_SHADOW_GATEWAY
+        if (router->gateway != NULL)
+        {
+            aws_iot_shadow_gateway_mqtt_data(router->gateway, event, prefix_len);
+        }
+#endif
+        return;
+    }
+
+    if (event->total_data_len > event->data_len)
+    {
+        // Larger than MQTT buffer
+        aws_iot_shadow_router_reassembly_start(router, handle, event);
+        return;
+    }
+
+    aws_iot_shadow_mqtt_data(handle, event);
+}
+
+#if ROUTER_USER_EVENTS
+static void aws_iot_shadow_router_deferred_run(struct aws_iot_shadow_router *router, const char *data)
+{
+    // Other MQTT_USER_EVENT senders are not dereferenced
+    struct router_deferred **it = &router->deferred;
+    while (*it && (const char *)*it != data)
+    {
+        it = &(*it)->next;
+    }
+    struct router_deferred *deferred = *it;
+    if (deferred == NULL)
+    {
+        return;
+    }
+    *it = deferred->next;
+
+    if (deferred->handle != NULL)
+    {
+        aws_iot_shadow_mqtt_deferred(deferred->handle, (enum aws_iot_shadow_event)deferred->event_id, deferred->data,
+                                     deferred->data_len);
+    }
+    free(deferred);
+}
+#endif
+
+static void aws_iot_shadow_router_mqtt_handler(void *handler_args, __unused esp_event_base_t base, __unused int32_t event_id, void *event_data)
+{
+    struct aws_iot_shadow_router *router = (struct aws_iot_shadow_router *)handler_args;
+    esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
+
+    aws_iot_shadow_router_lock();
+
+    switch (event->event_id)
+    {
+#if ROUTER_USER_EVENTS
+    case MQTT_USER_EVENT:
+        aws_iot_shadow_router_deferred_run(router, event->data);
+        aws_iot_shadow_router_unlock();
+        return;
+#endif
+
+    case MQTT_EVENT_CONNECTED:
+        router->connected = true;
+        aws_iot_shadow_router_subscriptions_clear(router);
+        for (aws_iot_shadow_handle_ptr handle = router->handles; handle; handle = handle->router_list_next)
+        {
+            aws_iot_shadow_mqtt_connected(handle, event->session_present);
+        }
+#if AWS_IOT_SHADOW_GATEWAY
+        if (router->gateway != NULL)
+        {
+            aws_iot_shadow_gateway_mqtt_connected(router->gateway, event->session_present);
+        }
+#endif
+        break;
+
+    case MQTT_EVENT_DISCONNECTED:
+        router->connected = false;
+        aws_iot_shadow_router_subscriptions_clear(router);
+        for (aws_iot_shadow_handle_ptr handle = router->handles; handle; handle = handle->router_list_next)
+        {
+            aws_iot_shadow_mqtt_disconnected(handle);
+        }
+#if AWS_IOT_SHADOW_GATEWAY
+        if (router->gateway != NULL)
+        {
+            aws_iot_shadow_gateway_mqtt_disconnected(router->gateway);
+        }
+#endif
+        break;
+
+    case MQTT_EVENT_SUBSCRIBED: {
+        struct router_subscription sub;
+        if (event->msg_id == -1)
+        {
+            ESP_LOGD(TAG, "invalid subscription msg_id");
+        }
+        else if (aws_iot_shadow_router_subscriptions_take(router, event->msg_id, &sub))
+        {
+            aws_iot_shadow_mqtt_subscribed(sub.handle, sub.bit);
+        }
+#if AWS_IOT_SHADOW_GATEWAY
+        else if (router->gateway != NULL && aws_iot_shadow_gateway_mqtt_subscribed(router->gateway, event->msg_id))
+        {
+            // Child thing of the gateway
+        }
+#endif
+        else if (router->subscribing > 0)
+        {
+            // Its sender has not recorded msg_id yet
+            router->early_acks[router->early_ack_next++ % ROUTER_EARLY_ACKS] = event->msg_id;
+        }
+        break;
+    }
+
+    case MQTT_EVENT_DATA:
+        aws_iot_shadow_router_mqtt_data(router, event);
+        break;
+
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    case MQTT_EVENT_PUBLISHED:
+        aws_iot_shadow_throttle_published(router->throttles, event->msg_id);
+        break;
+#endif
+
+    case MQTT_EVENT_ERROR:
+        ESP_LOGD(TAG, "got mqtt error type: %d", event->error_handle->error_type);
+        break;
+
+    default:
+        ESP_LOGD(TAG, "unhandled mqtt event %d", event->event_id);
+        break;
+    }
+
+    router->mqtt_task = xTaskGetCurrentTaskHandle();
+    aws_iot_shadow_router_unlock();
+}
+
+static struct aws_iot_shadow_router *aws_iot_shadow_router_get(esp_mqtt_client_handle_t client)
+{
+    for (struct aws_iot_shadow_router *router = routers; router; router = router->next)
+    {
+        if (router->client == client)
+        {
+            return router;
+        }
+    }
+
+    // Create new
+    struct aws_iot_shadow_router *router = (struct aws_iot_shadow_router *)calloc(1, sizeof(*router));
+    if (router == NULL)
+    {
+        return NULL;
+    }
+    router->client = client;
+
+    if (aws_iot_shadow_router_rehash(router, ROUTER_INITIAL_BUCKETS) != ESP_OK
+        || aws_iot_shadow_router_subscriptions_grow(router) != ESP_OK)
+    {
+        free(router->buckets);
+        free(router);
+        return NULL;
+    }
+
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+    if (aws_iot_shadow_async_create(&router->async) != ESP_OK)
+    {
+        free(router->subscriptions);
+        free(router->buckets);
+        free(router);
+        return NULL;
+    }
+#endif
+
+    esp_err_t err = esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, aws_iot_shadow_router_mqtt_handler, router);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "failed to register mqtt event handler: %d", err);
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+        // Nothing has been posted yet
+        aws_iot_shadow_async_destroy(router->async);
+#endif
+        free(router->subscriptions);
+        free(router->buckets);
+        free(router);
+        return NULL;
+    }
+
+    router->next = routers;
+    routers = router;
+    return router;
+}
+
+esp_err_t aws_iot_shadow_router_add(esp_mqtt_client_handle_t client, aws_iot_shadow_handle_ptr handle)
+{
+    assert(client);
+    assert(handle);
+
+    aws_iot_shadow_router_lock();
+
+    struct aws_iot_shadow_router *router = aws_iot_shadow_router_get(client);
+    if (router == NULL)
+    {
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (aws_iot_shadow_router_find(router, handle->topic_prefix, handle->topic_prefix_len) != NULL)
+    {
+        ESP_LOGE(TAG, "%s is already initialized", handle->topic_prefix);
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Keep load factor <= 1
+    if (router->handle_count + 1 > router->bucket_count
+        && aws_iot_shadow_router_rehash(router, router->bucket_count * 2) != ESP_OK)
+    {
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_NO_MEM;
+    }
+
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    esp_err_t err = aws_iot_shadow_throttle_attach(&router->throttles, client, handle);
+    if (err != ESP_OK)
+    {
+        aws_iot_shadow_router_unlock();
+        return err;
+    }
+#endif
+
+    handle->router = router;
+    handle->topic_prefix_hash = aws_iot_shadow_router_hash(handle->topic_prefix, handle->topic_prefix_len);
+
+    size_t index = handle->topic_prefix_hash & (router->bucket_count - 1);
+    handle->router_bucket_next = router->buckets[index];
+    router->buckets[index] = handle;
+    handle->router_list_next = router->handles;
+    router->handles = handle;
+    router->handle_count++;
+    bool connected = router->connected;
+
+    aws_iot_shadow_router_unlock();
+
+    // Late init, CONNECTED event has been already dispatched. Subscribes, so outside of router lock.
+    if (connected)
+    {
+        aws_iot_shadow_mqtt_connected(handle, false);
+    }
+    return ESP_OK;
+}
+
+void aws_iot_shadow_router_remove(aws_iot_shadow_handle_ptr handle)
+{
+    struct aws_iot_shadow_router *router = handle->router;
+    if (router == NULL)
+    {
+        return;
+    }
+
+    aws_iot_shadow_router_lock();
+
+    aws_iot_shadow_handle_ptr *it = &router->buckets[handle->topic_prefix_hash & (router->bucket_count - 1)];
+    while (*it && *it != handle)
+    {
+        it = &(*it)->router_bucket_next;
+    }
+    if (*it)
+    {
+        *it = handle->router_bucket_next;
+    }
+
+    it = &router->handles;
+    while (*it && *it != handle)
+    {
+        it = &(*it)->router_list_next;
+    }
+    if (*it)
+    {
+        *it = handle->router_list_next;
+    }
+
+    aws_iot_shadow_router_subscriptions_remove_handle(router, handle);
+    if (router->reassembly_handle == handle)
+    {
+        router->reassembly_handle = NULL;
+    }
+#if ROUTER_USER_EVENTS
+    for (struct router_deferred *deferred = router->deferred; deferred; deferred = deferred->next)
+    {
+        if (deferred->handle == handle)
+        {
+            deferred->handle = NULL;
+        }
+    }
+#endif
+    router->handle_count--;
+    handle->router = NULL;
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+    aws_iot_shadow_throttle_detach(handle);
+#endif
+
+    // TODO esp_mqtt_client_unregister_event is not implemented, so router itself stays registered, even when empty
+
+    aws_iot_shadow_router_unlock();
+
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+    // Outside of router lock, worker might be waiting for it in a handler
+    aws_iot_shadow_async_purge(router->async, handle);
+#endif
+}
+
+#if AWS_IOT_SHADOW_GATEWAY
+esp_err_t aws_iot_shadow_router_gateway_attach(esp_mqtt_client_handle_t client, aws_iot_shadow_gateway_ptr gateway)
+{
+    assert(client);
+    assert(gateway);
+
+    aws_iot_shadow_router_lock();
+
+    struct aws_iot_shadow_router *router = aws_iot_shadow_router_get(client);
+    if (router == NULL)
+    {
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_NO_MEM;
+    }
+    if (router->gateway != NULL)
+    {
+        ESP_LOGE(TAG, "client has a gateway already");
+        aws_iot_shadow_router_unlock();
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    router->gateway = gateway;
+    if (router->connected)
+    {
+        // Has no things yet, so it sends nothing
+        aws_iot_shadow_gateway_mqtt_connected(gateway, false);
+    }
+
+    aws_iot_shadow_router_unlock();
+    return ESP_OK;
+}
+
+void aws_iot_shadow_router_gateway_subscribe_begin(esp_mqtt_client_handle_t client)
+{
+    for (struct aws_iot_shadow_router *router = routers; router; router = router->next)
+    {
+        if (router->client == client)
+        {
+            router->subscribing++;
+        }
+    }
+}
+
+bool aws_iot_shadow_router_gateway_subscribe_end(esp_mqtt_client_handle_t client, int msg_id)
+{
+    for (struct aws_iot_shadow_router *router = routers; router; router = router->next)
+    {
+        if (router->client == client)
+        {
+            return aws_iot_shadow_router_subscribe_end(router, msg_id);
+        }
+    }
+    return false;
+}
+
+void aws_iot_shadow_router_gateway_detach(esp_mqtt_client_handle_t client, aws_iot_shadow_gateway_ptr gateway)
+{
+    aws_iot_shadow_router_lock();
+    for (struct aws_iot_shadow_router *router = routers; router; router = router->next)
+    {
+        if (router->client == client && router->gateway == gateway)
+        {
+            router->gateway = NULL;
+        }
+    }
+    aws_iot_shadow_router_unlock();
+}
+#endif
+
+void aws_iot_shadow_router_dispatch_lock(aws_iot_shadow_handle_ptr handle)
+{
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+    aws_iot_shadow_async_lock(handle->router->async);
+#else
+    aws_iot_shadow_router_lock();
+#endif
+}
+
+void aws_iot_shadow_router_dispatch_unlock(aws_iot_shadow_handle_ptr handle)
+{
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+    aws_iot_shadow_async_unlock(handle->router->async);
+#else
+    aws_iot_shadow_router_unlock();
+#endif
+}
+
+bool aws_iot_shadow_router_dispatching(aws_iot_shadow_handle_ptr handle)
+{
+    // Routers are created under the lock, so it exists
+    if (xSemaphoreGetMutexHolder(routers_mutex) == xTaskGetCurrentTaskHandle())
+    {
+        return true;
+    }
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+    return aws_iot_shadow_async_lock_held(handle->router->async);
+#else
+    return false;
+#endif
+}
+
+bool aws_iot_shadow_router_defer(__unused aws_iot_shadow_handle_ptr handle, __unused enum aws_iot_shadow_event event_id,
+                                 __unused const char *data, __unused size_t data_len)
+{
+#if ROUTER_USER_EVENTS
+    struct aws_iot_shadow_router *router = handle->router;
+
+    // Before the client is started, nothing waits for router lock holding the esp-mqtt one
+    aws_iot_shadow_router_lock();
+    TaskHandle_t mqtt_task = router->mqtt_task;
+    aws_iot_shadow_router_unlock();
+    if (mqtt_task == NULL || mqtt_task == xTaskGetCurrentTaskHandle())
+    {
+        return false;
+    }
+
+    struct router_deferred *deferred = (struct router_deferred *)malloc(sizeof(*deferred) + data_len);
+    if (deferred == NULL)
+    {
+        ESP_LOGE(TAG, "%s failed to allocate event %d, dropped", handle->topic_prefix, (int)event_id);
+        return true;
+    }
+    deferred->handle = handle;
+    deferred->event_id = event_id;
+    deferred->data_len = data_len;
+    if (data_len > 0)
+    {
+        memcpy(deferred->data, data, data_len);
+    }
+
+    // MQTT task can run it before the post returns
+    aws_iot_shadow_router_lock();
+    deferred->next = router->deferred;
+    router->deferred = deferred;
+    aws_iot_shadow_router_unlock();
+
+    esp_mqtt_event_t event = {
+        .data = (char *)deferred,
+    };
+    if (esp_mqtt_dispatch_custom_event(router->client, &event) != ESP_OK)
+    {
+        aws_iot_shadow_router_lock();
+        struct router_deferred **it = &router->deferred;
+        while (*it && *it != deferred)
+        {
+            it = &(*it)->next;
+        }
+        bool queued = *it != NULL;
+        if (queued)
+        {
+            *it = deferred->next;
+        }
+        aws_iot_shadow_router_unlock();
+
+        ESP_LOGE(TAG, "%s failed to post event %d, dropped", handle->topic_prefix, (int)event_id);
+        if (queued)
+        {
+            free(deferred);
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+void aws_iot_shadow_router_post(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                const char *data, size_t data_len)
+{
+    aws_iot_shadow_async_post(handle->router->async, handle, event_id, data, data_len);
+}
+#endif
+
+int aws_iot_shadow_router_subscribe(aws_iot_shadow_handle_ptr handle, const char *topic, EventBits_t bit)
+{
+    struct aws_iot_shadow_router *router = handle->router;
+    if (router == NULL || topic == NULL)
+    {
+        return -1;
+    }
+
+    // Reserve a slot, keeping load factor <= 3/4, so msg_id is always recorded
+    aws_iot_shadow_router_lock();
+    if ((router->subscription_count + router->subscription_reserved + 1) * 4 > router->subscription_capacity * 3
+        && aws_iot_shadow_router_subscriptions_grow(router) != ESP_OK)
+    {
+        aws_iot_shadow_router_unlock();
+        return -1;
+    }
+    router->subscription_reserved++;
+    router->subscribing++;
+    aws_iot_shadow_router_unlock();
+
+    // esp-mqtt holds its lock while it delivers events, which take router lock
+    int msg_id = esp_mqtt_client_subscribe(router->client, topic, 0);
+
+    aws_iot_shadow_router_lock();
+    router->subscription_reserved--;
+    // Handle might have been removed meanwhile
+    bool acked = aws_iot_shadow_router_subscribe_end(router, msg_id) && handle->router == router;
+    if (msg_id > 0 && !acked && handle->router == router)
+    {
+        struct router_subscription sub = {
+            .msg_id = msg_id,
+            .handle = handle,
+            .bit = bit,
+        };
+        aws_iot_shadow_router_subscriptions_insert(router, &sub);
+    }
+    aws_iot_shadow_router_unlock();
+
+    if (acked)
+    {
+        aws_iot_shadow_mqtt_subscribed(handle, bit);
+    }
+    return msg_id;
+}
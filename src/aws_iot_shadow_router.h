@@ -0,0 +1,126 @@
+#ifndef AWS_IOT_SHADOW_ROUTER_H
+#define AWS_IOT_SHADOW_ROUTER_H
+
+#include "aws_iot_shadow.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <mqtt_client.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Registers the handle with a MQTT dispatcher shared by all shadows of the client.
+ *
+ * Dispatcher is created on first use, it is the only MQTT event handler registered on the client.
+ * If the client is already connected, handle subscribes immediately.
+ */
+esp_err_t aws_iot_shadow_router_add(esp_mqtt_client_handle_t client, aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Removes the handle from its dispatcher. No-op if the handle has not been added.
+ */
+void aws_iot_shadow_router_remove(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Subscribes to a topic, and associates the SUBACK with given handle and event group bit.
+ *
+ * Called without router lock, unless on the MQTT task, as esp-mqtt holds its own lock while it delivers events.
+ * SUBACK processed before msg_id is recorded is applied before it returns.
+ *
+ * @return MQTT msg_id, or -1 on failure.
+ */
+int aws_iot_shadow_router_subscribe(aws_iot_shadow_handle_ptr handle, const char *topic, EventBits_t bit);
+
+/**
+ * @brief Global (recursive) lock of all dispatchers, it is held while MQTT events are processed.
+ */
+void aws_iot_shadow_router_lock();
+
+void aws_iot_shadow_router_unlock();
+
+/**
+ * @brief Lock held while handlers of the handle run. Router lock, or the one of the worker with AWS_IOT_SHADOW_ASYNC_DISPATCH.
+ */
+void aws_iot_shadow_router_dispatch_lock(aws_iot_shadow_handle_ptr handle);
+
+void aws_iot_shadow_router_dispatch_unlock(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Whether the calling task holds the router or dispatch lock, so responses of the handle cannot be
+ * dispatched while it waits for them.
+ */
+bool aws_iot_shadow_router_dispatching(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief FNV-1a hash, of topic prefixes and thing names.
+ */
+uint32_t aws_iot_shadow_router_hash(const char *str, size_t len);
+
+#if AWS_IOT_SHADOW_GATEWAY
+/**
+ * @brief Attaches the gateway to the dispatcher of the client, it receives messages of topics no handle has,
+ * and SUBACKs of subscriptions no handle has made. If the client is already connected, gateway is told so.
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM, or ESP_ERR_INVALID_STATE if the client has a gateway already.
+ */
+esp_err_t aws_iot_shadow_router_gateway_attach(esp_mqtt_client_handle_t client, aws_iot_shadow_gateway_ptr gateway);
+
+void aws_iot_shadow_router_gateway_detach(esp_mqtt_client_handle_t client, aws_iot_shadow_gateway_ptr gateway);
+
+/**
+ * @brief Brackets a SUBSCRIBE of the gateway sent without router lock, both are called under router lock.
+ * SUBACK processed before the gateway stores msg_id is kept until the end.
+ *
+ * @return true if SUBACK of msg_id has been already processed.
+ */
+void aws_iot_shadow_router_gateway_subscribe_begin(esp_mqtt_client_handle_t client);
+
+bool aws_iot_shadow_router_gateway_subscribe_end(esp_mqtt_client_handle_t client, int msg_id);
+#endif
+
+/**
+ * @brief Hands an event raised on another task than the MQTT one to the MQTT task, as MQTT_USER_EVENT (esp-mqtt
+ * of ESP-IDF 5.1 and later). Its handlers must not run on the raising task under router lock: they may publish,
+ * while esp-mqtt holds its own lock waiting for the router lock. Called without router lock.
+ *
+ * @return false if the caller dispatches it: on the MQTT task, before the client is started, with
+ *         AWS_IOT_SHADOW_ASYNC_DISPATCH (handlers run on the worker), or with older esp-mqtt.
+ */
+bool aws_iot_shadow_router_defer(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                 const char *data, size_t data_len);
+
+#if AWS_IOT_SHADOW_ASYNC_DISPATCH
+/**
+ * @brief Queues an event for the worker task of the handle's client. Called under router lock.
+ */
+void aws_iot_shadow_router_post(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                const char *data, size_t data_len);
+#endif
+
+// Callbacks of the dispatcher, implemented by aws_iot_shadow.c. Connected and subscribed take router lock
+// themselves, and (un)subscribe and publish without it, they are called on an application task too.
+
+/**
+ * @param session_present Broker resumed the session (CONNACK session present flag), keeping subscriptions.
+ */
+void aws_iot_shadow_mqtt_connected(aws_iot_shadow_handle_ptr handle, bool session_present);
+
+void aws_iot_shadow_mqtt_disconnected(aws_iot_shadow_handle_ptr handle);
+
+void aws_iot_shadow_mqtt_subscribed(aws_iot_shadow_handle_ptr handle, EventBits_t bit);
+
+void aws_iot_shadow_mqtt_data(aws_iot_shadow_handle_ptr handle, esp_mqtt_event_handle_t event);
+
+/**
+ * @brief Event of aws_iot_shadow_router_defer(), on the MQTT task under router lock.
+ */
+void aws_iot_shadow_mqtt_deferred(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id,
+                                  const char *data, size_t data_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
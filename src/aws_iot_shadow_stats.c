@@ -0,0 +1,256 @@
+#include "aws_iot_shadow_stats.h"
+#include <esp_timer.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_STATS
+
+// Names in JSON, by event id
+static const char *const EVENT_NAMES[] = {
+    "ready",
+    "disconnected",
+    "get_accepted",
+    "get_rejected",
+    "update_accepted",
+    "update_rejected",
+    "update_delta",
+    "delete_accepted",
+    "delete_rejected",
+    "update_documents",
+};
+
+// Messages from the broker, READY and DISCONNECTED are not
+#define STATS_FIRST_RECEIVED AWS_IOT_SHADOW_EVENT_GET_ACCEPTED
+
+static inline void aws_iot_shadow_stats_inc(uint32_t *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t aws_iot_shadow_stats_load(const uint32_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint32_t aws_iot_shadow_stats_now()
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+static void aws_iot_shadow_stats_sample(struct aws_iot_shadow_histogram *histogram, uint32_t us)
+{
+    // floor(log2(us)), 0 and 1 go to the first bucket
+    unsigned int bucket = us < 2 ? 0 : 31 - __builtin_clz(us);
+    if (bucket >= AWS_IOT_SHADOW_HISTOGRAM_BUCKETS)
+    {
+        bucket = AWS_IOT_SHADOW_HISTOGRAM_BUCKETS - 1;
+    }
+    aws_iot_shadow_stats_inc(&histogram->buckets[bucket]);
+    aws_iot_shadow_stats_inc(&histogram->count);
+
+    uint32_t max = __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&histogram->max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+void aws_iot_shadow_stats_record(struct aws_iot_shadow_histogram *histogram, uint32_t start)
+{
+    aws_iot_shadow_stats_sample(histogram, aws_iot_shadow_stats_now() - start);
+}
+
+void aws_iot_shadow_stats_received(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id)
+{
+    if (event_id < STATS_FIRST_RECEIVED || event_id >= AWS_IOT_SHADOW_EVENT_MAX)
+    {
+        return;
+    }
+    aws_iot_shadow_stats_inc(&handle->stats.received[event_id]);
+}
+
+void aws_iot_shadow_stats_dropped(aws_iot_shadow_handle_ptr handle)
+{
+    aws_iot_shadow_stats_inc(&handle->stats.dropped);
+}
+
+void aws_iot_shadow_stats_fragmented(aws_iot_shadow_handle_ptr handle)
+{
+    aws_iot_shadow_stats_inc(&handle->stats.fragmented);
+}
+
+void aws_iot_shadow_stats_published(aws_iot_shadow_handle_ptr handle, int msg_id)
+{
+    aws_iot_shadow_stats_inc(msg_id != -1 ? &handle->stats.published : &handle->stats.publish_failed);
+}
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+void aws_iot_shadow_stats_latency(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id, int64_t rtt_us)
+{
+    struct aws_iot_shadow_histogram *latency;
+    switch ((int)event_id)
+    {
+    case AWS_IOT_SHADOW_EVENT_GET_ACCEPTED:
+        latency = &handle->stats.get_latency;
+        break;
+    case AWS_IOT_SHADOW_EVENT_UPDATE_ACCEPTED:
+        latency = &handle->stats.update_latency;
+        break;
+#if AWS_IOT_SHADOW_SUPPORT_DELETE
+    case AWS_IOT_SHADOW_EVENT_DELETE_ACCEPTED:
+        latency = &handle->stats.delete_latency;
+        break;
+#endif
+    default:
+        return;
+    }
+    aws_iot_shadow_stats_sample(latency, rtt_us < UINT32_MAX ? (uint32_t)rtt_us : UINT32_MAX);
+}
+#endif
+
+static void aws_iot_shadow_stats_histogram_copy(struct aws_iot_shadow_histogram *dst, const struct aws_iot_shadow_histogram *src)
+{
+    dst->count = aws_iot_shadow_stats_load(&src->count);
+    dst->max_us = aws_iot_shadow_stats_load(&src->max_us);
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_HISTOGRAM_BUCKETS; i++)
+    {
+        dst->buckets[i] = aws_iot_shadow_stats_load(&src->buckets[i]);
+    }
+}
+
+esp_err_t aws_iot_shadow_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_stats *stats)
+{
+    if (handle == NULL || stats == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_EVENT_MAX; i++)
+    {
+        stats->received[i] = aws_iot_shadow_stats_load(&handle->stats.received[i]);
+    }
+    stats->dropped = aws_iot_shadow_stats_load(&handle->stats.dropped);
+    stats->fragmented = aws_iot_shadow_stats_load(&handle->stats.fragmented);
+    stats->published = aws_iot_shadow_stats_load(&handle->stats.published);
+    stats->publish_failed = aws_iot_shadow_stats_load(&handle->stats.publish_failed);
+    aws_iot_shadow_stats_histogram_copy(&stats->ready, &handle->stats.ready);
+    aws_iot_shadow_stats_histogram_copy(&stats->handler, &handle->stats.handler);
+    aws_iot_shadow_stats_histogram_copy(&stats->get_latency, &handle->stats.get_latency);
+    aws_iot_shadow_stats_histogram_copy(&stats->update_latency, &handle->stats.update_latency);
+    aws_iot_shadow_stats_histogram_copy(&stats->delete_latency, &handle->stats.delete_latency);
+    return ESP_OK;
+}
+
+struct stats_writer
+{
+    char *buf;
+    size_t buf_len;
+    size_t len;
+    bool overflow;
+};
+
+static void aws_iot_shadow_stats_write(struct stats_writer *writer, const char *format, ...)
+{
+    if (writer->overflow)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(writer->buf + writer->len, writer->buf_len - writer->len, format, args);
+    va_end(args);
+
+    if (n < 0 || (size_t)n >= writer->buf_len - writer->len)
+    {
+        writer->overflow = true;
+        return;
+    }
+    writer->len += (size_t)n;
+}
+
+uint32_t aws_iot_shadow_histogram_percentile(const struct aws_iot_shadow_histogram *histogram, uint32_t permille)
+{
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_HISTOGRAM_BUCKETS; i++)
+    {
+        total += histogram->buckets[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (total * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_HISTOGRAM_BUCKETS - 1; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            uint32_t upper = 2U << i;
+            return upper < histogram->max_us ? upper : histogram->max_us;
+        }
+    }
+    return histogram->max_us;
+}
+
+static void aws_iot_shadow_stats_write_histogram(struct stats_writer *writer, const char *name,
+                                                 const struct aws_iot_shadow_histogram *histogram)
+{
+    aws_iot_shadow_stats_write(writer, ",\"%s\":{\"n\":%" PRIu32 ",\"max\":%" PRIu32 ",\"p50\":%" PRIu32 ",\"p99\":%" PRIu32 ",\"buckets\":[",
+                               name, histogram->count, histogram->max_us, aws_iot_shadow_histogram_percentile(histogram, 500),
+                               aws_iot_shadow_histogram_percentile(histogram, 990));
+
+    unsigned int used = AWS_IOT_SHADOW_HISTOGRAM_BUCKETS;
+    while (used > 0 && histogram->buckets[used - 1] == 0)
+    {
+        used--;
+    }
+    for (unsigned int i = 0; i < used; i++)
+    {
+        aws_iot_shadow_stats_write(writer, i > 0 ? ",%" PRIu32 : "%" PRIu32, histogram->buckets[i]);
+    }
+    aws_iot_shadow_stats_write(writer, "]}");
+}
+
+esp_err_t aws_iot_shadow_stats_json(const struct aws_iot_shadow_stats *stats, char *buf, size_t buf_len, size_t *written)
+{
+    if (stats == NULL || buf == NULL || buf_len == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct stats_writer writer = {
+        .buf = buf,
+        .buf_len = buf_len,
+    };
+
+    aws_iot_shadow_stats_write(&writer, "{\"received\":{");
+    for (unsigned int i = STATS_FIRST_RECEIVED; i < AWS_IOT_SHADOW_EVENT_MAX && i < sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]); i++)
+    {
+        aws_iot_shadow_stats_write(&writer, "%s\"%s\":%" PRIu32, i > STATS_FIRST_RECEIVED ? "," : "", EVENT_NAMES[i], stats->received[i]);
+    }
+    aws_iot_shadow_stats_write(&writer, "},\"dropped\":%" PRIu32 ",\"fragmented\":%" PRIu32 ",\"published\":%" PRIu32 ",\"publish_failed\":%" PRIu32,
+                               stats->dropped, stats->fragmented, stats->published, stats->publish_failed);
+    aws_iot_shadow_stats_write_histogram(&writer, "ready_us", &stats->ready);
+    aws_iot_shadow_stats_write_histogram(&writer, "handler_us", &stats->handler);
+    aws_iot_shadow_stats_write_histogram(&writer, "get_us", &stats->get_latency);
+    aws_iot_shadow_stats_write_histogram(&writer, "update_us", &stats->update_latency);
+    aws_iot_shadow_stats_write_histogram(&writer, "delete_us", &stats->delete_latency);
+    aws_iot_shadow_stats_write(&writer, "}");
+
+    if (writer.overflow)
+    {
+        buf[0] = '\0';
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (written != NULL)
+    {
+        *written = writer.len;
+    }
+    return ESP_OK;
+}
+
+#endif
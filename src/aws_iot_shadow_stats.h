@@ -0,0 +1,49 @@
+#ifndef AWS_IOT_SHADOW_STATS_H
+#define AWS_IOT_SHADOW_STATS_H
+
+#include "aws_iot_shadow.h"
+#include "aws_iot_shadow_handle.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if AWS_IOT_SHADOW_STATS
+/**
+ * @brief Counts a message received from the broker, before it is filtered, other events are ignored.
+ * Called under router lock.
+ */
+void aws_iot_shadow_stats_received(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id);
+
+void aws_iot_shadow_stats_dropped(aws_iot_shadow_handle_ptr handle);
+
+void aws_iot_shadow_stats_fragmented(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Counts a request returned by esp_mqtt_client_publish().
+ */
+void aws_iot_shadow_stats_published(aws_iot_shadow_handle_ptr handle, int msg_id);
+
+#if AWS_IOT_SHADOW_REQUEST_TRACKING
+/**
+ * @brief Records round trip of a tracked request, its response matched by client token. Rejected ones are ignored.
+ */
+void aws_iot_shadow_stats_latency(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_event event_id, int64_t rtt_us);
+#endif
+
+/**
+ * @brief Records a duration since start, a value of aws_iot_shadow_stats_now().
+ */
+void aws_iot_shadow_stats_record(struct aws_iot_shadow_histogram *histogram, uint32_t start);
+
+/**
+ * @brief Microseconds, wraps around every 71 minutes, which is fine for durations.
+ */
+uint32_t aws_iot_shadow_stats_now();
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
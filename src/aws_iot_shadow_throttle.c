@@ -0,0 +1,556 @@
+#include "aws_iot_shadow_throttle.h"
+#include "aws_iot_shadow_stats.h"
+#include "aws_iot_shadow_trace.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+
+static const char TAG[] = "aws_iot_shadow";
+
+// AWS_IOT_SHADOW_PRIORITY_HIGH..AWS_IOT_SHADOW_PRIORITY_LOW
+#define THROTTLE_CLASSES (3U)
+#define THROTTLE_CLASS(priority) ((unsigned int)(priority) - (unsigned int)AWS_IOT_SHADOW_PRIORITY_HIGH)
+
+// Token bucket as GCRA, a request conforms while theoretical arrival time is at most TOLERANCE ahead of now
+#define THROTTLE_INTERVAL_US (1000000LL / AWS_IOT_SHADOW_THROTTLE_RATE)
+#define THROTTLE_TOLERANCE_US ((AWS_IOT_SHADOW_THROTTLE_BURST - 1) * THROTTLE_INTERVAL_US)
+
+// PUBACK of a publish lost with the connection may never come
+#define THROTTLE_IN_FLIGHT_TIMEOUT_US (10000000LL)
+#define THROTTLE_EARLY_ACKS (4U)
+
+#define THROTTLE_MSG_ID_FREE (0)
+#define THROTTLE_MSG_ID_PUBLISHING (-1)
+
+struct throttle_entry
+{
+    struct throttle_entry *next;
+    aws_iot_shadow_handle_ptr handle; // for aws_iot_shadow_throttle_detach(), dereferenced under lock only
+    const char *data;                 // points after topic, NULL for empty requests
+    size_t data_len;
+    char topic[]; // NUL terminated, followed by data
+};
+
+struct throttle_in_flight
+{
+    int msg_id; // THROTTLE_MSG_ID_FREE, THROTTLE_MSG_ID_PUBLISHING, or MQTT msg_id
+    int64_t sent_at;
+};
+
+/**
+ * @brief Limits of a thing, shared by all its shadows of the client.
+ */
+struct aws_iot_shadow_throttle
+{
+    struct aws_iot_shadow_throttle *next;
+    esp_mqtt_client_handle_t client;
+    SemaphoreHandle_t mutex; // never held while publishing
+    esp_timer_handle_t timer; // the only task publishing queued requests
+
+    int64_t tat; // theoretical arrival time of the next request
+    struct throttle_in_flight in_flight[AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT];
+    uint8_t in_flight_count; // including slots being published
+    // PUBACKs processed before esp_mqtt_client_publish() returned their msg_id
+    int early_acks[THROTTLE_EARLY_ACKS];
+    uint8_t early_ack_next;
+
+    // FIFO per priority
+    struct throttle_entry *queue_head[THROTTLE_CLASSES];
+    struct throttle_entry *queue_tail[THROTTLE_CLASSES];
+    uint8_t queue_count;
+    bool draining; // a queued request is being published, later ones wait for it
+#if AWS_IOT_SHADOW_STATS
+    aws_iot_shadow_handle_ptr draining_handle; // of the request being published, NULL once detached
+#endif
+
+    struct aws_iot_shadow_throttle_stats stats;
+    char thing_name[AWS_IOT_SHADOW_THINGNAME_LENGTH_MAX];
+};
+
+static void aws_iot_shadow_throttle_lock(struct aws_iot_shadow_throttle *throttle)
+{
+    xSemaphoreTake(throttle->mutex, portMAX_DELAY);
+}
+
+static void aws_iot_shadow_throttle_unlock(struct aws_iot_shadow_throttle *throttle)
+{
+    xSemaphoreGive(throttle->mutex);
+}
+
+static int64_t aws_iot_shadow_throttle_wait_us(struct aws_iot_shadow_throttle *throttle, int64_t now)
+{
+    int64_t wait = throttle->tat - THROTTLE_TOLERANCE_US - now;
+    return wait > 0 ? wait : 0;
+}
+
+static void aws_iot_shadow_throttle_release(struct aws_iot_shadow_throttle *throttle, unsigned int slot)
+{
+    throttle->in_flight[slot].msg_id = THROTTLE_MSG_ID_FREE;
+    throttle->in_flight_count--;
+}
+
+/**
+ * @brief Whether a slot is free, after dropping those waiting for PUBACK for too long.
+ */
+static bool aws_iot_shadow_throttle_has_slot(struct aws_iot_shadow_throttle *throttle, int64_t now)
+{
+    if (throttle->in_flight_count < AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT)
+    {
+        return true;
+    }
+
+    for (unsigned int i = 0; i < AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT; i++)
+    {
+        struct throttle_in_flight *in_flight = &throttle->in_flight[i];
+        if (in_flight->msg_id > 0 && now - in_flight->sent_at >= THROTTLE_IN_FLIGHT_TIMEOUT_US)
+        {
+            ESP_LOGD(TAG, "%s request %d was not acknowledged", throttle->thing_name, in_flight->msg_id);
+            aws_iot_shadow_throttle_release(throttle, i);
+        }
+    }
+    return throttle->in_flight_count < AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT;
+}
+
+/**
+ * @brief Takes a token and an in flight slot, the caller must have checked both are available.
+ */
+static unsigned int aws_iot_shadow_throttle_take(struct aws_iot_shadow_throttle *throttle, int64_t now)
+{
+    throttle->tat = (throttle->tat > now ? throttle->tat : now) + THROTTLE_INTERVAL_US;
+
+    unsigned int slot = 0;
+    while (throttle->in_flight[slot].msg_id != THROTTLE_MSG_ID_FREE)
+    {
+        slot++;
+    }
+    throttle->in_flight[slot].msg_id = THROTTLE_MSG_ID_PUBLISHING;
+    throttle->in_flight[slot].sent_at = now;
+    throttle->in_flight_count++;
+    return slot;
+}
+
+/**
+ * @brief Stores msg_id of a published request, or releases its slot if it failed or has been acknowledged already.
+ */
+static void aws_iot_shadow_throttle_sent(struct aws_iot_shadow_throttle *throttle, unsigned int slot, int msg_id)
+{
+    if (msg_id <= 0)
+    {
+        aws_iot_shadow_throttle_release(throttle, slot);
+        return;
+    }
+
+    for (unsigned int i = 0; i < THROTTLE_EARLY_ACKS; i++)
+    {
+        if (throttle->early_acks[i] == msg_id)
+        {
+            throttle->early_acks[i] = THROTTLE_MSG_ID_FREE;
+            aws_iot_shadow_throttle_release(throttle, slot);
+            return;
+        }
+    }
+    throttle->in_flight[slot].msg_id = msg_id;
+}
+
+static bool aws_iot_shadow_throttle_can_send(struct aws_iot_shadow_throttle *throttle, unsigned int priority_class, int64_t now)
+{
+    // Requests of the same or higher priority are queued already, and go first
+    if (throttle->draining)
+    {
+        return false;
+    }
+    for (unsigned int c = 0; c <= priority_class; c++)
+    {
+        if (throttle->queue_head[c] != NULL)
+        {
+            return false;
+        }
+    }
+    return aws_iot_shadow_throttle_has_slot(throttle, now) && aws_iot_shadow_throttle_wait_us(throttle, now) == 0;
+}
+
+static struct throttle_entry *aws_iot_shadow_throttle_head(struct aws_iot_shadow_throttle *throttle, unsigned int *priority_class)
+{
+    for (unsigned int c = 0; c < THROTTLE_CLASSES; c++)
+    {
+        if (throttle->queue_head[c] != NULL)
+        {
+            *priority_class = c;
+            return throttle->queue_head[c];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Arms the timer for when the head of the queue can be published. Called under throttle lock.
+ */
+static void aws_iot_shadow_throttle_schedule(struct aws_iot_shadow_throttle *throttle)
+{
+    unsigned int priority_class;
+    if (throttle->draining || aws_iot_shadow_throttle_head(throttle, &priority_class) == NULL)
+    {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int64_t delay = aws_iot_shadow_throttle_wait_us(throttle, now);
+    if (!aws_iot_shadow_throttle_has_slot(throttle, now))
+    {
+        // Until the oldest one times out, PUBACK reschedules it earlier
+        int64_t oldest = INT64_MAX;
+        for (unsigned int i = 0; i < AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT; i++)
+        {
+            const struct throttle_in_flight *in_flight = &throttle->in_flight[i];
+            if (in_flight->msg_id > 0 && in_flight->sent_at < oldest)
+            {
+                oldest = in_flight->sent_at;
+            }
+        }
+        if (oldest == INT64_MAX)
+        {
+            return; // all are being published, publisher reschedules it
+        }
+        int64_t timeout = oldest + THROTTLE_IN_FLIGHT_TIMEOUT_US - now;
+        if (timeout > delay)
+        {
+            delay = timeout;
+        }
+    }
+
+    esp_timer_stop(throttle->timer);
+    esp_timer_start_once(throttle->timer, (uint64_t)delay);
+}
+
+/**
+ * @brief Publishes queued requests, highest priority first. Runs on the esp_timer task only, so they are sent in order.
+ */
+static void aws_iot_shadow_throttle_drain(void *arg)
+{
+    struct aws_iot_shadow_throttle *throttle = (struct aws_iot_shadow_throttle *)arg;
+
+    aws_iot_shadow_throttle_lock(throttle);
+    for (;;)
+    {
+        unsigned int priority_class;
+        struct throttle_entry *entry = aws_iot_shadow_throttle_head(throttle, &priority_class);
+        int64_t now = esp_timer_get_time();
+        if (entry == NULL || !aws_iot_shadow_throttle_has_slot(throttle, now)
+            || aws_iot_shadow_throttle_wait_us(throttle, now) > 0)
+        {
+            break;
+        }
+
+        throttle->queue_head[priority_class] = entry->next;
+        if (entry->next == NULL)
+        {
+            throttle->queue_tail[priority_class] = NULL;
+        }
+        throttle->queue_count--;
+        unsigned int slot = aws_iot_shadow_throttle_take(throttle, now);
+        throttle->draining = true;
+#if AWS_IOT_SHADOW_STATS
+        throttle->draining_handle = entry->handle;
+#endif
+#if AWS_IOT_SHADOW_TRACE
+        // Handle may be deleted once the lock is released, the entry is not queued anymore
+        aws_iot_shadow_trace(entry->handle, AWS_IOT_SHADOW_TRACE_PUBLISH_THROTTLED,
+                             aws_iot_shadow_trace_op(entry->topic + entry->handle->topic_prefix_len), entry->data_len);
+#endif
+        aws_iot_shadow_throttle_unlock(throttle);
+
+#if !AWS_IOT_SHADOW_TRACE
+        ESP_LOGI(TAG, "sending %s (%zu bytes), was throttled", entry->topic, entry->data_len);
+#endif
+        int msg_id = esp_mqtt_client_publish(throttle->client, entry->topic, entry->data, (int)entry->data_len, 1, 0);
+        if (msg_id == -1)
+        {
+            ESP_LOGW(TAG, "failed to publish throttled %s", entry->topic);
+        }
+
+        aws_iot_shadow_throttle_lock(throttle);
+#if AWS_IOT_SHADOW_STATS
+        // Not if the handle has been deleted meanwhile
+        if (throttle->draining_handle != NULL)
+        {
+            aws_iot_shadow_stats_published(throttle->draining_handle, msg_id);
+            throttle->draining_handle = NULL;
+        }
+#endif
+        free(entry);
+        throttle->draining = false;
+        aws_iot_shadow_throttle_sent(throttle, slot, msg_id);
+    }
+    aws_iot_shadow_throttle_schedule(throttle);
+    aws_iot_shadow_throttle_unlock(throttle);
+}
+
+esp_err_t aws_iot_shadow_throttle_attach(struct aws_iot_shadow_throttle **list, esp_mqtt_client_handle_t client,
+                                         aws_iot_shadow_handle_ptr handle)
+{
+    for (struct aws_iot_shadow_throttle *throttle = *list; throttle; throttle = throttle->next)
+    {
+        if (strcmp(throttle->thing_name, handle->thing_name) == 0)
+        {
+            handle->throttle = throttle;
+            return ESP_OK;
+        }
+    }
+
+    struct aws_iot_shadow_throttle *throttle = (struct aws_iot_shadow_throttle *)calloc(1, sizeof(*throttle));
+    if (throttle == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    throttle->client = client;
+    strcpy(throttle->thing_name, handle->thing_name);
+
+    throttle->mutex = xSemaphoreCreateMutex();
+    if (throttle->mutex == NULL)
+    {
+        free(throttle);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_timer_create_args_t timer_args = {
+        .callback = aws_iot_shadow_throttle_drain,
+        .arg = throttle,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "aws_iot_shadow_throttle",
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &throttle->timer);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "failed to create throttle timer: %d", err);
+        vSemaphoreDelete(throttle->mutex);
+        free(throttle);
+        return err;
+    }
+
+    throttle->next = *list;
+    *list = throttle;
+    handle->throttle = throttle;
+    return ESP_OK;
+}
+
+void aws_iot_shadow_throttle_detach(aws_iot_shadow_handle_ptr handle)
+{
+    struct aws_iot_shadow_throttle *throttle = handle->throttle;
+    if (throttle == NULL)
+    {
+        return;
+    }
+
+    aws_iot_shadow_throttle_lock(throttle);
+    for (unsigned int c = 0; c < THROTTLE_CLASSES; c++)
+    {
+        struct throttle_entry *prev = NULL;
+        struct throttle_entry **it = &throttle->queue_head[c];
+        while (*it)
+        {
+            struct throttle_entry *entry = *it;
+            if (entry->handle == handle)
+            {
+                *it = entry->next;
+                throttle->queue_count--;
+                free(entry);
+            }
+            else
+            {
+                prev = entry;
+                it = &entry->next;
+            }
+        }
+        throttle->queue_tail[c] = prev;
+    }
+#if AWS_IOT_SHADOW_STATS
+    if (throttle->draining_handle == handle)
+    {
+        throttle->draining_handle = NULL;
+    }
+#endif
+    aws_iot_shadow_throttle_unlock(throttle);
+
+    handle->throttle = NULL;
+}
+
+void aws_iot_shadow_throttle_published(struct aws_iot_shadow_throttle *list, int msg_id)
+{
+    if (msg_id <= 0)
+    {
+        return;
+    }
+
+    for (struct aws_iot_shadow_throttle *throttle = list; throttle; throttle = throttle->next)
+    {
+        aws_iot_shadow_throttle_lock(throttle);
+        for (unsigned int i = 0; i < AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT; i++)
+        {
+            if (throttle->in_flight[i].msg_id == msg_id)
+            {
+                aws_iot_shadow_throttle_release(throttle, i);
+                aws_iot_shadow_throttle_schedule(throttle);
+                aws_iot_shadow_throttle_unlock(throttle);
+                return;
+            }
+        }
+        aws_iot_shadow_throttle_unlock(throttle);
+    }
+
+    // Not a request, or esp_mqtt_client_publish() has not returned its msg_id yet
+    for (struct aws_iot_shadow_throttle *throttle = list; throttle; throttle = throttle->next)
+    {
+        aws_iot_shadow_throttle_lock(throttle);
+        for (unsigned int i = 0; i < AWS_IOT_SHADOW_THROTTLE_MAX_IN_FLIGHT; i++)
+        {
+            if (throttle->in_flight[i].msg_id == THROTTLE_MSG_ID_PUBLISHING)
+            {
+                throttle->early_acks[throttle->early_ack_next] = msg_id;
+                throttle->early_ack_next = (throttle->early_ack_next + 1) % THROTTLE_EARLY_ACKS;
+                break;
+            }
+        }
+        aws_iot_shadow_throttle_unlock(throttle);
+    }
+}
+
+esp_err_t aws_iot_shadow_throttle_publish(aws_iot_shadow_handle_ptr handle, const char *topic, const char *data,
+                                          size_t data_len, enum aws_iot_shadow_priority priority)
+{
+    if (priority < AWS_IOT_SHADOW_PRIORITY_HIGH || priority > AWS_IOT_SHADOW_PRIORITY_LOW)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct aws_iot_shadow_throttle *throttle = handle->throttle;
+    if (throttle == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    unsigned int priority_class = THROTTLE_CLASS(priority);
+    aws_iot_shadow_throttle_lock(throttle);
+
+    int64_t now = esp_timer_get_time();
+    if (aws_iot_shadow_throttle_can_send(throttle, priority_class, now))
+    {
+        unsigned int slot = aws_iot_shadow_throttle_take(throttle, now);
+        throttle->stats.sent++;
+        aws_iot_shadow_throttle_unlock(throttle);
+
+        int msg_id = esp_mqtt_client_publish(throttle->client, topic, data, (int)data_len, 1, 0);
+#if AWS_IOT_SHADOW_STATS
+        aws_iot_shadow_stats_published(handle, msg_id);
+#endif
+
+        aws_iot_shadow_throttle_lock(throttle);
+        aws_iot_shadow_throttle_sent(throttle, slot, msg_id);
+        aws_iot_shadow_throttle_schedule(throttle);
+        aws_iot_shadow_throttle_unlock(throttle);
+        return msg_id != -1 ? ESP_OK : ESP_FAIL;
+    }
+
+    if (data_len == 0)
+    {
+        // Queued get or delete of the shadow gets the same response
+        for (struct throttle_entry *entry = throttle->queue_head[priority_class]; entry; entry = entry->next)
+        {
+            if (entry->handle == handle && entry->data_len == 0 && strcmp(entry->topic, topic) == 0)
+            {
+                aws_iot_shadow_throttle_unlock(throttle);
+                return ESP_OK;
+            }
+        }
+    }
+
+    // Low priority can fill half of the queue, so it does not keep others out
+    unsigned int limit = priority == AWS_IOT_SHADOW_PRIORITY_LOW ? AWS_IOT_SHADOW_THROTTLE_QUEUE_LENGTH / 2
+                                                                 : AWS_IOT_SHADOW_THROTTLE_QUEUE_LENGTH;
+    if (throttle->queue_count >= limit)
+    {
+        throttle->stats.refused++;
+        aws_iot_shadow_throttle_unlock(throttle);
+        ESP_LOGW(TAG, "%s is throttled, queue is full", topic);
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t topic_size = strlen(topic) + 1;
+    struct throttle_entry *entry = (struct throttle_entry *)malloc(sizeof(*entry) + topic_size + data_len);
+    if (entry == NULL)
+    {
+        aws_iot_shadow_throttle_unlock(throttle);
+        return ESP_ERR_NO_MEM;
+    }
+    entry->next = NULL;
+    entry->handle = handle;
+    memcpy(entry->topic, topic, topic_size);
+    entry->data = data_len > 0 ? entry->topic + topic_size : NULL;
+    entry->data_len = data_len;
+    if (data_len > 0)
+    {
+        memcpy(entry->topic + topic_size, data, data_len);
+    }
+
+    if (throttle->queue_tail[priority_class] != NULL)
+    {
+        throttle->queue_tail[priority_class]->next = entry;
+    }
+    else
+    {
+        throttle->queue_head[priority_class] = entry;
+    }
+    throttle->queue_tail[priority_class] = entry;
+    throttle->queue_count++;
+    throttle->stats.deferred++;
+
+    aws_iot_shadow_throttle_schedule(throttle);
+    aws_iot_shadow_throttle_unlock(throttle);
+
+    ESP_LOGD(TAG, "%s is throttled, queued", topic);
+    return ESP_OK;
+}
+
+bool aws_iot_shadow_would_throttle(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_priority priority)
+{
+    if (priority == AWS_IOT_SHADOW_PRIORITY_DEFAULT)
+    {
+        priority = AWS_IOT_SHADOW_PRIORITY_NORMAL;
+    }
+    if (handle == NULL || handle->throttle == NULL || priority > AWS_IOT_SHADOW_PRIORITY_LOW)
+    {
+        return true;
+    }
+
+    struct aws_iot_shadow_throttle *throttle = handle->throttle;
+    aws_iot_shadow_throttle_lock(throttle);
+    bool result = !aws_iot_shadow_throttle_can_send(throttle, THROTTLE_CLASS(priority), esp_timer_get_time());
+    aws_iot_shadow_throttle_unlock(throttle);
+    return result;
+}
+
+esp_err_t aws_iot_shadow_throttle_stats(aws_iot_shadow_handle_ptr handle, struct aws_iot_shadow_throttle_stats *stats)
+{
+    if (handle == NULL || stats == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct aws_iot_shadow_throttle *throttle = handle->throttle;
+    if (throttle == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    aws_iot_shadow_throttle_lock(throttle);
+    *stats = throttle->stats;
+    stats->queued = throttle->queue_count;
+    stats->in_flight = throttle->in_flight_count;
+    aws_iot_shadow_throttle_unlock(throttle);
+    return ESP_OK;
+}
+
+#endif
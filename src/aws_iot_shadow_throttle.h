@@ -0,0 +1,48 @@
+#ifndef AWS_IOT_SHADOW_THROTTLE_H
+#define AWS_IOT_SHADOW_THROTTLE_H
+
+#include "aws_iot_shadow.h"
+#include "aws_iot_shadow_handle.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if AWS_IOT_SHADOW_PUBLISH_THROTTLE
+struct aws_iot_shadow_throttle;
+
+/**
+ * @brief Sets handle->throttle to the one of its thing, from the list of the dispatcher. Called under router lock.
+ *
+ * Throttles are never released, like dispatchers, so limits hold when a shadow is deleted and initialized again.
+ */
+esp_err_t aws_iot_shadow_throttle_attach(struct aws_iot_shadow_throttle **list, esp_mqtt_client_handle_t client,
+                                         aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Drops queued requests of the handle. Called under router lock.
+ */
+void aws_iot_shadow_throttle_detach(aws_iot_shadow_handle_ptr handle);
+
+/**
+ * @brief Releases the in flight slot of an acknowledged (MQTT_EVENT_PUBLISHED) request. Called under router lock.
+ */
+void aws_iot_shadow_throttle_published(struct aws_iot_shadow_throttle *list, int msg_id);
+
+/**
+ * @brief Publishes a request (QoS 1) right away, or queues it until the limits of the thing allow it.
+ *
+ * Never holds a lock while publishing, queued requests are published from the esp_timer task only.
+ *
+ * @param priority AWS_IOT_SHADOW_PRIORITY_DEFAULT is not allowed, callers resolve it per operation.
+ * @return ESP_OK when published or queued, ESP_ERR_NO_MEM when the queue is full.
+ */
+esp_err_t aws_iot_shadow_throttle_publish(aws_iot_shadow_handle_ptr handle, const char *topic, const char *data,
+                                          size_t data_len, enum aws_iot_shadow_priority priority);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
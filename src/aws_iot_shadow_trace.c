@@ -0,0 +1,107 @@
+#include "aws_iot_shadow_trace.h"
+#include <esp_timer.h>
+#include <string.h>
+
+#if AWS_IOT_SHADOW_TRACE
+
+// Positions are free running 32-bit counters, so the ring size must be a power of 2
+_Static_assert(AWS_IOT_SHADOW_TRACE_RECORDS > 0 && (AWS_IOT_SHADOW_TRACE_RECORDS & (AWS_IOT_SHADOW_TRACE_RECORDS - 1)) == 0,
+               "AWS_IOT_SHADOW_TRACE_RECORDS must be a power of 2");
+#define TRACE_RING_MASK (AWS_IOT_SHADOW_TRACE_RECORDS - 1U)
+
+// Shared by all shadows, so records keep their order across them
+static struct aws_iot_shadow_trace_record trace_ring[AWS_IOT_SHADOW_TRACE_RECORDS];
+static uint32_t trace_head;  // next position, updated atomically
+static uint32_t trace_start; // position of the oldest record not cleared
+static uint16_t trace_shadows;
+
+uint16_t aws_iot_shadow_trace_register()
+{
+    return __atomic_fetch_add(&trace_shadows, 1, __ATOMIC_RELAXED);
+}
+
+void aws_iot_shadow_trace(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_trace_type type, uint8_t arg, size_t len)
+{
+    // Claim a slot, a writer lapped by the whole ring would race with the next one, which is fine for a trace
+    uint32_t pos = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct aws_iot_shadow_trace_record *record = &trace_ring[pos & TRACE_RING_MASK];
+    record->timestamp_us = (uint32_t)esp_timer_get_time();
+    record->shadow = handle->trace_index;
+    record->type = (uint8_t)type;
+    record->arg = arg;
+    record->len = len <= UINT32_MAX ? (uint32_t)len : UINT32_MAX;
+}
+
+enum aws_iot_shadow_trace_op aws_iot_shadow_trace_op(const char *op)
+{
+    if (strcmp(op, AWS_IOT_SHADOW_OP_GET) == 0)
+    {
+        return AWS_IOT_SHADOW_TRACE_OP_GET;
+    }
+    else if (strcmp(op, AWS_IOT_SHADOW_OP_UPDATE) == 0)
+    {
+        return AWS_IOT_SHADOW_TRACE_OP_UPDATE;
+    }
+    else if (strcmp(op, AWS_IOT_SHADOW_OP_DELETE) == 0)
+    {
+        return AWS_IOT_SHADOW_TRACE_OP_DELETE;
+    }
+    return AWS_IOT_SHADOW_TRACE_OP_UNKNOWN;
+}
+
+esp_err_t aws_iot_shadow_trace_dump(void *buf, size_t buf_len, size_t *written)
+{
+    if (buf == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (buf_len < sizeof(struct aws_iot_shadow_trace_header))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t start = __atomic_load_n(&trace_start, __ATOMIC_RELAXED);
+    uint32_t available = head - start;
+    uint32_t overwritten = 0;
+    if (available > AWS_IOT_SHADOW_TRACE_RECORDS)
+    {
+        overwritten = available - AWS_IOT_SHADOW_TRACE_RECORDS;
+        available = AWS_IOT_SHADOW_TRACE_RECORDS;
+    }
+
+    // Newest ones, when the buffer is short
+    size_t capacity = (buf_len - sizeof(struct aws_iot_shadow_trace_header)) / sizeof(struct aws_iot_shadow_trace_record);
+    uint32_t count = available <= capacity ? available : (uint32_t)capacity;
+    overwritten += available - count;
+
+    struct aws_iot_shadow_trace_header header = {
+        .magic = AWS_IOT_SHADOW_TRACE_MAGIC,
+        .version = AWS_IOT_SHADOW_TRACE_VERSION,
+        .record_size = sizeof(struct aws_iot_shadow_trace_record),
+        .count = count,
+        .overwritten = overwritten,
+    };
+    char *out = (char *)buf;
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+
+    for (uint32_t pos = head - count; pos != head; pos++)
+    {
+        memcpy(out, &trace_ring[pos & TRACE_RING_MASK], sizeof(struct aws_iot_shadow_trace_record));
+        out += sizeof(struct aws_iot_shadow_trace_record);
+    }
+
+    if (written != NULL)
+    {
+        *written = (size_t)(out - (char *)buf);
+    }
+    return ESP_OK;
+}
+
+void aws_iot_shadow_trace_clear()
+{
+    __atomic_store_n(&trace_start, __atomic_load_n(&trace_head, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef AWS_IOT_SHADOW_TRACE_H
+#define AWS_IOT_SHADOW_TRACE_H
+
+#include "aws_iot_shadow.h"
+#include "aws_iot_shadow_handle.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if AWS_IOT_SHADOW_TRACE
+/**
+ * @brief Index of a new shadow in trace records.
+ */
+uint16_t aws_iot_shadow_trace_register();
+
+/**
+ * @brief Records a trace of the shadow into the ring, from any task, without a lock.
+ */
+void aws_iot_shadow_trace(aws_iot_shadow_handle_ptr handle, enum aws_iot_shadow_trace_type type, uint8_t arg, size_t len);
+
+/**
+ * @brief Op of a request topic suffix, e.g. AWS_IOT_SHADOW_OP_UPDATE.
+ */
+enum aws_iot_shadow_trace_op aws_iot_shadow_trace_op(const char *op);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif